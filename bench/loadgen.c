@@ -0,0 +1,214 @@
+// Load generator for rcalc --serve.
+//
+// Opens several connections to a server's socket, one thread each, and
+// sends the same request over and over with a fixed number in flight per
+// connection. Reports throughput and the latency percentiles of every
+// request, measured from when its batch was written to when its reply
+// arrived. Replies starting with "error" are counted as failures.
+//
+//   gcc -O2 bench/loadgen.c -o loadgen -pthread
+//   ./rcalc --serve /tmp/rcalc.sock example.calc &
+//   ./loadgen [-c connections] [-d depth] [-n requests] [-f] /tmp/rcalc.sock 'circle_area(2)'
+//
+// -d is the pipeline depth, -n the requests per connection, and -f sends
+// length-prefixed frames instead of lines.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+typedef struct Client {
+    pthread_t thread;
+    double *latencies;         // One per request, in seconds
+    long errors;
+    int failed;
+} Client;
+
+static const char *socket_path;
+static const char *expression;
+static int depth = 1;
+static long requests = 100000;
+static int framed = 0;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static int write_all(int fd, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t sent = write(fd, data, length);
+        if (sent <= 0) return -1;
+        data += sent;
+        length -= (size_t)sent;
+    }
+    return 0;
+}
+
+static void *client_main(void *arg) {
+    Client *client = arg;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", socket_path);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+        perror("connect");
+        client->failed = 1;
+        return NULL;
+    }
+
+    // One batch of depth requests, written with a single call
+    size_t request_length = strlen(expression);
+    size_t frame_length = request_length + (framed ? 4 : 1);
+    char *batch = malloc(frame_length * (size_t)depth);
+    for (int i = 0; i < depth; i++) {
+        char *p = batch + frame_length * (size_t)i;
+        if (framed) {
+            uint32_t size = (uint32_t)request_length;
+            p[0] = (char)(size >> 24);
+            p[1] = (char)(size >> 16);
+            p[2] = (char)(size >> 8);
+            p[3] = (char)size;
+            memcpy(p + 4, expression, request_length);
+        } else {
+            memcpy(p, expression, request_length);
+            p[request_length] = '\n';
+        }
+    }
+
+    char buffer[65536];
+    size_t buffered = 0;
+    long done = 0;
+    while (done < requests && !client->failed) {
+        int count = requests - done < depth ? (int)(requests - done) : depth;
+        double start = now_seconds();
+        if (write_all(fd, batch, frame_length * (size_t)count) != 0) {
+            client->failed = 1;
+            break;
+        }
+
+        // Collect this batch's replies
+        int replies = 0;
+        while (replies < count) {
+            size_t pos = 0;
+            while (replies < count) {
+                size_t length;
+                const char *reply;
+                if (framed) {
+                    if (buffered - pos < 4) break;
+                    const unsigned char *header = (const unsigned char *)buffer + pos;
+                    length = (size_t)header[0] << 24 | (size_t)header[1] << 16 |
+                             (size_t)header[2] << 8 | header[3];
+                    if (buffered - pos < 4 + length) break;
+                    reply = buffer + pos + 4;
+                    pos += 4 + length;
+                } else {
+                    const char *newline = memchr(buffer + pos, '\n', buffered - pos);
+                    if (!newline) break;
+                    reply = buffer + pos;
+                    length = (size_t)(newline - reply);
+                    pos += length + 1;
+                }
+                if (length >= 5 && memcmp(reply, "error", 5) == 0) client->errors++;
+                client->latencies[done + replies] = now_seconds() - start;
+                replies++;
+            }
+            memmove(buffer, buffer + pos, buffered - pos);
+            buffered -= pos;
+            if (replies == count) break;
+            ssize_t received = read(fd, buffer + buffered, sizeof(buffer) - buffered);
+            if (received <= 0) {
+                client->failed = 1;
+                break;
+            }
+            buffered += (size_t)received;
+        }
+        done += replies;
+    }
+
+    free(batch);
+    close(fd);
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    int connections = 1;
+    int arg = 1;
+    for (; arg < argc && argv[arg][0] == '-'; arg++) {
+        if (strcmp(argv[arg], "-f") == 0) {
+            framed = 1;
+        } else if (arg + 1 < argc && strcmp(argv[arg], "-c") == 0) {
+            connections = atoi(argv[++arg]);
+        } else if (arg + 1 < argc && strcmp(argv[arg], "-d") == 0) {
+            depth = atoi(argv[++arg]);
+        } else if (arg + 1 < argc && strcmp(argv[arg], "-n") == 0) {
+            requests = atol(argv[++arg]);
+        } else {
+            break;
+        }
+    }
+    if (arg + 2 != argc || connections < 1 || depth < 1 || requests < 1) {
+        fprintf(stderr, "Usage: %s [-c connections] [-d depth] [-n requests] [-f] socket expression\n", argv[0]);
+        return 1;
+    }
+    socket_path = argv[arg];
+    expression = argv[arg + 1];
+
+    Client *clients = calloc((size_t)connections, sizeof(Client));
+    for (int i = 0; i < connections; i++) {
+        clients[i].latencies = malloc((size_t)requests * sizeof(double));
+        if (!clients[i].latencies) {
+            fprintf(stderr, "Error: Memory allocation failed\n");
+            return 1;
+        }
+    }
+    double start = now_seconds();
+    for (int i = 0; i < connections; i++) {
+        pthread_create(&clients[i].thread, NULL, client_main, &clients[i]);
+    }
+    for (int i = 0; i < connections; i++) {
+        pthread_join(clients[i].thread, NULL);
+    }
+    double elapsed = now_seconds() - start;
+
+    // Merge every client's latencies
+    long total = (long)connections * requests;
+    double *all = malloc((size_t)total * sizeof(double));
+    long errors = 0;
+    int failed = 0;
+    for (int i = 0; i < connections; i++) {
+        memcpy(all + (long)i * requests, clients[i].latencies, (size_t)requests * sizeof(double));
+        errors += clients[i].errors;
+        failed |= clients[i].failed;
+        free(clients[i].latencies);
+    }
+    free(clients);
+    if (failed) {
+        fprintf(stderr, "Error: A connection failed before all replies arrived\n");
+        free(all);
+        return 1;
+    }
+    qsort(all, (size_t)total, sizeof(double), compare_doubles);
+
+    printf("%ld requests over %d connection%s, depth %d: %.0f requests/s\n", total, connections,
+           connections == 1 ? "" : "s", depth, total / elapsed);
+    printf("latency p50 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us\n",
+           all[total / 2] * 1e6, all[(long)(total * 0.99)] * 1e6, all[(long)(total * 0.999)] * 1e6,
+           all[total - 1] * 1e6);
+    if (errors) printf("%ld replies were errors\n", errors);
+    free(all);
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,284 @@
+// Microbenchmarks of rcalc's internals.
+//
+// Includes rcalc.c (as the library build) to reach the functions behind
+// every statement: the tokenizer, the AST parser, the evaluator, user
+// function calls, and script loading from source and from the compiled
+// cache. Each benchmark is calibrated to run for about 50 ms per sample and
+// reports the fastest of 7 samples, since other activity on the machine can
+// only slow a sample down.
+//
+// Output is one line per benchmark: name, ns per operation, the operations
+// per sample, and how far the median sample was above the fastest.
+// Save one run and pass it to -c after a change to print the differences:
+//
+//   gcc -O2 -I. bench/micro.c -o micro -lm -pthread
+//   ./micro > before.txt
+//   ./micro -c before.txt [name-filter...]
+#define RCALC_LIBRARY
+#include "rcalc.c"
+
+#define MICRO_SAMPLES 7
+#define MICRO_SAMPLE_SECONDS 0.05
+#define MICRO_MAX_BASELINE 64
+
+typedef struct MicroBench {
+    const char *name;
+    const char *unit;          // What one operation is
+    void (*run)(long count);
+} MicroBench;
+
+typedef struct BaselineResult {
+    char name[64];
+    double ns;
+} BaselineResult;
+
+// Every result is added here, so no work can be optimized away
+static volatile double micro_sink;
+
+static const char *arithmetic_source =
+    "(a + 2.5) * (b - 1.25) / (a * a + 1) + (b ^ 2 - a ^ 3) * 0.5 - ((a - b) * (a + b)) / 7 + "
+    "-(a * b) + (1 + 2 * a - 3 * b) * (4 - a) / (5 + b * b) + a * 1e-3 - b * 2.5e2 + (a < b) + (a >= b)";
+static const char *call_source =
+    "sq(a) + sq(b) + hyp(a, b) + sin(a) * cos(b) + max(a, b) + clamp(lerp(a, b, 0.5), 0, 10) + "
+    "if(a < b, sq(a + b), hyp(b, a))";
+static const char *definitions =
+    "var sq(var x) { return x * x; }\n"
+    "var hyp(var x, var y) { return sqrt(sq(x) + sq(y)); }\n"
+    "var id(var x) { return x; }\n"
+    "var fib(var n) { return if(n < 2, n, fib(n - 1) + fib(n - 2)); }\n"
+    "a = 3.5\n"
+    "b = 7.25\n";
+
+static rcalc_context *micro_context;
+static ASTNode *arithmetic_ast;
+static ASTNode *call_ast;
+static ASTNode *fib_ast;
+static char script_path[256];
+
+static ASTNode *parse_micro_expression(const char *source) {
+    Statement stmt;
+    if (parse_statement_source(source, &stmt) != 0 || stmt.kind != STMT_EXPRESSION) {
+        fprintf(stderr, "Error: Cannot parse benchmark expression\n");
+        exit(1);
+    }
+    return stmt.ast;
+}
+
+static void bench_lex(long count) {
+    double sum = 0.0;
+    for (long i = 0; i < count; ) {
+        expr_pos = arithmetic_source;
+        do {
+            get_next_token();
+            sum += current_token.value;
+            i++;
+        } while (current_token.type != CALC_TOKEN_END && i < count);
+    }
+    micro_sink = sum;
+}
+
+static void bench_parse(long count) {
+    for (long i = 0; i < count; i++) {
+        Statement stmt;
+        if (parse_statement_source(arithmetic_source, &stmt) == 0) {
+            micro_sink = stmt.ast->type;
+            free_statement(&stmt);
+        }
+    }
+}
+
+static void evaluate_repeatedly(ASTNode *ast, long count) {
+    double sum = 0.0;
+    clear_eval_error();
+    for (long i = 0; i < count; i++) sum += evaluate_ast(ast);
+    micro_sink = sum;
+}
+
+static void bench_eval_arithmetic(long count) {
+    evaluate_repeatedly(arithmetic_ast, count);
+}
+
+static void bench_eval_calls(long count) {
+    evaluate_repeatedly(call_ast, count);
+}
+
+static void bench_call(long count) {
+    UserFunction *id = lookup_user_function("id");
+    double sum = 0.0;
+    double arg = 1.5;
+    clear_eval_error();
+    for (long i = 0; i < count; i++) sum += evaluate_user_function(id, &arg, 1);
+    micro_sink = sum;
+}
+
+// fib(15) makes 1973 calls
+static void bench_recursion(long count) {
+    evaluate_repeatedly(fib_ast, (count + 1972) / 1973);
+}
+
+static void load_script(long count) {
+    for (long i = 0; i < count; i++) {
+        rcalc_context *ctx = rcalc_create();
+        rcalc_set_quiet(ctx, 1);
+        if (rcalc_load_file(ctx, script_path) != RCALC_OK) {
+            fprintf(stderr, "Error: Cannot load %s\n", script_path);
+            exit(1);
+        }
+        rcalc_destroy(ctx);
+    }
+}
+
+static void bench_load_source(long count) {
+    script_cache_enabled = 0;
+    load_script(count);
+    script_cache_enabled = 1;
+}
+
+static void bench_load_cached(long count) {
+    load_script(count);
+}
+
+static const MicroBench benchmarks[] = {
+    { "lex_tokens", "token", bench_lex },
+    { "parse_arithmetic", "parse", bench_parse },
+    { "eval_arithmetic", "eval", bench_eval_arithmetic },
+    { "eval_calls", "eval", bench_eval_calls },
+    { "call_overhead", "call", bench_call },
+    { "call_recursive", "call", bench_recursion },
+    { "load_source_4k", "load", bench_load_source },
+    { "load_cached_4k", "load", bench_load_cached },
+};
+
+// A script of 2000 functions, each calling an earlier one, and 2000 variables
+static void write_large_script(void) {
+    snprintf(script_path, sizeof(script_path), "/tmp/rcalc_micro_%ld.calc", (long)getpid());
+    FILE *fp = fopen(script_path, "w");
+    if (!fp) {
+        fprintf(stderr, "Error: Cannot write %s\n", script_path);
+        exit(1);
+    }
+    fprintf(fp, "# Generated by bench/micro.c\n");
+    for (int i = 0; i < 2000; i++) {
+        if (i == 0) {
+            fprintf(fp, "var f0(var x, var y) { return x * y + 1; }\n");
+        } else {
+            fprintf(fp, "var f%d(var x, var y) {\n    return f%d(x, y) * 0.5 + x ^ 2 - y / %d;\n}\n", i, i / 2,
+                    i + 1);
+        }
+        fprintf(fp, "v%d = %d * 0.25 + sqrt(%d)\n", i, i, i);
+    }
+    fclose(fp);
+}
+
+static void remove_large_script(void) {
+    char cache[512];
+    cache_path_for(script_path, cache, sizeof(cache));
+    remove(cache);
+    remove(script_path);
+}
+
+static int compare_micro_doubles(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static int read_baseline(const char *path, BaselineResult *baseline) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        fprintf(stderr, "Error: Cannot open baseline '%s'\n", path);
+        exit(1);
+    }
+    char line[256];
+    int count = 0;
+    while (count < MICRO_MAX_BASELINE && fgets(line, sizeof(line), fp)) {
+        if (line[0] == '#') continue;
+        if (sscanf(line, "%63s %lf", baseline[count].name, &baseline[count].ns) == 2) count++;
+    }
+    fclose(fp);
+    return count;
+}
+
+static int selected(const char *name, char **filters, int filter_count) {
+    if (filter_count == 0) return 1;
+    for (int i = 0; i < filter_count; i++) {
+        if (strstr(name, filters[i])) return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    BaselineResult baseline[MICRO_MAX_BASELINE];
+    int baseline_count = 0;
+    int arg = 1;
+    if (arg + 1 < argc && strcmp(argv[arg], "-c") == 0) {
+        baseline_count = read_baseline(argv[arg + 1], baseline);
+        arg += 2;
+    }
+    char **filters = argv + arg;
+    int filter_count = argc - arg;
+
+    micro_context = rcalc_create();
+    if (!micro_context || rcalc_define(micro_context, definitions) != RCALC_OK) {
+        fprintf(stderr, "Error: Cannot define benchmark functions\n");
+        return 1;
+    }
+    write_large_script();
+    ContextBinding binding;
+    bind_context(micro_context, &binding);
+    arithmetic_ast = parse_micro_expression(arithmetic_source);
+    call_ast = parse_micro_expression(call_source);
+    fib_ast = parse_micro_expression("fib(15)");
+
+    if (baseline_count) {
+        printf("# %-18s %12s %12s %8s\n", "benchmark", "ns/op", "baseline", "change");
+    } else {
+        printf("# %-18s %12s %12s %8s  %s\n", "benchmark", "ns/op", "ops/sample", "spread", "op");
+    }
+    for (size_t b = 0; b < sizeof(benchmarks) / sizeof(benchmarks[0]); b++) {
+        const MicroBench *bench = &benchmarks[b];
+        if (!selected(bench->name, filters, filter_count)) continue;
+
+        // Double the count until a sample is long enough; this also warms up
+        long count = 1;
+        for (;;) {
+            double start = monotonic_seconds();
+            bench->run(count);
+            if (monotonic_seconds() - start >= MICRO_SAMPLE_SECONDS || count > LONG_MAX / 4) break;
+            count *= 2;
+        }
+        double samples[MICRO_SAMPLES];
+        for (int i = 0; i < MICRO_SAMPLES; i++) {
+            double start = monotonic_seconds();
+            bench->run(count);
+            samples[i] = (monotonic_seconds() - start) * 1e9 / (double)count;
+        }
+        qsort(samples, MICRO_SAMPLES, sizeof(double), compare_micro_doubles);
+        double fastest = samples[0];
+        double spread = (samples[MICRO_SAMPLES / 2] - fastest) * 100.0 / fastest;
+
+        if (baseline_count) {
+            const BaselineResult *old = NULL;
+            for (int i = 0; i < baseline_count; i++) {
+                if (strcmp(baseline[i].name, bench->name) == 0) old = &baseline[i];
+            }
+            if (old) {
+                printf("%-20s %12.2f %12.2f %+7.1f%%\n", bench->name, fastest, old->ns,
+                       (fastest - old->ns) * 100.0 / old->ns);
+            } else {
+                printf("%-20s %12.2f %12s %8s\n", bench->name, fastest, "-", "new");
+            }
+        } else {
+            printf("%-20s %12.2f %12ld %7.1f%%  %s\n", bench->name, fastest, count, spread, bench->unit);
+        }
+        fflush(stdout);
+    }
+
+    free_ast(arithmetic_ast);
+    free_ast(call_ast);
+    free_ast(fib_ast);
+    unbind_context(&binding);
+    rcalc_destroy(micro_context);
+    remove_large_script();
+    return 0;
+}
@@ -0,0 +1,260 @@
+// End-to-end regression harness.
+//
+// Runs rcalc on a workload from bench/workload.c in each of its modes and
+// measures wall time, peak RSS and throughput. It can compare the results
+// against a stored baseline. Each scenario runs once to warm up (which also
+// writes the script cache for load_cached), then -n times, keeping the
+// fastest wall time and the largest RSS. A scenario regresses when either
+// exceeds its baseline by more than the tolerance, and then the harness
+// exits with status 1.
+//
+//   gcc -O2 bench/regress.c -o regress
+//   ./workload /tmp/workload
+//   ./regress -w baseline.txt /tmp/workload          # Record a baseline
+//   ./regress -b baseline.txt [-t 10] /tmp/workload  # Compare against it
+//
+// -r names the rcalc binary (default ./rcalc). Baselines are plain text, one
+// scenario per line: name, wall ms, peak RSS KB, items per second.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#define MAX_SCENARIOS 16
+
+extern char **environ;
+
+typedef struct Scenario {
+    const char *name;
+    const char *input;         // File in the workload directory fed to stdin, or NULL
+    long items;                // Work done per run, for throughput; 0 for none
+    char *argv[16];
+} Scenario;
+
+typedef struct Result {
+    char name[32];
+    double wall_ms;
+    long rss_kb;
+    double rate;               // Items per second
+} Result;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static char *workload_path(const char *dir, const char *name) {
+    size_t size = strlen(dir) + strlen(name) + 2;
+    char *path = malloc(size);
+    if (!path) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        exit(1);
+    }
+    snprintf(path, size, "%s/%s", dir, name);
+    return path;
+}
+
+// Lines in a workload file, less those that are not work items
+static long count_lines(const char *path, long skip) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        fprintf(stderr, "Error: Cannot open '%s'; generate it with bench/workload.c\n", path);
+        exit(1);
+    }
+    long lines = 0;
+    int c;
+    while ((c = fgetc(fp)) != EOF) {
+        if (c == '\n') lines++;
+    }
+    fclose(fp);
+    return lines > skip ? lines - skip : 0;
+}
+
+static char *read_first_line(const char *path) {
+    static char line[4096];
+    FILE *fp = fopen(path, "r");
+    if (!fp || !fgets(line, sizeof(line), fp)) {
+        fprintf(stderr, "Error: Cannot read '%s'\n", path);
+        exit(1);
+    }
+    fclose(fp);
+    line[strcspn(line, "\n")] = '\0';
+    return line;
+}
+
+// Run a scenario once; returns 0 if rcalc exited cleanly
+static int run_once(const char *dir, const Scenario *scenario, double *wall, long *rss_kb) {
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+    char *input = scenario->input ? workload_path(dir, scenario->input) : NULL;
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, input ? input : "/dev/null", O_RDONLY, 0);
+
+    double start = now_seconds();
+    pid_t pid;
+    int status = -1;
+    struct rusage usage;
+    memset(&usage, 0, sizeof(usage));
+    int spawned = posix_spawn(&pid, scenario->argv[0], &actions, NULL, scenario->argv, environ) == 0;
+    if (spawned) wait4(pid, &status, 0, &usage);
+    *wall = now_seconds() - start;
+    *rss_kb = usage.ru_maxrss;
+    posix_spawn_file_actions_destroy(&actions);
+    free(input);
+    if (!spawned) {
+        perror(scenario->argv[0]);
+        return -1;
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+static int read_baseline(const char *path, Result *baseline) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        fprintf(stderr, "Error: Cannot open baseline '%s'\n", path);
+        exit(1);
+    }
+    char line[256];
+    int count = 0;
+    while (count < MAX_SCENARIOS && fgets(line, sizeof(line), fp)) {
+        Result *r = &baseline[count];
+        if (line[0] != '#' && sscanf(line, "%31s %lf %ld %lf", r->name, &r->wall_ms, &r->rss_kb, &r->rate) == 4) {
+            count++;
+        }
+    }
+    fclose(fp);
+    return count;
+}
+
+static double change_percent(double value, double base) {
+    return base > 0.0 ? (value - base) * 100.0 / base : 0.0;
+}
+
+int main(int argc, char *argv[]) {
+    const char *rcalc = "./rcalc";
+    const char *baseline_path = NULL;
+    const char *write_path = NULL;
+    double tolerance = 10.0;
+    int repeats = 5;
+    int arg = 1;
+    for (; arg + 1 < argc && argv[arg][0] == '-'; arg += 2) {
+        if (strcmp(argv[arg], "-r") == 0) rcalc = argv[arg + 1];
+        else if (strcmp(argv[arg], "-b") == 0) baseline_path = argv[arg + 1];
+        else if (strcmp(argv[arg], "-w") == 0) write_path = argv[arg + 1];
+        else if (strcmp(argv[arg], "-t") == 0) tolerance = atof(argv[arg + 1]);
+        else if (strcmp(argv[arg], "-n") == 0) repeats = atoi(argv[arg + 1]);
+        else break;
+    }
+    if (arg + 1 != argc || repeats < 1 || tolerance < 0.0) {
+        fprintf(stderr, "Usage: %s [-r rcalc] [-b baseline] [-w baseline] [-t tolerance%%] [-n runs] dir\n",
+                argv[0]);
+        return 1;
+    }
+    const char *dir = argv[arg];
+    char *rc = (char *)rcalc;
+    char *lib = workload_path(dir, "lib.calc");
+    char *exprs = workload_path(dir, "exprs.txt");
+    char *data = workload_path(dir, "data.txt");
+    char *statements = workload_path(dir, "statements.calc");
+    char *batch_file = workload_path(dir, "batch.txt");
+    char *batch = read_first_line(batch_file);
+    long statement_count = count_lines(statements, 1);  // Less the final quit
+    long expression_count = count_lines(exprs, 0);
+    long row_count = count_lines(data, 1);             // Less the header
+
+    Scenario scenarios[] = {
+        { "startup", NULL, 0, { rc, "-e", "1 + 2", NULL } },
+        { "load_source", NULL, 0, { rc, "--no-cache", "-l", lib, "-e", "1", NULL } },
+        { "load_cached", NULL, 0, { rc, "-l", lib, "-e", "1", NULL } },
+        { "repl", "statements.calc", statement_count, { rc, lib, NULL } },
+        { "eval_file", NULL, expression_count, { rc, "--eval-file", exprs, "--output", "/dev/null", lib, NULL } },
+        { "batch", NULL, row_count, { rc, "--batch", batch, "--input", data, "--output", "/dev/null", lib, NULL } },
+        { "batch_stream", NULL, row_count,
+          { rc, "--batch", batch, "--input", data, "--stream", "--output", "/dev/null", lib, NULL } },
+    };
+    int scenario_count = (int)(sizeof(scenarios) / sizeof(scenarios[0]));
+
+    Result baseline[MAX_SCENARIOS];
+    int baseline_count = baseline_path ? read_baseline(baseline_path, baseline) : 0;
+    Result results[MAX_SCENARIOS];
+    int regressions = 0;
+    int failures = 0;
+
+    printf("%-14s %10s %10s %12s", "scenario", "wall ms", "rss KB", "items/s");
+    if (baseline_path) printf(" %10s %8s %8s", "base ms", "wall", "rss");
+    printf("\n");
+    for (int s = 0; s < scenario_count; s++) {
+        const Scenario *scenario = &scenarios[s];
+        Result *result = &results[s];
+        snprintf(result->name, sizeof(result->name), "%s", scenario->name);
+        result->wall_ms = 0.0;
+        result->rss_kb = 0;
+        double wall;
+        long rss_kb;
+        int failed = run_once(dir, scenario, &wall, &rss_kb) != 0;
+        if (failed) {
+            printf("%-14s  FAILED\n", result->name);
+            failures++;
+            continue;
+        }
+        for (int i = 0; i < repeats; i++) {
+            if (run_once(dir, scenario, &wall, &rss_kb) != 0) failed = 1;
+            if (i == 0 || wall * 1000.0 < result->wall_ms) result->wall_ms = wall * 1000.0;
+            if (rss_kb > result->rss_kb) result->rss_kb = rss_kb;
+        }
+        result->rate = scenario->items ? scenario->items / (result->wall_ms / 1000.0) : 0.0;
+        failures += failed;
+
+        printf("%-14s %10.2f %10ld %12.0f", result->name, result->wall_ms, result->rss_kb, result->rate);
+        const Result *base = NULL;
+        for (int i = 0; i < baseline_count; i++) {
+            if (strcmp(baseline[i].name, result->name) == 0) base = &baseline[i];
+        }
+        if (base) {
+            double wall_change = change_percent(result->wall_ms, base->wall_ms);
+            double rss_change = change_percent((double)result->rss_kb, (double)base->rss_kb);
+            int regressed = wall_change > tolerance || rss_change > tolerance;
+            regressions += regressed;
+            printf(" %10.2f %+7.1f%% %+7.1f%%%s", base->wall_ms, wall_change, rss_change,
+                   regressed ? "  REGRESSION" : "");
+        } else if (baseline_path) {
+            printf(" %10s", "-");
+        }
+        printf("%s\n", failed ? "  FAILED" : "");
+        fflush(stdout);
+    }
+
+    // A baseline is only worth keeping if every scenario ran
+    if (write_path && failures == 0) {
+        FILE *fp = fopen(write_path, "w");
+        if (!fp) {
+            fprintf(stderr, "Error: Cannot write baseline '%s'\n", write_path);
+            return 1;
+        }
+        fprintf(fp, "# scenario wall_ms rss_kb items_per_second\n");
+        for (int s = 0; s < scenario_count; s++) {
+            fprintf(fp, "%s %.3f %ld %.0f\n", results[s].name, results[s].wall_ms, results[s].rss_kb,
+                    results[s].rate);
+        }
+        fclose(fp);
+    }
+
+    free(lib);
+    free(exprs);
+    free(data);
+    free(statements);
+    free(batch_file);
+    if (failures) fprintf(stderr, "%d scenario%s failed to run\n", failures, failures == 1 ? "" : "s");
+    if (regressions) {
+        fprintf(stderr, "%d scenario%s regressed by more than %.1f%%\n", regressions,
+                regressions == 1 ? "" : "s", tolerance);
+    }
+    return failures || regressions ? 1 : 0;
+}
@@ -0,0 +1,97 @@
+// Per-session memory overhead with a shared library.
+//
+// Loads a script into one library context and shares it, then creates many
+// sessions on top of it, each with a few variables of its own. Reports the
+// heap each session costs, next to the cost of loading the script into every
+// session instead. Every session's results are checked, including one that
+// shadows a library function, so the run doubles as a correctness test.
+//
+//   gcc -O2 -I. -DRCALC_LIBRARY bench/sessions.c rcalc.c -o sessions -lm -pthread
+//   ./sessions [script] [sessions]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+
+#include "rcalc.h"
+
+static size_t heap_in_use(void) {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+    return mallinfo2().uordblks;
+#else
+    return (size_t)mallinfo().uordblks;
+#endif
+}
+
+// Give a session its own state and check it sees the library through it
+static int use_session(rcalc_context *session, int id) {
+    double radius = 1.0 + id % 100;
+    double result;
+    if (rcalc_set_variable(session, "r", radius) != RCALC_OK ||
+        rcalc_set_variable(session, "id", (double)id) != RCALC_OK ||
+        rcalc_evaluate(session, "circle_area(r)", &result) != RCALC_OK) {
+        return -1;
+    }
+    return result == 3.14159265358979323846 * (radius * radius) ? 0 : -1;
+}
+
+int main(int argc, char *argv[]) {
+    const char *script = argc > 1 ? argv[1] : "example.calc";
+    int count = argc > 2 ? atoi(argv[2]) : 10000;
+    if (count < 1) count = 1;
+    int copies = count < 100 ? count : 100;
+
+    size_t before = heap_in_use();
+    rcalc_context *library = rcalc_create();
+    if (!library || rcalc_load_file(library, script) != RCALC_OK || rcalc_share(library) != RCALC_OK) {
+        fprintf(stderr, "Error: Cannot load %s: %s\n", script, rcalc_error_message(library));
+        return 1;
+    }
+    size_t library_bytes = heap_in_use() - before;
+
+    // Sessions over the shared library
+    rcalc_context **sessions = calloc((size_t)count, sizeof(rcalc_context *));
+    before = heap_in_use();
+    int failures = 0;
+    for (int i = 0; i < count; i++) {
+        sessions[i] = rcalc_create_session(library);
+        if (!sessions[i] || use_session(sessions[i], i) != 0) failures++;
+    }
+    size_t shared_bytes = heap_in_use() - before;
+
+    // A redefinition shadows the library function in one session only
+    double shadowed, unchanged;
+    if (rcalc_define(sessions[0], "var circle_area(var radius) { return -radius; }") != RCALC_OK ||
+        rcalc_evaluate(sessions[0], "circle_area(2)", &shadowed) != RCALC_OK || shadowed != -2.0 ||
+        rcalc_evaluate(sessions[count - 1], "circle_area(2)", &unchanged) != RCALC_OK ||
+        unchanged != 4.0 * 3.14159265358979323846 ||
+        rcalc_define(library, "x = 1") != RCALC_ERR_READ_ONLY) {
+        failures++;
+    }
+
+    for (int i = 0; i < count; i++) rcalc_destroy(sessions[i]);
+    rcalc_destroy(library);
+
+    // The same sessions, each loading its own copy of the script
+    before = heap_in_use();
+    for (int i = 0; i < copies; i++) {
+        sessions[i] = rcalc_create();
+        if (!sessions[i] || rcalc_load_file(sessions[i], script) != RCALC_OK ||
+            use_session(sessions[i], i) != 0) {
+            failures++;
+        }
+    }
+    size_t copied_bytes = heap_in_use() - before;
+    for (int i = 0; i < copies; i++) rcalc_destroy(sessions[i]);
+    free(sessions);
+
+    printf("library %s: %zu bytes\n", script, library_bytes);
+    printf("%-22s %10s %14s\n", "", "sessions", "bytes/session");
+    printf("%-22s %10d %14.0f\n", "shared library", count, (double)shared_bytes / count);
+    printf("%-22s %10d %14.0f\n", "private copy", copies, (double)copied_bytes / copies);
+    if (failures) {
+        fprintf(stderr, "FAILED: %d sessions returned wrong results\n", failures);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,145 @@
+// Concurrent calls into one shared rcalc_context.
+//
+// Loads a script once, then has 1, 2, 4, ... threads call its functions at
+// the same time through rcalc_call() and rcalc_run(). Every result is checked
+// against a table computed on one thread first, so the run doubles as a
+// stress test: any mismatch or error fails the run. Prints calls per second
+// and the speedup over one thread.
+//
+//   gcc -O2 -I. -DRCALC_LIBRARY bench/shared_calls.c rcalc.c -o shared_calls -lm -pthread
+//   ./shared_calls [script] [calls per thread] [max threads]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "rcalc.h"
+
+#define INPUT_COUNT 1024
+
+typedef struct Call {
+    const char *name;
+    int arg_count;
+} Call;
+
+// Functions from example.calc, including ones that call other functions and
+// read globals
+static const Call calls[] = {
+    { "circle_area", 1 },
+    { "distance", 4 },
+    { "kinetic_energy", 2 },
+    { "potential_energy", 2 },
+    { "safe_divide", 2 },
+    { "fahrenheit_to_celsius", 1 }
+};
+#define CALL_COUNT (int)(sizeof(calls) / sizeof(calls[0]))
+
+static rcalc_context *ctx;
+static rcalc_expr *expr;
+static double inputs[INPUT_COUNT][4];
+static double expected[INPUT_COUNT][CALL_COUNT + 1];  // Last column: expr
+static long calls_per_thread;
+
+typedef struct Worker {
+    pthread_t thread;
+    int id;
+    long mismatches;
+} Worker;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static int evaluate_input(int input, int call, double *result) {
+    if (call == CALL_COUNT) {
+        return rcalc_run(ctx, expr, result);
+    }
+    return rcalc_call(ctx, calls[call].name, inputs[input], calls[call].arg_count, result);
+}
+
+static void *worker_main(void *arg) {
+    Worker *worker = arg;
+
+    // Threads start at different inputs so they do not move in lockstep
+    long i = (long)worker->id * 7919;
+    for (long n = 0; n < calls_per_thread; n++, i++) {
+        int input = (int)(i % INPUT_COUNT);
+        int call = (int)(i % (CALL_COUNT + 1));
+        double result;
+        if (evaluate_input(input, call, &result) != RCALC_OK ||
+            memcmp(&result, &expected[input][call], sizeof(double)) != 0) {
+            worker->mismatches++;
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    const char *script = argc > 1 ? argv[1] : "example.calc";
+    calls_per_thread = argc > 2 ? atol(argv[2]) : 2000000;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int max_threads = argc > 3 ? atoi(argv[3]) : (int)(cpus > 0 ? cpus : 1) * 2;
+    if (max_threads < 1) max_threads = 1;
+
+    ctx = rcalc_create();
+    if (!ctx || rcalc_load_file(ctx, script) != RCALC_OK) {
+        fprintf(stderr, "Error: Cannot load %s: %s\n", script, ctx ? rcalc_error_message(ctx) : "");
+        return 1;
+    }
+    rcalc_status status;
+    expr = rcalc_compile(ctx, "circle_area(gravity) + kinetic_energy(2, speed_of_light / 1e8)", &status);
+    if (!expr) {
+        fprintf(stderr, "Error: %s\n", rcalc_error_message(ctx));
+        return 1;
+    }
+
+    // Expected results, computed before any concurrency
+    srand(12345);
+    for (int i = 0; i < INPUT_COUNT; i++) {
+        for (int a = 0; a < 4; a++) {
+            inputs[i][a] = (double)(rand() % 20000) / 100.0 - 50.0;
+        }
+        for (int c = 0; c <= CALL_COUNT; c++) {
+            if (evaluate_input(i, c, &expected[i][c]) != RCALC_OK) {
+                fprintf(stderr, "Error: %s failed: %s\n",
+                        c < CALL_COUNT ? calls[c].name : "expression", rcalc_error_message(ctx));
+                return 1;
+            }
+        }
+    }
+
+    printf("%-8s %14s %10s %8s\n", "threads", "calls/s", "speedup", "errors");
+    double base_rate = 0.0;
+    int failed = 0;
+    Worker *workers = calloc((size_t)max_threads, sizeof(Worker));
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+        double start = now_seconds();
+        for (int t = 0; t < threads; t++) {
+            workers[t].id = t;
+            workers[t].mismatches = 0;
+            pthread_create(&workers[t].thread, NULL, worker_main, &workers[t]);
+        }
+        long mismatches = 0;
+        for (int t = 0; t < threads; t++) {
+            pthread_join(workers[t].thread, NULL);
+            mismatches += workers[t].mismatches;
+        }
+        double rate = (double)calls_per_thread * threads / (now_seconds() - start);
+        if (threads == 1) base_rate = rate;
+        printf("%-8d %14.0f %9.2fx %8ld\n", threads, rate, rate / base_rate, mismatches);
+        if (mismatches) failed = 1;
+    }
+
+    free(workers);
+    rcalc_expr_free(expr);
+    rcalc_destroy(ctx);
+    if (failed) {
+        fprintf(stderr, "FAILED: results differed from single-threaded evaluation\n");
+        return 1;
+    }
+    return 0;
+}
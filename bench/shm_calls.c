@@ -0,0 +1,156 @@
+// Round trips through rcalc --shm.
+//
+// Attaches to a server's shared-memory region and calls one function over
+// and over, first one call at a time to measure latency percentiles, then
+// with a number of requests kept in flight to measure throughput. With -t,
+// several threads each use their own channel at once. Every result must
+// match the first one, so the run doubles as a consistency check.
+//
+//   gcc -O2 -I. bench/shm_calls.c -o shm_calls -pthread
+//   ./rcalc --shm /rcalc example.calc &
+//   ./shm_calls [-n calls] [-d depth] [-t threads] /rcalc distance 1 2 3 4
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "rcalc_shm.h"
+
+typedef struct Caller {
+    pthread_t thread;
+    double rate;               // Pipelined calls per second
+    long mismatches;
+    int failed;
+} Caller;
+
+static rcalc_shm shm;
+static int function;
+static double args[RCALC_SHM_MAX_ARGS];
+static int arg_count;
+static double expected;
+static long calls = 1000000;
+static int depth = 64;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Keep depth requests in flight, filling each slot in place
+static void *caller_main(void *arg) {
+    Caller *caller = arg;
+    rcalc_shm_client client;
+    if (rcalc_shm_open_channel(&shm, &client) != 0) {
+        fprintf(stderr, "Error: No free channel\n");
+        caller->failed = 1;
+        return NULL;
+    }
+    long submitted = 0, received = 0;
+    double start = now_seconds();
+    while (received < calls) {
+        rcalc_shm_request *request;
+        while (submitted < calls && submitted - received < depth &&
+               (request = rcalc_shm_next_request(&client))) {
+            request->function = (uint32_t)function;
+            request->arg_count = (uint32_t)arg_count;
+            memcpy(request->args, args, (size_t)arg_count * sizeof(double));
+            rcalc_shm_submit(&client);
+            submitted++;
+        }
+        const rcalc_shm_response *response = rcalc_shm_wait(&client);
+        if (!response) {
+            caller->failed = 1;
+            break;
+        }
+        if (response->status != RCALC_OK || response->result != expected) caller->mismatches++;
+        rcalc_shm_release(&client);
+        received++;
+    }
+    caller->rate = (double)received / (now_seconds() - start);
+    rcalc_shm_close_channel(&client);
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    int threads = 1;
+    int arg = 1;
+    for (; arg + 1 < argc && argv[arg][0] == '-'; arg += 2) {
+        if (strcmp(argv[arg], "-n") == 0) calls = atol(argv[arg + 1]);
+        else if (strcmp(argv[arg], "-d") == 0) depth = atoi(argv[arg + 1]);
+        else if (strcmp(argv[arg], "-t") == 0) threads = atoi(argv[arg + 1]);
+        else break;
+    }
+    if (argc - arg < 2 || argc - arg - 2 > RCALC_SHM_MAX_ARGS || calls < 1 || depth < 1 ||
+        threads < 1 || threads > RCALC_SHM_CHANNELS) {
+        fprintf(stderr, "Usage: %s [-n calls] [-d depth] [-t threads] name function [args...]\n", argv[0]);
+        return 1;
+    }
+    if (rcalc_shm_attach(argv[arg], &shm) != 0) {
+        fprintf(stderr, "Error: No rcalc server on shared memory '%s'\n", argv[arg]);
+        return 1;
+    }
+    function = rcalc_shm_function(&shm, argv[arg + 1]);
+    if (function < 0) {
+        fprintf(stderr, "Error: Server has no function '%s'\n", argv[arg + 1]);
+        return 1;
+    }
+    arg_count = argc - arg - 2;
+    for (int i = 0; i < arg_count; i++) args[i] = atof(argv[arg + 2 + i]);
+
+    // One call at a time
+    rcalc_shm_client client;
+    if (rcalc_shm_open_channel(&shm, &client) != 0 ||
+        rcalc_shm_call(&client, function, args, arg_count, &expected) != RCALC_OK) {
+        fprintf(stderr, "Error: Call to %s failed\n", argv[arg + 1]);
+        return 1;
+    }
+    long samples = calls < 100000 ? calls : 100000;
+    double *latencies = malloc((size_t)samples * sizeof(double));
+    long mismatches = 0;
+    double start = now_seconds();
+    for (long i = 0; i < samples; i++) {
+        double call_start = now_seconds();
+        double result;
+        if (rcalc_shm_call(&client, function, args, arg_count, &result) != RCALC_OK || result != expected) {
+            mismatches++;
+        }
+        latencies[i] = now_seconds() - call_start;
+    }
+    double elapsed = now_seconds() - start;
+    rcalc_shm_close_channel(&client);
+    qsort(latencies, (size_t)samples, sizeof(double), compare_doubles);
+    printf("%s = %.17g\n", argv[arg + 1], expected);
+    printf("one at a time: %.0f calls/s, p50 %.2f us, p99 %.2f us, p99.9 %.2f us\n", samples / elapsed,
+           latencies[samples / 2] * 1e6, latencies[(long)(samples * 0.99)] * 1e6,
+           latencies[(long)(samples * 0.999)] * 1e6);
+    free(latencies);
+
+    // Pipelined, one channel per thread
+    Caller *callers = calloc((size_t)threads, sizeof(Caller));
+    for (int t = 0; t < threads; t++) pthread_create(&callers[t].thread, NULL, caller_main, &callers[t]);
+    double total_rate = 0.0;
+    int failed = 0;
+    for (int t = 0; t < threads; t++) {
+        pthread_join(callers[t].thread, NULL);
+        total_rate += callers[t].rate;
+        mismatches += callers[t].mismatches;
+        failed |= callers[t].failed;
+    }
+    free(callers);
+    printf("depth %d, %d thread%s: %.0f calls/s\n", depth, threads, threads == 1 ? "" : "s", total_rate);
+
+    rcalc_shm_detach(&shm);
+    if (failed || mismatches) {
+        fprintf(stderr, "FAILED: %ld wrong results%s\n", mismatches, failed ? ", server went away" : "");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,80 @@
+// Process startup-to-result time.
+//
+// Runs a command many times, each time waiting for it to exit with its
+// output sent to /dev/null, and reports the wall-clock time per run. Use it
+// to keep one-shot evaluation (rcalc -e) fast enough for shell pipelines.
+//
+//   gcc -O2 bench/startup.c -o startup
+//   ./startup [-n runs] ./rcalc -e '1 + 2'
+//   ./startup -n 500 ./rcalc -l example.calc -e 'circle_area(2)'
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+extern char **environ;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char *argv[]) {
+    int runs = 1000;
+    int first = 1;
+    if (argc > 2 && strcmp(argv[1], "-n") == 0) {
+        runs = atoi(argv[2]);
+        first = 3;
+    }
+    if (first >= argc || runs < 1) {
+        fprintf(stderr, "Usage: %s [-n runs] command [args...]\n", argv[0]);
+        return 1;
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+
+    double *times = malloc((size_t)runs * sizeof(double));
+    if (!times) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return 1;
+    }
+    int failures = 0;
+    for (int i = 0; i < runs; i++) {
+        double start = now_seconds();
+        pid_t pid;
+        int status;
+        if (posix_spawn(&pid, argv[first], &actions, NULL, argv + first, environ) != 0) {
+            perror("posix_spawn");
+            return 1;
+        }
+        waitpid(pid, &status, 0);
+        times[i] = now_seconds() - start;
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) failures++;
+    }
+
+    qsort(times, (size_t)runs, sizeof(double), compare_doubles);
+    double total = 0.0;
+    for (int i = 0; i < runs; i++) total += times[i];
+    printf("%d runs: mean %.1f us, p50 %.1f us, p99 %.1f us, min %.1f us\n", runs,
+           total / runs * 1e6, times[runs / 2] * 1e6, times[(int)(runs * 0.99)] * 1e6, times[0] * 1e6);
+    if (failures) {
+        printf("%d runs exited with a non-zero status\n", failures);
+    }
+
+    free(times);
+    posix_spawn_file_actions_destroy(&actions);
+    return failures ? 1 : 0;
+}
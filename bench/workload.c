@@ -0,0 +1,193 @@
+// Synthetic workload generator.
+//
+// Writes a library of functions plus the inputs to exercise it end to end,
+// for bench/regress.c or for trying rcalc at scale by hand. Functions are
+// arranged in levels: each one calls a function of the next level down, so
+// a call to a top-level function runs a chain -d calls deep. Every body is
+// a sum of -s terms mixing arithmetic, built-ins and global variables. The
+// same seed always produces the same files.
+//
+//   gcc -O2 bench/workload.c -o workload
+//   ./workload [-f functions] [-d depth] [-s terms] [-r rows] [-e expressions] [-x seed] dir
+//
+// In dir, which is created if need be, it writes:
+//   lib.calc         the functions and their globals
+//   statements.calc  REPL input: assignments and expressions, then quit
+//   exprs.txt        one expression per line, for --eval-file
+//   data.txt         columns x, y and z, for --batch --input
+//   batch.txt        the expression to pass to --batch
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+typedef struct Workload {
+    int functions;
+    int depth;
+    int terms;
+    int rows;
+    int expressions;
+    int globals;
+    uint64_t state;            // xorshift64 generator
+} Workload;
+
+static uint64_t next_random(Workload *w) {
+    w->state ^= w->state << 13;
+    w->state ^= w->state >> 7;
+    w->state ^= w->state << 17;
+    return w->state;
+}
+
+static int random_below(Workload *w, int limit) {
+    return (int)(next_random(w) % (uint64_t)limit);
+}
+
+// A value in [low, high) with two decimals
+static double random_value(Workload *w, double low, double high) {
+    return low + (double)random_below(w, (int)((high - low) * 100.0)) / 100.0;
+}
+
+// Functions are numbered level by level; level 0 holds the top-level ones
+static int level_start(const Workload *w, int level) {
+    return (int)((long)w->functions * level / w->depth);
+}
+
+static int random_function(Workload *w, int level) {
+    int first = level_start(w, level);
+    int count = level_start(w, level + 1) - first;
+    return first + random_below(w, count > 0 ? count : 1);
+}
+
+static void write_term(FILE *fp, Workload *w) {
+    double c = random_value(w, 0.5, 9.5);
+    switch (random_below(w, 8)) {
+        case 0: fprintf(fp, "x * %.2f", c); break;
+        case 1: fprintf(fp, "y / %.2f", c); break;
+        case 2: fprintf(fp, "sin(x + %.2f)", c); break;
+        case 3: fprintf(fp, "sqrt(abs(y) + %.2f)", c); break;
+        case 4: fprintf(fp, "(x - y) ^ 2"); break;
+        case 5: fprintf(fp, "min(x, y) * g%d", random_below(w, w->globals)); break;
+        case 6: fprintf(fp, "if(x < y, x, y)"); break;
+        default: fprintf(fp, "hypot(x, %.2f)", c); break;
+    }
+}
+
+static FILE *open_output(const char *dir, const char *name) {
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        fprintf(stderr, "Error: Cannot write '%s'\n", path);
+        exit(1);
+    }
+    return fp;
+}
+
+static void write_library(const char *dir, Workload *w) {
+    FILE *fp = open_output(dir, "lib.calc");
+    fprintf(fp, "# Generated by bench/workload.c: %d functions, depth %d, %d terms\n\n", w->functions, w->depth,
+            w->terms);
+    for (int g = 0; g < w->globals; g++) {
+        fprintf(fp, "g%d = %.2f\n", g, random_value(w, 0.1, 2.0));
+    }
+    fprintf(fp, "\n");
+
+    // Define the deepest level first, so every call is to a known function
+    for (int level = w->depth - 1; level >= 0; level--) {
+        for (int i = level_start(w, level); i < level_start(w, level + 1); i++) {
+            fprintf(fp, "var f%d(var x, var y) {\n    return ", i);
+            for (int t = 0; t < w->terms; t++) {
+                if (t > 0) fprintf(fp, random_below(w, 3) ? " + " : " - ");
+                write_term(fp, w);
+            }
+            if (level + 1 < w->depth) {
+                fprintf(fp, " + f%d(y, x * 0.5) * 0.25", random_function(w, level + 1));
+            }
+            fprintf(fp, ";\n}\n");
+        }
+    }
+    fclose(fp);
+}
+
+static void write_call(FILE *fp, Workload *w, const char *x, const char *y) {
+    fprintf(fp, "f%d(%s, %s)", random_function(w, 0), x, y);
+}
+
+static void write_inputs(const char *dir, Workload *w) {
+    char x[32], y[32];
+
+    FILE *fp = open_output(dir, "statements.calc");
+    for (int i = 0; i < w->expressions; i++) {
+        snprintf(x, sizeof(x), "%.2f", random_value(w, -5.0, 5.0));
+        snprintf(y, sizeof(y), "%.2f", random_value(w, -5.0, 5.0));
+        if (i % 4 == 0) fprintf(fp, "t%d = ", i % 16);
+        write_call(fp, w, x, y);
+        if (i % 4 == 3) fprintf(fp, " + t%d", (i - 3) % 16);
+        fprintf(fp, "\n");
+    }
+    fprintf(fp, "quit\n");
+    fclose(fp);
+
+    fp = open_output(dir, "exprs.txt");
+    for (int i = 0; i < w->expressions; i++) {
+        snprintf(x, sizeof(x), "%.2f", random_value(w, -5.0, 5.0));
+        snprintf(y, sizeof(y), "%.2f", random_value(w, -5.0, 5.0));
+        write_call(fp, w, x, y);
+        fprintf(fp, " + ");
+        write_call(fp, w, y, x);
+        fprintf(fp, "\n");
+    }
+    fclose(fp);
+
+    fp = open_output(dir, "data.txt");
+    fprintf(fp, "x,y,z\n");
+    for (int i = 0; i < w->rows; i++) {
+        fprintf(fp, "%.2f,%.2f,%.2f\n", random_value(w, -5.0, 5.0), random_value(w, -5.0, 5.0),
+                random_value(w, 0.0, 10.0));
+    }
+    fclose(fp);
+
+    fp = open_output(dir, "batch.txt");
+    write_call(fp, w, "x", "y");
+    fprintf(fp, " + ");
+    write_call(fp, w, "y", "z");
+    fprintf(fp, " * 0.5\n");
+    fclose(fp);
+}
+
+int main(int argc, char *argv[]) {
+    Workload w = { 1000, 8, 6, 100000, 10000, 0, 0x2545F4914F6CDD1DULL };
+    int arg = 1;
+    for (; arg + 1 < argc && argv[arg][0] == '-'; arg += 2) {
+        int value = atoi(argv[arg + 1]);
+        if (strcmp(argv[arg], "-f") == 0) w.functions = value;
+        else if (strcmp(argv[arg], "-d") == 0) w.depth = value;
+        else if (strcmp(argv[arg], "-s") == 0) w.terms = value;
+        else if (strcmp(argv[arg], "-r") == 0) w.rows = value;
+        else if (strcmp(argv[arg], "-e") == 0) w.expressions = value;
+        else if (strcmp(argv[arg], "-x") == 0) w.state = (uint64_t)strtoull(argv[arg + 1], NULL, 0) | 1;
+        else break;
+    }
+    if (arg + 1 != argc || w.depth < 1 || w.functions < w.depth || w.terms < 1 || w.rows < 1 ||
+        w.expressions < 1) {
+        fprintf(stderr, "Usage: %s [-f functions] [-d depth] [-s terms] [-r rows] [-e expressions] "
+                        "[-x seed] dir\n", argv[0]);
+        if (w.depth >= 1 && w.functions < w.depth) {
+            fprintf(stderr, "There must be at least as many functions as levels of depth\n");
+        }
+        return 1;
+    }
+    w.globals = w.functions / 10 + 1;
+    if (mkdir(argv[arg], 0777) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Error: Cannot create directory '%s'\n", argv[arg]);
+        return 1;
+    }
+
+    write_library(argv[arg], &w);
+    write_inputs(argv[arg], &w);
+    printf("Wrote %d functions in %d levels, %d statements, %d expressions and %d rows to %s\n", w.functions,
+           w.depth, w.expressions, w.expressions, w.rows, argv[arg]);
+    return 0;
+}
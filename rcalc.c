@@ -3,12 +3,19 @@
 #include <string.h>
 #include <ctype.h>
 #include <math.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <time.h>
+#include <limits.h>
+
+#include "rcalc.h"
 
 #ifdef _WIN32
 #include <windows.h>
-// Windows doesn't have getline, so we'll implement our own
 typedef long long ssize_t;
 
+#ifndef RCALC_LIBRARY
+// Windows doesn't have getline, so we'll implement our own
 ssize_t getline_impl(char **lineptr, size_t *n, FILE *stream) {
     if (!lineptr || !n || !stream) return -1;
     
@@ -42,9 +49,36 @@ ssize_t getline_impl(char **lineptr, size_t *n, FILE *stream) {
 }
 
 #define getline getline_impl
+#endif
 #else
 #define _GNU_SOURCE
 #include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#ifndef RCALC_LIBRARY
+#include "rcalc_shm.h"
+#endif
+#endif
+#endif
+
+#if defined(_MSC_VER)
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL _Thread_local
 #endif
 
 #ifndef M_PI
@@ -55,6 +89,7 @@ ssize_t getline_impl(char **lineptr, size_t *n, FILE *stream) {
 #define M_E 2.71828182845904523536
 #endif
 
+#ifndef RCALC_LIBRARY
 // ANSI color codes for cross-platform compatibility
 #define COLOR_RESET   "\033[0m"
 #define COLOR_BLUE    "\033[94m"  // Pale blue
@@ -145,6 +180,14 @@ void show_help(void) {
     print_normal("COMMANDS:\n");
     print_normal("  help                     # Show this help\n");
     print_normal("  load \"filename.calc\"    # Load and execute a script file\n");
+    print_normal("  watch \"filename.calc\"   # Load a script and reload it when it changes\n");
+    print_normal("  save \"workspace.img\"    # Save all variables and functions to an image\n");
+    print_normal("  restore \"workspace.img\" # Replace the session with a saved image\n");
+    print_normal("  stats [json|reset]       # Show latency and throughput statistics\n");
+    print_normal("  memory [functions]       # Show memory held by definitions, or by each function\n");
+    print_normal("  time expression          # Time parsing, compiling and evaluating it once\n");
+    print_normal("  bench expression [N]     # Measure ns per evaluation, N times or calibrated\n");
+    print_normal("  profile on|off|report    # Time each user function; 'report folded' for flame graphs\n");
     print_normal("  quit                     # Exit calculator\n\n");
     
     print_normal("SCRIPT FILES:\n");
@@ -165,6 +208,8 @@ void show_help(void) {
 }
 
 // Variable and function data structures
+#endif
+
 typedef struct Variable {
     char name[32];
     double value;
@@ -214,13 +259,147 @@ typedef struct UserFunction {
     Parameter *params;
     int param_count;
     ASTNode *body; // AST instead of string
+    char *source;  // Unparsed definition in lazy mode, compiled on first call
     struct UserFunction *next;
+    struct UserFunction *hash_next;  // Chain in the context's function_index
 } UserFunction;
 
-// Global symbol tables
-static Variable *variables = NULL;
-static UserFunction *user_functions = NULL;
-static int silent_mode = 0;  // For suppressing output during script loading
+// A statement in parsed form. Statements are parsed completely before they
+// run, so a parsed script can also be saved and replayed from a cache.
+typedef enum {
+    STMT_FUNCTION,
+    STMT_ASSIGNMENT,
+    STMT_EXPRESSION
+} StatementKind;
+
+typedef struct Statement {
+    StatementKind kind;
+    char name[32];             // Function or variable name
+    Parameter *params;         // Function parameters
+    ASTNode *ast;              // Function body, assigned value or expression
+} Statement;
+
+// Built-in functions, dispatched by kind
+typedef enum {
+    BUILTIN_UNARY,
+    BUILTIN_BINARY,
+    BUILTIN_CLAMP,
+    BUILTIN_LERP,
+    BUILTIN_IF
+} BuiltinKind;
+
+typedef struct Builtin {
+    const char *name;
+    BuiltinKind kind;
+    double (*unary)(double);
+    double (*binary)(double, double);
+} Builtin;
+
+// Evaluation errors. The evaluator records the first error of a statement
+// or batch row instead of printing, so hot loops never touch stdio; callers
+// decide whether to print, count, or attach the error to a row.
+typedef enum {
+    CALC_OK = 0,
+    CALC_ERR_DIVISION_BY_ZERO,
+    CALC_ERR_UNDEFINED_VARIABLE,
+    CALC_ERR_UNKNOWN_FUNCTION,
+    CALC_ERR_ARITY,
+    CALC_ERR_CALL_LIMIT,
+    CALC_ERR_RECURSION_LIMIT,
+    CALC_ERR_TIMEOUT,
+    CALC_ERR_CANCELLED,
+    CALC_ERR_SYNTAX,           // Expression files only: the line did not parse
+    CALC_ERR_COUNT
+} CalcError;
+
+typedef struct EvalError {
+    CalcError code;
+    char name[32];             // Variable or function involved, if any
+    int expected;              // Arity errors only
+    int got;
+} EvalError;
+
+static const char *calc_error_names[CALC_ERR_COUNT] = {
+    "ok", "division_by_zero", "undefined_variable", "unknown_function", "arity",
+    "call_limit", "recursion_limit", "timeout", "cancelled", "syntax"
+};
+
+// Limits on each evaluation, so a runaway recursion fails with an error
+// instead of hanging or overflowing the stack. Only user function calls are
+// limited: anything else is bounded by the size of the expression. Zero
+// means no limit, except for depth, which is limited by default.
+#define DEFAULT_MAX_DEPTH 1000
+#define BUDGET_CHECK_INTERVAL 1024  // Calls between deadline and cancel checks
+
+typedef struct EvalLimits {
+    long max_calls;            // User function calls per evaluation
+    int max_depth;             // Nested user function calls
+    double timeout;            // Seconds from the evaluation's first call
+} EvalLimits;
+
+// Cancelling bumps a context's generation; evaluations that started under
+// an older generation stop at their next check
+#ifdef _WIN32
+typedef volatile LONG CancelGeneration;
+#define cancel_generation_load(generation) ((unsigned)*(generation))
+#define cancel_generation_bump(generation) InterlockedIncrement(generation)
+#else
+typedef atomic_uint CancelGeneration;
+#define cancel_generation_load(generation) atomic_load_explicit(generation, memory_order_relaxed)
+#define cancel_generation_bump(generation) atomic_fetch_add(generation, 1u)
+#endif
+
+// Everything a session defines lives in its context. An API call binds the
+// caller's context to the current thread for the duration of the call (the
+// CLI binds one for its whole run), so contexts on different threads never
+// touch each other.
+struct rcalc_context {
+    Variable *variables;       // Globals, while the context is not bound
+    UserFunction *user_functions;
+    UserFunction **function_index;  // Hash buckets over user_functions
+    size_t function_index_size;
+    size_t function_count;
+    int quiet;                 // Mute syntax and evaluation error messages
+    unsigned char *image;      // Restored workspace image that bodies point into
+    size_t image_size;
+    const struct rcalc_context *library;  // Shared layer that lookups fall through to
+    int shared;                // Frozen so sessions can use it as their library
+    EvalLimits limits;
+    CancelGeneration cancel_generation;
+};
+
+struct rcalc_expr {
+    ASTNode *ast;
+};
+
+// Symbol tables of the bound context. Variables are per-thread so batch
+// evaluator threads can each bind their own input columns.
+static THREAD_LOCAL rcalc_context *context = NULL;
+static THREAD_LOCAL Variable *variables = NULL;
+static THREAD_LOCAL const Variable *shared_variables = NULL;  // Read-only fallback for worker threads
+
+// Arguments of the user function call being evaluated on this thread
+typedef struct Frame {
+    const Parameter *params;
+    const double *args;
+    int arg_count;
+    int depth;                 // 1 for the outermost call
+} Frame;
+
+// How much of its limits the evaluation on this thread has used
+typedef struct EvalBudget {
+    long calls;
+    long next_check;           // Call count at which to check the costly limits
+    double deadline;           // Set at the first check, if there is a timeout
+    unsigned generation;       // Context's cancel generation when evaluation began
+    int exhausted;             // A limit was hit; unwind without calling anything
+} EvalBudget;
+
+static THREAD_LOCAL const Frame *current_frame = NULL;
+static THREAD_LOCAL int silent_mode = 0;  // For suppressing output during script loading
+static THREAD_LOCAL int definitions_locked = 0;  // Workers must not modify shared functions
+static THREAD_LOCAL EvalError eval_error;  // First error since the last clear_eval_error()
+static THREAD_LOCAL EvalBudget budget;     // Reset with eval_error for each evaluation
 
 // Token types for parsing
 typedef enum {
@@ -251,35 +430,34 @@ typedef struct {
     char name[32];
 } Token;
 
-// Global variables for parsing
-static const char *expr_pos;
-static Token current_token;
+// Global variables for parsing (per-thread so workers can parse concurrently)
+static THREAD_LOCAL const char *expr_pos;
+static THREAD_LOCAL Token current_token;
 
 // Function prototypes
 static void get_next_token(void);
-static double parse_expression(void);
-static double parse_term(void);
-static double parse_factor(void);
-static double parse_function(const char *func_name);
-static double parse_power(void);
-static double parse_statement(void);
-static double parse_assignment(void);
-static void parse_function_definition(void);
 static int is_function(const char *name);
+static const Builtin* lookup_builtin(const char *name);
+static int builtin_arity(const Builtin *builtin);
+static double apply_builtin(const Builtin *builtin, const double *args);
 static void skip_whitespace(void);
 static Variable* lookup_variable(const char *name);
 static UserFunction* lookup_user_function(const char *name);
-static void create_variable(const char *name, double value);
-static void set_variable_value(const char *name, double value);
+static int create_variable(const char *name, double value);
+static int set_variable_value(const char *name, double value);
 static double get_variable_value(const char *name);
 static void free_variables(Variable *vars);
 static void free_user_functions(void);
 static Parameter* create_parameter(const char *name);
 static void free_parameters(Parameter *params);
 static UserFunction* create_user_function(const char *name, Parameter *params, ASTNode *body);
-static double evaluate_user_function(UserFunction *func, double *args, int arg_count);
-static int load_script_file(const char *filename);
-static void parse_load_command(const char *line);
+static double evaluate_user_function(UserFunction *func, const double *args, int arg_count);
+static ASTNode* user_function_body(UserFunction *func);
+static double monotonic_seconds(void);
+#ifndef RCALC_LIBRARY
+static int profiling = 0;
+static double profile_user_function(UserFunction *func, const double *args, int arg_count);
+#endif
 
 // AST functions
 static ASTNode* create_number_node(double value);
@@ -296,23 +474,289 @@ static ASTNode* parse_power_ast(void);
 static double evaluate_ast(ASTNode *node);
 static void free_ast(ASTNode *node);
 
-// AST creation functions
+// Error reporting
+static THREAD_LOCAL int errors_muted = 0;  // Set on threads that stage scripts
+static THREAD_LOCAL int errors_reported = 0;  // Including muted ones
+static THREAD_LOCAL int error_line = 0;       // Expression file line being parsed, if any
+
+// Report a syntax or load error. While an expression file line is parsed,
+// "Error: " messages name the line, as batch input errors do.
+static void report_error(const char *format, ...) {
+    errors_reported++;
+    if (errors_muted) return;
+    va_list args;
+    va_start(args, format);
+    if (error_line && strncmp(format, "Error: ", 7) == 0) {
+        // One write, so lines from worker threads do not interleave
+        char message[256];
+        vsnprintf(message, sizeof(message), format + 7, args);
+        fprintf(stderr, "Error: Line %d: %s", error_line, message);
+    } else {
+        vfprintf(stderr, format, args);
+    }
+    va_end(args);
+}
+
+// Start a new evaluation: no error yet, and its limits start over
+static void clear_eval_error(void) {
+    eval_error.code = CALC_OK;
+    budget.calls = 0;
+    budget.next_check = 1;
+    budget.deadline = 0.0;
+    budget.exhausted = 0;
+    budget.generation = context ? cancel_generation_load(&context->cancel_generation) : 0;
+}
+
+static void raise_eval_error(CalcError code, const char *name, int expected, int got) {
+    if (eval_error.code != CALC_OK) return;  // Keep the first error
+    eval_error.code = code;
+    strncpy(eval_error.name, name ? name : "", sizeof(eval_error.name) - 1);
+    eval_error.name[sizeof(eval_error.name) - 1] = '\0';
+    eval_error.expected = expected;
+    eval_error.got = got;
+}
+
+static void format_eval_error(const EvalError *error, char *buffer, size_t size) {
+    switch (error->code) {
+        case CALC_ERR_DIVISION_BY_ZERO:
+            snprintf(buffer, size, "Division by zero");
+            break;
+        case CALC_ERR_UNDEFINED_VARIABLE:
+            snprintf(buffer, size, "Undefined variable '%s'", error->name);
+            break;
+        case CALC_ERR_UNKNOWN_FUNCTION:
+            snprintf(buffer, size, "Unknown function '%s'", error->name);
+            break;
+        case CALC_ERR_ARITY: {
+            // Worded as before arity errors became codes, since scripts match them
+            const Builtin *builtin = lookup_builtin(error->name);
+            if (!builtin) {
+                snprintf(buffer, size, "Function '%s' expects %d arguments, got %d",
+                         error->name, error->expected, error->got);
+            } else if (builtin->kind == BUILTIN_UNARY) {
+                snprintf(buffer, size, "Built-in function '%s' expects 1 argument", error->name);
+            } else {
+                const char *usage = builtin->kind == BUILTIN_CLAMP ? " (value, min, max)" :
+                                    builtin->kind == BUILTIN_LERP ? " (a, b, t)" :
+                                    builtin->kind == BUILTIN_IF ? " (condition, true_value, false_value)" : "";
+                snprintf(buffer, size, "%s() requires %d arguments%s", error->name, error->expected, usage);
+            }
+            break;
+        }
+        case CALC_ERR_CALL_LIMIT:
+            snprintf(buffer, size, "More than %d function calls, stopped in '%s'", error->expected, error->name);
+            break;
+        case CALC_ERR_RECURSION_LIMIT:
+            snprintf(buffer, size, "Calls nested more than %d deep, stopped in '%s'", error->expected, error->name);
+            break;
+        case CALC_ERR_TIMEOUT:
+            snprintf(buffer, size, "Evaluation timed out in '%s'", error->name);
+            break;
+        case CALC_ERR_CANCELLED:
+            snprintf(buffer, size, "Evaluation cancelled in '%s'", error->name);
+            break;
+        default:
+            buffer[0] = '\0';
+            break;
+    }
+}
+
+static void print_eval_error(const EvalError *error) {
+    char message[128];
+    format_eval_error(error, message, sizeof(message));
+    if (message[0]) report_error("Error: %s\n", message);
+}
+
+// Memory accounting. Loaded state is allocated and released through these
+// with its category and size, so the memory command can show what each kind
+// of object costs and --max-memory can turn an allocation past the limit
+// into an error instead of a crash.
+typedef enum {
+    MEMORY_AST,                // Expression trees and their argument arrays
+    MEMORY_SYMBOLS,            // Variables, parameters, functions and the function index
+    MEMORY_SOURCE,             // Unparsed bodies of lazily loaded functions
+    MEMORY_CACHE,              // Script cache being built while a script loads
+    MEMORY_KERNEL,             // Compiled batch kernels
+    MEMORY_CATEGORY_COUNT
+} MemoryCategory;
+
+#ifdef _WIN32
+typedef volatile LONG64 MemoryCount;
+#define memory_count_load(count) ((size_t)*(count))
+#define memory_count_store(count, value) (*(count) = (LONG64)(value))
+#define memory_count_add(count, n) ((size_t)InterlockedExchangeAdd64(count, (LONG64)(n)))
+#define memory_count_replace(count, expected, value) \
+    (InterlockedCompareExchange64(count, (LONG64)(value), (LONG64)(expected)) == (LONG64)(expected))
+#else
+typedef atomic_size_t MemoryCount;
+#define memory_count_load(count) atomic_load_explicit(count, memory_order_relaxed)
+#define memory_count_store(count, value) atomic_store_explicit(count, value, memory_order_relaxed)
+#define memory_count_add(count, n) atomic_fetch_add_explicit(count, (size_t)(n), memory_order_relaxed)
+#define memory_count_replace(count, expected, value) \
+    atomic_compare_exchange_weak_explicit(count, &(size_t){expected}, value, memory_order_relaxed, memory_order_relaxed)
+#endif
+
+typedef struct MemoryUsage {
+    MemoryCount bytes;
+    MemoryCount objects;
+} MemoryUsage;
+
+// Each thread tallies its own changes and adds them to the shared counters
+// every MEMORY_FLUSH_CHANGES changes, and before it exits, so allocating a
+// node costs no atomic operation. With a limit, the shared total is updated
+// on every change instead, so the limit is exact.
+#define MEMORY_FLUSH_CHANGES 256
+
+typedef struct MemoryTally {
+    long long bytes[MEMORY_CATEGORY_COUNT];
+    long long objects[MEMORY_CATEGORY_COUNT];
+    long long total;           // Not yet in memory_total (only without a limit)
+    long long high;            // Highest total since the last flush, for the peak
+    int changes;
+} MemoryTally;
+
+#define AST_MAX_ARGS 10
+#define AST_ARGS_SIZE (AST_MAX_ARGS * sizeof(ASTNode*))
+
+static MemoryUsage memory_usage[MEMORY_CATEGORY_COUNT];
+static MemoryCount memory_total;
+static MemoryCount memory_peak;
+static size_t memory_limit = 0;            // Bytes; 0 for no limit; set before anything is allocated
+static THREAD_LOCAL MemoryTally memory_tally;
+static THREAD_LOCAL int allocation_failures = 0;  // Counted like errors_reported
+static THREAD_LOCAL int memory_error_reported = 0;  // Once per statement, not per node
+
+// Another thread may raise the peak between the load and the store, so
+// retry until the peak is at least total
+static void memory_raise_peak(size_t total) {
+    size_t peak = memory_count_load(&memory_peak);
+    while (total > peak && !memory_count_replace(&memory_peak, peak, total)) {
+        peak = memory_count_load(&memory_peak);
+    }
+}
+
+// Add this thread's tally to the shared counters
+static void memory_flush(void) {
+    MemoryTally *tally = &memory_tally;
+    for (int i = 0; i < MEMORY_CATEGORY_COUNT; i++) {
+        if (tally->bytes[i]) memory_count_add(&memory_usage[i].bytes, tally->bytes[i]);
+        if (tally->objects[i]) memory_count_add(&memory_usage[i].objects, tally->objects[i]);
+    }
+    if (tally->total || tally->high) {
+        size_t before = memory_count_add(&memory_total, tally->total);
+        memory_raise_peak(before + (size_t)tally->high);
+    }
+    memset(tally, 0, sizeof(*tally));
+}
+
+// Account for a change of size bytes (negative when released). Growth fails
+// if it would take the total past the limit.
+static int memory_change(MemoryCategory category, long long size, int objects) {
+    MemoryTally *tally = &memory_tally;
+    if (memory_limit) {
+        size_t total = memory_count_add(&memory_total, size) + (size_t)size;
+        if (size > 0 && total > memory_limit) {
+            memory_count_add(&memory_total, -size);
+            allocation_failures++;
+            return -1;
+        }
+        memory_raise_peak(total);
+    } else {
+        tally->total += size;
+        if (tally->total > tally->high) tally->high = tally->total;
+    }
+    tally->bytes[category] += size;
+    tally->objects[category] += objects;
+    if (++tally->changes == MEMORY_FLUSH_CHANGES) memory_flush();
+    return 0;
+}
+
+static void* memory_alloc(MemoryCategory category, size_t size) {
+    if (memory_change(category, (long long)size, 1) != 0) return NULL;
+    void *ptr = malloc(size);
+    if (!ptr) {
+        memory_change(category, -(long long)size, -1);
+        allocation_failures++;
+    }
+    return ptr;
+}
+
+static void* memory_calloc(MemoryCategory category, size_t size) {
+    void *ptr = memory_alloc(category, size);
+    if (ptr) memset(ptr, 0, size);
+    return ptr;
+}
+
+// Resize a block of old_size bytes (a new one if ptr is NULL). On failure
+// the old block is untouched and still accounted for.
+static void* memory_realloc(MemoryCategory category, void *ptr, size_t old_size, size_t new_size) {
+    long long growth = (long long)new_size - (long long)old_size;
+    int objects = ptr ? 0 : 1;
+    if (growth > 0 && memory_change(category, growth, objects) != 0) return NULL;
+    void *new_ptr = realloc(ptr, new_size);
+    if (!new_ptr) {
+        if (growth > 0) memory_change(category, -growth, -objects);
+        allocation_failures++;
+        return NULL;
+    }
+    if (growth <= 0) memory_change(category, growth, objects);
+    return new_ptr;
+}
+
+static void memory_free(MemoryCategory category, void *ptr, size_t size) {
+    if (!ptr) return;
+    memory_change(category, -(long long)size, -1);
+    free(ptr);
+}
+
+// Report an allocation that failed while parsing or defining. A statement
+// that runs out fails every allocation after the first, so only the first
+// is printed, though each still counts as an error.
+static void report_out_of_memory(void) {
+    if (memory_error_reported) {
+        errors_reported++;
+        return;
+    }
+    memory_error_reported = 1;
+    if (memory_limit) {
+        report_error("Error: Out of memory (limit of %zu bytes reached)\n", memory_limit);
+    } else {
+        report_error("Error: Out of memory\n");
+    }
+}
+
+// AST creation functions. When a node can't be allocated its operands are
+// freed and NULL is returned, after reporting the error so that the
+// statement being parsed fails.
+static ASTNode* alloc_ast_node(void) {
+    ASTNode *node = memory_alloc(MEMORY_AST, sizeof(ASTNode));
+    if (!node) report_out_of_memory();
+    return node;
+}
+
 static ASTNode* create_number_node(double value) {
-    ASTNode *node = malloc(sizeof(ASTNode));
+    ASTNode *node = alloc_ast_node();
+    if (!node) return NULL;
     node->type = AST_NUMBER;
     node->data.number = value;
     return node;
 }
 
 static ASTNode* create_variable_node(const char *name) {
-    ASTNode *node = malloc(sizeof(ASTNode));
+    ASTNode *node = alloc_ast_node();
+    if (!node) return NULL;
     node->type = AST_VARIABLE;
     strcpy(node->data.variable, name);
     return node;
 }
 
 static ASTNode* create_binary_op_node(char op, ASTNode *left, ASTNode *right) {
-    ASTNode *node = malloc(sizeof(ASTNode));
+    ASTNode *node = alloc_ast_node();
+    if (!node) {
+        free_ast(left);
+        free_ast(right);
+        return NULL;
+    }
     node->type = AST_BINARY_OP;
     node->data.binary.op = op;
     node->data.binary.comparison[0] = '\0'; // Initialize to empty string
@@ -322,25 +766,31 @@ static ASTNode* create_binary_op_node(char op, ASTNode *left, ASTNode *right) {
 }
 
 static ASTNode* create_comparison_node(const char *comparison, ASTNode *left, ASTNode *right) {
-    ASTNode *node = malloc(sizeof(ASTNode));
-    node->type = AST_BINARY_OP;
-    node->data.binary.op = comparison[0]; // Store first character for compatibility
-    strcpy(node->data.binary.comparison, comparison);
-    node->data.binary.left = left;
-    node->data.binary.right = right;
+    ASTNode *node = create_binary_op_node(comparison[0], left, right); // First character for compatibility
+    if (node) strcpy(node->data.binary.comparison, comparison);
     return node;
 }
 
 static ASTNode* create_unary_op_node(char op, ASTNode *operand) {
-    ASTNode *node = malloc(sizeof(ASTNode));
+    ASTNode *node = alloc_ast_node();
+    if (!node) {
+        free_ast(operand);
+        return NULL;
+    }
     node->type = AST_UNARY_OP;
     node->data.unary.op = op;
     node->data.unary.operand = operand;
     return node;
 }
 
+// Takes ownership of args, an array of AST_MAX_ARGS slots (or NULL)
 static ASTNode* create_function_call_node(const char *name, ASTNode **args, int arg_count) {
-    ASTNode *node = malloc(sizeof(ASTNode));
+    ASTNode *node = alloc_ast_node();
+    if (!node) {
+        for (int i = 0; i < arg_count; i++) free_ast(args[i]);
+        memory_free(MEMORY_AST, args, AST_ARGS_SIZE);
+        return NULL;
+    }
     node->type = AST_FUNCTION_CALL;
     strcpy(node->data.func_call.name, name);
     node->data.func_call.args = args;
@@ -380,7 +830,7 @@ static double evaluate_ast(ASTNode *node) {
                 case '*': return left * right;
                 case '/': 
                     if (right == 0.0) {
-                        fprintf(stderr, "Error: Division by zero\n");
+                        raise_eval_error(CALC_ERR_DIVISION_BY_ZERO, NULL, 0, 0);
                         return NAN;
                     }
                     return left / right;
@@ -399,152 +849,47 @@ static double evaluate_ast(ASTNode *node) {
         }
         
         case AST_FUNCTION_CALL: {
+            const char *name = node->data.func_call.name;
+            int arg_count = node->data.func_call.arg_count;
+            
             // Handle built-in functions
-            if (is_function(node->data.func_call.name)) {
-                // Multi-argument built-in functions
-                if (strcmp(node->data.func_call.name, "pow") == 0) {
-                    if (node->data.func_call.arg_count != 2) {
-                        fprintf(stderr, "Error: pow() requires 2 arguments\n");
-                        return NAN;
-                    }
-                    double arg1 = evaluate_ast(node->data.func_call.args[0]);
-                    double arg2 = evaluate_ast(node->data.func_call.args[1]);
-                    return pow(arg1, arg2);
-                }
-                
-                if (strcmp(node->data.func_call.name, "atan2") == 0) {
-                    if (node->data.func_call.arg_count != 2) {
-                        fprintf(stderr, "Error: atan2() requires 2 arguments\n");
-                        return NAN;
-                    }
-                    double arg1 = evaluate_ast(node->data.func_call.args[0]);
-                    double arg2 = evaluate_ast(node->data.func_call.args[1]);
-                    return atan2(arg1, arg2);
-                }
-                
-                if (strcmp(node->data.func_call.name, "fmod") == 0) {
-                    if (node->data.func_call.arg_count != 2) {
-                        fprintf(stderr, "Error: fmod() requires 2 arguments\n");
-                        return NAN;
-                    }
-                    double arg1 = evaluate_ast(node->data.func_call.args[0]);
-                    double arg2 = evaluate_ast(node->data.func_call.args[1]);
-                    return fmod(arg1, arg2);
-                }
-                
-                if (strcmp(node->data.func_call.name, "min") == 0) {
-                    if (node->data.func_call.arg_count != 2) {
-                        fprintf(stderr, "Error: min() requires 2 arguments\n");
-                        return NAN;
-                    }
-                    double arg1 = evaluate_ast(node->data.func_call.args[0]);
-                    double arg2 = evaluate_ast(node->data.func_call.args[1]);
-                    return (arg1 < arg2) ? arg1 : arg2;
-                }
-                
-                if (strcmp(node->data.func_call.name, "max") == 0) {
-                    if (node->data.func_call.arg_count != 2) {
-                        fprintf(stderr, "Error: max() requires 2 arguments\n");
-                        return NAN;
-                    }
-                    double arg1 = evaluate_ast(node->data.func_call.args[0]);
-                    double arg2 = evaluate_ast(node->data.func_call.args[1]);
-                    return (arg1 > arg2) ? arg1 : arg2;
-                }
-                
-                if (strcmp(node->data.func_call.name, "hypot") == 0) {
-                    if (node->data.func_call.arg_count != 2) {
-                        fprintf(stderr, "Error: hypot() requires 2 arguments\n");
-                        return NAN;
-                    }
-                    double arg1 = evaluate_ast(node->data.func_call.args[0]);
-                    double arg2 = evaluate_ast(node->data.func_call.args[1]);
-                    return hypot(arg1, arg2);
-                }
-                
-                // Three-argument functions
-                if (strcmp(node->data.func_call.name, "clamp") == 0) {
-                    if (node->data.func_call.arg_count != 3) {
-                        fprintf(stderr, "Error: clamp() requires 3 arguments (value, min, max)\n");
-                        return NAN;
-                    }
-                    double value = evaluate_ast(node->data.func_call.args[0]);
-                    double min_val = evaluate_ast(node->data.func_call.args[1]);
-                    double max_val = evaluate_ast(node->data.func_call.args[2]);
-                    if (value < min_val) return min_val;
-                    if (value > max_val) return max_val;
-                    return value;
-                }
-                
-                if (strcmp(node->data.func_call.name, "lerp") == 0) {
-                    if (node->data.func_call.arg_count != 3) {
-                        fprintf(stderr, "Error: lerp() requires 3 arguments (a, b, t)\n");
-                        return NAN;
-                    }
-                    double a = evaluate_ast(node->data.func_call.args[0]);
-                    double b = evaluate_ast(node->data.func_call.args[1]);
-                    double t = evaluate_ast(node->data.func_call.args[2]);
-                    return a + t * (b - a);
+            const Builtin *builtin = lookup_builtin(name);
+            if (builtin) {
+                if (arg_count != builtin_arity(builtin)) {
+                    raise_eval_error(CALC_ERR_ARITY, name, builtin_arity(builtin), arg_count);
+                    return NAN;
                 }
                 
-                if (strcmp(node->data.func_call.name, "if") == 0) {
-                    if (node->data.func_call.arg_count != 3) {
-                        fprintf(stderr, "Error: if() requires 3 arguments (condition, true_value, false_value)\n");
-                        return NAN;
-                    }
+                // if() only evaluates the selected branch
+                if (builtin->kind == BUILTIN_IF) {
                     double condition = evaluate_ast(node->data.func_call.args[0]);
-                    if (condition != 0.0) {
-                        return evaluate_ast(node->data.func_call.args[1]);
-                    } else {
-                        return evaluate_ast(node->data.func_call.args[2]);
-                    }
+                    return evaluate_ast(node->data.func_call.args[condition != 0.0 ? 1 : 2]);
                 }
                 
-                // Single-argument built-in functions
-                if (node->data.func_call.arg_count != 1) {
-                    fprintf(stderr, "Error: Built-in function '%s' expects 1 argument\n", 
-                            node->data.func_call.name);
-                    return NAN;
+                double args[3];
+                for (int i = 0; i < arg_count; i++) {
+                    args[i] = evaluate_ast(node->data.func_call.args[i]);
                 }
-                double arg = evaluate_ast(node->data.func_call.args[0]);
-                
-                if (strcmp(node->data.func_call.name, "sin") == 0) return sin(arg);
-                if (strcmp(node->data.func_call.name, "cos") == 0) return cos(arg);
-                if (strcmp(node->data.func_call.name, "tan") == 0) return tan(arg);
-                if (strcmp(node->data.func_call.name, "sqrt") == 0) return sqrt(arg);
-                if (strcmp(node->data.func_call.name, "log") == 0) return log(arg);
-                if (strcmp(node->data.func_call.name, "ln") == 0) return log(arg);
-                if (strcmp(node->data.func_call.name, "exp") == 0) return exp(arg);
-                if (strcmp(node->data.func_call.name, "abs") == 0) return fabs(arg);
-                if (strcmp(node->data.func_call.name, "fabs") == 0) return fabs(arg);
-                if (strcmp(node->data.func_call.name, "floor") == 0) return floor(arg);
-                if (strcmp(node->data.func_call.name, "ceil") == 0) return ceil(arg);
-                if (strcmp(node->data.func_call.name, "round") == 0) return round(arg);
-                if (strcmp(node->data.func_call.name, "sqrt") == 0) return sqrt(arg);
-                if (strcmp(node->data.func_call.name, "cbrt") == 0) return cbrt(arg);
-                if (strcmp(node->data.func_call.name, "deg") == 0) return arg * 180.0 / M_PI;
-                if (strcmp(node->data.func_call.name, "rad") == 0) return arg * M_PI / 180.0;
-                // Add other single-argument functions as needed
+                return apply_builtin(builtin, args);
             }
             
             // Handle user-defined functions
-            UserFunction *func = lookup_user_function(node->data.func_call.name);
+            UserFunction *func = lookup_user_function(name);
             if (func) {
-                if (node->data.func_call.arg_count != func->param_count) {
-                    fprintf(stderr, "Error: Function '%s' expects %d arguments, got %d\n",
-                            node->data.func_call.name, func->param_count, node->data.func_call.arg_count);
+                if (arg_count != func->param_count) {
+                    raise_eval_error(CALC_ERR_ARITY, name, func->param_count, arg_count);
                     return NAN;
                 }
                 
                 double args[10]; // Max 10 args
-                for (int i = 0; i < node->data.func_call.arg_count; i++) {
+                for (int i = 0; i < arg_count; i++) {
                     args[i] = evaluate_ast(node->data.func_call.args[i]);
                 }
                 
-                return evaluate_user_function(func, args, node->data.func_call.arg_count);
+                return evaluate_user_function(func, args, arg_count);
             }
             
-            fprintf(stderr, "Error: Unknown function '%s'\n", node->data.func_call.name);
+            raise_eval_error(CALC_ERR_UNKNOWN_FUNCTION, name, 0, 0);
             return NAN;
         }
         
@@ -556,6 +901,12 @@ static double evaluate_ast(ASTNode *node) {
 static void free_ast(ASTNode *node) {
     if (!node) return;
     
+    // Trees restored from a workspace image are part of its mapping
+    if (context && context->image && (unsigned char *)node >= context->image &&
+        (unsigned char *)node < context->image + context->image_size) {
+        return;
+    }
+    
     switch (node->type) {
         case AST_BINARY_OP:
             free_ast(node->data.binary.left);
@@ -568,12 +919,12 @@ static void free_ast(ASTNode *node) {
             for (int i = 0; i < node->data.func_call.arg_count; i++) {
                 free_ast(node->data.func_call.args[i]);
             }
-            free(node->data.func_call.args);
+            memory_free(MEMORY_AST, node->data.func_call.args, AST_ARGS_SIZE);
             break;
         default:
             break;
     }
-    free(node);
+    memory_free(MEMORY_AST, node, sizeof(ASTNode));
 }
 
 // AST parsing functions
@@ -603,21 +954,23 @@ static ASTNode* parse_factor_ast(void) {
             int arg_count = 0;
             
             if (current_token.type != CALC_TOKEN_RPAREN) {
-                args = malloc(10 * sizeof(ASTNode*)); // Max 10 args
+                args = memory_alloc(MEMORY_AST, AST_ARGS_SIZE);
+                if (!args) {
+                    report_out_of_memory();
+                    return NULL;
+                }
                 while (1) {
-                    if (arg_count >= 10) {
-                        fprintf(stderr, "Error: Too many arguments\n");
-                        return NULL;
+                    ASTNode *arg_node = NULL;
+                    if (arg_count >= AST_MAX_ARGS) {
+                        report_error("Error: Too many arguments\n");
+                    } else if (!(arg_node = parse_expression_ast())) {
+                        report_error("Error: Failed to parse argument %d in function '%s'\n", arg_count + 1, name);
                     }
-                    ASTNode *arg_node = parse_expression_ast();
                     if (!arg_node) {
-                        fprintf(stderr, "Error: Failed to parse argument %d in function '%s'\n", arg_count + 1, name);
-                        if (args) {
-                            for (int i = 0; i < arg_count; i++) {
-                                free_ast(args[i]);
-                            }
-                            free(args);
+                        for (int i = 0; i < arg_count; i++) {
+                            free_ast(args[i]);
                         }
+                        memory_free(MEMORY_AST, args, AST_ARGS_SIZE);
                         return NULL;
                     }
                     args[arg_count++] = arg_node;
@@ -631,13 +984,11 @@ static ASTNode* parse_factor_ast(void) {
             }
             
             if (current_token.type != CALC_TOKEN_RPAREN) {
-                fprintf(stderr, "Error: Expected ')' in function call '%s'\n", name);
-                if (args) {
-                    for (int i = 0; i < arg_count; i++) {
-                        free_ast(args[i]);
-                    }
-                    free(args);
+                report_error("Error: Expected ')' in function call '%s'\n", name);
+                for (int i = 0; i < arg_count; i++) {
+                    free_ast(args[i]);
                 }
+                memory_free(MEMORY_AST, args, AST_ARGS_SIZE);
                 return NULL;
             }
             get_next_token(); // consume ')'
@@ -653,7 +1004,7 @@ static ASTNode* parse_factor_ast(void) {
         get_next_token(); // consume '('
         ASTNode *node = parse_expression_ast();
         if (current_token.type != CALC_TOKEN_RPAREN) {
-            fprintf(stderr, "Error: Expected ')'\n");
+            report_error("Error: Expected ')'\n");
             free_ast(node);
             return NULL;
         }
@@ -668,7 +1019,7 @@ static ASTNode* parse_factor_ast(void) {
         return create_unary_op_node(op, operand);
     }
     
-    fprintf(stderr, "Error: Unexpected token in AST parsing\n");
+    report_error("Error: Unexpected token in AST parsing\n");
     return NULL;
 }
 
@@ -743,52 +1094,131 @@ static Variable* lookup_variable(const char *name) {
     return NULL;
 }
 
-static void create_variable(const char *name, double value) {
-    Variable *var = malloc(sizeof(Variable));
+static int create_variable(const char *name, double value) {
+    Variable *var = memory_alloc(MEMORY_SYMBOLS, sizeof(Variable));
+    if (!var) {
+        report_out_of_memory();
+        return -1;
+    }
     strcpy(var->name, name);
     var->value = value;
     var->next = variables;
     variables = var;
+    return 0;
 }
 
-static void set_variable_value(const char *name, double value) {
+static int set_variable_value(const char *name, double value) {
     Variable *var = lookup_variable(name);
     if (var) {
         var->value = value;
-    } else {
-        create_variable(name, value);
+        return 0;
     }
+    return create_variable(name, value);
 }
 
 static double get_variable_value(const char *name) {
+    // Parameters of the innermost call shadow variables
+    if (current_frame) {
+        const Parameter *param = current_frame->params;
+        for (int i = 0; i < current_frame->arg_count && param; i++, param = param->next) {
+            if (strcmp(param->name, name) == 0) {
+                return current_frame->args[i];
+            }
+        }
+    }
+    
     Variable *var = lookup_variable(name);
     if (var) return var->value;
-    fprintf(stderr, "Error: Undefined variable '%s'\n", name);
+    
+    // Fall back to the read-only shared globals, then to the shared
+    // library's; assignments stay local
+    for (const Variable *shared = shared_variables; shared; shared = shared->next) {
+        if (strcmp(shared->name, name) == 0) {
+            return shared->value;
+        }
+    }
+    if (context && context->library) {
+        for (const Variable *shared = context->library->variables; shared; shared = shared->next) {
+            if (strcmp(shared->name, name) == 0) {
+                return shared->value;
+            }
+        }
+    }
+    raise_eval_error(CALC_ERR_UNDEFINED_VARIABLE, name, 0, 0);
     return NAN;
 }
 
 static void free_variables(Variable *vars) {
     while (vars) {
         Variable *next = vars->next;
-        free(vars);
+        memory_free(MEMORY_SYMBOLS, vars, sizeof(Variable));
         vars = next;
     }
 }
 
 // User function management
-static UserFunction* lookup_user_function(const char *name) {
-    UserFunction *func = user_functions;
+static size_t function_name_hash(const char *name) {
+    size_t hash = 2166136261u;
+    while (*name) {
+        hash = (hash ^ (unsigned char)*name++) * 16777619u;
+    }
+    return hash;
+}
+
+static UserFunction* find_user_function(const rcalc_context *ctx, const char *name) {
+    if (!ctx->function_index) return NULL;
+    UserFunction *func = ctx->function_index[function_name_hash(name) & (ctx->function_index_size - 1)];
     while (func) {
         if (strcmp(func->name, name) == 0) {
             return func;
         }
-        func = func->next;
+        func = func->hash_next;
     }
     return NULL;
 }
 
+// Session definitions shadow those of the shared library, if any
+static UserFunction* lookup_user_function(const char *name) {
+    UserFunction *func = find_user_function(context, name);
+    if (!func && context->library) {
+        func = find_user_function(context->library, name);
+    }
+    return func;
+}
+
+// Add a new function to the index, growing it to keep chains short.
+// Fails only if there is no index at all.
+static int index_user_function(UserFunction *func) {
+    if (context->function_count >= context->function_index_size) {
+        size_t new_size = context->function_index_size ? context->function_index_size * 2 : 64;
+        UserFunction **new_index = memory_calloc(MEMORY_SYMBOLS, new_size * sizeof(UserFunction*));
+        if (new_index) {
+            memory_free(MEMORY_SYMBOLS, context->function_index,
+                        context->function_index_size * sizeof(UserFunction*));
+            context->function_index = new_index;
+            context->function_index_size = new_size;
+            for (UserFunction *f = context->user_functions; f; f = f->next) {
+                if (f == func) continue;
+                size_t bucket = function_name_hash(f->name) & (new_size - 1);
+                f->hash_next = context->function_index[bucket];
+                context->function_index[bucket] = f;
+            }
+        }
+    }
+    if (!context->function_index) return -1;
+    size_t bucket = function_name_hash(func->name) & (context->function_index_size - 1);
+    func->hash_next = context->function_index[bucket];
+    context->function_index[bucket] = func;
+    context->function_count++;
+    return 0;
+}
+
 static Parameter* create_parameter(const char *name) {
-    Parameter *param = malloc(sizeof(Parameter));
+    Parameter *param = memory_alloc(MEMORY_SYMBOLS, sizeof(Parameter));
+    if (!param) {
+        report_out_of_memory();
+        return NULL;
+    }
     strcpy(param->name, name);
     param->next = NULL;
     return param;
@@ -797,32 +1227,43 @@ static Parameter* create_parameter(const char *name) {
 static void free_parameters(Parameter *params) {
     while (params) {
         Parameter *next = params->next;
-        free(params);
+        memory_free(MEMORY_SYMBOLS, params, sizeof(Parameter));
         params = next;
     }
 }
 
+// Release the source text of a lazily loaded function
+static void free_function_source(char *source) {
+    if (source) memory_free(MEMORY_SOURCE, source, strlen(source) + 1);
+}
+
+// Takes ownership of params and body, which are freed if the function
+// can't be allocated
 static UserFunction* create_user_function(const char *name, Parameter *params, ASTNode *body) {
-    // Remove existing function with same name
-    UserFunction **current = &user_functions;
-    while (*current) {
-        if (strcmp((*current)->name, name) == 0) {
-            UserFunction *to_remove = *current;
-            *current = (*current)->next;
-            free_ast(to_remove->body);
-            free_parameters(to_remove->params);
-            free(to_remove);
-            break;
+    // A redefinition replaces the existing function's contents in place.
+    // Only this context's own functions are candidates: redefining a shared
+    // library function adds a local one that shadows it.
+    UserFunction *func = find_user_function(context, name);
+    if (func) {
+        free_ast(func->body);
+        free_function_source(func->source);
+        free_parameters(func->params);
+    } else {
+        func = memory_alloc(MEMORY_SYMBOLS, sizeof(UserFunction));
+        if (func) strcpy(func->name, name);
+        if (!func || index_user_function(func) != 0) {
+            report_out_of_memory();
+            memory_free(MEMORY_SYMBOLS, func, sizeof(UserFunction));
+            free_parameters(params);
+            free_ast(body);
+            return NULL;
         }
-        current = &(*current)->next;
+        func->next = context->user_functions;
+        context->user_functions = func;
     }
-    
-    // Create new function
-    UserFunction *func = malloc(sizeof(UserFunction));
-    strcpy(func->name, name);
     func->params = params;
     func->body = body;
-    func->next = user_functions;
+    func->source = NULL;
     
     // Count parameters
     func->param_count = 0;
@@ -832,44 +1273,119 @@ static UserFunction* create_user_function(const char *name, Parameter *params, A
         p = p->next;
     }
     
-    user_functions = func;
     return func;
 }
 
 static void free_user_functions(void) {
-    while (user_functions) {
-        UserFunction *next = user_functions->next;
-        free_ast(user_functions->body);
-        free_parameters(user_functions->params);
-        free(user_functions);
-        user_functions = next;
+    while (context->user_functions) {
+        UserFunction *next = context->user_functions->next;
+        free_ast(context->user_functions->body);
+        free_function_source(context->user_functions->source);
+        free_parameters(context->user_functions->params);
+        memory_free(MEMORY_SYMBOLS, context->user_functions, sizeof(UserFunction));
+        context->user_functions = next;
     }
+    memory_free(MEMORY_SYMBOLS, context->function_index, context->function_index_size * sizeof(UserFunction*));
+    context->function_index = NULL;
+    context->function_index_size = 0;
+    context->function_count = 0;
 }
 
-// Skip whitespace characters
+// Skip whitespace characters and '#' comments, which run to the end of the line
 static void skip_whitespace(void) {
-    while (*expr_pos && isspace(*expr_pos)) {
-        expr_pos++;
+    while (*expr_pos) {
+        if (*expr_pos == '#') {
+            while (*expr_pos && *expr_pos != '\n') expr_pos++;
+        } else if (isspace((unsigned char)*expr_pos)) {
+            expr_pos++;
+        } else {
+            break;
+        }
     }
 }
 
-// Check if a string is a known function
-static int is_function(const char *name) {
-    const char *functions[] = {
-        "sin", "cos", "tan", "asin", "acos", "atan",
-        "sinh", "cosh", "tanh", "asinh", "acosh", "atanh",
-        "log", "ln", "log10", "log2", "exp", "exp2", "exp10",
-        "sqrt", "cbrt", "abs", "floor", "ceil", "round",
-        "deg", "rad", "pow", "fmod", "fabs", "atan2",
-        "min", "max", "clamp", "lerp", "hypot", "if", NULL
-    };
-    
-    for (int i = 0; functions[i]; i++) {
-        if (strcmp(name, functions[i]) == 0) {
-            return 1;
+// Built-in function table
+static double builtin_exp10(double x) { return pow(10, x); }
+static double builtin_deg(double x) { return x * 180.0 / M_PI; }
+static double builtin_rad(double x) { return x * M_PI / 180.0; }
+static double builtin_min(double a, double b) { return (a < b) ? a : b; }
+static double builtin_max(double a, double b) { return (a > b) ? a : b; }
+
+static const Builtin builtins[] = {
+    {"sin", BUILTIN_UNARY, sin, NULL},
+    {"cos", BUILTIN_UNARY, cos, NULL},
+    {"tan", BUILTIN_UNARY, tan, NULL},
+    {"asin", BUILTIN_UNARY, asin, NULL},
+    {"acos", BUILTIN_UNARY, acos, NULL},
+    {"atan", BUILTIN_UNARY, atan, NULL},
+    {"sinh", BUILTIN_UNARY, sinh, NULL},
+    {"cosh", BUILTIN_UNARY, cosh, NULL},
+    {"tanh", BUILTIN_UNARY, tanh, NULL},
+    {"asinh", BUILTIN_UNARY, asinh, NULL},
+    {"acosh", BUILTIN_UNARY, acosh, NULL},
+    {"atanh", BUILTIN_UNARY, atanh, NULL},
+    {"log", BUILTIN_UNARY, log, NULL},
+    {"ln", BUILTIN_UNARY, log, NULL},
+    {"log10", BUILTIN_UNARY, log10, NULL},
+    {"log2", BUILTIN_UNARY, log2, NULL},
+    {"exp", BUILTIN_UNARY, exp, NULL},
+    {"exp2", BUILTIN_UNARY, exp2, NULL},
+    {"exp10", BUILTIN_UNARY, builtin_exp10, NULL},
+    {"sqrt", BUILTIN_UNARY, sqrt, NULL},
+    {"cbrt", BUILTIN_UNARY, cbrt, NULL},
+    {"abs", BUILTIN_UNARY, fabs, NULL},
+    {"fabs", BUILTIN_UNARY, fabs, NULL},
+    {"floor", BUILTIN_UNARY, floor, NULL},
+    {"ceil", BUILTIN_UNARY, ceil, NULL},
+    {"round", BUILTIN_UNARY, round, NULL},
+    {"deg", BUILTIN_UNARY, builtin_deg, NULL},
+    {"rad", BUILTIN_UNARY, builtin_rad, NULL},
+    {"pow", BUILTIN_BINARY, NULL, pow},
+    {"fmod", BUILTIN_BINARY, NULL, fmod},
+    {"atan2", BUILTIN_BINARY, NULL, atan2},
+    {"min", BUILTIN_BINARY, NULL, builtin_min},
+    {"max", BUILTIN_BINARY, NULL, builtin_max},
+    {"hypot", BUILTIN_BINARY, NULL, hypot},
+    {"clamp", BUILTIN_CLAMP, NULL, NULL},
+    {"lerp", BUILTIN_LERP, NULL, NULL},
+    {"if", BUILTIN_IF, NULL, NULL},
+    {NULL, BUILTIN_UNARY, NULL, NULL}
+};
+
+static const Builtin* lookup_builtin(const char *name) {
+    for (int i = 0; builtins[i].name; i++) {
+        if (strcmp(name, builtins[i].name) == 0) {
+            return &builtins[i];
         }
     }
-    return 0;
+    return NULL;
+}
+
+static int builtin_arity(const Builtin *builtin) {
+    switch (builtin->kind) {
+        case BUILTIN_UNARY: return 1;
+        case BUILTIN_BINARY: return 2;
+        default: return 3;
+    }
+}
+
+static double apply_builtin(const Builtin *builtin, const double *args) {
+    switch (builtin->kind) {
+        case BUILTIN_UNARY: return builtin->unary(args[0]);
+        case BUILTIN_BINARY: return builtin->binary(args[0], args[1]);
+        case BUILTIN_CLAMP:
+            if (args[0] < args[1]) return args[1];
+            if (args[0] > args[2]) return args[2];
+            return args[0];
+        case BUILTIN_LERP: return args[0] + args[2] * (args[1] - args[0]);
+        case BUILTIN_IF: return args[0] != 0.0 ? args[1] : args[2];
+        default: return NAN;
+    }
+}
+
+// Check if a string is a known function
+static int is_function(const char *name) {
+    return lookup_builtin(name) != NULL;
 }
 
 // Get the next token from the expression
@@ -1011,220 +1527,125 @@ static void get_next_token(void) {
             current_token.value = M_E;
         } else if (is_function(current_token.name)) {
             current_token.type = CALC_TOKEN_FUNCTION;
-        } else if (lookup_user_function(current_token.name)) {
-            current_token.type = CALC_TOKEN_FUNCTION;
         } else {
+            // User functions are resolved when called, so parsing never
+            // depends on what has been defined so far
             current_token.type = CALC_TOKEN_IDENTIFIER;
         }
         return;
     }
     
     // Unknown character
-    fprintf(stderr, "Error: Unknown character '%c'\n", *expr_pos);
+    report_error("Error: Unknown character '%c'\n", *expr_pos);
     current_token.type = CALC_TOKEN_END;
 }
 
-// Parse function calls (both built-in and user-defined)
-static double parse_function(const char *func_name) {
-    if (current_token.type != CALC_TOKEN_LPAREN) {
-        fprintf(stderr, "Error: Expected '(' after function '%s'\n", func_name);
+// Check the limits too costly to test on every call: the call count, the
+// deadline and cancellation. Runs every BUDGET_CHECK_INTERVAL calls, so a
+// deadline or cancel is noticed within microseconds.
+static int within_budget(const UserFunction *func) {
+    const EvalLimits *limits = &context->limits;
+    CalcError code = CALC_OK;
+    if (limits->max_calls && budget.calls > limits->max_calls) {
+        code = CALC_ERR_CALL_LIMIT;
+    } else if (cancel_generation_load(&context->cancel_generation) != budget.generation) {
+        code = CALC_ERR_CANCELLED;
+    } else if (limits->timeout > 0.0) {
+        double now = monotonic_seconds();
+        if (budget.deadline == 0.0) {
+            budget.deadline = now + limits->timeout;
+        } else if (now > budget.deadline) {
+            code = CALC_ERR_TIMEOUT;
+        }
+    }
+    if (code != CALC_OK) {
+        int limit = limits->max_calls > INT_MAX ? INT_MAX : (int)limits->max_calls;
+        raise_eval_error(code, func->name, limit, 0);
+        budget.exhausted = 1;
+        return 0;
+    }
+    budget.next_check = budget.calls + BUDGET_CHECK_INTERVAL;
+    if (limits->max_calls && budget.next_check > limits->max_calls + 1) {
+        budget.next_check = limits->max_calls + 1;
+    }
+    return 1;
+}
+
+// Evaluate user-defined function with its arguments bound in a new frame.
+// The frame lives on the evaluating thread's stack and the function itself
+// is only read, so any number of threads can call one function at once.
+static double evaluate_user_function(UserFunction *func, const double *args, int arg_count) {
+    if (budget.exhausted) return NAN;
+    if (++budget.calls >= budget.next_check && !within_budget(func)) return NAN;
+    
+    // A lazily loaded body that failed to compile is left NULL. Every call
+    // then fails as it would had the definition been rejected at load time.
+    if (!user_function_body(func)) {
+        raise_eval_error(CALC_ERR_UNKNOWN_FUNCTION, func->name, 0, 0);
+        return NAN;
+    }
+    Frame frame = { func->params, args, arg_count, current_frame ? current_frame->depth + 1 : 1 };
+    if (context->limits.max_depth && frame.depth > context->limits.max_depth) {
+        raise_eval_error(CALC_ERR_RECURSION_LIMIT, func->name, context->limits.max_depth, 0);
+        budget.exhausted = 1;
         return NAN;
     }
+    const Frame *saved_frame = current_frame;
+    current_frame = &frame;
+    
+#ifndef RCALC_LIBRARY
+    // The profiler sees every call while on and costs one test while off
+    double result = profiling ? profile_user_function(func, args, arg_count)
+                              : evaluate_ast(user_function_body(func));
+#else
+    double result = evaluate_ast(user_function_body(func));
+#endif
+    
+    current_frame = saved_frame;
+    return result;
+}
+
+
+// Free whatever a statement still owns
+static void free_statement(Statement *stmt) {
+    free_parameters(stmt->params);
+    free_ast(stmt->ast);
+    stmt->params = NULL;
+    stmt->ast = NULL;
+}
+
+// Parse a function signature up to and including '{'; 'var' has been
+// consumed and the current token is the function name
+static int parse_function_header(Statement *stmt) {
+    stmt->kind = STMT_FUNCTION;
+    strcpy(stmt->name, current_token.name);
+    get_next_token(); // consume function name
     
+    if (current_token.type != CALC_TOKEN_LPAREN) {
+        report_error("Error: Expected '(' after function name\n");
+        return -1;
+    }
     get_next_token(); // consume '('
     
-    // Check if it's a user-defined function
-    UserFunction *user_func = lookup_user_function(func_name);
-    if (user_func) {
-        double args[10]; // Maximum 10 parameters
-        int arg_count = 0;
-        
-        // Parse arguments
-        if (current_token.type != CALC_TOKEN_RPAREN) {
-            do {
-                if (arg_count >= 10) {
-                    fprintf(stderr, "Error: Too many arguments (max 10)\n");
-                    return NAN;
-                }
-                args[arg_count++] = parse_expression();
-                if (current_token.type == CALC_TOKEN_COMMA) {
-                    get_next_token(); // consume ','
-                }
-            } while (current_token.type == CALC_TOKEN_COMMA);
+    // Parse parameter list
+    Parameter **last_param = &stmt->params;
+    while (current_token.type != CALC_TOKEN_RPAREN) {
+        if (current_token.type != CALC_TOKEN_VAR) {
+            report_error("Error: Expected parameter type 'var'\n");
+            return -1;
         }
+        get_next_token(); // consume 'var'
         
-        if (current_token.type != CALC_TOKEN_RPAREN) {
-            fprintf(stderr, "Error: Expected ')' after function arguments\n");
-            return NAN;
+        if (current_token.type != CALC_TOKEN_IDENTIFIER) {
+            report_error("Error: Expected parameter name\n");
+            return -1;
         }
         
-        get_next_token(); // consume ')'
+        *last_param = create_parameter(current_token.name);
+        if (!*last_param) return -1;
+        last_param = &(*last_param)->next;
         
-        if (arg_count != user_func->param_count) {
-            fprintf(stderr, "Error: Function '%s' expects %d arguments, got %d\n", 
-                    func_name, user_func->param_count, arg_count);
-            return NAN;
-        }
-        
-        return evaluate_user_function(user_func, args, arg_count);
-    }
-    
-    // Built-in function - parse arguments
-    double args[10]; // Maximum 10 arguments
-    int arg_count = 0;
-    
-    if (current_token.type != CALC_TOKEN_RPAREN) {
-        do {
-            if (arg_count >= 10) {
-                fprintf(stderr, "Error: Too many arguments (max 10)\n");
-                return NAN;
-            }
-            args[arg_count++] = parse_expression();
-            if (current_token.type == CALC_TOKEN_COMMA) {
-                get_next_token(); // consume ','
-            }
-        } while (current_token.type == CALC_TOKEN_COMMA);
-    }
-    
-    if (current_token.type != CALC_TOKEN_RPAREN) {
-        fprintf(stderr, "Error: Expected ')' after function arguments\n");
-        return NAN;
-    }
-    
-    get_next_token(); // consume ')'
-    
-    // Apply the built-in function
-    if (strcmp(func_name, "pow") == 0) {
-        if (arg_count != 2) {
-            fprintf(stderr, "Error: pow() requires 2 arguments\n");
-            return NAN;
-        }
-        return pow(args[0], args[1]);
-    }
-    
-    if (strcmp(func_name, "atan2") == 0) {
-        if (arg_count != 2) {
-            fprintf(stderr, "Error: atan2() requires 2 arguments\n");
-            return NAN;
-        }
-        return atan2(args[0], args[1]);
-    }
-    
-    if (strcmp(func_name, "fmod") == 0) {
-        if (arg_count != 2) {
-            fprintf(stderr, "Error: fmod() requires 2 arguments\n");
-            return NAN;
-        }
-        return fmod(args[0], args[1]);
-    }
-    
-    // Single argument functions
-    if (arg_count != 1) {
-        fprintf(stderr, "Error: Function '%s' requires 1 argument\n", func_name);
-        return NAN;
-    }
-    
-    double arg = args[0];
-    
-    if (strcmp(func_name, "sin") == 0) return sin(arg);
-    if (strcmp(func_name, "cos") == 0) return cos(arg);
-    if (strcmp(func_name, "tan") == 0) return tan(arg);
-    if (strcmp(func_name, "asin") == 0) return asin(arg);
-    if (strcmp(func_name, "acos") == 0) return acos(arg);
-    if (strcmp(func_name, "atan") == 0) return atan(arg);
-    if (strcmp(func_name, "sinh") == 0) return sinh(arg);
-    if (strcmp(func_name, "cosh") == 0) return cosh(arg);
-    if (strcmp(func_name, "tanh") == 0) return tanh(arg);
-    if (strcmp(func_name, "asinh") == 0) return asinh(arg);
-    if (strcmp(func_name, "acosh") == 0) return acosh(arg);
-    if (strcmp(func_name, "atanh") == 0) return atanh(arg);
-    if (strcmp(func_name, "log") == 0) return log(arg);
-    if (strcmp(func_name, "ln") == 0) return log(arg);
-    if (strcmp(func_name, "log10") == 0) return log10(arg);
-    if (strcmp(func_name, "log2") == 0) return log2(arg);
-    if (strcmp(func_name, "exp") == 0) return exp(arg);
-    if (strcmp(func_name, "exp2") == 0) return exp2(arg);
-    if (strcmp(func_name, "exp10") == 0) return pow(10, arg);
-    if (strcmp(func_name, "sqrt") == 0) return sqrt(arg);
-    if (strcmp(func_name, "cbrt") == 0) return cbrt(arg);
-    if (strcmp(func_name, "abs") == 0) return fabs(arg);
-    if (strcmp(func_name, "fabs") == 0) return fabs(arg);
-    if (strcmp(func_name, "floor") == 0) return floor(arg);
-    if (strcmp(func_name, "ceil") == 0) return ceil(arg);
-    if (strcmp(func_name, "round") == 0) return round(arg);
-    if (strcmp(func_name, "deg") == 0) return arg * 180.0 / M_PI;
-    if (strcmp(func_name, "rad") == 0) return arg * M_PI / 180.0;
-    
-    fprintf(stderr, "Error: Unknown function '%s'\n", func_name);
-    return NAN;
-}
-
-// Evaluate user-defined function with local scope
-static double evaluate_user_function(UserFunction *func, double *args, int arg_count) {
-    // Create local scope by saving current variables
-    Variable *saved_vars = variables;
-    variables = NULL;
-    
-    // Bind parameters to arguments
-    Parameter *param = func->params;
-    for (int i = 0; i < arg_count && param; i++, param = param->next) {
-        create_variable(param->name, args[i]);
-    }
-    
-    // Evaluate the AST body
-    double result = evaluate_ast(func->body);
-    
-    // Restore global scope
-    free_variables(variables);
-    variables = saved_vars;
-    
-    return result;
-}
-
-// Parse function definition
-static void parse_function_definition(void) {
-    // Already consumed 'var'
-    if (current_token.type != CALC_TOKEN_IDENTIFIER) {
-        fprintf(stderr, "Error: Expected function name\n");
-        return;
-    }
-    
-    char func_name[32];
-    strcpy(func_name, current_token.name);
-    get_next_token(); // consume function name
-    
-    if (current_token.type != CALC_TOKEN_LPAREN) {
-        fprintf(stderr, "Error: Expected '(' after function name\n");
-        return;
-    }
-    get_next_token(); // consume '('
-    
-    // Parse parameter list
-    Parameter *params = NULL;
-    Parameter *last_param = NULL;
-    
-    while (current_token.type != CALC_TOKEN_RPAREN) {
-        if (current_token.type != CALC_TOKEN_VAR) {
-            fprintf(stderr, "Error: Expected parameter type 'var'\n");
-            return;
-        }
-        get_next_token(); // consume 'var'
-        
-        if (current_token.type != CALC_TOKEN_IDENTIFIER) {
-            fprintf(stderr, "Error: Expected parameter name\n");
-            return;
-        }
-        
-        Parameter *param = create_parameter(current_token.name);
-        if (params == NULL) {
-            params = param;
-            last_param = param;
-        } else {
-            last_param->next = param;
-            last_param = param;
-        }
-        
-        get_next_token(); // consume parameter name
+        get_next_token(); // consume parameter name
         
         if (current_token.type == CALC_TOKEN_COMMA) {
             get_next_token(); // consume ','
@@ -1234,559 +1655,6533 @@ static void parse_function_definition(void) {
     get_next_token(); // consume ')'
     
     if (current_token.type != CALC_TOKEN_LBRACE) {
-        fprintf(stderr, "Error: Expected '{' to start function body\n");
-        return;
+        report_error("Error: Expected '{' to start function body\n");
+        return -1;
     }
     get_next_token(); // consume '{'
+    return 0;
+}
+
+// Parse a function definition; 'var' has been consumed and the current
+// token is the function name
+static int parse_function_definition(Statement *stmt) {
+    if (parse_function_header(stmt) != 0) {
+        return -1;
+    }
     
     // Parse the function body as AST
     if (current_token.type != CALC_TOKEN_RETURN) {
-        fprintf(stderr, "Error: Expected 'return' statement in function body\n");
-        free_parameters(params);
-        return;
+        report_error("Error: Expected 'return' statement in function body\n");
+        return -1;
     }
     get_next_token(); // consume 'return'
     
     // Parse the return expression as AST
-    ASTNode *body = parse_expression_ast();
-    if (!body) {
-        fprintf(stderr, "Error: Failed to parse return expression\n");
-        fprintf(stderr, "Debug: Current token type: %d\n", current_token.type);
-        if (current_token.type == CALC_TOKEN_IDENTIFIER || current_token.type == CALC_TOKEN_FUNCTION) {
-            fprintf(stderr, "Debug: Current token name: '%s'\n", current_token.name);
-        }
-        free_parameters(params);
-        return;
+    stmt->ast = parse_expression_ast();
+    if (!stmt->ast) {
+        report_error("Error: Failed to parse return expression\n");
+        return -1;
     }
     
     if (current_token.type != CALC_TOKEN_SEMICOLON) {
-        fprintf(stderr, "Error: Expected ';' after return expression\n");
-        free_parameters(params);
-        free_ast(body);
-        return;
+        report_error("Error: Expected ';' after return expression\n");
+        return -1;
     }
     get_next_token(); // consume ';'
     
     if (current_token.type != CALC_TOKEN_RBRACE) {
-        fprintf(stderr, "Error: Expected '}' to end function body\n");
-        free_parameters(params);
-        free_ast(body);
-        return;
+        report_error("Error: Expected '}' to end function body\n");
+        return -1;
     }
     get_next_token(); // consume '}'
-    
-    // Create the function with AST body
-    create_user_function(func_name, params, body);
-    
-    if (!silent_mode) {
-        printf("Function '%s' defined\n", func_name);
-    }
-}
-
-// Parse factors (numbers, constants, functions, parentheses, variables)
-static double parse_factor(void) {
-    double result;
-    
-    if (current_token.type == CALC_TOKEN_NUMBER) {
-        result = current_token.value;
-        get_next_token();
-        return result;
-    }
-    
-    if (current_token.type == CALC_TOKEN_CONSTANT) {
-        result = current_token.value;
-        get_next_token();
-        return result;
-    }
-    
-    if (current_token.type == CALC_TOKEN_FUNCTION) {
-        char func_name[32];
-        strcpy(func_name, current_token.name);
-        get_next_token();
-        return parse_function(func_name);
-    }
-    
-    if (current_token.type == CALC_TOKEN_IDENTIFIER) {
-        char name[32];
-        strcpy(name, current_token.name);
-        
-        // Look ahead to see if this is a function call
-        const char *saved_pos = expr_pos;
-        Token saved_token = current_token;
-        get_next_token();
-        
-        if (current_token.type == CALC_TOKEN_LPAREN && lookup_user_function(name)) {
-            // It's a user-defined function call
-            expr_pos = saved_pos;
-            current_token = saved_token;
-            get_next_token(); // consume function name
-            return parse_function(name);
-        } else {
-            // It's a variable, restore state
-            expr_pos = saved_pos;
-            current_token = saved_token;
-            get_next_token(); // consume variable name
-            return get_variable_value(name);
-        }
-    }
-    
-    if (current_token.type == CALC_TOKEN_LPAREN) {
-        get_next_token(); // consume '('
-        result = parse_expression();
-        if (current_token.type != CALC_TOKEN_RPAREN) {
-            fprintf(stderr, "Error: Expected ')'\n");
-            return NAN;
-        }
-        get_next_token(); // consume ')'
-        return result;
-    }
-    
-    if (current_token.type == CALC_TOKEN_OPERATOR && current_token.op == '-') {
-        get_next_token(); // consume unary '-'
-        return -parse_factor();
-    }
-    
-    if (current_token.type == CALC_TOKEN_OPERATOR && current_token.op == '+') {
-        get_next_token(); // consume unary '+'
-        return parse_factor();
-    }
-    
-    fprintf(stderr, "Error: Unexpected token\n");
-    return NAN;
+    return 0;
 }
 
-// Parse assignment or variable declaration
-static double parse_assignment(void) {
-    char var_name[32];
-    strcpy(var_name, current_token.name);
+// Parse an assignment; the current token is the variable name
+static int parse_assignment(Statement *stmt) {
+    stmt->kind = STMT_ASSIGNMENT;
+    strcpy(stmt->name, current_token.name);
     get_next_token(); // consume variable name
     
     if (current_token.type != CALC_TOKEN_ASSIGN) {
-        fprintf(stderr, "Error: Expected '=' in assignment\n");
-        return NAN;
+        report_error("Error: Expected '=' in assignment\n");
+        return -1;
     }
     get_next_token(); // consume '='
     
-    double value = parse_expression();
-    set_variable_value(var_name, value);
-    
-    return value;
+    stmt->ast = parse_expression_ast();
+    if (!stmt->ast) {
+        report_error("Error: Failed to parse expression\n");
+        return -1;
+    }
+    return 0;
 }
 
-// Parse statements (assignments, declarations, expressions)
-static double parse_statement(void) {
+// Parse statements (function definitions, declarations, assignments, expressions)
+static int parse_statement(Statement *stmt) {
+    memset(stmt, 0, sizeof(*stmt));
+    int declared = 0;
+    
+    // Loading a script would define shared functions from a worker thread.
+    // The rest of the line is a file name, so it is skipped rather than
+    // tokenized.
+    if (current_token.type == CALC_TOKEN_LOAD && definitions_locked) {
+        report_error("Error: load is not allowed here\n");
+        expr_pos += strlen(expr_pos);
+        current_token.type = CALC_TOKEN_END;
+        return -1;
+    }
+    
     if (current_token.type == CALC_TOKEN_VAR) {
         get_next_token(); // consume 'var'
         
-        if (current_token.type == CALC_TOKEN_IDENTIFIER) {
-            // Check if this is a function definition
-            const char *saved_pos = expr_pos;
-            Token saved_token = current_token;
-            
-            char name[32];
-            strcpy(name, current_token.name);
-            get_next_token();
-            
-            if (current_token.type == CALC_TOKEN_LPAREN) {
-                // It's a function definition
-                expr_pos = saved_pos;
-                current_token = saved_token;
-                parse_function_definition();
-                return NAN; // Functions don't return values to REPL
-            } else {
-                // It's a variable declaration
-                expr_pos = saved_pos;
-                current_token = saved_token;
-                
-                if (current_token.type != CALC_TOKEN_IDENTIFIER) {
-                    fprintf(stderr, "Error: Expected variable name\n");
-                    return NAN;
-                }
-                
-                double value = parse_assignment();
-                if (!silent_mode) {
-                    printf("Variable '%s' = %.10g\n", name, value);
-                }
-                return value;
-            }
+        if (current_token.type != CALC_TOKEN_IDENTIFIER) {
+            report_error("Error: Expected variable name\n");
+            return -1;
         }
+        declared = 1;
     }
     
     if (current_token.type == CALC_TOKEN_IDENTIFIER) {
-        // Could be assignment, function call, or expression
+        // Look ahead one token to tell definitions and assignments apart
         const char *saved_pos = expr_pos;
         Token saved_token = current_token;
-        
-        char name[32];
-        strcpy(name, current_token.name);
         get_next_token();
+        CalcTokenType next = current_token.type;
+        expr_pos = saved_pos;
+        current_token = saved_token;
         
-        if (current_token.type == CALC_TOKEN_ASSIGN) {
-            // It's an assignment
-            expr_pos = saved_pos;
-            current_token = saved_token;
-            double value = parse_assignment();
-            if (!silent_mode) {
-                printf("Variable '%s' = %.10g\n", name, value);
-            }
-            return value;
-        } else if (current_token.type == CALC_TOKEN_LPAREN && lookup_user_function(name)) {
-            // It's a user-defined function call, restore and parse with AST
-            expr_pos = saved_pos;
-            current_token = saved_token;
-            ASTNode *ast = parse_expression_ast();
-            if (!ast) {
-                fprintf(stderr, "Error: Failed to parse expression\n");
-                return NAN;
-            }
-            double result = evaluate_ast(ast);
-            free_ast(ast);
-            return result;
-        } else {
-            // It's an expression, restore state and parse with AST
-            expr_pos = saved_pos;
-            current_token = saved_token;
-            ASTNode *ast = parse_expression_ast();
-            if (!ast) {
-                fprintf(stderr, "Error: Failed to parse expression\n");
-                return NAN;
+        if (declared && next == CALC_TOKEN_LPAREN) {
+            if (parse_function_definition(stmt) != 0) return -1;
+            if (definitions_locked) {
+                report_error("Error: Function definitions are not allowed here\n");
+                return -1;
             }
-            double result = evaluate_ast(ast);
-            free_ast(ast);
-            return result;
+            return 0;
+        }
+        if (declared || next == CALC_TOKEN_ASSIGN) {
+            return parse_assignment(stmt);
         }
     }
     
-    // Regular expression - use AST parser
-    ASTNode *ast = parse_expression_ast();
-    if (!ast) {
-        fprintf(stderr, "Error: Failed to parse expression\n");
-        return NAN;
+    // Regular expression
+    stmt->kind = STMT_EXPRESSION;
+    stmt->ast = parse_expression_ast();
+    if (!stmt->ast) {
+        report_error("Error: Failed to parse expression\n");
+        return -1;
     }
-    double result = evaluate_ast(ast);
-    free_ast(ast);
-    return result;
+    return 0;
 }
 
-// Parse power operations (right associative)
-static double parse_power(void) {
-    double result = parse_factor();
+// Parse a complete statement from source text
+static int parse_statement_source(const char *source, Statement *stmt) {
+    // The expression parser reports some errors and carries on with a
+    // partial tree, so any report during the parse fails the statement
+    int reported = errors_reported;
+    memory_error_reported = 0;
+    expr_pos = source;
+    get_next_token();
+    int status = parse_statement(stmt) != 0 || errors_reported != reported ? -1 : 0;
     
-    if (current_token.type == CALC_TOKEN_OPERATOR && current_token.op == '^') {
-        get_next_token(); // consume '^'
-        double exponent = parse_power(); // right associative
-        result = pow(result, exponent);
+    // Check if we consumed the entire statement. A failed parse stops
+    // early, so this also follows the error that stopped it.
+    if (current_token.type != CALC_TOKEN_END && current_token.type != CALC_TOKEN_SEMICOLON) {
+        report_error("Error: Unexpected characters at end of expression\n");
+        status = -1;
     }
-    
-    return result;
+    if (status != 0) {
+        free_statement(stmt);
+    }
+    return status;
 }
 
-// Parse terms (multiplication and division)
-static double parse_term(void) {
-    double result = parse_power();
-    
-    while (current_token.type == CALC_TOKEN_OPERATOR && 
-           (current_token.op == '*' || current_token.op == '/')) {
-        char op = current_token.op;
-        get_next_token();
-        double right = parse_power();
-        
-        if (op == '*') {
-            result *= right;
-        } else {
-            if (right == 0.0) {
-                fprintf(stderr, "Error: Division by zero\n");
-                return NAN;
+// Run a parsed statement. Ownership of its parameters and AST passes to the
+// function table or is released here.
+static double execute_statement(Statement *stmt) {
+    double result = NAN;
+    memory_error_reported = 0;
+    switch (stmt->kind) {
+        case STMT_FUNCTION:
+            if (!create_user_function(stmt->name, stmt->params, stmt->ast)) {
+                stmt->params = NULL;
+                stmt->ast = NULL;
+                break;
             }
-            result /= right;
-        }
+            stmt->params = NULL;
+            stmt->ast = NULL;
+            if (!silent_mode) {
+                printf("Function '%s' defined\n", stmt->name);
+            }
+            break;
+        case STMT_ASSIGNMENT:
+            result = evaluate_ast(stmt->ast);
+            if (set_variable_value(stmt->name, result) != 0) {
+                result = NAN;
+                break;
+            }
+            if (!silent_mode) {
+                printf("Variable '%s' = %.10g\n", stmt->name, result);
+            }
+            break;
+        case STMT_EXPRESSION:
+            result = evaluate_ast(stmt->ast);
+            break;
     }
-    
+    free_statement(stmt);
     return result;
 }
 
-// Parse expressions (addition and subtraction)
-static double parse_expression(void) {
-    double result = parse_term();
+// In lazy mode a script function is defined from its signature alone; the
+// body is parsed the first time the function is called
+static int lazy_functions = 0;
+
+// Parse just the signature of a function definition, keeping a copy of its
+// source for later. Returns 1 if parsed, 0 if the statement is not a function
+// definition, or -1 after reporting a syntax error in the signature.
+static int parse_lazy_function(const char *source, Statement *stmt, char **copy) {
+    memset(stmt, 0, sizeof(*stmt));
+    expr_pos = source;
+    get_next_token();
+    if (current_token.type != CALC_TOKEN_VAR) return 0;
+    get_next_token(); // consume 'var'
+    if (current_token.type != CALC_TOKEN_IDENTIFIER) return 0;
     
-    while (current_token.type == CALC_TOKEN_OPERATOR && 
-           (current_token.op == '+' || current_token.op == '-')) {
-        char op = current_token.op;
-        get_next_token();
-        double right = parse_term();
-        
-        if (op == '+') {
-            result += right;
-        } else {
-            result -= right;
-        }
+    const char *saved_pos = expr_pos;
+    Token saved_token = current_token;
+    get_next_token();
+    if (current_token.type != CALC_TOKEN_LPAREN) return 0;
+    expr_pos = saved_pos;
+    current_token = saved_token;
+    
+    *copy = memory_alloc(MEMORY_SOURCE, strlen(source) + 1);
+    if (!*copy || parse_function_header(stmt) != 0) {
+        if (!*copy) report_out_of_memory();
+        free_function_source(*copy);
+        *copy = NULL;
+        free_statement(stmt);
+        return -1;
     }
-    
-    return result;
+    strcpy(*copy, source);
+    return 1;
 }
 
-double compute_expression(const char *expression)
-{
-    if(expression == NULL || strlen(expression) == 0) 
-    {
-        fprintf(stderr, "Error: Empty expression\n");
-        return NAN;
+// A function's body, parsed now if it was loaded lazily
+static ASTNode* user_function_body(UserFunction *func) {
+    if (!func->source) return func->body;
+    
+    // Calls can happen mid-statement, so keep the caller's tokenizer state
+    const char *saved_pos = expr_pos;
+    Token saved_token = current_token;
+    Statement stmt;
+    if (parse_statement_source(func->source, &stmt) == 0 && stmt.kind == STMT_FUNCTION) {
+        func->body = stmt.ast;
+        stmt.ast = NULL;
+    } else {
+        fprintf(stderr, "Error: Failed to compile function '%s'\n", func->name);
     }
+    free_statement(&stmt);
+    free_function_source(func->source);
+    func->source = NULL;
+    expr_pos = saved_pos;
+    current_token = saved_token;
+    return func->body;
+}
 
-    // Initialize parser
-    expr_pos = expression;
-    get_next_token();
-    
-    // Parse as statement (handles declarations, assignments, expressions)
-    double result = parse_statement();
-    
-    // Check if we consumed the entire expression
-    if (current_token.type != CALC_TOKEN_END && current_token.type != CALC_TOKEN_SEMICOLON) {
-        fprintf(stderr, "Error: Unexpected characters at end of expression\n");
-        return NAN;
+// Compile every lazily loaded function, before worker threads share them
+static void compile_user_functions(void) {
+    for (UserFunction *func = context->user_functions; func; func = func->next) {
+        user_function_body(func);
     }
-    
-    return result;
 }
 
-// Load and execute a script file
-static int load_script_file(const char *filename) {
-    FILE *fp = fopen(filename, "r");
-    if (!fp) {
-        fprintf(stderr, "Error: Cannot open file '%s'\n", filename);
-        return -1;
+// Platform and file helpers (the first few serve only the CLI)
+#ifndef RCALC_LIBRARY
+static int online_cpu_count(void) {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors > 0 ? (int)info.dwNumberOfProcessors : 1;
+#else
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (int)cpus : 1;
+#endif
+}
+
+static long peak_memory_kb(void) {
+#ifdef _WIN32
+    return -1;  // Not tracked without psapi
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return -1;
+    return usage.ru_maxrss;
+#endif
+}
+
+#endif
+
+static double monotonic_seconds(void) {
+#ifdef _WIN32
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (double)counter.QuadPart / (double)frequency.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+#endif
+}
+
+static int host_is_little_endian(void) {
+    const uint16_t probe = 1;
+    return *(const unsigned char *)&probe == 1;
+}
+
+static uint32_t read_le32(const unsigned char *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t read_le64(const unsigned char *p) {
+    return (uint64_t)read_le32(p) | (uint64_t)read_le32(p + 4) << 32;
+}
+
+static void write_le32(unsigned char *p, uint32_t v) {
+    for (int i = 0; i < 4; i++) p[i] = (unsigned char)(v >> (8 * i));
+}
+
+static void write_le64(unsigned char *p, uint64_t v) {
+    for (int i = 0; i < 8; i++) p[i] = (unsigned char)(v >> (8 * i));
+}
+
+// Map a whole file (read into memory where mmap is unavailable). A writable
+// mapping is private: changes are copy-on-write and never reach the file.
+static unsigned char* map_file_mode(const char *path, size_t *size, int writable) {
+#ifdef _WIN32
+    (void)writable;
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return NULL;
+    fseek(fp, 0, SEEK_END);
+    long length = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    unsigned char *data = length > 0 ? malloc(length) : NULL;
+    if (!data || fread(data, 1, length, fp) != (size_t)length) {
+        free(data);
+        fclose(fp);
+        return NULL;
+    }
+    fclose(fp);
+    *size = (size_t)length;
+    return data;
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+    void *data = mmap(NULL, (size_t)st.st_size, writable ? PROT_READ | PROT_WRITE : PROT_READ,
+                      MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return NULL;
+    madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+    *size = (size_t)st.st_size;
+    return data;
+#endif
+}
+
+static unsigned char* map_file(const char *path, size_t *size) {
+    return map_file_mode(path, size, 0);
+}
+
+static void unmap_file(unsigned char *data, size_t size) {
+    if (!data) return;
+#ifdef _WIN32
+    (void)size;
+    free(data);
+#else
+    munmap(data, size);
+#endif
+}
+
+// Incremental statement-boundary lexer shared by script loading and the REPL.
+// Bytes are scanned once as they arrive, tracking bracket nesting, strings
+// and '#' comments. A statement ends at the end of a line once every bracket
+// is closed and the line does not end in an operator, comma or open bracket.
+typedef struct StatementLexer {
+    int brace_depth;
+    int paren_depth;
+    int in_string;
+    int in_comment;
+    char last_char;           // Last significant byte of the pending statement
+    size_t start;             // Offset of the pending statement's first byte
+    int line;                 // Lines completed so far
+} StatementLexer;
+
+static void statement_lexer_reset(StatementLexer *lexer) {
+    int line = lexer->line;
+    memset(lexer, 0, sizeof(*lexer));
+    lexer->line = line;
+}
+
+static int statement_lexer_pending(const StatementLexer *lexer) {
+    return lexer->last_char != '\0';
+}
+
+static int statement_lexer_complete(const StatementLexer *lexer) {
+    if (lexer->brace_depth > 0 || lexer->paren_depth > 0) return 0;
+    return strchr("{,(+-*/^", lexer->last_char) == NULL;
+}
+
+// Scan data[*pos..end) and stop just past the line end that completes a
+// statement. Returns 1 with the statement at data[lexer->start..*pos), or 0
+// once the input is used up. Blank and comment-only lines between statements
+// are skipped.
+static int statement_lexer_scan(StatementLexer *lexer, const char *data, size_t *pos, size_t end) {
+    for (size_t i = *pos; i < end; i++) {
+        char c = data[i];
+        if (c == '\n') {
+            lexer->line++;
+            lexer->in_comment = 0;
+            if (statement_lexer_pending(lexer) && statement_lexer_complete(lexer)) {
+                *pos = i + 1;
+                return 1;
+            }
+            continue;
+        }
+        if (lexer->in_comment || isspace((unsigned char)c)) continue;
+        if (!lexer->in_string && c == '#') {
+            lexer->in_comment = 1;
+            continue;
+        }
+        
+        if (!statement_lexer_pending(lexer)) lexer->start = i;
+        lexer->last_char = c;
+        if (c == '"') {
+            lexer->in_string = !lexer->in_string;
+        } else if (!lexer->in_string) {
+            if (c == '{') lexer->brace_depth++;
+            else if (c == '}') lexer->brace_depth--;
+            else if (c == '(') lexer->paren_depth++;
+            else if (c == ')') lexer->paren_depth--;
+        }
+    }
+    *pos = end;
+    return 0;
+}
+
+// Compiled script cache. After a script loads cleanly its parsed statements
+// are saved next to it ("lib.calc" -> "lib.calcc") and later loads replay
+// them straight from the mapped cache, skipping the lexer and parser. The
+// cache is keyed by a hash of the script's bytes and by CALCC_VERSION, and
+// is rewritten whenever either no longer matches. All fields little-endian:
+//
+//   char     magic[4]                      "RCLC"
+//   uint32_t version                       CALCC_VERSION
+//   uint64_t source_hash                   FNV-1a of the script
+//   uint64_t source_size
+//   uint64_t entry_count
+//   (padding to CALCC_ENTRY_SIZE)
+//   entries[entry_count], CALCC_ENTRY_SIZE bytes each
+//
+// Each statement is one entry, followed by an entry per function parameter
+// and its AST in postorder. An entry holds a tag, an operator (op and
+// comparison[3]), two counts, a float64 and a name[32]; replay rebuilds each
+// tree with a stack of finished subtrees.
+#define CALCC_MAGIC "RCLC"
+#define CALCC_VERSION 1  // Bump whenever the AST or this layout changes
+#define CALCC_ENTRY_SIZE 64
+
+enum {
+    CALCC_FUNCTION = 1,        // count_a: line, count_b: parameter count
+    CALCC_ASSIGNMENT,          // count_a: line
+    CALCC_EXPRESSION,          // count_a: line
+    CALCC_PARAMETER,
+    CALCC_NUMBER,
+    CALCC_VARIABLE,
+    CALCC_BINARY,
+    CALCC_UNARY,
+    CALCC_CALL                 // count_b: argument count
+};
+
+static int script_cache_enabled = 1;
+
+typedef struct ScriptCache {
+    unsigned char *data;       // Header, then entries
+    size_t length;
+    size_t capacity;
+    uint64_t entry_count;
+    int valid;                 // Cleared when a statement can't be cached
+} ScriptCache;
+
+static uint64_t hash_bytes(const unsigned char *data, size_t size) {
+    uint64_t hash = 1469598103934665603ULL;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ data[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+static unsigned char* cache_add_entry(ScriptCache *cache, int tag, uint32_t count_a, uint32_t count_b,
+                                      const char *name) {
+    if (cache->capacity - cache->length < CALCC_ENTRY_SIZE) {
+        size_t new_capacity = cache->capacity ? cache->capacity * 2 : 64 * CALCC_ENTRY_SIZE;
+        unsigned char *new_data = memory_realloc(MEMORY_CACHE, cache->data, cache->capacity, new_capacity);
+        if (!new_data) {
+            cache->valid = 0;
+            return NULL;
+        }
+        cache->data = new_data;
+        cache->capacity = new_capacity;
+    }
+    unsigned char *entry = cache->data + cache->length;
+    memset(entry, 0, CALCC_ENTRY_SIZE);
+    entry[0] = (unsigned char)tag;
+    write_le32(entry + 4, count_a);
+    write_le32(entry + 8, count_b);
+    if (name) strncpy((char *)entry + 24, name, 31);
+    cache->length += CALCC_ENTRY_SIZE;
+    cache->entry_count++;
+    return entry;
+}
+
+static int cache_add_ast(ScriptCache *cache, const ASTNode *node) {
+    if (!node) return -1;
+    unsigned char *entry = NULL;
+    uint64_t bits;
+    switch (node->type) {
+        case AST_NUMBER:
+            entry = cache_add_entry(cache, CALCC_NUMBER, 0, 0, NULL);
+            if (!entry) return -1;
+            memcpy(&bits, &node->data.number, sizeof(bits));
+            write_le64(entry + 16, bits);
+            return 0;
+        case AST_VARIABLE:
+            return cache_add_entry(cache, CALCC_VARIABLE, 0, 0, node->data.variable) ? 0 : -1;
+        case AST_BINARY_OP:
+            if (cache_add_ast(cache, node->data.binary.left) != 0 ||
+                cache_add_ast(cache, node->data.binary.right) != 0) return -1;
+            entry = cache_add_entry(cache, CALCC_BINARY, 0, 0, NULL);
+            if (!entry) return -1;
+            entry[1] = (unsigned char)node->data.binary.op;
+            memcpy(entry + 2, node->data.binary.comparison, 2);
+            return 0;
+        case AST_UNARY_OP:
+            if (cache_add_ast(cache, node->data.unary.operand) != 0) return -1;
+            entry = cache_add_entry(cache, CALCC_UNARY, 0, 0, NULL);
+            if (!entry) return -1;
+            entry[1] = (unsigned char)node->data.unary.op;
+            return 0;
+        case AST_FUNCTION_CALL:
+            for (int i = 0; i < node->data.func_call.arg_count; i++) {
+                if (cache_add_ast(cache, node->data.func_call.args[i]) != 0) return -1;
+            }
+            return cache_add_entry(cache, CALCC_CALL, 0, (uint32_t)node->data.func_call.arg_count,
+                                   node->data.func_call.name) ? 0 : -1;
+    }
+    return -1;
+}
+
+// Append a parsed statement; a statement that can't be stored (such as one
+// with a half-parsed expression) leaves the whole script uncached
+static void cache_add_statement(ScriptCache *cache, const Statement *stmt, int line) {
+    if (!cache->valid) return;
+    
+    static const int tags[] = { CALCC_FUNCTION, CALCC_ASSIGNMENT, CALCC_EXPRESSION };
+    uint32_t param_count = 0;
+    for (const Parameter *p = stmt->params; p; p = p->next) param_count++;
+    
+    if (!cache_add_entry(cache, tags[stmt->kind], (uint32_t)line, param_count, stmt->name)) return;
+    for (const Parameter *p = stmt->params; p; p = p->next) {
+        if (!cache_add_entry(cache, CALCC_PARAMETER, 0, 0, p->name)) return;
+    }
+    if (cache_add_ast(cache, stmt->ast) != 0) {
+        cache->valid = 0;
+    }
+}
+
+static void cache_path_for(const char *filename, char *path, size_t size) {
+    snprintf(path, size, "%sc", filename);
+}
+
+// A temporary name beside path, unique to this process and call, since
+// several staging threads can write the same script's cache at once
+static void make_temp_path(const char *path, char *temp_path, size_t size) {
+#ifdef _WIN32
+    static volatile LONG serial = 0;
+    unsigned long n = (unsigned long)InterlockedIncrement(&serial);
+    snprintf(temp_path, size, "%s.%lu.%lu.tmp", path, (unsigned long)GetCurrentProcessId(), n);
+#else
+    static atomic_ulong serial = 0;
+    unsigned long n = atomic_fetch_add(&serial, 1) + 1;
+    snprintf(temp_path, size, "%s.%ld.%lu.tmp", path, (long)getpid(), n);
+#endif
+}
+
+// Write the cache beside the script. Failures are ignored: the script is
+// simply parsed again next time.
+static void write_script_cache(const char *filename, ScriptCache *cache, uint64_t hash, size_t source_size) {
+    char path[512];
+    char temp_path[544];
+    cache_path_for(filename, path, sizeof(path));
+    make_temp_path(path, temp_path, sizeof(temp_path));
+    
+    unsigned char *header = cache->data;
+    memset(header, 0, CALCC_ENTRY_SIZE);
+    memcpy(header, CALCC_MAGIC, 4);
+    write_le32(header + 4, CALCC_VERSION);
+    write_le64(header + 8, hash);
+    write_le64(header + 16, (uint64_t)source_size);
+    write_le64(header + 24, cache->entry_count);
+    
+    FILE *fp = fopen(temp_path, "wb");
+    if (!fp) return;
+    int ok = fwrite(cache->data, 1, cache->length, fp) == cache->length;
+    ok = fclose(fp) == 0 && ok;
+#ifdef _WIN32
+    if (ok) remove(path);  // rename() won't replace an existing file
+#endif
+    if (!ok || rename(temp_path, path) != 0) {
+        remove(temp_path);
+    }
+}
+
+// Rebuild one statement from cache entries starting at *index. Nodes are
+// copied out of the mapping rather than used in place: each function owns
+// its tree, which is freed node by node when the function is redefined,
+// reloaded or restored, so trees inside a shared mapping could not be.
+static int cache_read_statement(const unsigned char *entries, uint64_t count, uint64_t *index,
+                                Statement *stmt, int *line, ASTNode **stack, size_t stack_size) {
+    memset(stmt, 0, sizeof(*stmt));
+    const unsigned char *entry = entries + *index * CALCC_ENTRY_SIZE;
+    int tag = entry[0];
+    if (tag == CALCC_FUNCTION) stmt->kind = STMT_FUNCTION;
+    else if (tag == CALCC_ASSIGNMENT) stmt->kind = STMT_ASSIGNMENT;
+    else if (tag == CALCC_EXPRESSION) stmt->kind = STMT_EXPRESSION;
+    else return -1;
+    
+    *line = (int)read_le32(entry + 4);
+    uint32_t param_count = read_le32(entry + 8);
+    memcpy(stmt->name, entry + 24, 31);
+    stmt->name[31] = '\0';
+    (*index)++;
+    
+    Parameter **last_param = &stmt->params;
+    for (uint32_t i = 0; i < param_count; i++, (*index)++) {
+        entry = entries + *index * CALCC_ENTRY_SIZE;
+        if (*index >= count || entry[0] != CALCC_PARAMETER) return -1;
+        char name[32];
+        memcpy(name, entry + 24, 31);
+        name[31] = '\0';
+        *last_param = create_parameter(name);
+        if (!*last_param) return -1;
+        last_param = &(*last_param)->next;
+    }
+    
+    // Postorder: each node takes its operands from the top of the stack, and
+    // the statement ends where a single finished tree remains
+    size_t depth = 0;
+    int status = -1;
+    for (; *index < count; (*index)++) {
+        entry = entries + *index * CALCC_ENTRY_SIZE;
+        if (entry[0] <= CALCC_PARAMETER) {
+            if (depth == 1) status = 0;
+            break;
+        }
+        char name[32];
+        memcpy(name, entry + 24, 31);
+        name[31] = '\0';
+        
+        ASTNode *node = NULL;
+        uint32_t arg_count = read_le32(entry + 8);
+        switch (entry[0]) {
+            case CALCC_NUMBER: {
+                double value;
+                uint64_t bits = read_le64(entry + 16);
+                memcpy(&value, &bits, sizeof(value));
+                node = create_number_node(value);
+                break;
+            }
+            case CALCC_VARIABLE:
+                node = create_variable_node(name);
+                break;
+            case CALCC_BINARY:
+                if (depth < 2) goto fail;
+                if (entry[2] != '\0') {
+                    char comparison[3] = { (char)entry[2], (char)entry[3], '\0' };
+                    node = create_comparison_node(comparison, stack[depth - 2], stack[depth - 1]);
+                } else {
+                    node = create_binary_op_node((char)entry[1], stack[depth - 2], stack[depth - 1]);
+                }
+                depth -= 2;
+                break;
+            case CALCC_UNARY:
+                if (depth < 1) goto fail;
+                node = create_unary_op_node((char)entry[1], stack[depth - 1]);
+                depth -= 1;
+                break;
+            case CALCC_CALL: {
+                if (arg_count > AST_MAX_ARGS || depth < arg_count) goto fail;
+                ASTNode **args = arg_count ? memory_alloc(MEMORY_AST, AST_ARGS_SIZE) : NULL;
+                if (arg_count && !args) goto fail;
+                depth -= arg_count;
+                if (arg_count) memcpy(args, stack + depth, arg_count * sizeof(ASTNode*));
+                node = create_function_call_node(name, args, (int)arg_count);
+                break;
+            }
+            default:
+                goto fail;
+        }
+        if (!node) goto fail;  // Out of memory; the operands are freed
+        if (depth == stack_size) {
+            free_ast(node);
+            goto fail;
+        }
+        stack[depth++] = node;
+    }
+    if (*index == count && depth == 1) status = 0;
+    
+fail:
+    if (status == 0) {
+        stmt->ast = stack[0];
+        return 0;
+    }
+    for (size_t i = 0; i < depth; i++) {
+        free_ast(stack[i]);
+    }
+    free_statement(stmt);
+    return -1;
+}
+
+// Run one script statement, reporting errors against its source line
+static void run_script_statement(const char *filename, Statement *stmt, int line) {
+    int is_definition = stmt->kind != STMT_EXPRESSION;
+    clear_eval_error();
+    double result = execute_statement(stmt);
+    if (eval_error.code != CALC_OK) {
+        print_eval_error(&eval_error);
+    }
+    
+    // Function and variable definitions may return NAN but that's OK
+    if (isnan(result) && !is_definition) {
+        fprintf(stderr, "Error in %s:%d: Failed to evaluate statement\n", filename, line);
+    }
+}
+
+// Scripts load in two steps. Staging reads a file and parses it (or decodes
+// its cache) into a private list of statements without touching any global
+// table, so several files can be staged at once. Committing then runs the
+// statements in order, one file at a time.
+typedef struct StagedStatement {
+    Statement stmt;
+    int line;
+    char *source;              // Lazy function definitions: the unparsed statement
+} StagedStatement;
+
+typedef struct ScriptStage {
+    const char *filename;
+    StagedStatement *statements;
+    size_t count;
+    size_t capacity;
+    int staged;
+    int status;                // -1 if the file could not be read
+    int syntax_errors;         // Statements that failed to parse, and incomplete input
+    int from_cache;            // Decoded from a current compiled cache
+    double seconds;            // Time spent staging
+} ScriptStage;
+
+static StagedStatement* stage_add(ScriptStage *stage, int line) {
+    if (stage->count == stage->capacity) {
+        size_t new_capacity = stage->capacity ? stage->capacity * 2 : 64;
+        StagedStatement *new_statements = realloc(stage->statements, new_capacity * sizeof(StagedStatement));
+        if (!new_statements) {
+            fprintf(stderr, "Error: Memory allocation failed\n");
+            stage->status = -1;
+            return NULL;
+        }
+        stage->statements = new_statements;
+        stage->capacity = new_capacity;
+    }
+    StagedStatement *staged = &stage->statements[stage->count++];
+    memset(staged, 0, sizeof(*staged));
+    staged->line = line;
+    return staged;
+}
+
+static void free_script_stage(ScriptStage *stage) {
+    for (size_t i = 0; i < stage->count; i++) {
+        free_statement(&stage->statements[i].stmt);
+        free_function_source(stage->statements[i].source);
+    }
+    free(stage->statements);
+    stage->statements = NULL;
+    stage->count = 0;
+    stage->capacity = 0;
+}
+
+// Decode a script's cache into the stage if the cache matches the script's
+// bytes. Returns 1 when staged from the cache, 0 if the script must be parsed.
+static int stage_script_cache(ScriptStage *stage, uint64_t hash, size_t source_size) {
+    char path[512];
+    cache_path_for(stage->filename, path, sizeof(path));
+    size_t size = 0;
+    unsigned char *data = map_file(path, &size);
+    if (!data) return 0;
+    
+    uint64_t count = 0;
+    if (size >= CALCC_ENTRY_SIZE) {
+        count = read_le64(data + 24);
+    }
+    if (size < CALCC_ENTRY_SIZE || memcmp(data, CALCC_MAGIC, 4) != 0 ||
+        read_le32(data + 4) != CALCC_VERSION || read_le64(data + 8) != hash ||
+        read_le64(data + 16) != (uint64_t)source_size ||
+        (size - CALCC_ENTRY_SIZE) % CALCC_ENTRY_SIZE != 0 ||
+        count != (size - CALCC_ENTRY_SIZE) / CALCC_ENTRY_SIZE) {
+        unmap_file(data, size);
+        return 0;
+    }
+    
+    const unsigned char *entries = data + CALCC_ENTRY_SIZE;
+    size_t stack_size = count ? (size_t)count : 1;
+    ASTNode **stack = malloc(stack_size * sizeof(ASTNode*));
+    int status = stack ? 1 : 0;
+    uint64_t index = 0;
+    while (status && index < count) {
+        Statement stmt;
+        int line;
+        StagedStatement *staged;
+        if (cache_read_statement(entries, count, &index, &stmt, &line, stack, stack_size) != 0 ||
+            !(staged = stage_add(stage, line))) {
+            free_statement(&stmt);
+            status = 0;
+            break;
+        }
+        staged->stmt = stmt;
+    }
+    
+    // A damaged cache is ignored and the script parsed instead
+    if (!status) {
+        free_script_stage(stage);
+        stage->status = 0;
+    }
+    free(stack);
+    unmap_file(data, size);
+    return status;
+}
+
+// Stage a script file, from its compiled cache when that is current and
+// --lazy is not set.
+// Otherwise the file is mapped and split into statements in a single pass;
+// each statement is parsed from a reused NUL-terminated buffer, since the
+// tokenizer reads up to the terminator. A freshly parsed script is cached.
+static void stage_script_contents(ScriptStage *stage) {
+    const char *filename = stage->filename;
+    size_t size = 0;
+    const char *data = (const char *)map_file(filename, &size);
+    if (!data) {
+        // An empty script maps to nothing but is still valid
+        FILE *fp = fopen(filename, "r");
+        if (!fp) {
+            report_error("Error: Cannot open file '%s'\n", filename);
+            stage->status = -1;
+            return;
+        }
+        fclose(fp);
+        return;
+    }
+    
+    uint64_t hash = 0;
+    if (script_cache_enabled) {
+        hash = hash_bytes((const unsigned char *)data, size);
+        // --lazy defers body errors to the first call; the cache would not
+        if (!lazy_functions && stage_script_cache(stage, hash, size)) {
+            stage->from_cache = 1;
+            unmap_file((unsigned char *)data, size);
+            return;
+        }
+    }
+    
+    // Parsed statements are collected for a new cache, after a header entry
+    ScriptCache cache;
+    memset(&cache, 0, sizeof(cache));
+    cache.valid = script_cache_enabled && cache_add_entry(&cache, 0, 0, 0, NULL) != NULL;
+    cache.entry_count = 0;
+    
+    char *statement = NULL;
+    size_t statement_capacity = 0;
+    StatementLexer lexer;
+    memset(&lexer, 0, sizeof(lexer));
+    size_t pos = 0;
+    while (stage->status == 0 && (pos < size || statement_lexer_pending(&lexer))) {
+        int line_num = lexer.line;
+        if (statement_lexer_scan(&lexer, data, &pos, size)) {
+            line_num = lexer.line;
+        } else if (statement_lexer_pending(&lexer) && statement_lexer_complete(&lexer)) {
+            // Final statement without a trailing newline
+            line_num++;
+        } else {
+            if (statement_lexer_pending(&lexer)) {
+                report_error("Warning: Incomplete statement at end of %s\n", filename);
+                stage->syntax_errors++;
+            }
+            break;
+        }
+        
+        size_t length = pos - lexer.start;
+        if (length + 1 > statement_capacity) {
+            size_t new_capacity = statement_capacity ? statement_capacity : 4096;
+            while (new_capacity < length + 1) {
+                new_capacity *= 2;
+            }
+            char *new_statement = realloc(statement, new_capacity);
+            if (!new_statement) {
+                fprintf(stderr, "Error: Memory allocation failed at line %d\n", line_num);
+                stage->status = -1;
+                break;
+            }
+            statement = new_statement;
+            statement_capacity = new_capacity;
+        }
+        memcpy(statement, data + lexer.start, length);
+        statement[length] = '\0';
+        statement_lexer_reset(&lexer);
+        
+        StagedStatement *staged = stage_add(stage, line_num);
+        if (!staged) break;
+        
+        // Lazily loaded functions have no AST to save, so skip the cache
+        int lazy = lazy_functions ? parse_lazy_function(statement, &staged->stmt, &staged->source) : 0;
+        int parsed = lazy > 0 || (lazy == 0 && parse_statement_source(statement, &staged->stmt) == 0);
+        if (!parsed) {
+            report_error("Error in %s:%d: Failed to evaluate statement\n", filename, line_num);
+            stage->syntax_errors++;
+            stage->count--;
+            cache.valid = 0;
+        } else if (lazy) {
+            cache.valid = 0;
+        } else {
+            cache_add_statement(&cache, &staged->stmt, line_num);
+        }
+    }
+    
+    if (cache.valid && stage->status == 0 && stage->syntax_errors == 0) {
+        write_script_cache(filename, &cache, hash, size);
+    }
+    memory_free(MEMORY_CACHE, cache.data, cache.capacity);
+    free(statement);
+    unmap_file((unsigned char *)data, size);
+}
+
+static void stage_script_file(ScriptStage *stage) {
+    double start = monotonic_seconds();
+    stage->staged = 1;
+    stage_script_contents(stage);
+    stage->seconds = monotonic_seconds() - start;
+}
+
+static int count_user_functions(void) {
+    int count = 0;
+    for (UserFunction *func = context->user_functions; func; func = func->next) count++;
+    return count;
+}
+
+static int count_variables(void) {
+    int count = 0;
+    for (Variable *var = variables; var; var = var->next) count++;
+    return count;
+}
+
+// Run a staged script's statements in order and report what it defined
+static int commit_script_stage(ScriptStage *stage) {
+    if (stage->status != 0) {
+        return -1;
+    }
+    
+    int saved_func_count = count_user_functions();
+    int saved_var_count = count_variables();
+    
+    // Enable silent mode for script loading (batch mode is already silent)
+    int was_silent = silent_mode;
+    silent_mode = 1;
+    
+    for (size_t i = 0; i < stage->count; i++) {
+        StagedStatement *staged = &stage->statements[i];
+        if (staged->source) {
+            UserFunction *func = create_user_function(staged->stmt.name, staged->stmt.params, NULL);
+            staged->stmt.params = NULL;
+            if (func) {
+                func->source = staged->source;
+                staged->source = NULL;
+            }
+        } else {
+            run_script_statement(stage->filename, &staged->stmt, staged->line);
+        }
+    }
+    free_script_stage(stage);
+    
+    int func_count = count_user_functions() - saved_func_count;
+    int var_count = count_variables() - saved_var_count;
+    
+    // Restore previous mode
+    silent_mode = was_silent;
+    if (silent_mode) {
+        return 0;
+    }
+    
+    if (func_count > 0 || var_count > 0) {
+        printf("Loaded ");
+        if (func_count > 0) {
+            printf("%d function%s", func_count, func_count == 1 ? "" : "s");
+            if (var_count > 0) printf(", ");
+        }
+        if (var_count > 0) {
+            printf("%d variable%s", var_count, var_count == 1 ? "" : "s");
+        }
+        printf(" from %s\n", stage->filename);
+    } else {
+        printf("Loaded %s\n", stage->filename);
+    }
+    
+    return 0;
+}
+
+// Workspace images. "save" writes every variable and user function, with
+// each body in compiled (AST) form, to one file; "restore" maps the file
+// copy-on-write and points the restored functions straight at the ASTs in
+// the mapping, so nothing is parsed and no tree is rebuilt node by node.
+// Pointers inside the image are stored as offsets from its start and turned
+// into addresses in a single pass when it is mapped. Nodes are stored in
+// this build's own ASTNode layout, so an image only restores on a build with
+// the same pointer size, byte order and IMAGE_VERSION. Layout:
+//
+//   char     magic[4]                      "RIMG"
+//   uint32_t version                       IMAGE_VERSION
+//   uint32_t host                          IMAGE_HOST
+//   uint32_t reserved                      0
+//   uint64_t variable_count, function_count, param_count, node_count, slot_count
+//   (padding to IMAGE_HEADER_SIZE)
+//   ImageVariable variables[variable_count]
+//   ImageFunction functions[function_count]
+//   char          params[param_count][32]  Parameter names, by function
+//   ASTNode       nodes[node_count]
+//   ASTNode      *slots[slot_count]        Argument arrays of call nodes
+//
+// Sections are listed oldest definition first.
+#define IMAGE_MAGIC "RIMG"
+#define IMAGE_VERSION 1  // Bump whenever ASTNode or this layout changes
+#define IMAGE_HEADER_SIZE 64
+#define IMAGE_HOST ((uint32_t)sizeof(void *) | (uint32_t)sizeof(ASTNode) << 8 | \
+                    (uint32_t)host_is_little_endian() << 24)
+
+typedef struct ImageVariable {
+    char name[32];
+    double value;
+} ImageVariable;
+
+typedef struct ImageFunction {
+    char name[32];
+    uint32_t param_count;
+    uint32_t reserved;
+    uintptr_t body;            // Offset of the body's root node, 0 if none
+} ImageFunction;
+
+typedef struct ImageWriter {
+    ASTNode *nodes;
+    size_t node_count;
+    uintptr_t *slots;
+    size_t slot_count;
+    size_t nodes_offset;
+    size_t slots_offset;
+} ImageWriter;
+
+static void count_ast(const ASTNode *node, size_t *nodes, size_t *slots) {
+    if (!node) return;
+    (*nodes)++;
+    switch (node->type) {
+        case AST_BINARY_OP:
+            count_ast(node->data.binary.left, nodes, slots);
+            count_ast(node->data.binary.right, nodes, slots);
+            break;
+        case AST_UNARY_OP:
+            count_ast(node->data.unary.operand, nodes, slots);
+            break;
+        case AST_FUNCTION_CALL:
+            *slots += node->data.func_call.arg_count;
+            for (int i = 0; i < node->data.func_call.arg_count; i++) {
+                count_ast(node->data.func_call.args[i], nodes, slots);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+// Copy a tree into the writer, returning the image offset of its root
+static uintptr_t image_add_ast(ImageWriter *writer, const ASTNode *node) {
+    if (!node) return 0;
+    size_t index = writer->node_count++;
+    ASTNode copy;
+    memcpy(&copy, node, sizeof(copy));
+    switch (node->type) {
+        case AST_BINARY_OP:
+            copy.data.binary.left = (ASTNode *)image_add_ast(writer, node->data.binary.left);
+            copy.data.binary.right = (ASTNode *)image_add_ast(writer, node->data.binary.right);
+            break;
+        case AST_UNARY_OP:
+            copy.data.unary.operand = (ASTNode *)image_add_ast(writer, node->data.unary.operand);
+            break;
+        case AST_FUNCTION_CALL: {
+            int arg_count = node->data.func_call.arg_count;
+            size_t first = writer->slot_count;
+            writer->slot_count += arg_count;
+            for (int i = 0; i < arg_count; i++) {
+                writer->slots[first + i] = image_add_ast(writer, node->data.func_call.args[i]);
+            }
+            copy.data.func_call.args = arg_count > 0 ?
+                (ASTNode **)(writer->slots_offset + first * sizeof(uintptr_t)) : NULL;
+            break;
+        }
+        default:
+            break;
+    }
+    writer->nodes[index] = copy;
+    return writer->nodes_offset + index * sizeof(ASTNode);
+}
+
+// Write the session's variables and functions to an image. Returns 0 on
+// success; counts are passed back for the caller's report.
+static int save_workspace_image(const char *path, int *function_count, int *variable_count) {
+    // Lazily loaded functions are compiled so that every body is saved
+    compile_user_functions();
+    
+    size_t var_count = 0, func_count = 0, param_count = 0, node_count = 0, slot_count = 0;
+    for (Variable *var = variables; var; var = var->next) var_count++;
+    for (UserFunction *func = context->user_functions; func; func = func->next) {
+        func_count++;
+        param_count += func->param_count;
+        count_ast(func->body, &node_count, &slot_count);
+    }
+    
+    size_t variables_offset = IMAGE_HEADER_SIZE;
+    size_t functions_offset = variables_offset + var_count * sizeof(ImageVariable);
+    size_t params_offset = functions_offset + func_count * sizeof(ImageFunction);
+    size_t nodes_offset = params_offset + param_count * 32;
+    nodes_offset = (nodes_offset + 15) & ~(size_t)15;
+    size_t slots_offset = nodes_offset + node_count * sizeof(ASTNode);
+    size_t size = slots_offset + slot_count * sizeof(uintptr_t);
+    
+    unsigned char *data = calloc(1, size);
+    ImageWriter writer = { NULL, 0, NULL, 0, nodes_offset, slots_offset };
+    writer.nodes = (ASTNode *)(data ? data + nodes_offset : NULL);
+    writer.slots = (uintptr_t *)(data ? data + slots_offset : NULL);
+    if (!data) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return -1;
+    }
+    
+    memcpy(data, IMAGE_MAGIC, 4);
+    uint32_t header[3] = { IMAGE_VERSION, IMAGE_HOST, 0 };
+    uint64_t counts[5] = { var_count, func_count, param_count, node_count, slot_count };
+    memcpy(data + 4, header, sizeof(header));
+    memcpy(data + 16, counts, sizeof(counts));
+    
+    // The lists are newest first; store them oldest first
+    ImageVariable *image_vars = (ImageVariable *)(data + variables_offset);
+    size_t i = var_count;
+    for (Variable *var = variables; var; var = var->next) {
+        i--;
+        strcpy(image_vars[i].name, var->name);
+        image_vars[i].value = var->value;
+    }
+    
+    ImageFunction *image_funcs = (ImageFunction *)(data + functions_offset);
+    char (*param_names)[32] = (char (*)[32])(data + params_offset);
+    size_t param_end = param_count;
+    i = func_count;
+    for (UserFunction *func = context->user_functions; func; func = func->next) {
+        i--;
+        strcpy(image_funcs[i].name, func->name);
+        image_funcs[i].param_count = (uint32_t)func->param_count;
+        image_funcs[i].body = image_add_ast(&writer, func->body);
+        param_end -= func->param_count;
+        size_t p = param_end;
+        for (Parameter *param = func->params; param; param = param->next) {
+            strcpy(param_names[p++], param->name);
+        }
+    }
+    
+    char temp_path[544];
+    make_temp_path(path, temp_path, sizeof(temp_path));
+    FILE *fp = fopen(temp_path, "wb");
+    int ok = fp != NULL;
+    if (fp) {
+        ok = fwrite(data, 1, size, fp) == size;
+        ok = fclose(fp) == 0 && ok;
+#ifdef _WIN32
+        if (ok) remove(path);  // rename() won't replace an existing file
+#endif
+        if (!ok || rename(temp_path, path) != 0) {
+            remove(temp_path);
+            ok = 0;
+        }
+    }
+    free(data);
+    if (!ok) {
+        fprintf(stderr, "Error: Cannot write image '%s'\n", path);
+        return -1;
+    }
+    *function_count = (int)func_count;
+    *variable_count = (int)var_count;
+    return 0;
+}
+
+// Turn a stored offset into an address, checking that it lands on an
+// element of the given section past the referring one. Children always
+// follow their parent, so a corrupt image cannot make a tree loop.
+static int image_relocate(unsigned char *base, size_t section, size_t count, size_t element,
+                          size_t after, void *field) {
+    uintptr_t offset;
+    memcpy(&offset, field, sizeof(offset));
+    if (offset == 0) return 0;
+    if (offset <= after || offset < section || offset >= section + count * element ||
+        (offset - section) % element != 0) {
+        return -1;
+    }
+    void *address = base + offset;
+    memcpy(field, &address, sizeof(address));
+    return 0;
+}
+
+static int is_image_name(const char *name, size_t size) {
+    return memchr(name, '\0', size) != NULL;
+}
+
+// Replace the session's variables and functions with those in an image
+static int restore_workspace_image(const char *path, int *function_count, int *variable_count) {
+    size_t size = 0;
+    unsigned char *data = map_file_mode(path, &size, 1);
+    if (!data) {
+        fprintf(stderr, "Error: Cannot open image '%s'\n", path);
+        return -1;
+    }
+    
+    uint32_t header[3];
+    uint64_t counts[5];
+    if (size < IMAGE_HEADER_SIZE || memcmp(data, IMAGE_MAGIC, 4) != 0) {
+        fprintf(stderr, "Error: '%s' is not a workspace image\n", path);
+        unmap_file(data, size);
+        return -1;
+    }
+    memcpy(header, data + 4, sizeof(header));
+    memcpy(counts, data + 16, sizeof(counts));
+    if (header[0] != IMAGE_VERSION || header[1] != IMAGE_HOST) {
+        fprintf(stderr, "Error: Image '%s' was saved by a different build of rcalc\n", path);
+        unmap_file(data, size);
+        return -1;
+    }
+    
+    // Check the sections fit before trusting any count
+    size_t var_count = counts[0], func_count = counts[1], param_count = counts[2];
+    size_t node_count = counts[3], slot_count = counts[4];
+    size_t functions_offset = IMAGE_HEADER_SIZE + var_count * sizeof(ImageVariable);
+    size_t params_offset = functions_offset + func_count * sizeof(ImageFunction);
+    size_t nodes_offset = (params_offset + param_count * 32 + 15) & ~(size_t)15;
+    size_t slots_offset = nodes_offset + node_count * sizeof(ASTNode);
+    int valid = var_count < size && func_count < size && param_count < size &&
+                node_count < size && slot_count < size &&
+                slots_offset + slot_count * sizeof(uintptr_t) == size;
+    
+    if (!valid) {
+        fprintf(stderr, "Error: Image '%s' is corrupt\n", path);
+        unmap_file(data, size);
+        return -1;
+    }
+    
+    // Relocate every pointer in the node and slot sections
+    ASTNode *nodes = (ASTNode *)(data + nodes_offset);
+    for (size_t i = 0; valid && i < node_count; i++) {
+        ASTNode *node = &nodes[i];
+        size_t self = nodes_offset + i * sizeof(ASTNode);
+        switch (node->type) {
+            case AST_NUMBER:
+                break;
+            case AST_VARIABLE:
+                valid = is_image_name(node->data.variable, sizeof(node->data.variable));
+                break;
+            case AST_BINARY_OP:
+                valid = image_relocate(data, nodes_offset, node_count, sizeof(ASTNode), self,
+                                       &node->data.binary.left) == 0 &&
+                        image_relocate(data, nodes_offset, node_count, sizeof(ASTNode), self,
+                                       &node->data.binary.right) == 0 &&
+                        is_image_name(node->data.binary.comparison, sizeof(node->data.binary.comparison));
+                break;
+            case AST_UNARY_OP:
+                valid = image_relocate(data, nodes_offset, node_count, sizeof(ASTNode), self,
+                                       &node->data.unary.operand) == 0;
+                break;
+            case AST_FUNCTION_CALL: {
+                int arg_count = node->data.func_call.arg_count;
+                valid = is_image_name(node->data.func_call.name, sizeof(node->data.func_call.name)) &&
+                        arg_count >= 0 && arg_count <= 10 &&
+                        image_relocate(data, slots_offset, slot_count, sizeof(uintptr_t), 0,
+                                       &node->data.func_call.args) == 0 &&
+                        (arg_count == 0 || (node->data.func_call.args &&
+                         (unsigned char *)(node->data.func_call.args + arg_count) <= data + size));
+                for (int a = 0; valid && a < arg_count; a++) {
+                    valid = image_relocate(data, nodes_offset, node_count, sizeof(ASTNode), self,
+                                           &node->data.func_call.args[a]) == 0;
+                }
+                break;
+            }
+            default:
+                valid = 0;
+                break;
+        }
+    }
+    
+    ImageVariable *image_vars = (ImageVariable *)(data + IMAGE_HEADER_SIZE);
+    ImageFunction *image_funcs = (ImageFunction *)(data + functions_offset);
+    char (*param_names)[32] = (char (*)[32])(data + params_offset);
+    size_t params_used = 0;
+    for (size_t i = 0; valid && i < var_count; i++) {
+        valid = is_image_name(image_vars[i].name, sizeof(image_vars[i].name));
+    }
+    for (size_t i = 0; valid && i < func_count; i++) {
+        valid = is_image_name(image_funcs[i].name, sizeof(image_funcs[i].name)) &&
+                image_relocate(data, nodes_offset, node_count, sizeof(ASTNode), 0, &image_funcs[i].body) == 0;
+        params_used += image_funcs[i].param_count;
+        valid = valid && params_used <= param_count;
+    }
+    for (size_t i = 0; valid && i < param_count; i++) {
+        valid = is_image_name(param_names[i], sizeof(param_names[i]));
+    }
+    if (!valid) {
+        fprintf(stderr, "Error: Image '%s' is corrupt\n", path);
+        unmap_file(data, size);
+        return -1;
+    }
+    
+    // Swap out the session, then install the image's definitions in order.
+    // Earlier images can go once no function refers to them.
+    free_variables(variables);
+    variables = NULL;
+    free_user_functions();
+    unmap_file(context->image, context->image_size);
+    context->image = data;
+    context->image_size = size;
+    
+    int failures = allocation_failures;
+    for (size_t i = 0; i < var_count; i++) {
+        set_variable_value(image_vars[i].name, image_vars[i].value);
+    }
+    size_t p = 0;
+    for (size_t i = 0; i < func_count && allocation_failures == failures; i++) {
+        Parameter *params = NULL;
+        Parameter **tail = &params;
+        for (uint32_t j = 0; j < image_funcs[i].param_count && (*tail = create_parameter(param_names[p++])); j++) {
+            tail = &(*tail)->next;
+        }
+        ASTNode *body;
+        memcpy(&body, &image_funcs[i].body, sizeof(body));
+        if (allocation_failures == failures) {
+            create_user_function(image_funcs[i].name, params, body);
+        } else {
+            free_parameters(params);
+        }
+    }
+    if (allocation_failures != failures) {
+        fprintf(stderr, "Error: Image '%s' was only partly restored\n", path);
+        return -1;
+    }
+    
+    *function_count = (int)func_count;
+    *variable_count = (int)var_count;
+    return 0;
+}
+
+// Library API. Each entry point binds its context to the calling thread,
+// runs with the CLI's messages turned off, and restores the thread's
+// previous state on the way out, so calls nest and threads stay independent.
+// Calls that only evaluate bind the context read-only: its globals become
+// the shared fallback scope and nothing is written back, so many threads
+// can evaluate in one context while no thread is changing it.
+typedef struct ContextBinding {
+    rcalc_context *context;
+    Variable *variables;
+    const Variable *shared_variables;
+    const Frame *frame;
+    int silent_mode;
+    int errors_muted;
+    int read_only;
+} ContextBinding;
+
+static THREAD_LOCAL char api_error_message[128];  // Last API error on this thread
+
+static void bind_context_mode(rcalc_context *ctx, ContextBinding *saved, int read_only) {
+    saved->context = context;
+    saved->variables = variables;
+    saved->shared_variables = shared_variables;
+    saved->frame = current_frame;
+    saved->silent_mode = silent_mode;
+    saved->errors_muted = errors_muted;
+    saved->read_only = read_only;
+    context = ctx;
+    variables = read_only ? NULL : ctx->variables;
+    shared_variables = read_only ? ctx->variables : NULL;
+    current_frame = NULL;
+    silent_mode = 1;
+    errors_muted = ctx->quiet;
+}
+
+static void bind_context(rcalc_context *ctx, ContextBinding *saved) {
+    bind_context_mode(ctx, saved, 0);
+}
+
+static void unbind_context(const ContextBinding *saved) {
+    if (!saved->read_only) context->variables = variables;
+    context = saved->context;
+    variables = saved->variables;
+    shared_variables = saved->shared_variables;
+    current_frame = saved->frame;
+    silent_mode = saved->silent_mode;
+    errors_muted = saved->errors_muted;
+}
+
+// Record how a call ended; evaluation errors are described from eval_error
+static rcalc_status finish_call(const ContextBinding *binding, rcalc_status status, const char *message) {
+    if (status == RCALC_OK) {
+        api_error_message[0] = '\0';
+    } else if (message) {
+        snprintf(api_error_message, sizeof(api_error_message), "%s", message);
+    } else {
+        format_eval_error(&eval_error, api_error_message, sizeof(api_error_message));
+    }
+    unbind_context(binding);
+    return status;
+}
+
+rcalc_context *rcalc_create(void) {
+    rcalc_context *ctx = calloc(1, sizeof(rcalc_context));
+    if (ctx) ctx->limits.max_depth = DEFAULT_MAX_DEPTH;
+    return ctx;
+}
+
+// Calls that change definitions fail on a shared library
+static int reject_shared(const rcalc_context *ctx) {
+    if (!ctx->shared) return 0;
+    snprintf(api_error_message, sizeof(api_error_message), "Context is a shared library and cannot change");
+    return 1;
+}
+
+rcalc_status rcalc_share(rcalc_context *ctx) {
+    if (ctx->library) {
+        snprintf(api_error_message, sizeof(api_error_message), "A session cannot be shared");
+        return RCALC_ERR_READ_ONLY;
+    }
+    if (!ctx->shared) {
+        // Sessions only read the library, so nothing may be left to compile
+        ContextBinding binding;
+        bind_context(ctx, &binding);
+        compile_user_functions();
+        unbind_context(&binding);
+        ctx->shared = 1;
+    }
+    api_error_message[0] = '\0';
+    return RCALC_OK;
+}
+
+rcalc_context *rcalc_create_session(const rcalc_context *library) {
+    if (!library->shared) {
+        snprintf(api_error_message, sizeof(api_error_message), "Library must be shared with rcalc_share() first");
+        return NULL;
+    }
+    rcalc_context *ctx = calloc(1, sizeof(rcalc_context));
+    if (ctx) {
+        ctx->library = library;
+        ctx->limits = library->limits;
+    }
+    return ctx;
+}
+
+void rcalc_destroy(rcalc_context *ctx) {
+    if (!ctx) return;
+    ContextBinding binding;
+    bind_context(ctx, &binding);
+    free_variables(variables);
+    variables = NULL;
+    free_user_functions();
+    unmap_file(ctx->image, ctx->image_size);
+    unbind_context(&binding);
+    free(ctx);
+}
+
+void rcalc_set_quiet(rcalc_context *ctx, int quiet) {
+    ctx->quiet = quiet;
+}
+
+rcalc_status rcalc_set_limits(rcalc_context *ctx, long max_calls, int max_depth, double timeout_ms) {
+    if (max_calls < 0 || max_depth < 0 || !(timeout_ms >= 0.0)) {
+        snprintf(api_error_message, sizeof(api_error_message), "Limits cannot be negative");
+        return RCALC_ERR_SYNTAX;
+    }
+    ctx->limits.max_calls = max_calls;
+    ctx->limits.max_depth = max_depth ? max_depth : DEFAULT_MAX_DEPTH;
+    ctx->limits.timeout = timeout_ms / 1000.0;
+    api_error_message[0] = '\0';
+    return RCALC_OK;
+}
+
+void rcalc_cancel(rcalc_context *ctx) {
+    cancel_generation_bump(&ctx->cancel_generation);
+}
+
+rcalc_status rcalc_define(rcalc_context *ctx, const char *source) {
+    if (reject_shared(ctx)) return RCALC_ERR_READ_ONLY;
+    ContextBinding binding;
+    bind_context(ctx, &binding);
+    
+    rcalc_status status = RCALC_OK;
+    const char *message = NULL;
+    char eval_message[128];
+    size_t size = strlen(source);
+    char *statement = malloc(size + 1);
+    if (!statement) {
+        return finish_call(&binding, RCALC_ERR_MEMORY, "Out of memory");
+    }
+    
+    StatementLexer lexer;
+    memset(&lexer, 0, sizeof(lexer));
+    size_t pos = 0;
+    while (pos < size || statement_lexer_pending(&lexer)) {
+        if (!statement_lexer_scan(&lexer, source, &pos, size) &&
+            !(statement_lexer_pending(&lexer) && statement_lexer_complete(&lexer))) {
+            if (statement_lexer_pending(&lexer) && status == RCALC_OK) {
+                status = RCALC_ERR_SYNTAX;
+                message = "Incomplete statement";
+            }
+            break;
+        }
+        size_t length = pos - lexer.start;
+        memcpy(statement, source + lexer.start, length);
+        statement[length] = '\0';
+        statement_lexer_reset(&lexer);
+        
+        // Keep going after an error, as a script load does
+        Statement stmt;
+        int failures = allocation_failures;
+        if (parse_statement_source(statement, &stmt) != 0) {
+            if (status == RCALC_OK) {
+                status = allocation_failures != failures ? RCALC_ERR_MEMORY : RCALC_ERR_SYNTAX;
+                message = allocation_failures != failures ? "Out of memory" : "Syntax error";
+            }
+            continue;
+        }
+        clear_eval_error();
+        execute_statement(&stmt);
+        if (allocation_failures != failures && status == RCALC_OK) {
+            status = RCALC_ERR_MEMORY;
+            message = "Out of memory";
+        } else if (eval_error.code != CALC_OK && status == RCALC_OK) {
+            status = (rcalc_status)eval_error.code;
+            format_eval_error(&eval_error, eval_message, sizeof(eval_message));
+            message = eval_message;
+        }
+    }
+    free(statement);
+    return finish_call(&binding, status, message);
+}
+
+rcalc_status rcalc_load_file(rcalc_context *ctx, const char *filename) {
+    if (reject_shared(ctx)) return RCALC_ERR_READ_ONLY;
+    ContextBinding binding;
+    bind_context(ctx, &binding);
+    
+    ScriptStage stage;
+    memset(&stage, 0, sizeof(stage));
+    stage.filename = filename;
+    stage_script_file(&stage);
+    rcalc_status status = RCALC_OK;
+    char message[128];
+    if (stage.status != 0) {
+        status = RCALC_ERR_IO;
+        snprintf(message, sizeof(message), "Cannot load file '%s'", filename);
+    } else if (stage.syntax_errors > 0) {
+        status = RCALC_ERR_SYNTAX;
+        snprintf(message, sizeof(message), "Syntax error in '%s'", filename);
+    }
+    commit_script_stage(&stage);
+    free_script_stage(&stage);
+    return finish_call(&binding, status, status == RCALC_OK ? NULL : message);
+}
+
+rcalc_status rcalc_save_image(rcalc_context *ctx, const char *path) {
+    ContextBinding binding;
+    bind_context(ctx, &binding);
+    int function_count, variable_count;
+    if (save_workspace_image(path, &function_count, &variable_count) != 0) {
+        return finish_call(&binding, RCALC_ERR_IO, "Cannot write image");
+    }
+    return finish_call(&binding, RCALC_OK, NULL);
+}
+
+rcalc_status rcalc_restore_image(rcalc_context *ctx, const char *path) {
+    if (reject_shared(ctx)) return RCALC_ERR_READ_ONLY;
+    ContextBinding binding;
+    bind_context(ctx, &binding);
+    int function_count, variable_count;
+    if (restore_workspace_image(path, &function_count, &variable_count) != 0) {
+        return finish_call(&binding, RCALC_ERR_IO, "Cannot restore image");
+    }
+    return finish_call(&binding, RCALC_OK, NULL);
+}
+
+rcalc_status rcalc_evaluate(rcalc_context *ctx, const char *expression, double *result) {
+    if (reject_shared(ctx)) {
+        *result = NAN;
+        return RCALC_ERR_READ_ONLY;
+    }
+    ContextBinding binding;
+    bind_context(ctx, &binding);
+    
+    Statement stmt;
+    *result = NAN;
+    int failures = allocation_failures;
+    if (!expression || parse_statement_source(expression, &stmt) != 0) {
+        if (allocation_failures != failures) return finish_call(&binding, RCALC_ERR_MEMORY, "Out of memory");
+        return finish_call(&binding, RCALC_ERR_SYNTAX, "Syntax error");
+    }
+    clear_eval_error();
+    *result = execute_statement(&stmt);
+    if (allocation_failures != failures) return finish_call(&binding, RCALC_ERR_MEMORY, "Out of memory");
+    return finish_call(&binding, (rcalc_status)eval_error.code, NULL);
+}
+
+rcalc_expr *rcalc_compile(rcalc_context *ctx, const char *expression, rcalc_status *status) {
+    ContextBinding binding;
+    bind_context(ctx, &binding);
+    
+    Statement stmt;
+    rcalc_expr *expr = NULL;
+    int failures = allocation_failures;
+    if (!expression || parse_statement_source(expression, &stmt) != 0) {
+        *status = allocation_failures != failures ? finish_call(&binding, RCALC_ERR_MEMORY, "Out of memory") :
+                  finish_call(&binding, RCALC_ERR_SYNTAX, "Syntax error");
+        return NULL;
+    }
+    if (stmt.kind != STMT_EXPRESSION) {
+        free_statement(&stmt);
+        *status = finish_call(&binding, RCALC_ERR_SYNTAX, "Only expressions can be compiled");
+        return NULL;
+    }
+    expr = malloc(sizeof(rcalc_expr));
+    if (!expr) {
+        free_statement(&stmt);
+        *status = finish_call(&binding, RCALC_ERR_MEMORY, "Out of memory");
+        return NULL;
+    }
+    expr->ast = stmt.ast;
+    *status = finish_call(&binding, RCALC_OK, NULL);
+    return expr;
+}
+
+rcalc_status rcalc_run(rcalc_context *ctx, const rcalc_expr *expr, double *result) {
+    ContextBinding binding;
+    bind_context_mode(ctx, &binding, 1);
+    clear_eval_error();
+    *result = evaluate_ast(expr->ast);
+    return finish_call(&binding, (rcalc_status)eval_error.code, NULL);
+}
+
+void rcalc_expr_free(rcalc_expr *expr) {
+    if (!expr) return;
+    free_ast(expr->ast);
+    free(expr);
+}
+
+rcalc_status rcalc_call(rcalc_context *ctx, const char *name, const double *args, int arg_count,
+                        double *result) {
+    ContextBinding binding;
+    bind_context_mode(ctx, &binding, 1);
+    clear_eval_error();
+    *result = NAN;
+    UserFunction *func = lookup_user_function(name);
+    if (!func) {
+        raise_eval_error(CALC_ERR_UNKNOWN_FUNCTION, name, 0, 0);
+    } else if (arg_count != func->param_count) {
+        raise_eval_error(CALC_ERR_ARITY, name, func->param_count, arg_count);
+    } else {
+        *result = evaluate_user_function(func, args, arg_count);
+    }
+    return finish_call(&binding, (rcalc_status)eval_error.code, NULL);
+}
+
+rcalc_status rcalc_set_variable(rcalc_context *ctx, const char *name, double value) {
+    if (!name[0] || strlen(name) >= sizeof(((Variable *)0)->name)) {
+        snprintf(api_error_message, sizeof(api_error_message), "Invalid variable name");
+        return RCALC_ERR_SYNTAX;
+    }
+    if (reject_shared(ctx)) return RCALC_ERR_READ_ONLY;
+    ContextBinding binding;
+    bind_context(ctx, &binding);
+    if (set_variable_value(name, value) != 0) {
+        return finish_call(&binding, RCALC_ERR_MEMORY, "Out of memory");
+    }
+    return finish_call(&binding, RCALC_OK, NULL);
+}
+
+rcalc_status rcalc_get_variable(rcalc_context *ctx, const char *name, double *value) {
+    ContextBinding binding;
+    bind_context_mode(ctx, &binding, 1);
+    clear_eval_error();
+    *value = get_variable_value(name);
+    return finish_call(&binding, (rcalc_status)eval_error.code, NULL);
+}
+
+const char *rcalc_error_message(const rcalc_context *ctx) {
+    (void)ctx;
+    return api_error_message;
+}
+
+const char *rcalc_status_name(rcalc_status status) {
+    static const char *other_names[] = { "syntax", "io", "memory", "read_only" };
+    if (status < RCALC_ERR_SYNTAX) return calc_error_names[status];
+    if (status <= RCALC_ERR_READ_ONLY) return other_names[status - RCALC_ERR_SYNTAX];
+    return "unknown";
+}
+
+#ifndef RCALC_LIBRARY
+// Run statistics, shown by the stats command, answered to a server's :stats
+// request and dumped every --stats-interval seconds. Latencies are kept in
+// log-linear histograms in the style of HdrHistogram: each power of two of
+// nanoseconds is split into 16 buckets, so a percentile is within about 3%
+// of the true value, and recording a sample is a few instructions. Only the
+// main thread records or reads them.
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_SUB_COUNT (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_COUNT)
+#define STATS_JSON_MAX 1024
+
+typedef struct Histogram {
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t count;
+    uint64_t max;              // Nanoseconds
+    double sum;
+} Histogram;
+
+typedef struct RunStats {
+    double started;            // Since the last reset
+    uint64_t statements;       // REPL and one-shot statements
+    uint64_t statement_errors;
+    uint64_t requests;         // Server requests
+    uint64_t request_errors;
+    uint64_t scripts;          // Script files loaded, or failing to load
+    uint64_t script_errors;
+    uint64_t cache_hits;       // Scripts staged from their compiled cache
+    uint64_t cache_misses;
+    Histogram statement_latency;
+    Histogram script_latency;
+    Histogram request_latency;
+} RunStats;
+
+static RunStats stats;
+static double stats_interval = 0.0;    // Seconds between dumps, 0 for none
+static double next_stats_dump = 0.0;
+static FILE *stats_file = NULL;
+
+static int highest_bit(uint64_t value) {
+#if defined(__GNUC__)
+    return 63 - __builtin_clzll(value);
+#else
+    int bit = 0;
+    while (value >>= 1) bit++;
+    return bit;
+#endif
+}
+
+static void histogram_record(Histogram *histogram, double seconds) {
+    uint64_t ns = seconds > 0.0 ? (uint64_t)(seconds * 1e9) : 0;
+    int index;
+    if (ns < HISTOGRAM_SUB_COUNT) {
+        index = (int)ns;
+    } else {
+        int shift = highest_bit(ns) - HISTOGRAM_SUB_BITS;
+        index = ((shift + 1) << HISTOGRAM_SUB_BITS) + (int)((ns >> shift) & (HISTOGRAM_SUB_COUNT - 1));
+    }
+    histogram->counts[index]++;
+    histogram->count++;
+    histogram->sum += (double)ns;
+    if (ns > histogram->max) histogram->max = ns;
+}
+
+// The value below which a fraction of the samples fall, in nanoseconds:
+// the middle of the bucket holding that sample, but never above the maximum
+static uint64_t histogram_percentile(const Histogram *histogram, double fraction) {
+    if (histogram->count == 0) return 0;
+    uint64_t rank = (uint64_t)ceil(fraction * (double)histogram->count);
+    if (rank < 1) rank = 1;
+    uint64_t seen = 0;
+    for (int index = 0; index < HISTOGRAM_BUCKETS; index++) {
+        seen += histogram->counts[index];
+        if (seen < rank) continue;
+        if (index < HISTOGRAM_SUB_COUNT) return (uint64_t)index;
+        int shift = (index >> HISTOGRAM_SUB_BITS) - 1;
+        uint64_t low = (uint64_t)(HISTOGRAM_SUB_COUNT + (index & (HISTOGRAM_SUB_COUNT - 1))) << shift;
+        uint64_t middle = low + (((uint64_t)1 << shift) >> 1);
+        return middle < histogram->max ? middle : histogram->max;
+    }
+    return histogram->max;
+}
+
+static double histogram_mean(const Histogram *histogram) {
+    return histogram->count ? histogram->sum / (double)histogram->count : 0.0;
+}
+
+static void reset_stats(void) {
+    memset(&stats, 0, sizeof(stats));
+    stats.started = monotonic_seconds();
+}
+
+static void record_statement(double seconds, int failed) {
+    stats.statements++;
+    stats.statement_errors += failed != 0;
+    histogram_record(&stats.statement_latency, seconds);
+}
+
+static void record_request(double seconds, int failed) {
+    stats.requests++;
+    stats.request_errors += failed != 0;
+    histogram_record(&stats.request_latency, seconds);
+}
+
+// A script counts once it is committed, including its staging time
+static void record_script_load(const ScriptStage *stage, double commit_seconds, int failed) {
+    stats.scripts++;
+    stats.script_errors += failed != 0;
+    if (script_cache_enabled) {
+        if (stage->from_cache) stats.cache_hits++;
+        else stats.cache_misses++;
+    }
+    histogram_record(&stats.script_latency, stage->seconds + commit_seconds);
+}
+
+static int format_histogram_json(char *buffer, size_t size, const char *name, const Histogram *histogram) {
+    return snprintf(buffer, size,
+                    ",\"%s\":{\"count\":%llu,\"mean\":%.0f,\"p50\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu}",
+                    name, (unsigned long long)histogram->count, histogram_mean(histogram),
+                    (unsigned long long)histogram_percentile(histogram, 0.50),
+                    (unsigned long long)histogram_percentile(histogram, 0.99),
+                    (unsigned long long)histogram_percentile(histogram, 0.999),
+                    (unsigned long long)histogram->max);
+}
+
+// One JSON object on one line; latencies are in nanoseconds
+static int format_stats_json(char *buffer, size_t size) {
+    int length = snprintf(buffer, size,
+                          "{\"time\":%lld,\"seconds\":%.3f,\"statements\":%llu,\"statement_errors\":%llu,"
+                          "\"requests\":%llu,\"request_errors\":%llu,\"scripts\":%llu,\"script_errors\":%llu,"
+                          "\"cache_hits\":%llu,\"cache_misses\":%llu",
+                          (long long)time(NULL), monotonic_seconds() - stats.started,
+                          (unsigned long long)stats.statements, (unsigned long long)stats.statement_errors,
+                          (unsigned long long)stats.requests, (unsigned long long)stats.request_errors,
+                          (unsigned long long)stats.scripts, (unsigned long long)stats.script_errors,
+                          (unsigned long long)stats.cache_hits, (unsigned long long)stats.cache_misses);
+    const char *names[] = { "statement_ns", "script_ns", "request_ns" };
+    const Histogram *histograms[] = { &stats.statement_latency, &stats.script_latency, &stats.request_latency };
+    for (int i = 0; i < 3 && length >= 0 && (size_t)length < size; i++) {
+        length += format_histogram_json(buffer + length, size - (size_t)length, names[i], histograms[i]);
+    }
+    if (length >= 0 && (size_t)length + 1 < size) {
+        buffer[length++] = '}';
+        buffer[length] = '\0';
+    }
+    return length < (int)size ? length : (int)size - 1;
+}
+
+static void print_histogram_row(const char *name, const Histogram *histogram) {
+    printf("  %-12s %10llu %10.1f %10.1f %10.1f %10.1f %10.1f\n", name, (unsigned long long)histogram->count,
+           histogram_mean(histogram) / 1000.0, histogram_percentile(histogram, 0.50) / 1000.0,
+           histogram_percentile(histogram, 0.99) / 1000.0, histogram_percentile(histogram, 0.999) / 1000.0,
+           histogram->max / 1000.0);
+}
+
+static void print_stats(void) {
+    double seconds = monotonic_seconds() - stats.started;
+    double per_second = seconds > 0.0 ? 1.0 / seconds : 0.0;
+    printf("Over %.1f s:\n", seconds);
+    printf("  %-12s %10llu %10.1f/s %llu failed\n", "statements", (unsigned long long)stats.statements,
+           stats.statements * per_second, (unsigned long long)stats.statement_errors);
+    printf("  %-12s %10llu %10.1f/s %llu failed\n", "requests", (unsigned long long)stats.requests,
+           stats.requests * per_second, (unsigned long long)stats.request_errors);
+    printf("  %-12s %10llu %12s %llu failed, %llu from cache, %llu parsed\n", "scripts",
+           (unsigned long long)stats.scripts, "", (unsigned long long)stats.script_errors,
+           (unsigned long long)stats.cache_hits, (unsigned long long)stats.cache_misses);
+    printf("Latency (us) %12s %10s %10s %10s %10s %10s\n", "count", "mean", "p50", "p99", "p99.9", "max");
+    print_histogram_row("statements", &stats.statement_latency);
+    print_histogram_row("scripts", &stats.script_latency);
+    print_histogram_row("requests", &stats.request_latency);
+}
+
+static void write_stats_dump(void) {
+    char line[STATS_JSON_MAX];
+    format_stats_json(line, sizeof(line));
+    FILE *out = stats_file ? stats_file : stderr;
+    fprintf(out, "%s\n", line);
+    fflush(out);
+}
+
+// Write the periodic dump if one is due. Counters keep running across dumps.
+static void maybe_dump_stats(void) {
+    if (stats_interval <= 0.0) return;
+    double now = monotonic_seconds();
+    if (now < next_stats_dump) return;
+    write_stats_dump();
+    next_stats_dump += stats_interval;
+    if (next_stats_dump <= now) next_stats_dump = now + stats_interval;
+}
+
+// Milliseconds until the next dump is due, or -1 without periodic dumps
+static int stats_dump_timeout_ms(void) {
+    if (stats_interval <= 0.0) return -1;
+    double remaining = next_stats_dump - monotonic_seconds();
+    return remaining > 0.0 ? (int)(remaining * 1000.0) + 1 : 0;
+}
+
+// The last dump, at exit, so short runs report too
+static void finish_stats_dump(void) {
+    write_stats_dump();
+    if (stats_file) fclose(stats_file);
+    stats_file = NULL;
+}
+
+// Parse and execute stats command: "stats", "stats json" or "stats reset"
+static void parse_stats_command(const char *line) {
+    const char *argument = line + 5;
+    while (isspace((unsigned char)*argument)) argument++;
+    if (*argument == '\0') {
+        print_stats();
+    } else if (strcmp(argument, "json") == 0) {
+        char json[STATS_JSON_MAX];
+        format_stats_json(json, sizeof(json));
+        printf("%s\n", json);
+    } else if (strcmp(argument, "reset") == 0) {
+        reset_stats();
+        printf("Statistics reset\n");
+    } else {
+        fprintf(stderr, "Error: Usage: stats [json|reset]\n");
+    }
+}
+
+// Evaluate a statement, passing back its first evaluation error rather than
+// printing it. Syntax errors are still reported as they are found.
+static double evaluate_statement(const char *expression, EvalError *error)
+{
+    error->code = CALC_OK;
+    if(expression == NULL || strlen(expression) == 0) 
+    {
+        fprintf(stderr, "Error: Empty expression\n");
+        return NAN;
+    }
+
+    // The parser has already reported why, so there is no message to add
+    Statement stmt;
+    if (parse_statement_source(expression, &stmt) != 0) {
+        error->code = CALC_ERR_SYNTAX;
+        return NAN;
+    }
+    
+    clear_eval_error();
+    double result = execute_statement(&stmt);
+    *error = eval_error;
+    return result;
+}
+
+static double compute_expression(const char *expression)
+{
+    EvalError error;
+    int reported = errors_reported;
+    double start = monotonic_seconds();
+    double result = evaluate_statement(expression, &error);
+    record_statement(monotonic_seconds() - start, error.code != CALC_OK || errors_reported != reported);
+    if (error.code != CALC_OK) {
+        print_eval_error(&error);
+    }
+    return result;
+}
+
+// Load and execute a script file
+static int load_script_file(const char *filename) {
+    ScriptStage stage;
+    memset(&stage, 0, sizeof(stage));
+    stage.filename = filename;
+    stage_script_file(&stage);
+    double start = monotonic_seconds();
+    int status = commit_script_stage(&stage);
+    record_script_load(&stage, monotonic_seconds() - start, status != 0);
+    free_script_stage(&stage);
+    return status;
+}
+
+#ifndef _WIN32
+typedef struct ScriptLoadJob {
+    ScriptStage *stages;
+    int count;
+    atomic_int next;
+} ScriptLoadJob;
+
+static void* script_stage_worker(void *arg) {
+    ScriptLoadJob *job = arg;
+    
+    // Errors are reported when a failed file is staged again in order
+    errors_muted = 1;
+    int i;
+    while ((i = atomic_fetch_add(&job->next, 1)) < job->count) {
+        stage_script_file(&job->stages[i]);
+    }
+    memory_flush();
+    return NULL;
+}
+#endif
+
+// Load several script files, staging them in parallel and committing them in
+// order, so later files still redefine what earlier ones defined. Returns the
+// number of files that loaded.
+static int load_script_files(char **filenames, int count) {
+    ScriptStage *stages = calloc(count > 0 ? count : 1, sizeof(ScriptStage));
+    if (!stages) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return 0;
+    }
+    for (int i = 0; i < count; i++) {
+        stages[i].filename = filenames[i];
+    }
+    
+#ifndef _WIN32
+    int thread_count = online_cpu_count();
+    if (thread_count > count) thread_count = count;
+    if (thread_count > 1) {
+        ScriptLoadJob job = { stages, count, 0 };
+        atomic_init(&job.next, 0);
+        pthread_t *workers = malloc(thread_count * sizeof(pthread_t));
+        int started = 0;
+        while (workers && started < thread_count &&
+               pthread_create(&workers[started], NULL, script_stage_worker, &job) == 0) {
+            started++;
+        }
+        
+        // Files no thread picked up are staged in order below
+        for (int i = 0; i < started; i++) {
+            pthread_join(workers[i], NULL);
+        }
+        free(workers);
+        for (int i = 0; i < count; i++) {
+            if (stages[i].syntax_errors > 0 || stages[i].status != 0) {
+                free_script_stage(&stages[i]);
+                memset(&stages[i], 0, sizeof(stages[i]));
+                stages[i].filename = filenames[i];
+            }
+        }
+    }
+#endif
+    
+    int loaded = 0;
+    for (int i = 0; i < count; i++) {
+        if (!stages[i].staged) {
+            // Not staged yet, or staged again to report its errors
+            stage_script_file(&stages[i]);
+        }
+        double start = monotonic_seconds();
+        int status = commit_script_stage(&stages[i]);
+        record_script_load(&stages[i], monotonic_seconds() - start, status != 0);
+        if (status == 0) {
+            loaded++;
+        } else {
+            fprintf(stderr, "Failed to load %s\n", filenames[i]);
+        }
+        free_script_stage(&stages[i]);
+    }
+    free(stages);
+    return loaded;
+}
+
+// Extract the filename argument of a REPL command, with or without quotes
+static int parse_command_filename(const char *command, const char *line, char *filename) {
+    // Skip the command name and whitespace
+    const char *p = line + strlen(command);
+    while (*p && isspace(*p)) p++;
+    
+    if (*p == '\0') {
+        fprintf(stderr, "Error: %s command requires a filename\n", command);
+        fprintf(stderr, "Usage: %s \"filename.calc\" or %s filename.calc\n", command, command);
+        return -1;
+    }
+    
+    // Extract filename (with or without quotes)
+    int i = 0;
+    
+    if (*p == '"') {
+        // Quoted filename
+        p++;
+        while (*p && *p != '"' && i < 255) {
+            filename[i++] = *p++;
+        }
+    } else {
+        // Unquoted filename
+        while (*p && !isspace(*p) && i < 255) {
+            filename[i++] = *p++;
+        }
+    }
+    
+    filename[i] = '\0';
+    
+    if (filename[0] == '\0') {
+        fprintf(stderr, "Error: Empty filename\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Per-function profiler, switched with "profile on" and "profile off".
+// While on, evaluate_user_function() hands every call to
+// profile_user_function(), which times it and files the time under both the
+// function and its place in a call tree. A call's exclusive time is its
+// inclusive time less that of the calls it made. Recursive calls add to a
+// function's inclusive time only at the outermost level, so it never exceeds
+// the wall time spent. The call tree gives the folded stacks that flame
+// graph tools read. Only the REPL turns it on, so it runs on the main thread.
+#define PROFILE_MAX_ARGS 10
+
+typedef struct ProfileEntry {
+    char name[32];
+    uint64_t calls;
+    int active;                // Calls in progress, for recursion
+    double inclusive;          // Seconds
+    double exclusive;
+    double arg_sums[PROFILE_MAX_ARGS];
+    int arg_count;
+} ProfileEntry;
+
+typedef struct ProfileNode {
+    const UserFunction *func;  // Identifies the node among its siblings
+    int entry;
+    int parent;                // -1 for a call made by a statement
+    int first_child;
+    int next_sibling;
+    double exclusive;
+} ProfileNode;
+
+typedef struct Profiler {
+    ProfileEntry *entries;
+    int entry_count;
+    int entry_capacity;
+    ProfileNode *nodes;
+    int node_count;
+    int node_capacity;
+    int first_root;
+    int current;               // Node of the running call, or -1
+    double child_time;         // Inclusive time of the running call's callees so far
+} Profiler;
+
+static Profiler profiler = { NULL, 0, 0, NULL, 0, 0, -1, -1, 0.0 };
+
+static void free_profile(void) {
+    free(profiler.entries);
+    free(profiler.nodes);
+    memset(&profiler, 0, sizeof(profiler));
+    profiler.first_root = -1;
+    profiler.current = -1;
+}
+
+static int profile_entry(const UserFunction *func) {
+    for (int i = 0; i < profiler.entry_count; i++) {
+        if (strcmp(profiler.entries[i].name, func->name) == 0) return i;
+    }
+    if (profiler.entry_count == profiler.entry_capacity) {
+        int new_capacity = profiler.entry_capacity ? profiler.entry_capacity * 2 : 32;
+        ProfileEntry *new_entries = realloc(profiler.entries, new_capacity * sizeof(ProfileEntry));
+        if (!new_entries) return -1;
+        profiler.entries = new_entries;
+        profiler.entry_capacity = new_capacity;
+    }
+    ProfileEntry *entry = &profiler.entries[profiler.entry_count];
+    memset(entry, 0, sizeof(*entry));
+    strcpy(entry->name, func->name);
+    entry->arg_count = func->param_count < PROFILE_MAX_ARGS ? func->param_count : PROFILE_MAX_ARGS;
+    return profiler.entry_count++;
+}
+
+// The node for a call to func from the running call, made on first use.
+// A function redefined at the same address still matches by name.
+static int profile_node(const UserFunction *func) {
+    int *link = profiler.current < 0 ? &profiler.first_root : &profiler.nodes[profiler.current].first_child;
+    for (int i = *link; i >= 0; i = profiler.nodes[i].next_sibling) {
+        ProfileNode *node = &profiler.nodes[i];
+        if (node->func == func && strcmp(profiler.entries[node->entry].name, func->name) == 0) return i;
+    }
+    int entry = profile_entry(func);
+    if (entry < 0) return -1;
+    if (profiler.node_count == profiler.node_capacity) {
+        int new_capacity = profiler.node_capacity ? profiler.node_capacity * 2 : 256;
+        ProfileNode *new_nodes = realloc(profiler.nodes, new_capacity * sizeof(ProfileNode));
+        if (!new_nodes) return -1;
+        profiler.nodes = new_nodes;
+        profiler.node_capacity = new_capacity;
+        link = profiler.current < 0 ? &profiler.first_root : &profiler.nodes[profiler.current].first_child;
+    }
+    int index = profiler.node_count++;
+    ProfileNode *node = &profiler.nodes[index];
+    node->func = func;
+    node->entry = entry;
+    node->parent = profiler.current;
+    node->first_child = -1;
+    node->next_sibling = *link;
+    node->exclusive = 0.0;
+    *link = index;
+    return index;
+}
+
+static double profile_user_function(UserFunction *func, const double *args, int arg_count) {
+    int node = profile_node(func);
+    if (node < 0) return evaluate_ast(user_function_body(func));  // Out of memory: run unprofiled
+    ProfileEntry *entry = &profiler.entries[profiler.nodes[node].entry];
+    entry->calls++;
+    entry->active++;
+    for (int i = 0; i < entry->arg_count && i < arg_count; i++) entry->arg_sums[i] += args[i];
+    
+    int parent = profiler.current;
+    double saved_child_time = profiler.child_time;
+    profiler.current = node;
+    profiler.child_time = 0.0;
+    double start = monotonic_seconds();
+    double result = evaluate_ast(user_function_body(func));
+    double elapsed = monotonic_seconds() - start;
+    
+    // The entry array may have moved while the body ran
+    entry = &profiler.entries[profiler.nodes[node].entry];
+    double exclusive = elapsed - profiler.child_time;
+    profiler.nodes[node].exclusive += exclusive;
+    entry->exclusive += exclusive;
+    if (--entry->active == 0) entry->inclusive += elapsed;
+    profiler.current = parent;
+    profiler.child_time = saved_child_time + elapsed;
+    return result;
+}
+
+static int compare_profile_entries(const void *a, const void *b) {
+    double x = (*(ProfileEntry * const *)a)->exclusive;
+    double y = (*(ProfileEntry * const *)b)->exclusive;
+    return (x < y) - (x > y);
+}
+
+// Functions by exclusive time, most first
+static void print_profile_report(void) {
+    if (profiler.entry_count == 0) {
+        printf("No calls profiled%s\n", profiling ? " yet" : "; use 'profile on' first");
+        return;
+    }
+    ProfileEntry **sorted = malloc(profiler.entry_count * sizeof(ProfileEntry*));
+    if (!sorted) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return;
+    }
+    double total = 0.0;
+    for (int i = 0; i < profiler.entry_count; i++) {
+        sorted[i] = &profiler.entries[i];
+        total += sorted[i]->exclusive;
+    }
+    qsort(sorted, profiler.entry_count, sizeof(ProfileEntry*), compare_profile_entries);
+    
+    printf("%-20s %12s %12s %12s %7s  %s\n", "function", "calls", "incl ms", "excl ms", "excl %", "mean args");
+    for (int i = 0; i < profiler.entry_count; i++) {
+        const ProfileEntry *entry = sorted[i];
+        printf("%-20s %12llu %12.3f %12.3f %6.1f%%  (", entry->name, (unsigned long long)entry->calls,
+               entry->inclusive * 1000.0, entry->exclusive * 1000.0,
+               total > 0.0 ? entry->exclusive * 100.0 / total : 0.0);
+        for (int a = 0; a < entry->arg_count; a++) {
+            printf("%s%.4g", a ? ", " : "", entry->calls ? entry->arg_sums[a] / entry->calls : 0.0);
+        }
+        printf(")\n");
+    }
+    free(sorted);
+}
+
+// One line per call path, "outer;inner nanoseconds", with the path's
+// exclusive time, as flamegraph.pl and speedscope expect
+static int write_folded_stacks(FILE *out) {
+    for (int i = 0; i < profiler.node_count; i++) {
+        long long nanos = llround(profiler.nodes[i].exclusive * 1e9);
+        if (nanos <= 0) continue;
+        
+        // Collect the path leaf first, then print it from the root
+        int depth = 0;
+        for (int n = i; n >= 0; n = profiler.nodes[n].parent) depth++;
+        int *path = malloc(depth * sizeof(int));
+        if (!path) return -1;
+        int d = depth;
+        for (int n = i; n >= 0; n = profiler.nodes[n].parent) path[--d] = n;
+        for (d = 0; d < depth; d++) {
+            fprintf(out, "%s%s", d ? ";" : "", profiler.entries[profiler.nodes[path[d]].entry].name);
+        }
+        fprintf(out, " %lld\n", nanos);
+        free(path);
+    }
+    return ferror(out) ? -1 : 0;
+}
+
+// Parse and execute profile command: "profile on", "profile off",
+// "profile report" or "profile report folded [filename]"
+static void parse_profile_command(const char *line) {
+    const char *argument = line + 7;
+    while (isspace((unsigned char)*argument)) argument++;
+    if (*argument == '\0') {
+        printf("Profiling is %s\n", profiling ? "on" : "off");
+    } else if (strcmp(argument, "on") == 0) {
+        free_profile();
+        profiling = 1;
+        printf("Profiling on\n");
+    } else if (strcmp(argument, "off") == 0) {
+        profiling = 0;
+        printf("Profiling off\n");
+    } else if (strcmp(argument, "report") == 0) {
+        print_profile_report();
+    } else if (strncmp(argument, "report", 6) == 0 && isspace((unsigned char)argument[6])) {
+        const char *rest = argument + 7;
+        while (isspace((unsigned char)*rest)) rest++;
+        if (strncmp(rest, "folded", 6) != 0 || (rest[6] != '\0' && !isspace((unsigned char)rest[6]))) {
+            fprintf(stderr, "Error: Usage: profile on|off|report [folded [filename]]\n");
+            return;
+        }
+        rest += 6;
+        while (isspace((unsigned char)*rest)) rest++;
+        if (*rest == '\0') {
+            write_folded_stacks(stdout);
+            return;
+        }
+        char filename[256];
+        if (parse_command_filename("", rest, filename) != 0) return;
+        FILE *out = fopen(filename, "w");
+        if (!out) {
+            fprintf(stderr, "Error: Cannot write '%s'\n", filename);
+            return;
+        }
+        int status = write_folded_stacks(out);
+        if (fclose(out) != 0 || status != 0) {
+            fprintf(stderr, "Error: Cannot write '%s'\n", filename);
+        } else {
+            printf("Wrote folded stacks to %s\n", filename);
+        }
+    } else {
+        fprintf(stderr, "Error: Usage: profile on|off|report [folded [filename]]\n");
+    }
+}
+
+// Memory report. Category totals come from the allocation counters; the
+// size of each function is measured from its body's tree.
+static const char *memory_category_names[MEMORY_CATEGORY_COUNT] = {
+    "ast", "symbols", "source", "cache", "kernels"
+};
+
+typedef struct FunctionMemory {
+    const UserFunction *func;
+    size_t nodes;
+    size_t bytes;
+} FunctionMemory;
+
+// Bytes held by a tree, including the argument arrays of its calls
+static size_t ast_memory(const ASTNode *node, size_t *nodes) {
+    if (!node) return 0;
+    (*nodes)++;
+    size_t bytes = sizeof(ASTNode);
+    switch (node->type) {
+        case AST_BINARY_OP:
+            bytes += ast_memory(node->data.binary.left, nodes);
+            bytes += ast_memory(node->data.binary.right, nodes);
+            break;
+        case AST_UNARY_OP:
+            bytes += ast_memory(node->data.unary.operand, nodes);
+            break;
+        case AST_FUNCTION_CALL:
+            if (node->data.func_call.args) bytes += AST_ARGS_SIZE;
+            for (int i = 0; i < node->data.func_call.arg_count; i++) {
+                bytes += ast_memory(node->data.func_call.args[i], nodes);
+            }
+            break;
+        default:
+            break;
+    }
+    return bytes;
+}
+
+// Format a byte count as B, KB, MB or GB
+static void format_memory_size(size_t bytes, char *buffer, size_t size) {
+    static const char *units[] = { "B", "KB", "MB", "GB" };
+    double value = (double)bytes;
+    int unit = 0;
+    while (value >= 1024.0 && unit < 3) {
+        value /= 1024.0;
+        unit++;
+    }
+    snprintf(buffer, size, unit ? "%.1f %s" : "%.0f %s", value, units[unit]);
+}
+
+// Parse a size such as 4096, 512K, 64M or 2G
+static int parse_memory_size(const char *text, size_t *bytes) {
+    char *end;
+    double value = strtod(text, &end);
+    double scale = 1.0;
+    switch (toupper((unsigned char)*end)) {
+        case 'K': scale = 1024.0; end++; break;
+        case 'M': scale = 1024.0 * 1024.0; end++; break;
+        case 'G': scale = 1024.0 * 1024.0 * 1024.0; end++; break;
+        default: break;
+    }
+    if (toupper((unsigned char)*end) == 'B') end++;
+    if (end == text || *end != '\0' || !(value > 0.0) || value * scale >= (double)SIZE_MAX) return -1;
+    *bytes = (size_t)(value * scale);
+    return 0;
+}
+
+static void print_memory_report(void) {
+    char size[32];
+    memory_flush();
+    printf("%-10s %10s %14s\n", "category", "objects", "bytes");
+    for (int i = 0; i < MEMORY_CATEGORY_COUNT; i++) {
+        printf("%-10s %10zu %14zu\n", memory_category_names[i], memory_count_load(&memory_usage[i].objects),
+               memory_count_load(&memory_usage[i].bytes));
+    }
+    size_t total = memory_count_load(&memory_total);
+    format_memory_size(total, size, sizeof(size));
+    printf("%-10s %10s %14zu  (%s", "total", "", total, size);
+    format_memory_size(memory_count_load(&memory_peak), size, sizeof(size));
+    printf(", peak %s", size);
+    if (memory_limit) {
+        format_memory_size(memory_limit, size, sizeof(size));
+        printf(", limit %s", size);
+    }
+    printf(")\n");
+
+    int function_count = count_user_functions();
+    int variable_count = count_variables();
+    printf("%d function%s, %d variable%s", function_count, function_count == 1 ? "" : "s",
+           variable_count, variable_count == 1 ? "" : "s");
+    if (context->image) {
+        format_memory_size(context->image_size, size, sizeof(size));
+        printf(", %s workspace image mapped", size);
+    }
+    printf("\n");
+}
+
+static int compare_function_memory(const void *a, const void *b) {
+    const FunctionMemory *x = a;
+    const FunctionMemory *y = b;
+    return (x->bytes < y->bytes) - (x->bytes > y->bytes);
+}
+
+// Each function's size: its entry, parameters and body, largest first.
+// Bodies of lazily loaded functions are still source text.
+static void print_function_memory(void) {
+    int count = count_user_functions();
+    if (count == 0) {
+        printf("No functions defined\n");
+        return;
+    }
+    FunctionMemory *functions = malloc(count * sizeof(FunctionMemory));
+    if (!functions) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return;
+    }
+    int i = 0;
+    for (const UserFunction *func = context->user_functions; func; func = func->next, i++) {
+        functions[i].func = func;
+        functions[i].nodes = 0;
+        functions[i].bytes = sizeof(UserFunction) + func->param_count * sizeof(Parameter) +
+                             (func->source ? strlen(func->source) + 1 : ast_memory(func->body, &functions[i].nodes));
+    }
+    qsort(functions, count, sizeof(FunctionMemory), compare_function_memory);
+
+    printf("%-24s %8s %10s %12s\n", "function", "params", "nodes", "bytes");
+    for (i = 0; i < count; i++) {
+        const UserFunction *func = functions[i].func;
+        int mapped = context->image && (const unsigned char *)func->body >= context->image &&
+                     (const unsigned char *)func->body < context->image + context->image_size;
+        if (func->source) {
+            printf("%-24s %8d %10s %12zu  (source, not yet parsed)\n", func->name, func->param_count, "-",
+                   functions[i].bytes);
+        } else {
+            printf("%-24s %8d %10zu %12zu%s\n", func->name, func->param_count, functions[i].nodes,
+                   functions[i].bytes, mapped ? "  (body in workspace image)" : "");
+        }
+    }
+    free(functions);
+}
+
+// Parse and execute memory command: "memory" or "memory functions"
+static void parse_memory_command(const char *line) {
+    const char *argument = line + 6;
+    while (isspace((unsigned char)*argument)) argument++;
+    if (*argument == '\0') {
+        print_memory_report();
+    } else if (strcmp(argument, "functions") == 0) {
+        print_function_memory();
+    } else {
+        fprintf(stderr, "Error: Usage: memory [functions]\n");
+    }
+}
+
+// Parse and execute load command
+static void parse_load_command(const char *line) {
+    char filename[256];
+    if (parse_command_filename("load", line, filename) == 0) {
+        load_script_file(filename);
+    }
+}
+
+// Restore the --image workspace, if any, announcing it unless silent
+static int load_startup_image(const char *path) {
+    int function_count, variable_count;
+    if (!path) return 0;
+    if (restore_workspace_image(path, &function_count, &variable_count) != 0) return -1;
+    if (!silent_mode) {
+        printf("Restored %d function%s, %d variable%s from %s\n", function_count, function_count == 1 ? "" : "s",
+               variable_count, variable_count == 1 ? "" : "s", path);
+    }
+    return 0;
+}
+
+// Parse and execute save command
+static void parse_save_command(const char *line) {
+    char filename[256];
+    int function_count, variable_count;
+    if (parse_command_filename("save", line, filename) == 0 &&
+        save_workspace_image(filename, &function_count, &variable_count) == 0) {
+        printf("Saved %d function%s, %d variable%s to %s\n", function_count, function_count == 1 ? "" : "s",
+               variable_count, variable_count == 1 ? "" : "s", filename);
+    }
+}
+
+// Parse and execute restore command
+static void parse_restore_command(const char *line) {
+    char filename[256];
+    int function_count, variable_count;
+    if (parse_command_filename("restore", line, filename) == 0 &&
+        restore_workspace_image(filename, &function_count, &variable_count) == 0) {
+        printf("Restored %d function%s, %d variable%s from %s\n", function_count, function_count == 1 ? "" : "s",
+               variable_count, variable_count == 1 ? "" : "s", filename);
+    }
+}
+
+// Watched scripts are reloaded when they change on disk. Each reload diffs
+// the file statement by statement against the previous version: changed and
+// new statements are run, definitions that disappeared are removed, and
+// unchanged assignments and expressions are run again only if they depend,
+// directly or through other definitions, on something that changed.
+#define MAX_WATCHED_SCRIPTS 16
+
+typedef struct WatchedStatement {
+    uint64_t hash;             // Hash of the statement's source text
+    StatementKind kind;
+    char name[32];             // Defined function or variable, if any
+    char (*refs)[32];          // Names the statement reads or calls
+    int ref_count;
+    int dirty;                 // Scratch during a reload
+} WatchedStatement;
+
+typedef struct WatchedScript {
+    char path[256];
+    const char *basename;      // Points into path
+    int dir_watch;             // inotify watch on the containing directory
+    WatchedStatement *statements;
+    int count;
+    int loaded;                // Reloads are reported after the first load
+} WatchedScript;
+
+static WatchedScript watched_scripts[MAX_WATCHED_SCRIPTS];
+static int watched_count = 0;
+
+static void collect_refs(const ASTNode *node, WatchedStatement *ws, int *capacity) {
+    if (!node) return;
+    const char *name = NULL;
+    switch (node->type) {
+        case AST_VARIABLE:
+            name = node->data.variable;
+            break;
+        case AST_BINARY_OP:
+            collect_refs(node->data.binary.left, ws, capacity);
+            collect_refs(node->data.binary.right, ws, capacity);
+            break;
+        case AST_UNARY_OP:
+            collect_refs(node->data.unary.operand, ws, capacity);
+            break;
+        case AST_FUNCTION_CALL:
+            name = node->data.func_call.name;
+            for (int i = 0; i < node->data.func_call.arg_count; i++) {
+                collect_refs(node->data.func_call.args[i], ws, capacity);
+            }
+            break;
+        default:
+            break;
+    }
+    if (!name) return;
+    for (int i = 0; i < ws->ref_count; i++) {
+        if (strcmp(ws->refs[i], name) == 0) return;
+    }
+    if (ws->ref_count == *capacity) {
+        int new_capacity = *capacity ? *capacity * 2 : 4;
+        char (*new_refs)[32] = realloc(ws->refs, new_capacity * sizeof(*new_refs));
+        if (!new_refs) return;
+        ws->refs = new_refs;
+        *capacity = new_capacity;
+    }
+    strcpy(ws->refs[ws->ref_count++], name);
+}
+
+static void free_watched_statements(WatchedStatement *statements, int count) {
+    for (int i = 0; i < count; i++) {
+        free(statements[i].refs);
+    }
+    free(statements);
+}
+
+static int name_is_dirty(const char *name, const WatchedStatement *statements, int count) {
+    for (int i = 0; i < count; i++) {
+        if (statements[i].dirty && statements[i].name[0] && strcmp(statements[i].name, name) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Function bodies read globals, but a function defined outside the script,
+// such as at the prompt, has no statement carrying its refs. Calls are
+// followed into the function table instead; seen stops recursion.
+#define WATCH_MAX_CALLEES 64
+
+typedef struct WatchCallees {
+    const UserFunction *seen[WATCH_MAX_CALLEES];
+    int count;
+} WatchCallees;
+
+static int function_reads_dirty(UserFunction *func, const WatchedStatement *statements, int count,
+                                WatchCallees *callees);
+
+static int ast_reads_dirty(const ASTNode *node, const Parameter *params,
+                           const WatchedStatement *statements, int count, WatchCallees *callees) {
+    if (!node) return 0;
+    switch (node->type) {
+        case AST_VARIABLE:
+            for (const Parameter *param = params; param; param = param->next) {
+                if (strcmp(param->name, node->data.variable) == 0) return 0;
+            }
+            return name_is_dirty(node->data.variable, statements, count);
+        case AST_BINARY_OP:
+            return ast_reads_dirty(node->data.binary.left, params, statements, count, callees) ||
+                   ast_reads_dirty(node->data.binary.right, params, statements, count, callees);
+        case AST_UNARY_OP:
+            return ast_reads_dirty(node->data.unary.operand, params, statements, count, callees);
+        case AST_FUNCTION_CALL: {
+            for (int i = 0; i < node->data.func_call.arg_count; i++) {
+                if (ast_reads_dirty(node->data.func_call.args[i], params, statements, count, callees)) return 1;
+            }
+            const char *name = node->data.func_call.name;
+            if (name_is_dirty(name, statements, count)) return 1;
+            UserFunction *func = lookup_builtin(name) ? NULL : find_user_function(context, name);
+            return func && function_reads_dirty(func, statements, count, callees);
+        }
+        default:
+            return 0;
+    }
+}
+
+static int function_reads_dirty(UserFunction *func, const WatchedStatement *statements, int count,
+                                WatchCallees *callees) {
+    for (int i = 0; i < callees->count; i++) {
+        if (callees->seen[i] == func) return 0;
+    }
+    // Too many to follow; assume the worst
+    if (callees->count == WATCH_MAX_CALLEES) return 1;
+    callees->seen[callees->count++] = func;
+    return ast_reads_dirty(user_function_body(func), func->params, statements, count, callees);
+}
+
+static int refs_are_dirty(const WatchedStatement *ws, const WatchedStatement *statements, int count) {
+    WatchCallees callees;
+    callees.count = 0;
+    for (int i = 0; i < ws->ref_count; i++) {
+        if (name_is_dirty(ws->refs[i], statements, count)) return 1;
+        UserFunction *func = lookup_builtin(ws->refs[i]) ? NULL : find_user_function(context, ws->refs[i]);
+        if (func && function_reads_dirty(func, statements, count, &callees)) return 1;
+    }
+    return 0;
+}
+
+static void remove_user_function(const char *name) {
+    UserFunction *func = find_user_function(context, name);
+    if (!func) return;
+    UserFunction **link = &context->function_index[function_name_hash(name) & (context->function_index_size - 1)];
+    while (*link != func) link = &(*link)->hash_next;
+    *link = func->hash_next;
+    for (link = &context->user_functions; *link != func; link = &(*link)->next) {}
+    *link = func->next;
+    context->function_count--;
+    free_ast(func->body);
+    free_function_source(func->source);
+    free_parameters(func->params);
+    memory_free(MEMORY_SYMBOLS, func, sizeof(UserFunction));
+}
+
+static void remove_variable(const char *name) {
+    for (Variable **link = &variables; *link; link = &(*link)->next) {
+        if (strcmp((*link)->name, name) == 0) {
+            Variable *var = *link;
+            *link = var->next;
+            memory_free(MEMORY_SYMBOLS, var, sizeof(Variable));
+            return;
+        }
+    }
+}
+
+// Parse one statement of a watched script
+static int parse_watched_statement(const char *data, size_t start, size_t end, Statement *stmt) {
+    size_t length = end - start;
+    char *text = malloc(length + 1);
+    if (!text) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return -1;
+    }
+    memcpy(text, data + start, length);
+    text[length] = '\0';
+    int status = parse_statement_source(text, stmt);
+    free(text);
+    return status;
+}
+
+// Bring the session up to date with a watched script. On the first load
+// every statement counts as changed.
+static int reload_watched_script(WatchedScript *script) {
+    size_t size = 0;
+    const char *data = (const char *)map_file(script->path, &size);
+    if (!data) {
+        FILE *fp = fopen(script->path, "r");
+        if (!fp) {
+            fprintf(stderr, "Error: Cannot open file '%s'\n", script->path);
+            return -1;
+        }
+        fclose(fp);
+    }
+    
+    // Split the new version into statements and hash each one
+    WatchedStatement *statements = NULL;
+    Statement *parsed = NULL;
+    size_t *starts = NULL;
+    size_t *ends = NULL;
+    int *lines = NULL;
+    int count = 0;
+    int capacity = 0;
+    StatementLexer lexer;
+    memset(&lexer, 0, sizeof(lexer));
+    size_t pos = 0;
+    while (pos < size || statement_lexer_pending(&lexer)) {
+        int line_num = lexer.line;
+        if (statement_lexer_scan(&lexer, data, &pos, size)) {
+            line_num = lexer.line;
+        } else if (statement_lexer_pending(&lexer) && statement_lexer_complete(&lexer)) {
+            // Final statement without a trailing newline
+            line_num++;
+        } else {
+            if (statement_lexer_pending(&lexer)) {
+                fprintf(stderr, "Warning: Incomplete statement at end of %s\n", script->path);
+            }
+            break;
+        }
+        if (count == capacity) {
+            // Nothing has been run or removed yet, so on failure the
+            // previous version's definitions simply stay
+            int new_capacity = capacity ? capacity * 2 : 64;
+            WatchedStatement *new_statements = realloc(statements, new_capacity * sizeof(WatchedStatement));
+            if (new_statements) statements = new_statements;
+            Statement *new_parsed = realloc(parsed, new_capacity * sizeof(Statement));
+            if (new_parsed) parsed = new_parsed;
+            size_t *new_starts = realloc(starts, new_capacity * sizeof(size_t));
+            if (new_starts) starts = new_starts;
+            size_t *new_ends = realloc(ends, new_capacity * sizeof(size_t));
+            if (new_ends) ends = new_ends;
+            int *new_lines = realloc(lines, new_capacity * sizeof(int));
+            if (new_lines) lines = new_lines;
+            if (!new_statements || !new_parsed || !new_starts || !new_ends || !new_lines) {
+                fprintf(stderr, "Error: Memory allocation failed; keeping the previous %s\n", script->path);
+                free(statements);
+                free(parsed);
+                free(starts);
+                free(ends);
+                free(lines);
+                unmap_file((unsigned char *)data, size);
+                return -1;
+            }
+            capacity = new_capacity;
+        }
+        memset(&statements[count], 0, sizeof(WatchedStatement));
+        memset(&parsed[count], 0, sizeof(Statement));
+        statements[count].hash = hash_bytes((const unsigned char *)data + lexer.start, pos - lexer.start);
+        starts[count] = lexer.start;
+        ends[count] = pos;
+        lines[count] = line_num;
+        count++;
+        statement_lexer_reset(&lexer);
+    }
+    
+    // Statements whose text is unchanged keep what was learned about them
+    for (int i = 0; i < count; i++) {
+        statements[i].dirty = 1;
+        for (int j = 0; j < script->count; j++) {
+            WatchedStatement *old = &script->statements[j];
+            if (old->hash == statements[i].hash && old->ref_count >= 0) {
+                statements[i].kind = old->kind;
+                strcpy(statements[i].name, old->name);
+                statements[i].refs = old->refs;
+                statements[i].ref_count = old->ref_count;
+                statements[i].dirty = 0;
+                old->refs = NULL;
+                old->ref_count = -1;  // Taken; identical statements pair off in order
+                break;
+            }
+        }
+    }
+    
+    // Parse the changed statements to learn what they define and read
+    int changed = 0;
+    for (int i = 0; i < count; i++) {
+        if (!statements[i].dirty) continue;
+        changed++;
+        if (parse_watched_statement(data, starts[i], ends[i], &parsed[i]) != 0) {
+            fprintf(stderr, "Error in %s:%d: Failed to evaluate statement\n", script->path, lines[i]);
+            statements[i].kind = STMT_EXPRESSION;
+            statements[i].dirty = -1;  // Not run
+            continue;
+        }
+        statements[i].kind = parsed[i].kind;
+        if (parsed[i].kind != STMT_EXPRESSION) strcpy(statements[i].name, parsed[i].name);
+        int ref_capacity = 0;
+        collect_refs(parsed[i].ast, &statements[i], &ref_capacity);
+    }
+    
+    // Definitions that are gone are removed, and count as changed
+    int removed = 0;
+    for (int j = 0; j < script->count; j++) {
+        WatchedStatement *old = &script->statements[j];
+        old->dirty = 0;
+        if (old->ref_count < 0 || old->kind == STMT_EXPRESSION) continue;
+        int still_defined = 0;
+        for (int i = 0; i < count && !still_defined; i++) {
+            still_defined = statements[i].kind == old->kind && strcmp(statements[i].name, old->name) == 0;
+        }
+        if (!still_defined) {
+            if (old->kind == STMT_FUNCTION) remove_user_function(old->name);
+            else remove_variable(old->name);
+            old->dirty = 1;
+            removed++;
+        }
+    }
+    
+    // Unchanged statements that read a changed or removed name, directly or
+    // through other unchanged definitions, are stale too
+    int propagated = 1;
+    while (propagated) {
+        propagated = 0;
+        for (int i = 0; i < count; i++) {
+            if (statements[i].dirty) continue;
+            if (refs_are_dirty(&statements[i], statements, count) ||
+                refs_are_dirty(&statements[i], script->statements, script->count)) {
+                statements[i].dirty = 2;
+                propagated = 1;
+            }
+        }
+    }
+    
+    // Run what is stale, in file order. Functions look their callees up on
+    // each call, so an unchanged function needs no recompiling.
+    int rerun = 0;
+    int was_silent = silent_mode;
+    silent_mode = 1;
+    for (int i = 0; i < count; i++) {
+        if (statements[i].dirty == 2 && statements[i].kind != STMT_FUNCTION &&
+            parse_watched_statement(data, starts[i], ends[i], &parsed[i]) == 0) {
+            statements[i].dirty = 1;
+            rerun++;
+        }
+        if (statements[i].dirty == 1) {
+            run_script_statement(script->path, &parsed[i], lines[i]);
+        }
+        statements[i].dirty = 0;
+    }
+    silent_mode = was_silent;
+    
+    free_watched_statements(script->statements, script->count);
+    script->statements = statements;
+    script->count = count;
+    free(parsed);
+    free(starts);
+    free(ends);
+    free(lines);
+    unmap_file((unsigned char *)data, size);
+    
+    if (!silent_mode && script->loaded && (changed || removed)) {
+        printf("Reloaded %s: %d changed, %d removed, %d re-evaluated\n",
+               script->path, changed, removed, rerun);
+    }
+    script->loaded = 1;
+    return 0;
+}
+
+#ifdef __linux__
+static int watch_fd = -1;
+
+// Reload the scripts whose directories reported a change
+static void process_watch_events(void) {
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int pending[MAX_WATCHED_SCRIPTS] = {0};
+    
+    ssize_t length;
+    while ((length = read(watch_fd, buffer, sizeof(buffer))) > 0) {
+        for (char *p = buffer; p < buffer + length; ) {
+            struct inotify_event *event = (struct inotify_event *)p;
+            for (int i = 0; i < watched_count; i++) {
+                if (event->wd == watched_scripts[i].dir_watch && event->len > 0 &&
+                    strcmp(event->name, watched_scripts[i].basename) == 0) {
+                    pending[i] = 1;
+                }
+            }
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+    
+    // One reload per script, however many events a save produced
+    for (int i = 0; i < watched_count; i++) {
+        if (pending[i]) {
+            reload_watched_script(&watched_scripts[i]);
+        }
+    }
+}
+
+// Wait for a line of input, reloading watched scripts while idle. Only a
+// terminal is waited on this way: a terminal delivers one line per read, so
+// stdin's buffer is empty whenever the prompt is shown.
+static void wait_for_input(int continuation) {
+    if (watch_fd < 0) return;
+    if (!isatty(STDIN_FILENO)) {
+        process_watch_events();
+        return;
+    }
+    
+    while (1) {
+        struct pollfd fds[2] = {
+            { STDIN_FILENO, POLLIN, 0 },
+            { watch_fd, POLLIN, 0 }
+        };
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        if (fds[1].revents & POLLIN) {
+            // Report over the prompt, then show it again
+            printf("\r");
+            process_watch_events();
+            if (continuation) print_normal("... ");
+            else print_prompt();
+            fflush(stdout);
+        }
+        if (fds[0].revents) return;
+    }
+}
+#else
+static void wait_for_input(int continuation) {
+    (void)continuation;
+}
+#endif
+
+// Parse and execute watch command: load a script and keep it up to date
+static void parse_watch_command(const char *line) {
+    char filename[256];
+    if (parse_command_filename("watch", line, filename) != 0) return;
+    
+#ifdef __linux__
+    for (int i = 0; i < watched_count; i++) {
+        if (strcmp(watched_scripts[i].path, filename) == 0) {
+            printf("Already watching %s\n", filename);
+            return;
+        }
+    }
+    if (watched_count == MAX_WATCHED_SCRIPTS) {
+        fprintf(stderr, "Error: Too many watched scripts (max %d)\n", MAX_WATCHED_SCRIPTS);
+        return;
+    }
+    if (watch_fd < 0) {
+        watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (watch_fd < 0) {
+            fprintf(stderr, "Error: Cannot watch files: %s\n", strerror(errno));
+            return;
+        }
+    }
+    
+    // Watch the directory, since editors often save by replacing the file
+    WatchedScript *script = &watched_scripts[watched_count];
+    memset(script, 0, sizeof(*script));
+    strcpy(script->path, filename);
+    char *slash = strrchr(script->path, '/');
+    char directory[256] = ".";
+    if (slash) {
+        size_t length = (size_t)(slash - script->path);
+        memcpy(directory, script->path, length ? length : 1);
+        directory[length ? length : 1] = '\0';
+        script->basename = slash + 1;
+    } else {
+        script->basename = script->path;
+    }
+    
+    if (reload_watched_script(script) != 0) {
+        free_watched_statements(script->statements, script->count);
+        return;
+    }
+    script->dir_watch = inotify_add_watch(watch_fd, directory, IN_CLOSE_WRITE | IN_MOVED_TO);
+    if (script->dir_watch < 0) {
+        fprintf(stderr, "Error: Cannot watch '%s': %s\n", directory, strerror(errno));
+        free_watched_statements(script->statements, script->count);
+        return;
+    }
+    watched_count++;
+    printf("Watching %s\n", filename);
+#else
+    fprintf(stderr, "Error: watch is not supported on this platform\n");
+#endif
+}
+
+static void free_watched_scripts(void) {
+    for (int i = 0; i < watched_count; i++) {
+        free_watched_statements(watched_scripts[i].statements, watched_scripts[i].count);
+    }
+    watched_count = 0;
+#ifdef __linux__
+    if (watch_fd >= 0) close(watch_fd);
+    watch_fd = -1;
+#endif
+}
+
+// Batch mode evaluates one or more output expressions per input row, with
+// each input column bound to a variable of the same name. Input and output are either text
+// (a header line of column names, then one row of numbers per line) or
+// RCOL binary columns. RCOL layout, all fields little-endian:
+//
+//   char     magic[4]                      "RCOL"
+//   uint32_t version                       1
+//   uint32_t col_count
+//   uint32_t reserved                      0
+//   uint64_t row_count
+//   char     names[col_count][32]          NUL-terminated
+//   double   data[col_count][row_count]    column-major, 8-byte aligned
+//
+// RCOL input is mmapped and evaluated straight out of the mapping.
+#define RCOL_MAGIC "RCOL"
+#define RCOL_VERSION 1
+#define RCOL_HEADER_SIZE 24
+#define RCOL_NAME_SIZE 32
+#define MAX_BATCH_COLUMNS 64
+#define MAX_BATCH_OUTPUTS 64
+
+typedef struct ColumnTable {
+    int col_count;
+    size_t row_count;
+    char names[MAX_BATCH_COLUMNS][RCOL_NAME_SIZE];
+    const double *columns[MAX_BATCH_COLUMNS];
+    unsigned char *mapping;   // Whole RCOL file, when input came from one
+    size_t mapping_size;
+    double *storage;          // Owned column data (text input or byte-swapped)
+} ColumnTable;
+
+typedef struct BatchOptions {
+    const char *expressions[MAX_BATCH_OUTPUTS];  // Each "name = expr" or "expr"
+    int expression_count;
+    const char *input_path;   // NULL reads text from stdin
+    const char *output_path;  // NULL writes to stdout
+    int binary_output;
+    int stream;               // Use the threaded reader/evaluator/writer pipeline
+    int thread_count;         // Evaluator threads (0 = auto)
+    const char *eval_path;    // Expression file: one expression per line
+    int timing;               // Report throughput on stderr
+    int on_error;             // ON_ERROR_* policy for rows that fail
+    int error_column;         // Append each row's CalcError code as a column
+} BatchOptions;
+
+enum { ON_ERROR_NAN, ON_ERROR_SKIP, ON_ERROR_ABORT };
+
+static void free_column_table(ColumnTable *table) {
+    unmap_file(table->mapping, table->mapping_size);
+    free(table->storage);
+    memset(table, 0, sizeof(*table));
+}
+
+// Column names must be usable as variable names in the batch expression
+static int is_valid_column_name(const char *name) {
+    if (!(isalpha((unsigned char)*name) || *name == '_')) return 0;
+    for (const char *p = name; *p; p++) {
+        if (!(isalnum((unsigned char)*p) || *p == '_')) return 0;
+    }
+    return strlen(name) < RCOL_NAME_SIZE;
+}
+
+static int load_rcol_table(const char *path, ColumnTable *table) {
+    size_t size = 0;
+    unsigned char *base = map_file(path, &size);
+    if (!base) {
+        fprintf(stderr, "Error: Cannot open file '%s'\n", path);
+        return -1;
+    }
+    table->mapping = base;
+    table->mapping_size = size;
+    
+    if (size < RCOL_HEADER_SIZE || memcmp(base, RCOL_MAGIC, 4) != 0 ||
+        read_le32(base + 4) != RCOL_VERSION) {
+        fprintf(stderr, "Error: '%s' is not an RCOL version %d file\n", path, RCOL_VERSION);
+        return -1;
+    }
+    
+    uint32_t col_count = read_le32(base + 8);
+    uint64_t row_count = read_le64(base + 16);
+    if (col_count == 0 || col_count > MAX_BATCH_COLUMNS) {
+        fprintf(stderr, "Error: '%s' has %u columns (expected 1 to %d)\n",
+                path, col_count, MAX_BATCH_COLUMNS);
+        return -1;
+    }
+    
+    size_t data_offset = RCOL_HEADER_SIZE + (size_t)col_count * RCOL_NAME_SIZE;
+    if (size < data_offset || row_count > (size - data_offset) / sizeof(double) / col_count) {
+        fprintf(stderr, "Error: '%s' is truncated\n", path);
+        return -1;
+    }
+    
+    table->col_count = (int)col_count;
+    table->row_count = (size_t)row_count;
+    for (int c = 0; c < table->col_count; c++) {
+        const char *name = (const char *)base + RCOL_HEADER_SIZE + (size_t)c * RCOL_NAME_SIZE;
+        if (memchr(name, '\0', RCOL_NAME_SIZE) == NULL || !is_valid_column_name(name)) {
+            fprintf(stderr, "Error: '%s' has an invalid name for column %d\n", path, c + 1);
+            return -1;
+        }
+        strcpy(table->names[c], name);
+    }
+    
+    const unsigned char *data = base + data_offset;
+    if (host_is_little_endian()) {
+        // Zero-copy: columns point straight into the mapping
+        for (int c = 0; c < table->col_count; c++) {
+            table->columns[c] = (const double *)(data + (size_t)c * table->row_count * sizeof(double));
+        }
+        return 0;
+    }
+    
+    // Big-endian hosts need a byte-swapped copy
+    size_t value_count = (size_t)table->col_count * table->row_count;
+    table->storage = malloc((value_count ? value_count : 1) * sizeof(double));
+    if (!table->storage) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return -1;
+    }
+    for (size_t i = 0; i < value_count; i++) {
+        uint64_t bits = read_le64(data + i * sizeof(double));
+        memcpy(&table->storage[i], &bits, sizeof(double));
+    }
+    for (int c = 0; c < table->col_count; c++) {
+        table->columns[c] = table->storage + (size_t)c * table->row_count;
+    }
+    return 0;
+}
+
+// Split a header line into column names separated by commas or whitespace
+static int parse_column_header(char *line, ColumnTable *table) {
+    char *p = line;
+    table->col_count = 0;
+    
+    while (*p) {
+        while (*p && (isspace((unsigned char)*p) || *p == ',')) p++;
+        if (!*p) break;
+        
+        char *start = p;
+        while (*p && !isspace((unsigned char)*p) && *p != ',') p++;
+        if (*p) *p++ = '\0';
+        
+        if (table->col_count >= MAX_BATCH_COLUMNS) {
+            fprintf(stderr, "Error: Too many input columns (max %d)\n", MAX_BATCH_COLUMNS);
+            return -1;
+        }
+        if (!is_valid_column_name(start)) {
+            fprintf(stderr, "Error: Invalid column name '%s'\n", start);
+            return -1;
+        }
+        strcpy(table->names[table->col_count++], start);
+    }
+    
+    if (table->col_count == 0) {
+        fprintf(stderr, "Error: Missing column header\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Parse one row of numbers; returns the number of fields read
+static int parse_column_row(const char *line, double *values, int max_values) {
+    const char *p = line;
+    int count = 0;
+    
+    while (*p) {
+        while (*p && (isspace((unsigned char)*p) || *p == ',')) p++;
+        if (!*p) break;
+        
+        char *endptr;
+        double value = strtod(p, &endptr);
+        if (endptr == p || count >= max_values) return -1;
+        values[count++] = value;
+        p = endptr;
+        if (*p && !isspace((unsigned char)*p) && *p != ',') return -1;
+    }
+    return count;
+}
+
+static int load_text_table(FILE *fp, ColumnTable *table) {
+    char *line = NULL;
+    size_t line_capacity = 0;
+    int line_num = 0;
+    int have_header = 0;
+    double *rows = NULL;
+    size_t row_capacity = 0;
+    
+    while (getline(&line, &line_capacity, fp) != -1) {
+        line_num++;
+        
+        // Skip empty lines and comments
+        char *trimmed = line;
+        while (*trimmed && isspace((unsigned char)*trimmed)) trimmed++;
+        if (*trimmed == '\0' || *trimmed == '#') {
+            continue;
+        }
+        
+        if (!have_header) {
+            if (parse_column_header(trimmed, table) != 0) goto fail;
+            have_header = 1;
+            continue;
+        }
+        
+        if (table->row_count == row_capacity) {
+            size_t new_capacity = row_capacity ? row_capacity * 2 : 1024;
+            double *new_rows = realloc(rows, new_capacity * table->col_count * sizeof(double));
+            if (!new_rows) {
+                fprintf(stderr, "Error: Memory allocation failed at line %d\n", line_num);
+                goto fail;
+            }
+            rows = new_rows;
+            row_capacity = new_capacity;
+        }
+        
+        double *row = rows + table->row_count * table->col_count;
+        if (parse_column_row(trimmed, row, table->col_count) != table->col_count) {
+            fprintf(stderr, "Error: Line %d: expected %d numeric fields\n", line_num, table->col_count);
+            goto fail;
+        }
+        table->row_count++;
+    }
+    
+    if (!have_header) {
+        fprintf(stderr, "Error: Missing column header\n");
+        goto fail;
+    }
+    
+    // Transpose the rows into column-major storage
+    table->storage = malloc((table->row_count ? table->row_count : 1) * table->col_count * sizeof(double));
+    if (!table->storage) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        goto fail;
+    }
+    for (int c = 0; c < table->col_count; c++) {
+        double *column = table->storage + (size_t)c * table->row_count;
+        for (size_t r = 0; r < table->row_count; r++) {
+            column[r] = rows[r * table->col_count + c];
+        }
+        table->columns[c] = column;
+    }
+    
+    free(rows);
+    free(line);
+    return 0;
+    
+fail:
+    free(rows);
+    free(line);
+    return -1;
+}
+
+// Load batch input, detecting RCOL files by their magic number
+static int load_column_table(const char *path, ColumnTable *table) {
+    memset(table, 0, sizeof(*table));
+    
+    if (!path) {
+        return load_text_table(stdin, table);
+    }
+    
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        fprintf(stderr, "Error: Cannot open file '%s'\n", path);
+        return -1;
+    }
+    
+    // Only a seekable file can be RCOL, which is mapped; pipes are text
+    char magic[4];
+    int seekable = fseek(fp, 0, SEEK_SET) == 0;
+    int is_rcol = seekable && fread(magic, 1, 4, fp) == 4 && memcmp(magic, RCOL_MAGIC, 4) == 0;
+    if (is_rcol) {
+        fclose(fp);
+        return load_rcol_table(path, table);
+    }
+    
+    if (seekable) rewind(fp);
+    int status = load_text_table(fp, table);
+    fclose(fp);
+    return status;
+}
+
+// Write an RCOL header for the given columns
+static int write_rcol_header(FILE *fp, int col_count, const char (*names)[RCOL_NAME_SIZE], size_t count) {
+    unsigned char header[RCOL_HEADER_SIZE + (MAX_BATCH_OUTPUTS + 1) * RCOL_NAME_SIZE];
+    size_t header_size = RCOL_HEADER_SIZE + (size_t)col_count * RCOL_NAME_SIZE;
+    memset(header, 0, header_size);
+    memcpy(header, RCOL_MAGIC, 4);
+    write_le32(header + 4, RCOL_VERSION);
+    write_le32(header + 8, (uint32_t)col_count);
+    write_le64(header + 16, count);
+    for (int c = 0; c < col_count; c++) {
+        strncpy((char *)header + RCOL_HEADER_SIZE + (size_t)c * RCOL_NAME_SIZE, names[c], RCOL_NAME_SIZE - 1);
+    }
+    
+    return fwrite(header, 1, header_size, fp) == header_size ? 0 : -1;
+}
+
+// Append raw little-endian values to an RCOL column
+static int write_rcol_values(FILE *fp, const double *values, size_t count) {
+    if (host_is_little_endian()) {
+        return fwrite(values, sizeof(double), count, fp) == count ? 0 : -1;
+    }
+    
+    for (size_t i = 0; i < count; i++) {
+        unsigned char bytes[8];
+        uint64_t bits;
+        memcpy(&bits, &values[i], sizeof(double));
+        write_le64(bytes, bits);
+        if (fwrite(bytes, 1, 8, fp) != 8) return -1;
+    }
+    return 0;
+}
+
+// Append one column of row-major results to an RCOL column
+static int write_rcol_strided(FILE *fp, const double *results, size_t rows, int stride, int column) {
+    if (stride == 1) {
+        return write_rcol_values(fp, results, rows);
+    }
+    
+    double gather[1024];
+    for (size_t r = 0; r < rows; ) {
+        size_t n = rows - r < 1024 ? rows - r : 1024;
+        for (size_t i = 0; i < n; i++) {
+            gather[i] = results[(r + i) * stride + column];
+        }
+        if (write_rcol_values(fp, gather, n) != 0) return -1;
+        r += n;
+    }
+    return 0;
+}
+
+// Batch kernels
+//
+// All batch outputs are compiled together into one kernel: a DAG of unique
+// subexpressions, hash-consed so that a subtree or function call appearing
+// in several outputs (or repeatedly in one) is evaluated once per row. Input
+// columns resolve to row slots, global variables fold to constants and
+// built-ins bind to their implementations, so rows need no name lookups.
+//
+// Node ids are topologically ordered. Nodes needed on every row ("eager")
+// are evaluated straight through in id order; nodes reachable only through
+// an if() branch are evaluated on demand and memoized per row. A kernel is
+// immutable once compiled, so threads can share it with their own scratch.
+typedef enum {
+    KERNEL_CONST,
+    KERNEL_COLUMN,
+    KERNEL_NEG,
+    KERNEL_ADD,
+    KERNEL_SUB,
+    KERNEL_MUL,
+    KERNEL_DIV,
+    KERNEL_POW,
+    KERNEL_LT,
+    KERNEL_GT,
+    KERNEL_LE,
+    KERNEL_GE,
+    KERNEL_EQ,
+    KERNEL_NE,
+    KERNEL_BUILTIN,
+    KERNEL_USER
+} KernelOp;
+
+typedef struct KernelNode {
+    KernelOp op;
+    int arg_count;
+    int first_arg;             // Index of the first argument id in Kernel.args
+    double value;              // KERNEL_CONST
+    int column;                // KERNEL_COLUMN
+    const Builtin *builtin;    // KERNEL_BUILTIN
+    UserFunction *func;        // KERNEL_USER
+    int eager;
+} KernelNode;
+
+typedef struct Kernel {
+    KernelNode *nodes;
+    int node_count;
+    int node_capacity;
+    int *args;
+    int arg_count;
+    int arg_capacity;
+    int *buckets;              // Hash-consing table of node ids, -1 when empty
+    int bucket_count;
+    int *eager_order;
+    int eager_count;
+    int output_count;
+    int outputs[MAX_BATCH_OUTPUTS];
+    char output_names[MAX_BATCH_OUTPUTS + 1][RCOL_NAME_SIZE];  // Plus the error column
+} Kernel;
+
+typedef struct KernelScratch {
+    double *values;
+    size_t *stamps;            // Row at which each lazy node was last computed
+    size_t row;
+} KernelScratch;
+
+static Kernel* create_kernel(void) {
+    return memory_calloc(MEMORY_KERNEL, sizeof(Kernel));
+}
+
+static void free_kernel(Kernel *kernel) {
+    if (!kernel) return;
+    memory_free(MEMORY_KERNEL, kernel->nodes, kernel->node_capacity * sizeof(KernelNode));
+    memory_free(MEMORY_KERNEL, kernel->args, kernel->arg_capacity * sizeof(int));
+    memory_free(MEMORY_KERNEL, kernel->buckets, kernel->bucket_count * sizeof(int));
+    memory_free(MEMORY_KERNEL, kernel->eager_order, (kernel->node_count ? kernel->node_count : 1) * sizeof(int));
+    memory_free(MEMORY_KERNEL, kernel, sizeof(Kernel));
+}
+
+static uint64_t kernel_node_hash(const KernelNode *node, const int *args) {
+    uint64_t hash = 1469598103934665603ULL;
+    uint64_t bits;
+    memcpy(&bits, &node->value, sizeof(bits));
+    uint64_t fields[5] = {
+        (uint64_t)node->op, bits, (uint64_t)node->column,
+        (uint64_t)(uintptr_t)node->builtin, (uint64_t)(uintptr_t)node->func
+    };
+    for (int i = 0; i < 5; i++) {
+        hash = (hash ^ fields[i]) * 1099511628211ULL;
+    }
+    for (int i = 0; i < node->arg_count; i++) {
+        hash = (hash ^ (uint64_t)args[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+static int kernel_node_equal(const Kernel *kernel, const KernelNode *a, const KernelNode *b, const int *b_args) {
+    if (a->op != b->op || a->arg_count != b->arg_count || a->column != b->column ||
+        a->builtin != b->builtin || a->func != b->func ||
+        memcmp(&a->value, &b->value, sizeof(double)) != 0) {
+        return 0;
+    }
+    return a->arg_count == 0 || memcmp(kernel->args + a->first_arg, b_args, a->arg_count * sizeof(int)) == 0;
+}
+
+static int kernel_grow_buckets(Kernel *kernel) {
+    int bucket_count = kernel->bucket_count ? kernel->bucket_count * 2 : 64;
+    int *buckets = memory_alloc(MEMORY_KERNEL, bucket_count * sizeof(int));
+    if (!buckets) return -1;
+    for (int i = 0; i < bucket_count; i++) buckets[i] = -1;
+    
+    for (int id = 0; id < kernel->node_count; id++) {
+        const KernelNode *node = &kernel->nodes[id];
+        size_t slot = kernel_node_hash(node, kernel->args + node->first_arg) & (bucket_count - 1);
+        while (buckets[slot] != -1) slot = (slot + 1) & (bucket_count - 1);
+        buckets[slot] = id;
+    }
+    
+    memory_free(MEMORY_KERNEL, kernel->buckets, kernel->bucket_count * sizeof(int));
+    kernel->buckets = buckets;
+    kernel->bucket_count = bucket_count;
+    return 0;
+}
+
+// Apply a node's operation to evaluated arguments
+static double kernel_apply(const KernelNode *node, const double *args) {
+    switch (node->op) {
+        case KERNEL_CONST: return node->value;
+        case KERNEL_NEG: return -args[0];
+        case KERNEL_ADD: return args[0] + args[1];
+        case KERNEL_SUB: return args[0] - args[1];
+        case KERNEL_MUL: return args[0] * args[1];
+        case KERNEL_DIV:
+            if (args[1] == 0.0) {
+                raise_eval_error(CALC_ERR_DIVISION_BY_ZERO, NULL, 0, 0);
+                return NAN;
+            }
+            return args[0] / args[1];
+        case KERNEL_POW: return pow(args[0], args[1]);
+        case KERNEL_LT: return args[0] < args[1] ? 1.0 : 0.0;
+        case KERNEL_GT: return args[0] > args[1] ? 1.0 : 0.0;
+        case KERNEL_LE: return args[0] <= args[1] ? 1.0 : 0.0;
+        case KERNEL_GE: return args[0] >= args[1] ? 1.0 : 0.0;
+        case KERNEL_EQ: return fabs(args[0] - args[1]) < 1e-10 ? 1.0 : 0.0;
+        case KERNEL_NE: return fabs(args[0] - args[1]) >= 1e-10 ? 1.0 : 0.0;
+        case KERNEL_BUILTIN: return apply_builtin(node->builtin, args);
+        case KERNEL_USER:
+            return evaluate_user_function(node->func, args, node->arg_count);
+        default:
+            return NAN;
+    }
+}
+
+static int kernel_is_if(const KernelNode *node) {
+    return node->op == KERNEL_BUILTIN && node->builtin->kind == BUILTIN_IF;
+}
+
+// Return the id of an equal node, adding it if new. Pure operations on
+// constant arguments fold to constants; if() with a constant condition
+// folds to the selected branch.
+static int kernel_intern(Kernel *kernel, KernelNode *node, const int *args) {
+    int all_const = 1;
+    for (int i = 0; i < node->arg_count; i++) {
+        if (kernel->nodes[args[i]].op != KERNEL_CONST) all_const = 0;
+    }
+    
+    if (kernel_is_if(node) && kernel->nodes[args[0]].op == KERNEL_CONST) {
+        return kernel->nodes[args[0]].value != 0.0 ? args[1] : args[2];
+    }
+    if (all_const && node->arg_count > 0 && node->op != KERNEL_USER && !kernel_is_if(node) &&
+        !(node->op == KERNEL_DIV && kernel->nodes[args[1]].value == 0.0)) {
+        double values[10];
+        for (int i = 0; i < node->arg_count; i++) values[i] = kernel->nodes[args[i]].value;
+        double folded = kernel_apply(node, values);
+        KernelNode constant;
+        memset(&constant, 0, sizeof(constant));
+        constant.op = KERNEL_CONST;
+        constant.value = folded;
+        return kernel_intern(kernel, &constant, NULL);
+    }
+    
+    if (kernel->node_count * 2 >= kernel->bucket_count && kernel_grow_buckets(kernel) != 0) return -1;
+    
+    size_t mask = kernel->bucket_count - 1;
+    size_t slot = kernel_node_hash(node, args) & mask;
+    while (kernel->buckets[slot] != -1) {
+        int id = kernel->buckets[slot];
+        if (kernel_node_equal(kernel, &kernel->nodes[id], node, args)) return id;
+        slot = (slot + 1) & mask;
+    }
+    
+    if (kernel->node_count == kernel->node_capacity) {
+        int capacity = kernel->node_capacity ? kernel->node_capacity * 2 : 64;
+        KernelNode *nodes = memory_realloc(MEMORY_KERNEL, kernel->nodes, kernel->node_capacity * sizeof(KernelNode),
+                                           capacity * sizeof(KernelNode));
+        if (!nodes) return -1;
+        kernel->nodes = nodes;
+        kernel->node_capacity = capacity;
+    }
+    if (kernel->arg_count + node->arg_count > kernel->arg_capacity) {
+        int capacity = kernel->arg_capacity ? kernel->arg_capacity * 2 : 128;
+        while (capacity < kernel->arg_count + node->arg_count) capacity *= 2;
+        int *new_args = memory_realloc(MEMORY_KERNEL, kernel->args, kernel->arg_capacity * sizeof(int),
+                                       capacity * sizeof(int));
+        if (!new_args) return -1;
+        kernel->args = new_args;
+        kernel->arg_capacity = capacity;
+    }
+    
+    node->first_arg = kernel->arg_count;
+    if (node->arg_count > 0) {
+        memcpy(kernel->args + kernel->arg_count, args, node->arg_count * sizeof(int));
+    }
+    kernel->arg_count += node->arg_count;
+    
+    int id = kernel->node_count++;
+    kernel->nodes[id] = *node;
+    kernel->buckets[slot] = id;
+    return id;
+}
+
+static int kernel_comparison_op(const char *comparison) {
+    if (strcmp(comparison, "<") == 0) return KERNEL_LT;
+    if (strcmp(comparison, ">") == 0) return KERNEL_GT;
+    if (strcmp(comparison, "<=") == 0) return KERNEL_LE;
+    if (strcmp(comparison, ">=") == 0) return KERNEL_GE;
+    if (strcmp(comparison, "==") == 0) return KERNEL_EQ;
+    return KERNEL_NE;
+}
+
+// Compile an AST into kernel nodes; returns the root id, or -1 on error
+static int kernel_add_ast(Kernel *kernel, ASTNode *ast, const ColumnTable *columns) {
+    KernelNode node;
+    memset(&node, 0, sizeof(node));
+    int args[10];
+    
+    switch (ast->type) {
+        case AST_NUMBER:
+            node.op = KERNEL_CONST;
+            node.value = ast->data.number;
+            break;
+            
+        case AST_VARIABLE: {
+            for (int c = 0; c < columns->col_count; c++) {
+                if (strcmp(columns->names[c], ast->data.variable) == 0) {
+                    node.op = KERNEL_COLUMN;
+                    node.column = c;
+                    return kernel_intern(kernel, &node, NULL);
+                }
+            }
+            Variable *var = lookup_variable(ast->data.variable);
+            if (!var) {
+                fprintf(stderr, "Error: Undefined variable '%s'\n", ast->data.variable);
+                return -1;
+            }
+            node.op = KERNEL_CONST;
+            node.value = var->value;
+            break;
+        }
+        
+        case AST_UNARY_OP:
+            args[0] = kernel_add_ast(kernel, ast->data.unary.operand, columns);
+            if (args[0] < 0) return -1;
+            if (ast->data.unary.op == '+') return args[0];
+            node.op = KERNEL_NEG;
+            node.arg_count = 1;
+            break;
+            
+        case AST_BINARY_OP:
+            args[0] = kernel_add_ast(kernel, ast->data.binary.left, columns);
+            args[1] = args[0] < 0 ? -1 : kernel_add_ast(kernel, ast->data.binary.right, columns);
+            if (args[1] < 0) return -1;
+            node.arg_count = 2;
+            if (ast->data.binary.comparison[0] != '\0') {
+                node.op = kernel_comparison_op(ast->data.binary.comparison);
+            } else {
+                switch (ast->data.binary.op) {
+                    case '+': node.op = KERNEL_ADD; break;
+                    case '-': node.op = KERNEL_SUB; break;
+                    case '*': node.op = KERNEL_MUL; break;
+                    case '/': node.op = KERNEL_DIV; break;
+                    default: node.op = KERNEL_POW; break;
+                }
+            }
+            break;
+            
+        case AST_FUNCTION_CALL: {
+            const char *name = ast->data.func_call.name;
+            int arg_count = ast->data.func_call.arg_count;
+            
+            // Built-ins take priority over user functions, as in evaluate_ast()
+            node.builtin = lookup_builtin(name);
+            if (node.builtin) {
+                node.op = KERNEL_BUILTIN;
+                if (arg_count != builtin_arity(node.builtin)) {
+                    fprintf(stderr, "Error: %s() requires %d argument%s\n", name,
+                            builtin_arity(node.builtin), builtin_arity(node.builtin) == 1 ? "" : "s");
+                    return -1;
+                }
+            } else {
+                node.func = lookup_user_function(name);
+                if (!node.func) {
+                    fprintf(stderr, "Error: Unknown function '%s'\n", name);
+                    return -1;
+                }
+                node.op = KERNEL_USER;
+                if (arg_count != node.func->param_count) {
+                    fprintf(stderr, "Error: Function '%s' expects %d arguments, got %d\n",
+                            name, node.func->param_count, arg_count);
+                    return -1;
+                }
+            }
+            
+            for (int i = 0; i < arg_count; i++) {
+                args[i] = kernel_add_ast(kernel, ast->data.func_call.args[i], columns);
+                if (args[i] < 0) return -1;
+            }
+            node.arg_count = arg_count;
+            break;
+        }
+        
+        default:
+            return -1;
+    }
+    
+    int id = kernel_intern(kernel, &node, args);
+    if (id < 0) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+    }
+    return id;
+}
+
+// Mark the nodes every row needs; if() branches stay lazy
+static void kernel_mark_eager(Kernel *kernel, int id) {
+    KernelNode *node = &kernel->nodes[id];
+    if (node->eager) return;
+    node->eager = 1;
+    
+    int arg_count = kernel_is_if(node) ? 1 : node->arg_count;
+    for (int i = 0; i < arg_count; i++) {
+        kernel_mark_eager(kernel, kernel->args[node->first_arg + i]);
+    }
+}
+
+static int kernel_finish(Kernel *kernel) {
+    for (int i = 0; i < kernel->output_count; i++) {
+        kernel_mark_eager(kernel, kernel->outputs[i]);
+    }
+    
+    kernel->eager_order = memory_alloc(MEMORY_KERNEL, (kernel->node_count ? kernel->node_count : 1) * sizeof(int));
+    if (!kernel->eager_order) return -1;
+    for (int id = 0; id < kernel->node_count; id++) {
+        if (kernel->nodes[id].eager) {
+            kernel->eager_order[kernel->eager_count++] = id;
+        }
+    }
+    return 0;
+}
+
+static int kernel_scratch_init(KernelScratch *scratch, const Kernel *kernel) {
+    size_t count = kernel->node_count ? kernel->node_count : 1;
+    scratch->values = malloc(count * sizeof(double));
+    scratch->stamps = calloc(count, sizeof(size_t));
+    scratch->row = 0;
+    if (!scratch->values || !scratch->stamps) {
+        free(scratch->values);
+        free(scratch->stamps);
+        return -1;
+    }
+    
+    // Constants never change, so load them once
+    for (int id = 0; id < kernel->node_count; id++) {
+        if (kernel->nodes[id].op == KERNEL_CONST) {
+            scratch->values[id] = kernel->nodes[id].value;
+        }
+    }
+    return 0;
+}
+
+static void kernel_scratch_free(KernelScratch *scratch) {
+    free(scratch->values);
+    free(scratch->stamps);
+}
+
+static double kernel_eval_lazy(const Kernel *kernel, KernelScratch *scratch, const double *row, int id);
+
+static double kernel_eval_node(const Kernel *kernel, KernelScratch *scratch, const double *row, int id) {
+    const KernelNode *node = &kernel->nodes[id];
+    const int *arg_ids = kernel->args + node->first_arg;
+    
+    switch (node->op) {
+        case KERNEL_CONST: return node->value;
+        case KERNEL_COLUMN: return row[node->column];
+        default: break;
+    }
+    
+    if (kernel_is_if(node)) {
+        double condition = kernel_eval_lazy(kernel, scratch, row, arg_ids[0]);
+        return kernel_eval_lazy(kernel, scratch, row, arg_ids[condition != 0.0 ? 1 : 2]);
+    }
+    
+    double args[10];
+    for (int i = 0; i < node->arg_count; i++) {
+        args[i] = kernel_eval_lazy(kernel, scratch, row, arg_ids[i]);
+    }
+    return kernel_apply(node, args);
+}
+
+// Evaluated eager nodes are read directly; lazy ones are memoized per row
+static double kernel_eval_lazy(const Kernel *kernel, KernelScratch *scratch, const double *row, int id) {
+    if (kernel->nodes[id].eager || kernel->nodes[id].op == KERNEL_CONST) {
+        return scratch->values[id];
+    }
+    if (scratch->stamps[id] != scratch->row) {
+        scratch->values[id] = kernel_eval_node(kernel, scratch, row, id);
+        scratch->stamps[id] = scratch->row;
+    }
+    return scratch->values[id];
+}
+
+// Evaluate all outputs for one input row; returns the row's first error
+static CalcError kernel_evaluate_row(const Kernel *kernel, KernelScratch *scratch, const double *row, double *results) {
+    clear_eval_error();
+    scratch->row++;
+    for (int i = 0; i < kernel->eager_count; i++) {
+        int id = kernel->eager_order[i];
+        scratch->values[id] = kernel_eval_node(kernel, scratch, row, id);
+    }
+    for (int i = 0; i < kernel->output_count; i++) {
+        results[i] = scratch->values[kernel->outputs[i]];
+    }
+    return eval_error.code;
+}
+
+// Parse the --batch expressions, each "name = expr" or a bare expression
+static int parse_batch_outputs(const BatchOptions *opts, Kernel *kernel, ASTNode **asts) {
+    for (int i = 0; i < opts->expression_count; i++) {
+        const char *expression = opts->expressions[i];
+        expr_pos = expression;
+        get_next_token();
+        
+        char *name = kernel->output_names[i];
+        if (opts->expression_count == 1) {
+            strcpy(name, "result");
+        } else {
+            snprintf(name, RCOL_NAME_SIZE, "result%d", i + 1);
+        }
+        
+        if (current_token.type == CALC_TOKEN_IDENTIFIER) {
+            const char *saved_pos = expr_pos;
+            Token saved_token = current_token;
+            get_next_token();
+            if (current_token.type == CALC_TOKEN_ASSIGN) {
+                strcpy(name, saved_token.name);
+                get_next_token();
+            } else {
+                expr_pos = saved_pos;
+                current_token = saved_token;
+            }
+        }
+        
+        for (int j = 0; j < i; j++) {
+            if (strcmp(kernel->output_names[j], name) == 0) {
+                fprintf(stderr, "Error: Duplicate batch output '%s'\n", name);
+                return -1;
+            }
+        }
+        
+        asts[i] = parse_expression_ast();
+        kernel->output_count = i + 1;
+        if (!asts[i] || (current_token.type != CALC_TOKEN_END && current_token.type != CALC_TOKEN_SEMICOLON)) {
+            fprintf(stderr, "Error: Invalid batch expression '%s'\n", expression);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Compile parsed batch outputs against the input columns, freeing the ASTs
+static int compile_batch_kernel(Kernel *kernel, ASTNode **asts, const ColumnTable *columns) {
+    int status = 0;
+    for (int i = 0; i < kernel->output_count; i++) {
+        if (status == 0) {
+            kernel->outputs[i] = kernel_add_ast(kernel, asts[i], columns);
+            if (kernel->outputs[i] < 0) status = -1;
+        }
+        free_ast(asts[i]);
+        asts[i] = NULL;
+    }
+    if (status == 0 && kernel_finish(kernel) != 0) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        status = -1;
+    }
+    return status;
+}
+
+static void free_batch_asts(ASTNode **asts, int count) {
+    for (int i = 0; i < count; i++) {
+        free_ast(asts[i]);
+        asts[i] = NULL;
+    }
+}
+
+// Result rows hold each output, then the error code when --error-column is set
+static int batch_row_width(const BatchOptions *opts, Kernel *kernel) {
+    if (opts->error_column) {
+        strcpy(kernel->output_names[kernel->output_count], "error");
+        return kernel->output_count + 1;
+    }
+    return kernel->output_count;
+}
+
+// Evaluate one row into out[0..width); returns the row's error code
+static CalcError evaluate_batch_row(const BatchOptions *opts, const Kernel *kernel, KernelScratch *scratch,
+                                    const double *row, double *out) {
+    CalcError code = kernel_evaluate_row(kernel, scratch, row, out);
+    if (opts->error_column) {
+        out[kernel->output_count] = (double)code;
+    }
+    return code;
+}
+
+// Apply the --on-error policy to evaluated rows, in input order. Failed rows
+// are counted by kind; with nan their outputs become nan, and with skip they
+// are dropped by compacting the results in place. Returns -1 to abort, else 0 with the surviving row count in *kept.
+static int apply_error_policy(const BatchOptions *opts, double *results, const unsigned char *errors,
+                              size_t rows, int width, size_t first_row, size_t *error_counts, size_t *kept) {
+    int output_count = opts->error_column ? width - 1 : width;
+    *kept = 0;
+    for (size_t r = 0; r < rows; r++) {
+        if (errors[r] != CALC_OK) {
+            error_counts[errors[r]]++;
+            if (opts->on_error == ON_ERROR_ABORT) {
+                fprintf(stderr, "Error: Row %zu: %s\n", first_row + r + 1, calc_error_names[errors[r]]);
+                return -1;
+            }
+            if (opts->on_error == ON_ERROR_SKIP) {
+                continue;
+            }
+            // Every output of a failed row is nan, even ones that computed
+            for (int i = 0; i < output_count; i++) {
+                results[r * width + i] = NAN;
+            }
+        }
+        if (*kept != r) {
+            memmove(results + *kept * width, results + r * width, width * sizeof(double));
+        }
+        (*kept)++;
+    }
+    return 0;
+}
+
+// One stderr line with the number of failed rows per error kind
+static void print_error_summary(const char *what, const size_t *error_counts) {
+    size_t total = 0;
+    for (int i = 1; i < CALC_ERR_COUNT; i++) total += error_counts[i];
+    if (total == 0) return;
+    
+    fprintf(stderr, "%s failed: %zu (", what, total);
+    const char *separator = "";
+    for (int i = 1; i < CALC_ERR_COUNT; i++) {
+        if (error_counts[i] > 0) {
+            fprintf(stderr, "%s%s=%zu", separator, calc_error_names[i], error_counts[i]);
+            separator = ", ";
+        }
+    }
+    fprintf(stderr, ")\n");
+}
+
+// Text output is one value per line for a single column, or a header line
+// and comma-separated rows (readable as batch input) for several
+static int write_text_header(FILE *fp, int width, const char (*names)[RCOL_NAME_SIZE]) {
+    if (width == 1) return 0;
+    for (int i = 0; i < width; i++) {
+        if (fprintf(fp, i ? ",%s" : "%s", names[i]) < 0) return -1;
+    }
+    return fputc('\n', fp) == EOF ? -1 : 0;
+}
+
+static int write_text_rows(FILE *fp, const double *results, size_t rows, int width) {
+    for (size_t r = 0; r < rows; r++) {
+        for (int i = 0; i < width; i++) {
+            if (fprintf(fp, i ? ",%.10g" : "%.10g", results[r * width + i]) < 0) return -1;
+        }
+        if (fputc('\n', fp) == EOF) return -1;
+    }
+    return 0;
+}
+
+static int write_batch_results(const BatchOptions *opts, int width, const char (*names)[RCOL_NAME_SIZE],
+                               const double *results, size_t count) {
+    FILE *fp = stdout;
+    if (opts->output_path) {
+        fp = fopen(opts->output_path, opts->binary_output ? "wb" : "w");
+        if (!fp) {
+            fprintf(stderr, "Error: Cannot create file '%s'\n", opts->output_path);
+            return -1;
+        }
+    }
+    
+    int status = 0;
+    if (opts->binary_output) {
+        status = write_rcol_header(fp, width, names, count);
+        for (int i = 0; i < width && status == 0; i++) {
+            status = write_rcol_strided(fp, results, count, width, i);
+        }
+    } else {
+        status = write_text_header(fp, width, names);
+        if (status == 0) status = write_text_rows(fp, results, count, width);
+    }
+    
+    if (fflush(fp) != 0) status = -1;
+    if (opts->output_path && fclose(fp) != 0) status = -1;
+    if (status != 0) {
+        fprintf(stderr, "Error: Failed to write batch results\n");
+    }
+    return status;
+}
+
+// Evaluate the batch kernel once per input row
+static int run_batch(const BatchOptions *opts) {
+    // Parse the outputs before reading any input
+    Kernel *kernel = create_kernel();
+    ASTNode *asts[MAX_BATCH_OUTPUTS] = {0};
+    if (!kernel) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return -1;
+    }
+    if (parse_batch_outputs(opts, kernel, asts) != 0) {
+        free_batch_asts(asts, kernel->output_count);
+        free_kernel(kernel);
+        return -1;
+    }
+    
+    ColumnTable table;
+    if (load_column_table(opts->input_path, &table) != 0 ||
+        compile_batch_kernel(kernel, asts, &table) != 0) {
+        free_batch_asts(asts, kernel->output_count);
+        free_column_table(&table);
+        free_kernel(kernel);
+        return -1;
+    }
+    
+    KernelScratch scratch;
+    size_t rows = table.row_count;
+    int width = batch_row_width(opts, kernel);
+    double *results = malloc((rows ? rows : 1) * width * sizeof(double));
+    unsigned char *errors = malloc(rows ? rows : 1);
+    if (!results || !errors || kernel_scratch_init(&scratch, kernel) != 0) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        free(results);
+        free(errors);
+        free_column_table(&table);
+        free_kernel(kernel);
+        return -1;
+    }
+    
+    double row[MAX_BATCH_COLUMNS];
+    size_t evaluated = 0;
+    while (evaluated < rows) {
+        size_t r = evaluated++;
+        for (int c = 0; c < table.col_count; c++) {
+            row[c] = table.columns[c][r];
+        }
+        errors[r] = (unsigned char)evaluate_batch_row(opts, kernel, &scratch, row, results + r * width);
+        if (errors[r] != CALC_OK && opts->on_error == ON_ERROR_ABORT) break;
+    }
+    
+    size_t error_counts[CALC_ERR_COUNT] = {0};
+    size_t kept = 0;
+    int status = apply_error_policy(opts, results, errors, evaluated, width, 0, error_counts, &kept);
+    if (status == 0) {
+        status = write_batch_results(opts, width, kernel->output_names, results, kept);
+    }
+    print_error_summary("Rows", error_counts);
+    
+    kernel_scratch_free(&scratch);
+    free(results);
+    free(errors);
+    free_column_table(&table);
+    free_kernel(kernel);
+    return status;
+}
+
+// Streaming batch pipeline
+//
+// Streaming mode overlaps I/O and evaluation with three stages: a reader
+// thread splits and parses text rows into blocks, evaluator threads run the
+// parsed expression over whole blocks, and a writer thread formats results
+// in input order. Stages hand blocks around a fixed ring of slots, so memory
+// stays bounded and a slow stage applies back-pressure to the ones before it.
+//
+// Each slot carries an atomic stamp of (sequence * 4 + state). The reader
+// waits for (seq, FREE), evaluators claim sequence numbers with a fetch-add
+// and wait for (seq, FILLED), and the writer waits for (seq, DONE) before
+// releasing the slot as (seq + STREAM_RING_SLOTS, FREE). No locks are taken.
+#ifndef _WIN32
+#define STREAM_BLOCK_ROWS 4096
+#define STREAM_RING_SLOTS 16
+
+enum { BLOCK_FREE = 0, BLOCK_FILLED = 1, BLOCK_DONE = 2 };
+
+#define BLOCK_STAMP(seq, state) ((size_t)(seq) * 4 + (state))
+
+typedef struct RowBlock {
+    atomic_size_t stamp;
+    size_t row_count;
+    size_t first_row;         // Index of the block's first data row
+    double *values;           // Row-major, STREAM_BLOCK_ROWS * col_count
+    double *results;          // Row-major, STREAM_BLOCK_ROWS * row width
+    unsigned char errors[STREAM_BLOCK_ROWS];
+} RowBlock;
+
+typedef struct StreamPipeline {
+    RowBlock blocks[STREAM_RING_SLOTS];
+    atomic_size_t next_eval;    // Next sequence number for evaluators to claim
+    atomic_size_t block_total;  // Number of blocks, SIZE_MAX until input ends
+    atomic_int failed;
+    
+    FILE *in;
+    FILE *out;
+    int line_num;
+    ColumnTable header;         // Column names only; no data
+    Kernel *kernel;
+    rcalc_context *context;     // Function table for user functions in the kernel
+    const Variable *globals;    // Read-only fallback scope for evaluator threads
+    const BatchOptions *opts;
+    int width;                  // Results per row, including any error column
+    FILE *spill[MAX_BATCH_OUTPUTS + 1];  // Binary output columns after the first
+    size_t rows_read;
+    size_t rows_written;
+    size_t error_counts[CALC_ERR_COUNT];
+} StreamPipeline;
+
+// Spin briefly, then yield, then sleep while waiting on another stage
+static void ring_backoff(int *spins) {
+    if (*spins < 64) {
+        (*spins)++;
+    } else if (*spins < 128) {
+        (*spins)++;
+        sched_yield();
+    } else {
+        usleep(50);
+    }
+}
+
+// Wait for a ring slot to reach a stamp; returns 0 if the pipeline failed or
+// (when total is given) the stream ended before block seq existed
+static int ring_wait(atomic_size_t *stamp, size_t expected, atomic_int *failed,
+                     atomic_size_t *total, size_t seq) {
+    int spins = 0;
+    while (atomic_load_explicit(stamp, memory_order_acquire) != expected) {
+        if (atomic_load_explicit(failed, memory_order_relaxed)) return 0;
+        if (total && seq >= atomic_load_explicit(total, memory_order_acquire)) return 0;
+        ring_backoff(&spins);
+    }
+    return 1;
+}
+
+static void* stream_reader(void *arg) {
+    StreamPipeline *pipe = arg;
+    int col_count = pipe->header.col_count;
+    char *line = NULL;
+    size_t line_capacity = 0;
+    size_t seq = 0;
+    int at_eof = 0;
+    
+    while (!at_eof) {
+        RowBlock *block = &pipe->blocks[seq % STREAM_RING_SLOTS];
+        if (!ring_wait(&block->stamp, BLOCK_STAMP(seq, BLOCK_FREE), &pipe->failed, NULL, seq)) break;
+        
+        block->row_count = 0;
+        block->first_row = pipe->rows_read;
+        while (block->row_count < STREAM_BLOCK_ROWS) {
+            if (getline(&line, &line_capacity, pipe->in) == -1) {
+                at_eof = 1;
+                break;
+            }
+            pipe->line_num++;
+            
+            char *trimmed = line;
+            while (*trimmed && isspace((unsigned char)*trimmed)) trimmed++;
+            if (*trimmed == '\0' || *trimmed == '#') {
+                continue;
+            }
+            
+            double *row = block->values + block->row_count * col_count;
+            if (parse_column_row(trimmed, row, col_count) != col_count) {
+                fprintf(stderr, "Error: Line %d: expected %d numeric fields\n", pipe->line_num, col_count);
+                atomic_store(&pipe->failed, 1);
+                free(line);
+                return NULL;
+            }
+            block->row_count++;
+        }
+        
+        pipe->rows_read += block->row_count;
+        if (block->row_count == 0) break;
+        atomic_store_explicit(&block->stamp, BLOCK_STAMP(seq, BLOCK_FILLED), memory_order_release);
+        seq++;
+    }
+    
+    atomic_store_explicit(&pipe->block_total, seq, memory_order_release);
+    free(line);
+    return NULL;
+}
+
+static void* stream_evaluator(void *arg) {
+    StreamPipeline *pipe = arg;
+    const Kernel *kernel = pipe->kernel;
+    int col_count = pipe->header.col_count;
+    context = pipe->context;
+    shared_variables = pipe->globals;
+    
+    KernelScratch scratch;
+    if (kernel_scratch_init(&scratch, kernel) != 0) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        atomic_store(&pipe->failed, 1);
+        return NULL;
+    }
+    
+    while (1) {
+        size_t seq = atomic_fetch_add(&pipe->next_eval, 1);
+        RowBlock *block = &pipe->blocks[seq % STREAM_RING_SLOTS];
+        if (!ring_wait(&block->stamp, BLOCK_STAMP(seq, BLOCK_FILLED), &pipe->failed, &pipe->block_total, seq)) break;
+        
+        for (size_t r = 0; r < block->row_count; r++) {
+            block->errors[r] = (unsigned char)evaluate_batch_row(pipe->opts, kernel, &scratch,
+                                                                 block->values + r * col_count,
+                                                                 block->results + r * pipe->width);
+        }
+        
+        atomic_store_explicit(&block->stamp, BLOCK_STAMP(seq, BLOCK_DONE), memory_order_release);
+    }
+    
+    kernel_scratch_free(&scratch);
+    return NULL;
+}
+
+static void* stream_writer(void *arg) {
+    StreamPipeline *pipe = arg;
+    
+    for (size_t seq = 0; ; seq++) {
+        RowBlock *block = &pipe->blocks[seq % STREAM_RING_SLOTS];
+        if (!ring_wait(&block->stamp, BLOCK_STAMP(seq, BLOCK_DONE), &pipe->failed, &pipe->block_total, seq)) break;
+        
+        size_t kept = 0;
+        if (apply_error_policy(pipe->opts, block->results, block->errors, block->row_count, pipe->width,
+                               block->first_row, pipe->error_counts, &kept) != 0) {
+            atomic_store(&pipe->failed, 1);
+            break;
+        }
+        
+        int status = 0;
+        if (pipe->opts->binary_output) {
+            // The first column follows the header; the rest are appended at the end
+            for (int i = 0; i < pipe->width && status == 0; i++) {
+                status = write_rcol_strided(i == 0 ? pipe->out : pipe->spill[i], block->results,
+                                            kept, pipe->width, i);
+            }
+        } else {
+            status = write_text_rows(pipe->out, block->results, kept, pipe->width);
+        }
+        if (status != 0) {
+            fprintf(stderr, "Error: Failed to write batch results\n");
+            atomic_store(&pipe->failed, 1);
+            break;
+        }
+        pipe->rows_written += kept;
+        
+        atomic_store_explicit(&block->stamp, BLOCK_STAMP(seq + STREAM_RING_SLOTS, BLOCK_FREE),
+                              memory_order_release);
+    }
+    return NULL;
+}
+
+static int default_thread_count(void) {
+    // Leave room for the reader and writer stages
+    int cpus = online_cpu_count();
+    return cpus > 3 ? cpus - 2 : 1;
+}
+
+// Read the text header line, leaving the stream positioned at the first row
+static int read_stream_header(FILE *fp, ColumnTable *header, int *line_num) {
+    char *line = NULL;
+    size_t line_capacity = 0;
+    int status = -1;
+    
+    while (getline(&line, &line_capacity, fp) != -1) {
+        (*line_num)++;
+        char *trimmed = line;
+        while (*trimmed && isspace((unsigned char)*trimmed)) trimmed++;
+        if (*trimmed == '\0' || *trimmed == '#') {
+            continue;
+        }
+        status = parse_column_header(trimmed, header);
+        break;
+    }
+    
+    if (status != 0 && header->col_count == 0 && !ferror(fp)) {
+        fprintf(stderr, "Error: Missing column header\n");
+    }
+    free(line);
+    return status;
+}
+
+static int run_stream_pipeline(StreamPipeline *pipe, int thread_count) {
+    pthread_t reader, writer;
+    pthread_t *evaluators = malloc(thread_count * sizeof(pthread_t));
+    if (!evaluators) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return -1;
+    }
+    
+    int started = 0;
+    compile_user_functions();
+    int ok = pthread_create(&reader, NULL, stream_reader, pipe) == 0;
+    if (ok) ok = pthread_create(&writer, NULL, stream_writer, pipe) == 0;
+    while (ok && started < thread_count) {
+        if (pthread_create(&evaluators[started], NULL, stream_evaluator, pipe) != 0) {
+            break;
+        }
+        started++;
+    }
+    if (!ok || started == 0) {
+        fprintf(stderr, "Error: Failed to start pipeline threads\n");
+        atomic_store(&pipe->failed, 1);
+    }
+    
+    for (int i = 0; i < started; i++) {
+        pthread_join(evaluators[i], NULL);
+    }
+    if (ok) {
+        pthread_join(reader, NULL);
+        pthread_join(writer, NULL);
+    }
+    free(evaluators);
+    return atomic_load(&pipe->failed) ? -1 : 0;
+}
+
+// Append spilled binary columns to the output and patch in the row count
+static int finish_stream_output(StreamPipeline *pipe) {
+    char buffer[1 << 16];
+    for (int i = 1; i < pipe->width; i++) {
+        rewind(pipe->spill[i]);
+        size_t n;
+        while ((n = fread(buffer, 1, sizeof(buffer), pipe->spill[i])) > 0) {
+            if (fwrite(buffer, 1, n, pipe->out) != n) return -1;
+        }
+        if (ferror(pipe->spill[i])) return -1;
+    }
+    
+    unsigned char count[8];
+    write_le64(count, pipe->rows_written);
+    if (fseek(pipe->out, 16, SEEK_SET) != 0 || fwrite(count, 1, 8, pipe->out) != 8) return -1;
+    return 0;
+}
+
+// Evaluate the batch kernel over streamed text input
+static int run_stream(const BatchOptions *opts) {
+    FILE *in = stdin;
+    if (opts->input_path) {
+        in = fopen(opts->input_path, "rb");
+        if (!in) {
+            fprintf(stderr, "Error: Cannot open file '%s'\n", opts->input_path);
+            return -1;
+        }
+        // RCOL input is already mapped without parsing; nothing to stream
+        char magic[4];
+        int is_rcol = fread(magic, 1, 4, in) == 4 && memcmp(magic, RCOL_MAGIC, 4) == 0;
+        if (is_rcol) {
+            fclose(in);
+            return run_batch(opts);
+        }
+        rewind(in);
+    }
+    
+    if (opts->binary_output && !opts->output_path) {
+        fprintf(stderr, "Error: Streaming binary output requires --output FILE\n");
+        if (in != stdin) fclose(in);
+        return -1;
+    }
+    
+    StreamPipeline *pipe = calloc(1, sizeof(StreamPipeline));
+    ASTNode *asts[MAX_BATCH_OUTPUTS] = {0};
+    if (pipe) pipe->kernel = create_kernel();
+    if (!pipe || !pipe->kernel) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        if (pipe) free(pipe);
+        if (in != stdin) fclose(in);
+        return -1;
+    }
+    pipe->in = in;
+    pipe->opts = opts;
+    Kernel *kernel = pipe->kernel;
+    
+    int status = -1;
+    
+    // Compile once; evaluator threads share the kernel read-only
+    if (parse_batch_outputs(opts, kernel, asts) != 0 ||
+        read_stream_header(in, &pipe->header, &pipe->line_num) != 0 ||
+        compile_batch_kernel(kernel, asts, &pipe->header) != 0) {
+        goto done;
+    }
+    
+    pipe->width = batch_row_width(opts, kernel);
+    for (int i = 0; i < STREAM_RING_SLOTS; i++) {
+        atomic_init(&pipe->blocks[i].stamp, BLOCK_STAMP(i, BLOCK_FREE));
+        pipe->blocks[i].values = malloc(STREAM_BLOCK_ROWS * pipe->header.col_count * sizeof(double));
+        pipe->blocks[i].results = malloc(STREAM_BLOCK_ROWS * pipe->width * sizeof(double));
+        if (!pipe->blocks[i].values || !pipe->blocks[i].results) {
+            fprintf(stderr, "Error: Memory allocation failed\n");
+            goto done;
+        }
+    }
+    atomic_init(&pipe->next_eval, 0);
+    atomic_init(&pipe->block_total, SIZE_MAX);
+    atomic_init(&pipe->failed, 0);
+    pipe->context = context;
+    pipe->globals = variables;
+    
+    pipe->out = stdout;
+    if (opts->output_path) {
+        pipe->out = fopen(opts->output_path, opts->binary_output ? "wb" : "w");
+        if (!pipe->out) {
+            fprintf(stderr, "Error: Cannot create file '%s'\n", opts->output_path);
+            goto done;
+        }
+    }
+    setvbuf(pipe->out, NULL, _IOFBF, 1 << 16);
+    
+    // Binary columns after the first are spilled to temporary files, and the
+    // row count is patched in once the stream ends
+    int header_status = 0;
+    if (opts->binary_output) {
+        header_status = write_rcol_header(pipe->out, pipe->width, kernel->output_names, 0);
+        for (int i = 1; i < pipe->width && header_status == 0; i++) {
+            pipe->spill[i] = tmpfile();
+            if (!pipe->spill[i]) header_status = -1;
+        }
+    } else {
+        header_status = write_text_header(pipe->out, pipe->width, kernel->output_names);
+    }
+    if (header_status != 0) {
+        fprintf(stderr, "Error: Failed to write batch results\n");
+        goto done;
+    }
+    
+    int thread_count = opts->thread_count > 0 ? opts->thread_count : default_thread_count();
+    status = run_stream_pipeline(pipe, thread_count);
+    
+    if (status == 0 && opts->binary_output && finish_stream_output(pipe) != 0) {
+        fprintf(stderr, "Error: Failed to write batch results\n");
+        status = -1;
+    }
+    if (fflush(pipe->out) != 0) status = -1;
+    print_error_summary("Rows", pipe->error_counts);
+    
+done:
+    if (pipe->out && pipe->out != stdout) fclose(pipe->out);
+    if (in != stdin) fclose(in);
+    for (int i = 0; i <= MAX_BATCH_OUTPUTS; i++) {
+        if (pipe->spill[i]) fclose(pipe->spill[i]);
+    }
+    for (int i = 0; i < STREAM_RING_SLOTS; i++) {
+        free(pipe->blocks[i].values);
+        free(pipe->blocks[i].results);
+    }
+    free_batch_asts(asts, kernel->output_count);
+    free_kernel(kernel);
+    free(pipe);
+    return status;
+}
+#else
+// No pthreads: stream by loading the whole input and evaluating in place
+static int run_stream(const BatchOptions *opts) {
+    return run_batch(opts);
+}
+#endif
+
+// Sharded batches
+//
+// For jobs too large for one machine, a coordinator splits the text input
+// into shards of rows and hands them to worker processes: local copies of
+// rcalc (--workers N), or commands that run "rcalc --worker" elsewhere, such
+// as over ssh (--worker-command). Workers are driven through their stdin and
+// stdout, so anything that carries a byte stream will do as a transport.
+// The protocol is line-based text:
+//
+//   coordinator                         worker
+//   job 1
+//   batch EXPR      (one per output)
+//   columns NAME,NAME,...
+//   go                                  ready | failed MESSAGE
+//   shard ID LINES
+//   LINES input lines                   result ID ROWS
+//                                       ROWS lines of outputs, then error code
+//                                     | error ID LINE MESSAGE
+//
+// A shard carries its input lines as they were read, comments and blank
+// lines included, so an error can name the line in the input file.
+// Each worker has up to SHARD_WORKER_DEPTH shards in flight, so it can start
+// on the next one as soon as it has replied. Values travel as "%.17g", which
+// reads back exactly. A worker that exits, rejects the job, sends anything
+// unexpected or has work but sends nothing for --worker-timeout seconds is
+// dropped, and its shards go to the others; a shard is given up on once
+// SHARD_MAX_ATTEMPTS workers have failed on it. A malformed row
+// fails the whole job, since every worker would reject it. The coordinator
+// holds a bounded window of shards and writes results in input order,
+// applying the --on-error policy as it goes.
+#define SHARD_DEFAULT_ROWS 10000
+#define SHARD_MAX_ROWS (1 << 24)
+#define SHARD_DEFAULT_TIMEOUT 60.0    // Seconds a worker with work may stay silent
+#define MAX_SHARD_WORKERS 64
+#define MAX_SHARD_FORWARD 16
+
+typedef struct ShardOptions {
+    int local_count;                           // Local worker processes (--workers)
+    const char *commands[MAX_SHARD_WORKERS];   // --worker-command, each run by /bin/sh
+    int command_count;
+    long shard_rows;                           // Rows per shard (0 = default)
+    double timeout;                            // Seconds of silence before a worker is dropped (0 = default)
+    const char *self;                          // argv[0], to start local workers
+    const char *forward[MAX_SHARD_FORWARD];    // Options local workers are started with
+    int forward_count;
+    char **scripts;                            // Scripts local workers load
+    int script_count;
+} ShardOptions;
+
+// A whole number from 1 to max, as --workers and --shard-rows take
+static int parse_count_option(const char *text, long max, long *value) {
+    char *end;
+    errno = 0;
+    long parsed = strtol(text, &end, 10);
+    if (end == text || *end != '\0' || errno != 0 || parsed < 1 || parsed > max) return -1;
+    *value = parsed;
+    return 0;
+}
+
+// Pass a loading or limit option on to local workers as given
+static void forward_worker_option(ShardOptions *opts, char **option, int count) {
+    for (int i = 0; i < count && opts->forward_count < MAX_SHARD_FORWARD; i++) {
+        opts->forward[opts->forward_count++] = option[i];
+    }
+}
+
+#ifndef _WIN32
+#define SHARD_WORKER_DEPTH 2
+#define SHARD_MAX_ATTEMPTS 3
+#define SHARD_READ_SIZE 65536
+#define SHARD_EXIT_GRACE 1.0          // Seconds a finished worker gets to exit
+
+typedef struct Shard {
+    size_t id;
+    size_t first_row;          // Index of the shard's first data row
+    size_t row_count;
+    int first_line;            // Input line number of its first line
+    size_t line_count;
+    char *text;                // Input lines as sent
+    size_t text_length;
+    size_t text_capacity;
+    int attempts;              // Workers it has been sent to
+    int done;
+    size_t received;           // Result rows read so far
+    double *results;           // Row-major, row_count * width, once a reply starts
+    unsigned char *errors;
+} Shard;
+
+typedef struct ShardWorker {
+    const char *label;         // The command, or "local"
+    pid_t pid;
+    int to_fd;                 // The worker's stdin
+    int from_fd;               // The worker's stdout
+    int alive;
+    int ready;                 // Accepted the job
+    char *out;                 // Bytes not yet sent, from out_start
+    size_t out_start;
+    size_t out_length;
+    size_t out_capacity;
+    char *in;                  // Received bytes not yet handled
+    size_t in_length;
+    size_t in_capacity;
+    size_t inflight[SHARD_WORKER_DEPTH];  // Shard ids, oldest first
+    int inflight_count;
+    size_t shards_done;
+    size_t rows_done;
+    double started;            // When it accepted the job
+    double finished;           // When its last result arrived
+    double last_heard;         // When it last sent anything, or was given work while idle
+} ShardWorker;
+
+typedef struct ShardJob {
+    const BatchOptions *opts;
+    FILE *in;
+    FILE *out;
+    char *line;
+    size_t line_capacity;
+    int line_num;              // Input lines read so far
+    Kernel *kernel;
+    ColumnTable header;        // Column names only; no data
+    int width;                 // Results per row, including any error column
+    size_t shard_rows;
+    double timeout;
+    ShardWorker *workers;
+    int worker_count;
+    Shard *window;             // Shard id % window_size
+    size_t window_size;
+    size_t next_read;          // Id the next shard read from the input gets
+    size_t next_write;         // Id of the next shard to write out
+    size_t *retry;             // Ids of shards waiting for another worker
+    size_t retry_head;
+    size_t retry_count;
+    int input_done;
+    size_t rows_read;
+    size_t rows_written;
+    size_t retried;
+    size_t error_counts[CALC_ERR_COUNT];
+} ShardJob;
+
+static int set_close_on_exec(int fd) {
+    return fcntl(fd, F_SETFD, FD_CLOEXEC);
+}
+
+// Start one worker with pipes on its stdin and stdout. Every pipe is close-on-
+// exec, so a worker never holds another's pipes open.
+static int start_shard_worker(ShardWorker *worker, char *const *argv, const char *command) {
+    int to_child[2], from_child[2];
+    if (pipe(to_child) != 0) return -1;
+    if (pipe(from_child) != 0) {
+        close(to_child[0]);
+        close(to_child[1]);
+        return -1;
+    }
+    for (int i = 0; i < 2; i++) {
+        set_close_on_exec(to_child[i]);
+        set_close_on_exec(from_child[i]);
+    }
+    
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(to_child[0], STDIN_FILENO);
+        dup2(from_child[1], STDOUT_FILENO);
+        if (command) {
+            execl("/bin/sh", "sh", "-c", command, (char *)NULL);
+        } else {
+            execvp(argv[0], argv);
+        }
+        fprintf(stderr, "Error: Cannot start worker '%s'\n", command ? command : argv[0]);
+        _exit(127);
+    }
+    close(to_child[0]);
+    close(from_child[1]);
+    if (pid < 0) {
+        close(to_child[1]);
+        close(from_child[0]);
+        return -1;
+    }
+    
+    worker->pid = pid;
+    worker->to_fd = to_child[1];
+    worker->from_fd = from_child[0];
+    worker->alive = 1;
+    worker->last_heard = monotonic_seconds();
+    fcntl(worker->to_fd, F_SETFL, O_NONBLOCK);
+    fcntl(worker->from_fd, F_SETFL, O_NONBLOCK);
+    return 0;
+}
+
+// Queue bytes for a worker; they go out as its pipe has room
+static int shard_send(ShardWorker *worker, const char *data, size_t length) {
+    if (worker->out_start > 0) {
+        memmove(worker->out, worker->out + worker->out_start, worker->out_length - worker->out_start);
+        worker->out_length -= worker->out_start;
+        worker->out_start = 0;
+    }
+    if (worker->out_capacity - worker->out_length < length) {
+        size_t new_capacity = worker->out_capacity ? worker->out_capacity : 4096;
+        while (new_capacity - worker->out_length < length) new_capacity *= 2;
+        char *new_out = realloc(worker->out, new_capacity);
+        if (!new_out) return -1;
+        worker->out = new_out;
+        worker->out_capacity = new_capacity;
+    }
+    memcpy(worker->out + worker->out_length, data, length);
+    worker->out_length += length;
+    return 0;
+}
+
+static int send_shard_job(const ShardJob *job, ShardWorker *worker) {
+    char line[64 + RCOL_NAME_SIZE];
+    int status = shard_send(worker, "job 1\n", 6);
+    for (int i = 0; i < job->opts->expression_count && status == 0; i++) {
+        const char *expression = job->opts->expressions[i];
+        status = shard_send(worker, "batch ", 6);
+        if (status == 0) status = shard_send(worker, expression, strlen(expression));
+        if (status == 0) status = shard_send(worker, "\n", 1);
+    }
+    if (status == 0) status = shard_send(worker, "columns ", 8);
+    for (int i = 0; i < job->header.col_count && status == 0; i++) {
+        int length = snprintf(line, sizeof(line), i ? ",%s" : "%s", job->header.names[i]);
+        status = shard_send(worker, line, length);
+    }
+    if (status == 0) status = shard_send(worker, "\ngo\n", 4);
+    return status;
+}
+
+static Shard *shard_for_id(ShardJob *job, size_t id) {
+    return &job->window[id % job->window_size];
+}
+
+static void release_shard(Shard *shard) {
+    free(shard->results);
+    free(shard->errors);
+    shard->results = NULL;
+    shard->errors = NULL;
+    shard->received = 0;
+    shard->done = 0;
+}
+
+// Read up to shard_rows rows into the shard; returns the number read, or -1
+static long read_shard(ShardJob *job, Shard *shard) {
+    shard->row_count = 0;
+    shard->line_count = 0;
+    shard->text_length = 0;
+    shard->first_line = job->line_num + 1;
+    while (shard->row_count < job->shard_rows && shard->line_count < SHARD_MAX_ROWS &&
+           getline(&job->line, &job->line_capacity, job->in) != -1) {
+        job->line_num++;
+        char *trimmed = job->line;
+        while (*trimmed && isspace((unsigned char)*trimmed)) trimmed++;
+        if (*trimmed != '\0' && *trimmed != '#') {
+            shard->row_count++;
+        }
+        
+        size_t length = strcspn(trimmed, "\r\n");
+        if (shard->text_capacity - shard->text_length < length + 1) {
+            size_t new_capacity = shard->text_capacity ? shard->text_capacity : 4096;
+            while (new_capacity - shard->text_length < length + 1) new_capacity *= 2;
+            char *new_text = realloc(shard->text, new_capacity);
+            if (!new_text) {
+                fprintf(stderr, "Error: Memory allocation failed\n");
+                return -1;
+            }
+            shard->text = new_text;
+            shard->text_capacity = new_capacity;
+        }
+        memcpy(shard->text + shard->text_length, trimmed, length);
+        shard->text[shard->text_length + length] = '\n';
+        shard->text_length += length + 1;
+        shard->line_count++;
+    }
+    if (ferror(job->in)) {
+        fprintf(stderr, "Error: Failed to read batch input\n");
+        return -1;
+    }
+    return (long)shard->row_count;
+}
+
+// The next shard to hand out: a retry, or else a new one from the input.
+// Returns 1 with its id, 0 when there is none for now, or -1 on failure.
+static int next_shard(ShardJob *job, size_t *id) {
+    if (job->retry_count > 0) {
+        *id = job->retry[job->retry_head];
+        job->retry_head = (job->retry_head + 1) % job->window_size;
+        job->retry_count--;
+        return 1;
+    }
+    if (job->input_done || job->next_read - job->next_write == job->window_size) {
+        return 0;
+    }
+    
+    Shard *shard = shard_for_id(job, job->next_read);
+    long rows = read_shard(job, shard);
+    if (rows < 0) return -1;
+    if (rows == 0) {
+        job->input_done = 1;
+        return 0;
+    }
+    shard->id = job->next_read++;
+    shard->first_row = job->rows_read;
+    shard->attempts = 0;
+    job->rows_read += rows;
+    *id = shard->id;
+    return 1;
+}
+
+static int send_shard(ShardJob *job, ShardWorker *worker, size_t id) {
+    Shard *shard = shard_for_id(job, id);
+    char line[64];
+    int length = snprintf(line, sizeof(line), "shard %zu %zu\n", shard->id, shard->line_count);
+    if (shard_send(worker, line, length) != 0 || shard_send(worker, shard->text, shard->text_length) != 0) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return -1;
+    }
+    if (worker->inflight_count == 0) worker->last_heard = monotonic_seconds();
+    worker->inflight[worker->inflight_count++] = id;
+    shard->attempts++;
+    return 0;
+}
+
+// Drop a worker and queue its shards for the others
+static int drop_shard_worker(ShardJob *job, ShardWorker *worker, const char *reason) {
+    int index = (int)(worker - job->workers) + 1;
+    if (worker->inflight_count > 0) {
+        fprintf(stderr, "Error: Worker %d (%s) %s; retrying %d shard%s\n", index, worker->label, reason,
+                worker->inflight_count, worker->inflight_count == 1 ? "" : "s");
+    } else {
+        fprintf(stderr, "Error: Worker %d (%s) %s\n", index, worker->label, reason);
+    }
+    close(worker->to_fd);
+    close(worker->from_fd);
+    kill(worker->pid, SIGTERM);
+    worker->alive = 0;
+    
+    int status = 0;
+    for (int i = 0; i < worker->inflight_count; i++) {
+        Shard *shard = shard_for_id(job, worker->inflight[i]);
+        release_shard(shard);
+        if (shard->attempts >= SHARD_MAX_ATTEMPTS) {
+            fprintf(stderr, "Error: Rows %zu to %zu failed on %d workers\n", shard->first_row + 1,
+                    shard->first_row + shard->row_count, shard->attempts);
+            status = -1;
+        }
+        job->retry[(job->retry_head + job->retry_count++) % job->window_size] = shard->id;
+        job->retried++;
+    }
+    worker->inflight_count = 0;
+    return status;
+}
+
+// Write every finished shard at the front of the window, in order
+static int write_finished_shards(ShardJob *job) {
+    while (job->next_write < job->next_read) {
+        Shard *shard = shard_for_id(job, job->next_write);
+        if (!shard->done) break;
+        
+        size_t kept = 0;
+        if (apply_error_policy(job->opts, shard->results, shard->errors, shard->row_count, job->width,
+                               shard->first_row, job->error_counts, &kept) != 0) {
+            return -1;
+        }
+        if (write_text_rows(job->out, shard->results, kept, job->width) != 0) {
+            fprintf(stderr, "Error: Failed to write batch results\n");
+            return -1;
+        }
+        job->rows_written += kept;
+        release_shard(shard);
+        job->next_write++;
+    }
+    return 0;
+}
+
+static int receive_result_row(ShardJob *job, ShardWorker *worker, Shard *shard, const char *line) {
+    int output_count = job->kernel->output_count;
+    double values[MAX_BATCH_OUTPUTS + 1];
+    if (parse_column_row(line, values, output_count + 1) != output_count + 1) return -1;
+    double code = values[output_count];
+    if (!(code >= 0 && code < CALC_ERR_COUNT) || code != (int)code) return -1;
+    
+    size_t r = shard->received++;
+    memcpy(shard->results + r * job->width, values, job->width * sizeof(double));
+    shard->errors[r] = (unsigned char)code;
+    if (shard->received < shard->row_count) return 0;
+    
+    shard->done = 1;
+    worker->inflight_count--;
+    memmove(worker->inflight, worker->inflight + 1, worker->inflight_count * sizeof(size_t));
+    worker->shards_done++;
+    worker->rows_done += shard->row_count;
+    worker->finished = monotonic_seconds();
+    return write_finished_shards(job) == 0 ? 0 : -2;
+}
+
+// Handle one line from a worker. Returns 0 when fine, -1 when the worker
+// must be dropped (with *reason set), or -2 when the job cannot go on.
+static int handle_worker_line(ShardJob *job, ShardWorker *worker, char *line, const char **reason) {
+    Shard *shard = worker->inflight_count ? shard_for_id(job, worker->inflight[0]) : NULL;
+    *reason = "sent an unexpected reply";
+    if (shard && shard->results && shard->received < shard->row_count) {
+        int status = receive_result_row(job, worker, shard, line);
+        if (status == -1) *reason = "sent a malformed result";
+        return status;
+    }
+    if (!worker->ready) {
+        if (strcmp(line, "ready") == 0) {
+            worker->ready = 1;
+            worker->started = monotonic_seconds();
+            return 0;
+        }
+        if (strncmp(line, "failed", 6) == 0) *reason = "could not take the job";
+        return -1;
+    }
+    
+    size_t id, rows;
+    int consumed = 0;
+    if (shard && sscanf(line, "result %zu %zu", &id, &rows) == 2 && id == shard->id && rows == shard->row_count) {
+        shard->results = malloc(rows * job->width * sizeof(double));
+        shard->errors = malloc(rows);
+        if (!shard->results || !shard->errors) {
+            fprintf(stderr, "Error: Memory allocation failed\n");
+            return -2;
+        }
+        return 0;
+    }
+    if (shard && sscanf(line, "error %zu %zu %n", &id, &rows, &consumed) == 2 && consumed > 0 &&
+        id == shard->id && rows < shard->line_count) {
+        fprintf(stderr, "Error: Line %d: %s\n", shard->first_line + (int)rows, line + consumed);
+        return -2;
+    }
+    return -1;
+}
+
+// Read what a worker has sent and handle each complete line
+static int read_from_worker(ShardJob *job, ShardWorker *worker) {
+    if (worker->in_capacity - worker->in_length < SHARD_READ_SIZE) {
+        size_t new_capacity = worker->in_capacity ? worker->in_capacity * 2 : 2 * SHARD_READ_SIZE;
+        char *new_in = realloc(worker->in, new_capacity);
+        if (!new_in) {
+            fprintf(stderr, "Error: Memory allocation failed\n");
+            return -1;
+        }
+        worker->in = new_in;
+        worker->in_capacity = new_capacity;
+    }
+    
+    ssize_t n = read(worker->from_fd, worker->in + worker->in_length, worker->in_capacity - worker->in_length - 1);
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EINTR) return 0;
+        return drop_shard_worker(job, worker, "could not be read from");
+    }
+    if (n == 0) {
+        return drop_shard_worker(job, worker, "exited");
+    }
+    worker->in_length += (size_t)n;
+    worker->last_heard = monotonic_seconds();
+    
+    char *start = worker->in;
+    char *end = worker->in + worker->in_length;
+    char *newline;
+    while ((newline = memchr(start, '\n', end - start)) != NULL) {
+        *newline = '\0';
+        const char *reason;
+        int status = handle_worker_line(job, worker, start, &reason);
+        if (status == -2) return -1;
+        if (status == -1) return drop_shard_worker(job, worker, reason);
+        start = newline + 1;
+    }
+    worker->in_length = end - start;
+    memmove(worker->in, start, worker->in_length);
+    return 0;
+}
+
+static int write_to_worker(ShardJob *job, ShardWorker *worker) {
+    while (worker->out_start < worker->out_length) {
+        ssize_t n = write(worker->to_fd, worker->out + worker->out_start, worker->out_length - worker->out_start);
+        if (n < 0) {
+            if (errno == EAGAIN) return 0;
+            if (errno == EINTR) continue;
+            return drop_shard_worker(job, worker, "stopped reading");
+        }
+        worker->out_start += (size_t)n;
+    }
+    return 0;
+}
+
+// A worker owes a reply while it has not taken the job or has shards
+static int worker_owes_reply(const ShardWorker *worker) {
+    return worker->alive && (!worker->ready || worker->inflight_count > 0);
+}
+
+// Drop workers that owe a reply and have sent nothing for the timeout
+static int drop_silent_workers(ShardJob *job) {
+    double now = monotonic_seconds();
+    for (int i = 0; i < job->worker_count; i++) {
+        ShardWorker *worker = &job->workers[i];
+        if (worker_owes_reply(worker) && now - worker->last_heard >= job->timeout &&
+            drop_shard_worker(job, worker, "timed out") != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// How long poll() may wait before a silent worker is due to be dropped, in
+// milliseconds, or -1 when no worker owes a reply
+static int silent_worker_wait(const ShardJob *job) {
+    double now = monotonic_seconds();
+    int waiting = 0;
+    double wait = 0.0;
+    for (int i = 0; i < job->worker_count; i++) {
+        const ShardWorker *worker = &job->workers[i];
+        if (!worker_owes_reply(worker)) continue;
+        double left = worker->last_heard + job->timeout - now;
+        if (!waiting || left < wait) wait = left;
+        waiting = 1;
+    }
+    if (!waiting) return -1;
+    return wait > 0.0 ? (int)(wait * 1000.0) + 1 : 0;
+}
+
+// Hand out shards to every worker with room for one, then wait for pipes
+static int run_shard_loop(ShardJob *job) {
+    struct pollfd *fds = malloc(2 * job->worker_count * sizeof(struct pollfd));
+    ShardWorker **owners = malloc(2 * job->worker_count * sizeof(ShardWorker *));
+    int status = fds && owners ? 0 : -1;
+    if (status != 0) fprintf(stderr, "Error: Memory allocation failed\n");
+    
+    while (status == 0 && !(job->input_done && job->retry_count == 0 && job->next_write == job->next_read)) {
+        if (drop_silent_workers(job) != 0) {
+            status = -1;
+            break;
+        }
+        int alive = 0;
+        for (int i = 0; i < job->worker_count && status == 0; i++) {
+            ShardWorker *worker = &job->workers[i];
+            if (!worker->alive) continue;
+            alive++;
+            size_t id;
+            int found = 0;
+            while (worker->ready && worker->inflight_count < SHARD_WORKER_DEPTH &&
+                   (found = next_shard(job, &id)) == 1) {
+                if (send_shard(job, worker, id) != 0) found = -1;
+            }
+            if (found < 0) status = -1;
+        }
+        if (status != 0) break;
+        if (job->input_done && job->retry_count == 0 && job->next_write == job->next_read) break;
+        if (alive == 0) {
+            fprintf(stderr, "Error: No workers left to run the batch\n");
+            status = -1;
+            break;
+        }
+        
+        int count = 0;
+        for (int i = 0; i < job->worker_count; i++) {
+            ShardWorker *worker = &job->workers[i];
+            if (!worker->alive) continue;
+            fds[count].fd = worker->from_fd;
+            fds[count].events = POLLIN;
+            owners[count++] = worker;
+            if (worker->out_start < worker->out_length) {
+                fds[count].fd = worker->to_fd;
+                fds[count].events = POLLOUT;
+                owners[count++] = worker;
+            }
+        }
+        if (poll(fds, count, silent_worker_wait(job)) < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "Error: Failed to wait for workers\n");
+            status = -1;
+            break;
+        }
+        for (int i = 0; i < count && status == 0; i++) {
+            ShardWorker *worker = owners[i];
+            if (!fds[i].revents || !worker->alive) continue;
+            if (fds[i].fd == worker->to_fd) {
+                status = write_to_worker(job, worker);
+            } else {
+                status = read_from_worker(job, worker);
+            }
+        }
+    }
+    
+    free(fds);
+    free(owners);
+    return status;
+}
+
+static void print_worker_throughput(const ShardJob *job, double elapsed) {
+    fprintf(stderr, "Sharded %zu rows in %.3f s (%.0f rows/s, %d workers, %zu shards, %zu retried)\n",
+            job->rows_read, elapsed, elapsed > 0 ? job->rows_read / elapsed : 0.0, job->worker_count,
+            job->next_read, job->retried);
+    fprintf(stderr, "%-6s %8s %12s %12s  %-8s %s\n", "worker", "shards", "rows", "rows/s", "status", "command");
+    for (int i = 0; i < job->worker_count; i++) {
+        const ShardWorker *worker = &job->workers[i];
+        double busy = worker->finished - worker->started;
+        fprintf(stderr, "%-6d %8zu %12zu %12.0f  %-8s %s\n", i + 1, worker->shards_done, worker->rows_done,
+                busy > 0 ? worker->rows_done / busy : 0.0, worker->alive ? "ok" : "failed", worker->label);
+    }
+}
+
+// Closing a worker's stdin ends it. Workers are stopped when the job has
+// failed, when they never took the job, or when they are still running a
+// moment after their stdin closed.
+static void stop_shard_workers(ShardJob *job, int status) {
+    for (int i = 0; i < job->worker_count; i++) {
+        ShardWorker *worker = &job->workers[i];
+        if (!worker->alive) continue;
+        close(worker->to_fd);
+        close(worker->from_fd);
+        if (status != 0 || !worker->ready) kill(worker->pid, SIGTERM);
+    }
+    double deadline = monotonic_seconds() + SHARD_EXIT_GRACE;
+    for (int i = 0; i < job->worker_count; i++) {
+        pid_t pid = job->workers[i].pid;
+        if (pid <= 0) continue;
+        while (waitpid(pid, NULL, WNOHANG) == 0) {
+            if (monotonic_seconds() >= deadline) {
+                kill(pid, SIGTERM);
+                waitpid(pid, NULL, 0);
+                break;
+            }
+            usleep(1000);
+        }
+    }
+}
+
+// Evaluate the batch kernel over text input on worker processes
+static int run_sharded(const BatchOptions *opts, const ShardOptions *shard_opts) {
+    ShardJob job;
+    memset(&job, 0, sizeof(job));
+    job.opts = opts;
+    job.shard_rows = shard_opts->shard_rows > 0 ? (size_t)shard_opts->shard_rows : SHARD_DEFAULT_ROWS;
+    job.timeout = shard_opts->timeout > 0.0 ? shard_opts->timeout : SHARD_DEFAULT_TIMEOUT;
+    job.worker_count = shard_opts->local_count + shard_opts->command_count;
+    for (int i = 0; i < opts->expression_count; i++) {
+        if (strchr(opts->expressions[i], '\n')) {
+            fprintf(stderr, "Error: Sharded batch expressions must each fit on one line\n");
+            return -1;
+        }
+    }
+    
+    job.in = stdin;
+    if (opts->input_path) {
+        job.in = fopen(opts->input_path, "rb");
+        if (!job.in) {
+            fprintf(stderr, "Error: Cannot open file '%s'\n", opts->input_path);
+            return -1;
+        }
+        char magic[4];
+        int is_rcol = fread(magic, 1, 4, job.in) == 4 && memcmp(magic, RCOL_MAGIC, 4) == 0;
+        if (is_rcol) {
+            fprintf(stderr, "Error: Sharded batches take text input\n");
+            fclose(job.in);
+            return -1;
+        }
+        rewind(job.in);
+    }
+    
+    // Compile here first, so a bad expression is reported once rather than
+    // by every worker
+    int status = -1;
+    char **worker_argv = NULL;
+    ASTNode *asts[MAX_BATCH_OUTPUTS] = {0};
+    job.kernel = create_kernel();
+    if (!job.kernel) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        goto done;
+    }
+    if (parse_batch_outputs(opts, job.kernel, asts) != 0 ||
+        read_stream_header(job.in, &job.header, &job.line_num) != 0 ||
+        compile_batch_kernel(job.kernel, asts, &job.header) != 0) {
+        goto done;
+    }
+    job.width = batch_row_width(opts, job.kernel);
+    
+    job.window_size = (size_t)job.worker_count * SHARD_WORKER_DEPTH * 2;
+    job.window = calloc(job.window_size, sizeof(Shard));
+    job.retry = malloc(job.window_size * sizeof(size_t));
+    job.workers = calloc(job.worker_count, sizeof(ShardWorker));
+    worker_argv = malloc((shard_opts->forward_count + 2 * shard_opts->script_count + 3) * sizeof(char *));
+    if (!job.window || !job.retry || !job.workers || !worker_argv) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        goto done;
+    }
+    
+    job.out = stdout;
+    if (opts->output_path) {
+        job.out = fopen(opts->output_path, "w");
+        if (!job.out) {
+            fprintf(stderr, "Error: Cannot create file '%s'\n", opts->output_path);
+            goto done;
+        }
+    }
+    setvbuf(job.out, NULL, _IOFBF, 1 << 16);
+    if (write_text_header(job.out, job.width, job.kernel->output_names) != 0) {
+        fprintf(stderr, "Error: Failed to write batch results\n");
+        goto done;
+    }
+    
+    // Local workers are this rcalc with the same scripts and limits
+    int argc = 0;
+    worker_argv[argc++] = (char *)shard_opts->self;
+    worker_argv[argc++] = "--worker";
+    for (int i = 0; i < shard_opts->forward_count; i++) {
+        worker_argv[argc++] = (char *)shard_opts->forward[i];
+    }
+    for (int i = 0; i < shard_opts->script_count; i++) {
+        worker_argv[argc++] = "-l";
+        worker_argv[argc++] = shard_opts->scripts[i];
+    }
+    worker_argv[argc] = NULL;
+    
+    signal(SIGPIPE, SIG_IGN);
+    fflush(NULL);
+    double start = monotonic_seconds();
+    for (int i = 0; i < job.worker_count; i++) {
+        ShardWorker *worker = &job.workers[i];
+        const char *command = i < shard_opts->local_count ? NULL : shard_opts->commands[i - shard_opts->local_count];
+        worker->label = command ? command : "local";
+        if (start_shard_worker(worker, worker_argv, command) != 0) {
+            fprintf(stderr, "Error: Cannot start worker %d (%s)\n", i + 1, worker->label);
+        } else if (send_shard_job(&job, worker) != 0) {
+            drop_shard_worker(&job, worker, "could not be sent the job");
+        }
+    }
+    
+    status = run_shard_loop(&job);
+    if (fflush(job.out) != 0) {
+        fprintf(stderr, "Error: Failed to write batch results\n");
+        status = -1;
     }
     
+    stop_shard_workers(&job, status);
+    if (opts->timing) {
+        print_worker_throughput(&job, monotonic_seconds() - start);
+    }
+    print_error_summary("Rows", job.error_counts);
+    
+done:
+    if (job.out && job.out != stdout) fclose(job.out);
+    if (job.in != stdin) fclose(job.in);
+    for (size_t i = 0; job.window && i < job.window_size; i++) {
+        release_shard(&job.window[i]);
+        free(job.window[i].text);
+    }
+    for (int i = 0; job.workers && i < job.worker_count; i++) {
+        free(job.workers[i].out);
+        free(job.workers[i].in);
+    }
+    if (job.kernel) {
+        free_batch_asts(asts, job.kernel->output_count);
+        free_kernel(job.kernel);
+    }
+    free(job.window);
+    free(job.retry);
+    free(job.workers);
+    free(worker_argv);
+    free(job.line);
+    return status;
+}
+
+// Worker side of a sharded batch: take the job, then answer shards until
+// the coordinator closes stdin
+static int run_worker(void) {
+    BatchOptions opts;
+    memset(&opts, 0, sizeof(opts));
+    ColumnTable header;
+    memset(&header, 0, sizeof(header));
+    char *expressions[MAX_BATCH_OUTPUTS] = {0};
+    ASTNode *asts[MAX_BATCH_OUTPUTS] = {0};
+    Kernel *kernel = create_kernel();
+    KernelScratch scratch;
+    int have_scratch = 0;
+    double *values = NULL;
+    size_t values_rows = 0;
     char *line = NULL;
     size_t line_capacity = 0;
-    char *accumulated = malloc(4096);
-    size_t accumulated_capacity = 4096;
-    size_t accumulated_length = 0;
+    int status = -1;
+    setvbuf(stdout, NULL, _IOFBF, 1 << 16);
+    
+    if (!kernel) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        goto done;
+    }
+    if (getline(&line, &line_capacity, stdin) == -1 || strcmp(line, "job 1\n") != 0) {
+        fprintf(stderr, "Error: Expected a job from the coordinator\n");
+        goto done;
+    }
+    int ready = 0;
+    while (getline(&line, &line_capacity, stdin) != -1) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (strcmp(line, "go") == 0) {
+            ready = 1;
+            break;
+        }
+        if (strncmp(line, "batch ", 6) == 0 && opts.expression_count < MAX_BATCH_OUTPUTS) {
+            size_t length = strlen(line + 6) + 1;
+            char *expression = malloc(length);
+            if (!expression) break;
+            memcpy(expression, line + 6, length);
+            expressions[opts.expression_count] = expression;
+            opts.expressions[opts.expression_count++] = expression;
+        } else if (strncmp(line, "columns ", 8) != 0 || parse_column_header(line + 8, &header) != 0) {
+            break;
+        }
+    }
+    
+    ready = ready && opts.expression_count > 0 && header.col_count > 0 &&
+            parse_batch_outputs(&opts, kernel, asts) == 0 && compile_batch_kernel(kernel, asts, &header) == 0;
+    if (ready) {
+        have_scratch = kernel_scratch_init(&scratch, kernel) == 0;
+        ready = have_scratch;
+    }
+    printf(ready ? "ready\n" : "failed Cannot compile the job\n");
+    if (fflush(stdout) != 0 || !ready) goto done;
+    
+    int col_count = header.col_count;
+    double results[MAX_BATCH_OUTPUTS];
+    while (getline(&line, &line_capacity, stdin) != -1) {
+        size_t id, lines;
+        if (sscanf(line, "shard %zu %zu", &id, &lines) != 2 || lines == 0 || lines > SHARD_MAX_ROWS) {
+            fprintf(stderr, "Error: Unexpected message from the coordinator\n");
+            goto done;
+        }
+        if (lines > values_rows) {
+            double *new_values = realloc(values, lines * col_count * sizeof(double));
+            if (!new_values) {
+                fprintf(stderr, "Error: Memory allocation failed\n");
+                goto done;
+            }
+            values = new_values;
+            values_rows = lines;
+        }
+        
+        // Read the whole shard before replying, so a bad row can fail it
+        size_t rows = 0;
+        size_t bad_line = SIZE_MAX;
+        for (size_t l = 0; l < lines; l++) {
+            if (getline(&line, &line_capacity, stdin) == -1) {
+                fprintf(stderr, "Error: Shard %zu ended early\n", id);
+                goto done;
+            }
+            char *trimmed = line;
+            while (*trimmed && isspace((unsigned char)*trimmed)) trimmed++;
+            if (*trimmed == '\0' || *trimmed == '#' || bad_line != SIZE_MAX) {
+                continue;
+            }
+            if (parse_column_row(trimmed, values + rows * col_count, col_count) != col_count) {
+                bad_line = l;
+            }
+            rows++;
+        }
+        if (bad_line != SIZE_MAX) {
+            printf("error %zu %zu expected %d numeric fields\n", id, bad_line, col_count);
+        } else {
+            printf("result %zu %zu\n", id, rows);
+            for (size_t r = 0; r < rows; r++) {
+                CalcError code = kernel_evaluate_row(kernel, &scratch, values + r * col_count, results);
+                for (int i = 0; i < kernel->output_count; i++) {
+                    printf("%.17g,", results[i]);
+                }
+                printf("%d\n", (int)code);
+            }
+        }
+        if (fflush(stdout) != 0) goto done;
+    }
+    status = 0;
+    
+done:
+    if (have_scratch) kernel_scratch_free(&scratch);
+    if (kernel) {
+        free_batch_asts(asts, kernel->output_count);
+        free_kernel(kernel);
+    }
+    for (int i = 0; i < opts.expression_count; i++) {
+        free(expressions[i]);
+    }
+    free(values);
+    free(line);
+    return status;
+}
+#else
+static int run_sharded(const BatchOptions *opts, const ShardOptions *shard_opts) {
+    (void)opts;
+    (void)shard_opts;
+    fprintf(stderr, "Error: --workers and --worker-command are not supported on this platform\n");
+    return -1;
+}
+
+static int run_worker(void) {
+    fprintf(stderr, "Error: --worker is not supported on this platform\n");
+    return -1;
+}
+#endif
+
+// Expression files
+//
+// An expression file holds one independent expression per line, evaluated
+// against the loaded scripts with one result printed per expression line.
+// The file is mmapped and split into fixed-size byte ranges that worker
+// threads claim in order. Each worker has its own parser state and a fresh
+// local scope per line over the read-only globals; function definitions are
+// rejected since the function table is shared. Results return through a ring
+// of chunk slots using the same stamp protocol as the streaming pipeline, so
+// output stays in input order and buffered output stays bounded.
+#define EXPR_CHUNK_BYTES (64 * 1024)
+
+typedef struct OutputBuffer {
+    char *data;
+    size_t length;
+    size_t capacity;
+} OutputBuffer;
+
+static int output_append_result(OutputBuffer *buffer, double value) {
+    if (buffer->capacity - buffer->length < 32) {
+        size_t new_capacity = buffer->capacity ? buffer->capacity * 2 : 4096;
+        char *new_data = realloc(buffer->data, new_capacity);
+        if (!new_data) return -1;
+        buffer->data = new_data;
+        buffer->capacity = new_capacity;
+    }
+    buffer->length += snprintf(buffer->data + buffer->length, buffer->capacity - buffer->length,
+                               "%.10g\n", value);
+    return 0;
+}
+
+// Evaluate the lines that start within [start, end) of an expression file.
+// lines_before is the number of lines that end before start, for messages.
+// line_buffer holds a NUL-terminated copy of the current line for the parser.
+static int evaluate_expression_range(const unsigned char *data, size_t size, size_t start, size_t end,
+                                     int lines_before, OutputBuffer *output, size_t *expr_count,
+                                     size_t *error_counts, char **line_buffer, size_t *line_capacity) {
+    size_t pos = start;
+    int line_num = lines_before;
+    
+    // A line straddling the range start belongs to the previous range
+    if (pos > 0 && data[pos - 1] != '\n') {
+        const unsigned char *newline = memchr(data + pos, '\n', size - pos);
+        pos = newline ? (size_t)(newline - data) + 1 : size;
+        line_num++;
+    }
+    
+    while (pos < end && pos < size) {
+        line_num++;
+        const unsigned char *newline = memchr(data + pos, '\n', size - pos);
+        size_t line_end = newline ? (size_t)(newline - data) : size;
+        size_t length = line_end - pos;
+        if (length > 0 && data[line_end - 1] == '\r') length--;
+        
+        if (length + 1 > *line_capacity) {
+            char *new_buffer = realloc(*line_buffer, length + 1);
+            if (!new_buffer) return -1;
+            *line_buffer = new_buffer;
+            *line_capacity = length + 1;
+        }
+        memcpy(*line_buffer, data + pos, length);
+        (*line_buffer)[length] = '\0';
+        pos = line_end + 1;
+        
+        // Skip empty lines and comments
+        char *trimmed = *line_buffer;
+        while (*trimmed && isspace((unsigned char)*trimmed)) trimmed++;
+        if (*trimmed == '\0' || *trimmed == '#') {
+            continue;
+        }
+        
+        // Each expression starts from a clean local scope; evaluation errors
+        // are counted rather than printed, and syntax errors name the line
+        EvalError error;
+        error_line = line_num;
+        double result = evaluate_statement(trimmed, &error);
+        error_line = 0;
+        free_variables(variables);
+        variables = NULL;
+        error_counts[error.code]++;
+        
+        if (output_append_result(output, result) != 0) return -1;
+        (*expr_count)++;
+    }
+    return 0;
+}
+
+#ifndef _WIN32
+#define EXPR_RING_SLOTS 64
+
+typedef struct ExprChunk {
+    atomic_size_t stamp;
+    OutputBuffer output;
+    size_t expr_count;
+    size_t error_counts[CALC_ERR_COUNT];
+} ExprChunk;
+
+typedef struct ExprFileJob {
+    const unsigned char *data;
+    size_t size;
+    size_t chunk_count;
+    int *chunk_lines;          // Lines ending before each chunk, for messages
+    ExprChunk chunks[EXPR_RING_SLOTS];
+    atomic_size_t next_chunk;
+    atomic_int failed;
+    rcalc_context *context;
+    const Variable *globals;
+} ExprFileJob;
+
+static void* expr_file_worker(void *arg) {
+    ExprFileJob *job = arg;
+    char *line_buffer = NULL;
+    size_t line_capacity = 0;
+    
+    context = job->context;
+    silent_mode = 1;
+    definitions_locked = 1;
+    shared_variables = job->globals;
+    
+    while (1) {
+        size_t seq = atomic_fetch_add(&job->next_chunk, 1);
+        if (seq >= job->chunk_count) break;
+        
+        ExprChunk *chunk = &job->chunks[seq % EXPR_RING_SLOTS];
+        if (!ring_wait(&chunk->stamp, BLOCK_STAMP(seq, BLOCK_FREE), &job->failed, NULL, seq)) break;
+        
+        chunk->output.length = 0;
+        chunk->expr_count = 0;
+        memset(chunk->error_counts, 0, sizeof(chunk->error_counts));
+        size_t start = seq * EXPR_CHUNK_BYTES;
+        if (evaluate_expression_range(job->data, job->size, start, start + EXPR_CHUNK_BYTES,
+                                      job->chunk_lines[seq], &chunk->output, &chunk->expr_count, chunk->error_counts,
+                                      &line_buffer, &line_capacity) != 0) {
+            fprintf(stderr, "Error: Memory allocation failed\n");
+            atomic_store(&job->failed, 1);
+            break;
+        }
+        
+        atomic_store_explicit(&chunk->stamp, BLOCK_STAMP(seq, BLOCK_DONE), memory_order_release);
+    }
+    
+    free(line_buffer);
+    memory_flush();
+    return NULL;
+}
+
+// Evaluate every line of an expression file on worker threads; the calling
+// thread writes results in order
+static int evaluate_expression_file(const unsigned char *data, size_t size, FILE *out,
+                                    int thread_count, size_t *expr_count, size_t *error_counts) {
+    size_t chunk_count = (size + EXPR_CHUNK_BYTES - 1) / EXPR_CHUNK_BYTES;
+    ExprFileJob *job = calloc(1, sizeof(ExprFileJob));
+    pthread_t *workers = malloc(thread_count * sizeof(pthread_t));
+    int *chunk_lines = malloc((chunk_count ? chunk_count : 1) * sizeof(int));
+    if (!job || !workers || !chunk_lines) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        free(job);
+        free(workers);
+        free(chunk_lines);
+        return -1;
+    }
+    
+    // Counting lines is far cheaper than evaluating them, so one pass up
+    // front lets every chunk number its lines
+    int lines = 0;
+    for (size_t seq = 0; seq < chunk_count; seq++) {
+        chunk_lines[seq] = lines;
+        size_t start = seq * EXPR_CHUNK_BYTES;
+        size_t end = start + EXPR_CHUNK_BYTES < size ? start + EXPR_CHUNK_BYTES : size;
+        for (const unsigned char *p = data + start; (p = memchr(p, '\n', data + end - p)); p++) {
+            lines++;
+        }
+    }
+    
+    job->data = data;
+    job->size = size;
+    job->chunk_count = chunk_count;
+    job->chunk_lines = chunk_lines;
+    job->context = context;
+    job->globals = variables;
+    atomic_init(&job->next_chunk, 0);
+    atomic_init(&job->failed, 0);
+    for (int i = 0; i < EXPR_RING_SLOTS; i++) {
+        atomic_init(&job->chunks[i].stamp, BLOCK_STAMP(i, BLOCK_FREE));
+    }
+    
+    // Workers share the function table read-only
+    compile_user_functions();
+    int started = 0;
+    while (started < thread_count) {
+        if (pthread_create(&workers[started], NULL, expr_file_worker, job) != 0) break;
+        started++;
+    }
+    if (started == 0) {
+        fprintf(stderr, "Error: Failed to start worker threads\n");
+        atomic_store(&job->failed, 1);
+    }
+    
+    for (size_t seq = 0; seq < job->chunk_count; seq++) {
+        ExprChunk *chunk = &job->chunks[seq % EXPR_RING_SLOTS];
+        if (!ring_wait(&chunk->stamp, BLOCK_STAMP(seq, BLOCK_DONE), &job->failed, NULL, seq)) break;
+        
+        if (fwrite(chunk->output.data, 1, chunk->output.length, out) != chunk->output.length) {
+            fprintf(stderr, "Error: Failed to write results\n");
+            atomic_store(&job->failed, 1);
+            break;
+        }
+        *expr_count += chunk->expr_count;
+        for (int i = 0; i < CALC_ERR_COUNT; i++) {
+            error_counts[i] += chunk->error_counts[i];
+        }
+        
+        atomic_store_explicit(&chunk->stamp, BLOCK_STAMP(seq + EXPR_RING_SLOTS, BLOCK_FREE),
+                              memory_order_release);
+    }
+    
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    
+    int status = atomic_load(&job->failed) ? -1 : 0;
+    for (int i = 0; i < EXPR_RING_SLOTS; i++) {
+        free(job->chunks[i].output.data);
+    }
+    free(chunk_lines);
+    free(workers);
+    free(job);
+    return status;
+}
+#else
+// No pthreads: evaluate the whole file on the calling thread
+static int evaluate_expression_file(const unsigned char *data, size_t size, FILE *out,
+                                    int thread_count, size_t *expr_count, size_t *error_counts) {
+    OutputBuffer output = {0};
+    char *line_buffer = NULL;
+    size_t line_capacity = 0;
+    (void)thread_count;
     
-    if (!accumulated) {
+    definitions_locked = 1;
+    int status = evaluate_expression_range(data, size, 0, size, 0, &output, expr_count, error_counts,
+                                           &line_buffer, &line_capacity);
+    definitions_locked = 0;
+    if (status != 0) {
         fprintf(stderr, "Error: Memory allocation failed\n");
+    } else if (fwrite(output.data, 1, output.length, out) != output.length) {
+        fprintf(stderr, "Error: Failed to write results\n");
+        status = -1;
+    }
+    free(output.data);
+    free(line_buffer);
+    return status;
+}
+
+static int online_cpu_count(void) {
+    return 1;
+}
+#endif
+
+static int run_expression_file(const BatchOptions *opts) {
+    size_t size = 0;
+    unsigned char *data = map_file(opts->eval_path, &size);
+    if (!data) {
+        // An empty file maps to nothing but is still valid
+        FILE *fp = fopen(opts->eval_path, "r");
+        if (!fp) {
+            fprintf(stderr, "Error: Cannot open file '%s'\n", opts->eval_path);
+            return -1;
+        }
         fclose(fp);
+    }
+    
+    FILE *out = stdout;
+    if (opts->output_path) {
+        out = fopen(opts->output_path, "w");
+        if (!out) {
+            fprintf(stderr, "Error: Cannot create file '%s'\n", opts->output_path);
+            unmap_file(data, size);
+            return -1;
+        }
+    }
+    
+    int thread_count = opts->thread_count > 0 ? opts->thread_count : online_cpu_count();
+    size_t expr_count = 0;
+    size_t error_counts[CALC_ERR_COUNT] = {0};
+    double start = monotonic_seconds();
+    int status = evaluate_expression_file(data, size, out, thread_count, &expr_count, error_counts);
+    if (fflush(out) != 0) status = -1;
+    double elapsed = monotonic_seconds() - start;
+    
+    if (opts->timing) {
+        fprintf(stderr, "Evaluated %zu expressions in %.3f s (%.0f expressions/s, %d threads)\n",
+                expr_count, elapsed, elapsed > 0 ? expr_count / elapsed : 0.0, thread_count);
+    }
+    print_error_summary("Expressions", error_counts);
+    
+    if (out != stdout) fclose(out);
+    unmap_file(data, size);
+    return status;
+}
+
+// Interactive timing. "time" reports how long one statement takes to parse,
+// compile and evaluate; "bench" evaluates an expression's compiled form over
+// and over and reports the cost per evaluation. The compiled form is the
+// batch kernel, with each global variable the expression reads bound as an
+// input column, as --batch would with that column in its input, so variables
+// are read on every evaluation instead of folding to constants.
+#define BENCH_SAMPLES 10
+#define BENCH_SAMPLE_SECONDS 0.01  // A calibrated sample runs at least this long
+
+typedef struct TimedExpression {
+    Kernel *kernel;
+    ColumnTable columns;
+    double row[MAX_BATCH_COLUMNS];
+    KernelScratch scratch;
+} TimedExpression;
+
+// Every result is added here, so no evaluation can be optimized away
+static volatile double bench_sink;
+
+static void bind_expression_variables(const ASTNode *node, TimedExpression *timed) {
+    if (!node) return;
+    switch (node->type) {
+        case AST_VARIABLE: {
+            ColumnTable *columns = &timed->columns;
+            Variable *var = lookup_variable(node->data.variable);
+            if (!var || columns->col_count == MAX_BATCH_COLUMNS) return;
+            for (int c = 0; c < columns->col_count; c++) {
+                if (strcmp(columns->names[c], var->name) == 0) return;
+            }
+            strcpy(columns->names[columns->col_count], var->name);
+            timed->row[columns->col_count++] = var->value;
+            break;
+        }
+        case AST_BINARY_OP:
+            bind_expression_variables(node->data.binary.left, timed);
+            bind_expression_variables(node->data.binary.right, timed);
+            break;
+        case AST_UNARY_OP:
+            bind_expression_variables(node->data.unary.operand, timed);
+            break;
+        case AST_FUNCTION_CALL:
+            for (int i = 0; i < node->data.func_call.arg_count; i++) {
+                bind_expression_variables(node->data.func_call.args[i], timed);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+// Compile an expression's AST, which is freed either way
+static int compile_timed_expression(ASTNode *ast, TimedExpression *timed) {
+    memset(timed, 0, sizeof(*timed));
+    bind_expression_variables(ast, timed);
+    timed->kernel = create_kernel();
+    if (!timed->kernel) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        free_ast(ast);
+        return -1;
+    }
+    timed->kernel->output_count = 1;
+    ASTNode *asts[1] = { ast };
+    if (compile_batch_kernel(timed->kernel, asts, &timed->columns) != 0) {
+        free_kernel(timed->kernel);
+        timed->kernel = NULL;
+        return -1;
+    }
+    if (kernel_scratch_init(&timed->scratch, timed->kernel) != 0) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        free_kernel(timed->kernel);
+        timed->kernel = NULL;
         return -1;
     }
+    return 0;
+}
+
+static void free_timed_expression(TimedExpression *timed) {
+    if (!timed->kernel) return;
+    kernel_scratch_free(&timed->scratch);
+    free_kernel(timed->kernel);
+    timed->kernel = NULL;
+}
+
+static CalcError evaluate_timed_expression(TimedExpression *timed, double *result) {
+    return kernel_evaluate_row(timed->kernel, &timed->scratch, timed->row, result);
+}
+
+// Seconds taken by count evaluations
+static double run_bench_sample(TimedExpression *timed, long count) {
+    double sum = 0.0;
+    double result;
+    double start = monotonic_seconds();
+    for (long i = 0; i < count; i++) {
+        evaluate_timed_expression(timed, &result);
+        sum += result;
+    }
+    double elapsed = monotonic_seconds() - start;
+    bench_sink = sum;
+    return elapsed;
+}
+
+static int compare_sample_times(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static const char* skip_command(const char *line, size_t length) {
+    const char *p = line + length;
+    while (isspace((unsigned char)*p)) p++;
+    return p;
+}
+
+// Whether a line starts with a REPL command word rather than using that word
+// as a variable: "time = 1" assigns, and "time + 1" is arithmetic once a
+// variable named time exists
+static int is_repl_command(const char *line, const char *name) {
+    size_t length = strlen(name);
+    if (strncmp(line, name, length) != 0 || !(line[length] == '\0' || isspace((unsigned char)line[length]))) {
+        return 0;
+    }
+    const char *rest = skip_command(line, length);
+    if (rest[0] == '=' && rest[1] != '=') return 0;
+    return !(*rest && strchr("+-*/^<>=!", *rest) && lookup_variable(name));
+}
+
+static void print_microseconds(const char *label, double seconds, const char *separator) {
+    printf("%s %.2f us%s", label, seconds * 1e6, separator);
+}
+
+// Parse and execute time command: "time statement"
+static void parse_time_command(const char *line) {
+    const char *text = skip_command(line, 4);
+    if (*text == '\0') {
+        fprintf(stderr, "Error: Usage: time expression\n");
+        return;
+    }
     
-    accumulated[0] = '\0';
+    double start = monotonic_seconds();
+    Statement stmt;
+    if (parse_statement_source(text, &stmt) != 0) return;
+    double parsed = monotonic_seconds();
+    
+    // Definitions and assignments run as usual and have nothing to compile
+    if (stmt.kind != STMT_EXPRESSION) {
+        clear_eval_error();
+        execute_statement(&stmt);
+        double executed = monotonic_seconds();
+        if (eval_error.code != CALC_OK) print_eval_error(&eval_error);
+        print_microseconds("parse", parsed - start, ", ");
+        print_microseconds("evaluate", executed - parsed, "\n");
+        return;
+    }
     
-    int line_num = 0;
-    int func_count = 0;
-    int var_count = 0;
-    int brace_count = 0;
-    int paren_count = 0;
-    int in_multiline = 0;
-    int saved_func_count = 0;
-    int saved_var_count = 0;
-    
-    // Enable silent mode for script loading
-    silent_mode = 1;
+    TimedExpression timed;
+    if (compile_timed_expression(stmt.ast, &timed) != 0) return;
+    double compiled = monotonic_seconds();
+    double result;
+    CalcError code = evaluate_timed_expression(&timed, &result);
+    double evaluated = monotonic_seconds();
+    if (code != CALC_OK) {
+        print_eval_error(&eval_error);
+    } else {
+        printf("= %.10g\n", result);
+    }
+    print_microseconds("parse", parsed - start, ", ");
+    print_microseconds("compile", compiled - parsed, ", ");
+    print_microseconds("evaluate", evaluated - compiled, "\n");
+    free_timed_expression(&timed);
+}
+
+// Parse and execute bench command: "bench expression [count]". A trailing
+// whole number is the count when it cannot be part of the expression.
+static void parse_bench_command(const char *line) {
+    char text[1024];
+    if (strlen(skip_command(line, 5)) >= sizeof(text)) {
+        fprintf(stderr, "Error: bench expressions are limited to %d characters\n", (int)sizeof(text) - 1);
+        return;
+    }
+    snprintf(text, sizeof(text), "%s", skip_command(line, 5));
+    size_t length = strlen(text);
+    while (length > 0 && isspace((unsigned char)text[length - 1])) text[--length] = '\0';
+    
+    long count = 0;
+    size_t digits = length;
+    while (digits > 0 && isdigit((unsigned char)text[digits - 1])) digits--;
+    if (digits < length && digits > 0 && isspace((unsigned char)text[digits - 1])) {
+        size_t end = digits - 1;
+        while (end > 0 && isspace((unsigned char)text[end - 1])) end--;
+        char last = end > 0 ? text[end - 1] : '\0';
+        if (isalnum((unsigned char)last) || last == ')' || last == '.' || last == '_') {
+            count = strtol(text + digits, NULL, 10);
+            text[end] = '\0';
+            if (count < 1) {
+                fprintf(stderr, "Error: The evaluation count must be positive\n");
+                return;
+            }
+        }
+    }
+    if (text[0] == '\0') {
+        fprintf(stderr, "Error: Usage: bench expression [count]\n");
+        return;
+    }
+    
+    Statement stmt;
+    if (parse_statement_source(text, &stmt) != 0) return;
+    if (stmt.kind != STMT_EXPRESSION) {
+        free_statement(&stmt);
+        fprintf(stderr, "Error: bench needs an expression, not a definition or assignment\n");
+        return;
+    }
+    TimedExpression timed;
+    if (compile_timed_expression(stmt.ast, &timed) != 0) return;
+    double result;
+    if (evaluate_timed_expression(&timed, &result) != CALC_OK) {
+        print_eval_error(&eval_error);
+        free_timed_expression(&timed);
+        return;
+    }
+    
+    // Warm up caches and branch predictors with a discarded sample. Without
+    // a count, that sample also finds how many evaluations fill one: double
+    // it until it runs for BENCH_SAMPLE_SECONDS.
+    int samples = BENCH_SAMPLES;
+    long per_sample;
+    if (count > 0) {
+        if (count < samples) samples = (int)count;
+        per_sample = count / samples;
+        run_bench_sample(&timed, per_sample);
+    } else {
+        per_sample = 1;
+        while (run_bench_sample(&timed, per_sample) < BENCH_SAMPLE_SECONDS && per_sample < LONG_MAX / 2) {
+            per_sample *= 2;
+        }
+    }
+    
+    double times[BENCH_SAMPLES];
+    double sum = 0.0;
+    for (int i = 0; i < samples; i++) {
+        times[i] = run_bench_sample(&timed, per_sample) * 1e9 / (double)per_sample;
+        sum += times[i];
+    }
+    double mean = sum / samples;
+    double variance = 0.0;
+    for (int i = 0; i < samples; i++) variance += (times[i] - mean) * (times[i] - mean);
+    double deviation = samples > 1 ? sqrt(variance / (samples - 1)) : 0.0;
+    qsort(times, (size_t)samples, sizeof(double), compare_sample_times);
+    
+    printf("= %.10g\n", result);
+    printf("%.1f ns/eval +- %.1f (%.1f%%), median %.1f, min %.1f, max %.1f; %d x %ld evaluations\n",
+           mean, deviation, mean > 0.0 ? deviation * 100.0 / mean : 0.0, times[samples / 2], times[0],
+           times[samples - 1], samples, per_sample);
+    if (timed.kernel->nodes[timed.kernel->outputs[0]].op == KERNEL_CONST) {
+        printf("Note: The expression folds to a constant when compiled\n");
+    }
+    free_timed_expression(&timed);
+}
+
+// One-shot evaluation (-e and --stdin-batch) skips all REPL setup and prints
+// only the value of each expression, one per line; a failed statement prints
+// nan so results stay aligned with their inputs. The exit status reports the
+// worst failure.
+#define EXIT_EVAL_ERROR 1      // An expression raised an evaluation error
+#define EXIT_SYNTAX_ERROR 2    // A statement or the command line did not parse
+#define EXIT_LOAD_ERROR 3      // A script could not be read
+
+static int run_one_shot_statement(const char *source) {
+    double start = monotonic_seconds();
+    Statement stmt;
+    if (parse_statement_source(source, &stmt) != 0) {
+        record_statement(monotonic_seconds() - start, 1);
+        fputs("nan\n", stdout);
+        return EXIT_SYNTAX_ERROR;
+    }
+    
+    int is_expression = stmt.kind == STMT_EXPRESSION;
+    clear_eval_error();
+    double result = execute_statement(&stmt);
+    record_statement(monotonic_seconds() - start, eval_error.code != CALC_OK);
+    if (is_expression) {
+        printf("%.10g\n", result);
+    }
+    if (eval_error.code != CALC_OK) {
+        print_eval_error(&eval_error);
+        return EXIT_EVAL_ERROR;
+    }
+    return 0;
+}
+
+static int run_one_shot_expressions(char **expressions, int count) {
+    int status = 0;
+    for (int i = 0; i < count; i++) {
+        int result = run_one_shot_statement(expressions[i]);
+        if (result > status) status = result;
+        maybe_dump_stats();
+    }
+    return status;
+}
+
+// Statements from stdin, which may span lines as in a script
+static int run_stdin_batch(void) {
+    char *input = NULL;
+    size_t input_capacity = 0;
+    size_t input_length = 0;
+    char *line = NULL;
+    size_t line_capacity = 0;
+    ssize_t chars_read;
+    int status = 0;
+    StatementLexer lexer;
+    memset(&lexer, 0, sizeof(lexer));
+    
+    while ((chars_read = getline(&line, &line_capacity, stdin)) != -1) {
+        if (input_length + (size_t)chars_read + 2 > input_capacity) {
+            size_t new_capacity = input_capacity ? input_capacity : 1024;
+            while (new_capacity < input_length + (size_t)chars_read + 2) {
+                new_capacity *= 2;
+            }
+            char *new_input = realloc(input, new_capacity);
+            if (!new_input) {
+                fprintf(stderr, "Error: Memory allocation failed\n");
+                status = EXIT_LOAD_ERROR;
+                break;
+            }
+            input = new_input;
+            input_capacity = new_capacity;
+        }
+        size_t scan_pos = input_length;
+        memcpy(input + input_length, line, (size_t)chars_read);
+        input_length += (size_t)chars_read;
+        if (input[input_length - 1] != '\n') input[input_length++] = '\n';
+        input[input_length] = '\0';
+        
+        if (!statement_lexer_scan(&lexer, input, &scan_pos, input_length)) {
+            // Nothing pending means the line was blank or a comment
+            if (!statement_lexer_pending(&lexer)) input_length = 0;
+            continue;
+        }
+        int result = run_one_shot_statement(input + lexer.start);
+        if (result > status) status = result;
+        maybe_dump_stats();
+        input_length = 0;
+        statement_lexer_reset(&lexer);
+    }
     
-    // Count existing functions and variables
-    UserFunction *uf = user_functions;
-    while (uf) {
-        saved_func_count++;
-        uf = uf->next;
+    if (statement_lexer_pending(&lexer)) {
+        fprintf(stderr, "Error: Incomplete statement at end of input\n");
+        fputs("nan\n", stdout);
+        status = EXIT_SYNTAX_ERROR;
+    }
+    free(input);
+    free(line);
+    return status;
+}
+
+// Calculation server. Each connection sends requests and gets one reply per
+// request, in order, so clients may pipeline. A request is one statement,
+// framed either as a line of text or as a 4-byte big-endian length followed
+// by that many bytes of statement text. Lengths are limited to 1 MB, so a
+// length's first byte is always NUL, which no line can start with.
+// Replies use the request's framing and hold the result ("%.17g"), "ok" for
+// definitions and assignments, or "error <kind>: <message>". Every
+// connection is a session over the scripts loaded at startup, so what one
+// client defines is invisible to the others.
+#define SERVER_MAX_REQUEST (1 << 20)
+#define SERVER_MAX_PENDING_OUTPUT (1 << 20)  // Stop reading while replies back up
+#define SERVER_MAX_EVENTS 64
+#define SERVER_READ_SIZE 65536
+
+#ifdef __linux__
+typedef struct Connection {
+    int fd;
+    rcalc_context *session;
+    char *in;                  // Received bytes not yet handled
+    size_t in_length;
+    size_t in_capacity;
+    char *out;                 // Replies not yet sent, from out_start
+    size_t out_start;
+    size_t out_length;
+    size_t out_capacity;
+    int eof;                   // Peer finished sending; close once replies are out
+    int reading;               // EPOLLIN is armed
+    int writing;               // EPOLLOUT is armed
+    struct Connection *prev;   // Open connections, to close them on shutdown
+    struct Connection *next;
+} Connection;
+
+static Connection *connections = NULL;
+static volatile sig_atomic_t server_stopping = 0;
+
+static void stop_server(int signal_number) {
+    (void)signal_number;
+    server_stopping = 1;
+}
+
+// Stop on SIGINT or SIGTERM. Without SA_RESTART, the signal also interrupts
+// a server blocked in epoll_wait or a futex.
+static void install_stop_handlers(void) {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stop_server;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+}
+
+static int reserve_buffer(char **buffer, size_t *capacity, size_t needed) {
+    if (needed <= *capacity) return 0;
+    size_t new_capacity = *capacity ? *capacity : 4096;
+    while (new_capacity < needed) new_capacity *= 2;
+    char *new_buffer = realloc(*buffer, new_capacity);
+    if (!new_buffer) return -1;
+    *buffer = new_buffer;
+    *capacity = new_capacity;
+    return 0;
+}
+
+// Evaluate one request in the connection's session and format the reply.
+// A request starting with a colon is a server command, which no statement
+// can be: ":stats" replies with the statistics as one line of JSON.
+static int serve_statement(Connection *conn, const char *text, char *reply, size_t size) {
+    if (text[0] == ':') {
+        if (strcmp(text, ":stats") == 0) return format_stats_json(reply, size);
+        int length = snprintf(reply, size, "error syntax: Unknown command '%.32s'", text);
+        return length < (int)size ? length : (int)size - 1;
+    }
+    ContextBinding binding;
+    bind_context(conn->session, &binding);
+    Statement stmt;
+    int length;
+    if (parse_statement_source(text, &stmt) != 0) {
+        length = snprintf(reply, size, "error syntax: Syntax error");
+    } else {
+        int is_expression = stmt.kind == STMT_EXPRESSION;
+        clear_eval_error();
+        double result = execute_statement(&stmt);
+        if (eval_error.code != CALC_OK) {
+            char message[128];
+            format_eval_error(&eval_error, message, sizeof(message));
+            length = snprintf(reply, size, "error %s: %s", calc_error_names[eval_error.code], message);
+        } else if (is_expression) {
+            length = snprintf(reply, size, "%.17g", result);
+        } else {
+            length = snprintf(reply, size, "ok");
+        }
     }
-    Variable *v = variables;
-    while (v) {
-        saved_var_count++;
-        v = v->next;
+    unbind_context(&binding);
+    return length < (int)size ? length : (int)size - 1;
+}
+
+static int queue_reply(Connection *conn, const char *reply, int length, int framed) {
+    if (reserve_buffer(&conn->out, &conn->out_capacity, conn->out_length + (size_t)length + 4) != 0) return -1;
+    char *p = conn->out + conn->out_length;
+    if (framed) {
+        uint32_t size = (uint32_t)length;
+        p[0] = (char)(size >> 24);
+        p[1] = (char)(size >> 16);
+        p[2] = (char)(size >> 8);
+        p[3] = (char)size;
+        memcpy(p + 4, reply, (size_t)length);
+        conn->out_length += (size_t)length + 4;
+    } else {
+        memcpy(p, reply, (size_t)length);
+        p[length] = '\n';
+        conn->out_length += (size_t)length + 1;
     }
-    
-    while (getline(&line, &line_capacity, fp) != -1) {
-        line_num++;
-        
-        // Remove trailing newline
-        size_t len = strlen(line);
-        if (len > 0 && line[len - 1] == '\n') {
-            line[len - 1] = '\0';
-            len--;
-        }
-        
-        // Skip empty lines and comments
-        char *trimmed = line;
-        while (*trimmed && isspace(*trimmed)) trimmed++;
-        if (*trimmed == '\0' || *trimmed == '#') {
-            continue;
+    return 0;
+}
+
+// Handle the complete requests in the input buffer until replies back up.
+// Returns 1 if it stopped for that reason with requests left, or -1 if the
+// connection must be dropped. Each request is timed from the end of the one
+// before it, so timing costs one clock read per request.
+static int handle_requests(Connection *conn) {
+    char reply[STATS_JSON_MAX];
+    size_t pos = 0;
+    int status = 0;
+    double last = monotonic_seconds();
+    while (pos < conn->in_length) {
+        if (conn->out_length - conn->out_start >= SERVER_MAX_PENDING_OUTPUT) {
+            status = 1;
+            break;
         }
-        
-        // Calculate space needed
-        size_t space_needed = accumulated_length + (accumulated_length > 0 ? 1 : 0) + len + 1;
-        
-        // Grow buffer if needed
-        if (space_needed > accumulated_capacity) {
-            size_t new_capacity = accumulated_capacity * 2;
-            while (new_capacity < space_needed) {
-                new_capacity *= 2;
+        char *request = conn->in + pos;
+        size_t available = conn->in_length - pos;
+        int framed = request[0] == '\0';
+        char *text;
+        size_t text_length;
+        if (framed) {
+            if (available < 4) break;
+            const unsigned char *header = (const unsigned char *)request;
+            text_length = (size_t)header[1] << 16 | (size_t)header[2] << 8 | header[3];
+            if (text_length > SERVER_MAX_REQUEST) {
+                status = -1;
+                break;
             }
-            char *new_accumulated = realloc(accumulated, new_capacity);
-            if (!new_accumulated) {
-                fprintf(stderr, "Error: Memory allocation failed at line %d\n", line_num);
-                free(accumulated);
-                free(line);
-                fclose(fp);
-                return -1;
+            if (available < 4 + text_length) break;
+            text = request + 4;
+            pos += 4 + text_length;
+        } else {
+            char *newline = memchr(request, '\n', available);
+            if (!newline) {
+                if (available > SERVER_MAX_REQUEST) status = -1;
+                if (!conn->eof || status != 0) break;
+                newline = request + available;  // Last line without a newline
             }
-            accumulated = new_accumulated;
-            accumulated_capacity = new_capacity;
-        }
-        
-        // Append line
-        if (accumulated_length > 0) {
-            strcat(accumulated, " ");
-            accumulated_length++;
+            text = request;
+            text_length = (size_t)(newline - request);
+            pos += text_length + (newline < request + available);
+            if (text_length > 0 && text[text_length - 1] == '\r') text_length--;
+            
+            // Blank lines are not requests
+            size_t first = 0;
+            while (first < text_length && isspace((unsigned char)text[first])) first++;
+            if (first == text_length) continue;
         }
-        strcat(accumulated, trimmed);
-        accumulated_length += strlen(trimmed);
         
-        // Count braces and parentheses
-        brace_count = 0;
-        paren_count = 0;
-        int in_string = 0;
+        // Terminate the text in place; the byte after it is already consumed
+        // or belongs to the next request, so keep it and put it back
+        char saved = text[text_length];
+        text[text_length] = '\0';
+        int length = serve_statement(conn, text, reply, sizeof(reply));
+        text[text_length] = saved;
         
-        for (const char *p = accumulated; *p; p++) {
-            if (*p == '"') {
-                in_string = !in_string;
-            } else if (!in_string) {
-                if (*p == '{') brace_count++;
-                else if (*p == '}') brace_count--;
-                else if (*p == '(') paren_count++;
-                else if (*p == ')') paren_count--;
-            }
+        // Server commands are not recorded, but the next request is still
+        // timed from the end of this one
+        double now = monotonic_seconds();
+        if (text[0] != ':') {
+            record_request(now - last, length >= 5 && memcmp(reply, "error", 5) == 0);
         }
-        
-        // Check if we need more input
-        int needs_more = 0;
-        if (brace_count > 0 || paren_count > 0) {
-            needs_more = 1;
+        last = now;
+        if (queue_reply(conn, reply, length, framed) != 0) {
+            status = -1;
+            break;
         }
-        
-        if (accumulated_length > 0) {
-            char last_char = accumulated[accumulated_length - 1];
-            if (last_char == '{' || last_char == ',' || last_char == '(' || 
-                last_char == '+' || last_char == '-' || last_char == '*' || 
-                last_char == '/' || last_char == '^') {
-                needs_more = 1;
+    }
+    memmove(conn->in, conn->in + pos, conn->in_length - pos);
+    conn->in_length -= pos;
+    return status;
+}
+
+static void close_connection(int epoll_fd, Connection *conn) {
+    if (conn->prev) conn->prev->next = conn->next;
+    else connections = conn->next;
+    if (conn->next) conn->next->prev = conn->prev;
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    rcalc_destroy(conn->session);
+    free(conn->in);
+    free(conn->out);
+    free(conn);
+}
+
+// Read what has arrived, answer it and send what the socket will take.
+// Epoll is level-triggered, so anything left unread is reported again.
+// Returns -1 once the connection is finished.
+static int service_connection(int epoll_fd, Connection *conn, uint32_t events) {
+    if ((events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && conn->reading) {
+        if (reserve_buffer(&conn->in, &conn->in_capacity, conn->in_length + SERVER_READ_SIZE) != 0) return -1;
+        ssize_t received = recv(conn->fd, conn->in + conn->in_length, conn->in_capacity - conn->in_length, 0);
+        if (received > 0) {
+            conn->in_length += (size_t)received;
+        } else if (received == 0) {
+            conn->eof = 1;
+        } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            return -1;
+        }
+    }
+    
+    int backed_up;
+    do {
+        backed_up = handle_requests(conn);
+        if (backed_up < 0) return -1;
+        while (conn->out_start < conn->out_length) {
+            ssize_t sent = send(conn->fd, conn->out + conn->out_start, conn->out_length - conn->out_start,
+                                MSG_NOSIGNAL);
+            if (sent >= 0) {
+                conn->out_start += (size_t)sent;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            } else if (errno != EINTR) {
+                return -1;
             }
         }
-        
-        if (needs_more) {
-            in_multiline = 1;
+        if (conn->out_start == conn->out_length) conn->out_start = conn->out_length = 0;
+    } while (backed_up && conn->out_length == 0);
+    
+    // Whatever is left after end of input is an incomplete frame
+    if (conn->eof && !backed_up && conn->out_length == 0) return -1;
+    
+    // Wait for room to send, and stop reading while replies back up
+    int reading = !conn->eof && conn->out_length - conn->out_start < SERVER_MAX_PENDING_OUTPUT;
+    int writing = conn->out_length > 0;
+    if (reading != conn->reading || writing != conn->writing) {
+        struct epoll_event event = { 0 };
+        event.events = (reading ? EPOLLIN : 0) | (writing ? EPOLLOUT : 0);
+        event.data.ptr = conn;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &event) != 0) return -1;
+        conn->reading = reading;
+        conn->writing = writing;
+    }
+    return 0;
+}
+
+static void accept_connections(int epoll_fd, int listen_fd, rcalc_context *library) {
+    while (1) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                fprintf(stderr, "Error: accept failed: %s\n", strerror(errno));
+            }
+            return;
+        }
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        Connection *conn = calloc(1, sizeof(Connection));
+        if (conn) conn->session = rcalc_create_session(library);
+        if (!conn || !conn->session) {
+            free(conn);
+            close(fd);
             continue;
         }
-        
-        // We have a complete statement
-        in_multiline = 0;
-        
-        // Track if this is a function or variable definition
-        int is_func_def = (strstr(accumulated, "var ") == accumulated && 
-                          strchr(accumulated, '(') != NULL && 
-                          strchr(accumulated, '{') != NULL);
-        int is_var_def = (strstr(accumulated, "var ") == accumulated && !is_func_def);
-        
-        // Execute the statement
-        double result = compute_expression(accumulated);
-        
-        // Only report errors for non-definition statements
-        // Function and variable definitions may return NAN but that's OK
-        if (isnan(result) && !is_func_def && !is_var_def) {
-            fprintf(stderr, "Error in %s:%d: Failed to evaluate statement\n", 
-                    filename, line_num);
+        rcalc_set_quiet(conn->session, 1);
+        conn->fd = fd;
+        conn->reading = 1;
+        conn->next = connections;
+        if (connections) connections->prev = conn;
+        connections = conn;
+        struct epoll_event event = { 0 };
+        event.events = EPOLLIN;
+        event.data.ptr = conn;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0) {
+            close_connection(epoll_fd, conn);
         }
-        
-        if (is_func_def) func_count++;
-        else if (is_var_def) var_count++;
-        
-        // Clear accumulated buffer
-        accumulated[0] = '\0';
-        accumulated_length = 0;
     }
-    
-    // Check for incomplete statement
-    if (accumulated_length > 0) {
-        fprintf(stderr, "Warning: Incomplete statement at end of %s\n", filename);
+}
+
+// Open the listening socket, replacing a stale socket file left by a server
+// that is no longer running
+static int listen_on_path(const char *path) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Error: Socket path '%s' is too long\n", path);
+        return -1;
     }
+    strcpy(address.sun_path, path);
     
-    free(accumulated);
-    free(line);
-    fclose(fp);
-    
-    // Calculate actual new counts
-    int new_func_count = 0;
-    uf = user_functions;
-    while (uf) {
-        new_func_count++;
-        uf = uf->next;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Cannot create socket: %s\n", strerror(errno));
+        return -1;
     }
-    int new_var_count = 0;
-    v = variables;
-    while (v) {
-        new_var_count++;
-        v = v->next;
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int in_use = probe >= 0 && connect(probe, (struct sockaddr *)&address, sizeof(address)) == 0;
+        if (probe >= 0) close(probe);
+        if (in_use) {
+            fprintf(stderr, "Error: A server is already listening on '%s'\n", path);
+            close(fd);
+            return -1;
+        }
+        unlink(path);
+    }
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(fd, SOMAXCONN) != 0) {
+        fprintf(stderr, "Error: Cannot listen on '%s': %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Serve until SIGINT or SIGTERM. The library must already be shared.
+static int run_server(const char *path, rcalc_context *library) {
+    int listen_fd = listen_on_path(path);
+    if (listen_fd < 0) return 1;
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event event = { 0 };
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    if (epoll_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event) != 0) {
+        fprintf(stderr, "Error: Cannot start event loop: %s\n", strerror(errno));
+        if (epoll_fd >= 0) close(epoll_fd);
+        close(listen_fd);
+        unlink(path);
+        return 1;
     }
     
-    func_count = new_func_count - saved_func_count;
-    var_count = new_var_count - saved_var_count;
-    
-    // Restore normal mode
-    silent_mode = 0;
+    install_stop_handlers();
+    fprintf(stderr, "Serving on %s\n", path);
     
-    if (func_count > 0 || var_count > 0) {
-        printf("Loaded ");
-        if (func_count > 0) {
-            printf("%d function%s", func_count, func_count == 1 ? "" : "s");
-            if (var_count > 0) printf(", ");
+    struct epoll_event events[SERVER_MAX_EVENTS];
+    while (!server_stopping) {
+        int count = epoll_wait(epoll_fd, events, SERVER_MAX_EVENTS, stats_dump_timeout_ms());
+        if (count < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "Error: epoll_wait failed: %s\n", strerror(errno));
+            break;
         }
-        if (var_count > 0) {
-            printf("%d variable%s", var_count, var_count == 1 ? "" : "s");
+        maybe_dump_stats();
+        for (int i = 0; i < count; i++) {
+            Connection *conn = events[i].data.ptr;
+            if (!conn) {
+                accept_connections(epoll_fd, listen_fd, library);
+            } else if (service_connection(epoll_fd, conn, events[i].events) != 0) {
+                close_connection(epoll_fd, conn);
+            }
         }
-        printf(" from %s\n", filename);
-    } else {
-        printf("Loaded %s\n", filename);
     }
     
+    while (connections) close_connection(epoll_fd, connections);
+    close(epoll_fd);
+    close(listen_fd);
+    unlink(path);
+    fprintf(stderr, "Server stopped\n");
     return 0;
 }
 
-// Parse and execute load command
-static void parse_load_command(const char *line) {
-    // Skip "load" and whitespace
-    const char *p = line + 4;
-    while (*p && isspace(*p)) p++;
-    
-    if (*p == '\0') {
-        fprintf(stderr, "Error: load command requires a filename\n");
-        fprintf(stderr, "Usage: load \"filename.calc\" or load filename.calc\n");
-        return;
+// Shared-memory server; rcalc_shm.h describes the region. One thread answers
+// every channel, polling them all while requests keep coming, then spinning,
+// yielding and finally sleeping on the doorbell futex until a client rings.
+static void answer_shm_request(UserFunction **functions, uint32_t function_count,
+                               const rcalc_shm_request *request, rcalc_shm_response *response) {
+    clear_eval_error();
+    double result = NAN;
+    uint32_t id = request->function;
+    if (id >= function_count) {
+        char name[32];
+        snprintf(name, sizeof(name), "#%u", id);
+        raise_eval_error(CALC_ERR_UNKNOWN_FUNCTION, name, 0, 0);
+    } else if (request->arg_count != (uint32_t)functions[id]->param_count) {
+        raise_eval_error(CALC_ERR_ARITY, functions[id]->name, functions[id]->param_count, (int)request->arg_count);
+    } else {
+        result = evaluate_user_function(functions[id], request->args, (int)request->arg_count);
     }
-    
-    // Extract filename (with or without quotes)
-    char filename[256];
-    int i = 0;
-    
-    if (*p == '"') {
-        // Quoted filename
-        p++;
-        while (*p && *p != '"' && i < 255) {
-            filename[i++] = *p++;
+    response->result = result;
+    response->status = (int32_t)eval_error.code;
+}
+
+// Answer everything waiting on one channel; returns the number answered.
+// Each request is timed from the end of the one before it, so timing costs
+// one clock read per request.
+static uint32_t service_shm_channel(rcalc_shm_channel *channel, UserFunction **functions, uint32_t function_count) {
+    uint32_t completed = atomic_load_explicit(&channel->completed, memory_order_relaxed);
+    uint32_t submitted = atomic_load_explicit(&channel->submitted, memory_order_acquire);
+    uint32_t answered = submitted - completed;
+    if (answered == 0) return 0;
+    double last = monotonic_seconds();
+    while (completed != submitted) {
+        uint32_t slot = completed % RCALC_SHM_SLOTS;
+        answer_shm_request(functions, function_count, &channel->requests[slot], &channel->responses[slot]);
+        double now = monotonic_seconds();
+        record_request(now - last, channel->responses[slot].status != RCALC_OK);
+        last = now;
+        completed++;
+        atomic_store(&channel->completed, completed);
+        if (atomic_load(&channel->client_waiting)) {
+            rcalc_shm_futex(&channel->completed, FUTEX_WAKE, 1, NULL);
         }
-    } else {
-        // Unquoted filename
-        while (*p && !isspace(*p) && i < 255) {
-            filename[i++] = *p++;
+    }
+    return answered;
+}
+
+// Create the region, replacing one left by a server that is no longer running
+static int create_shm_region(const char *name, size_t size) {
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0 && errno == EEXIST) {
+        rcalc_shm existing;
+        if (rcalc_shm_attach(name, &existing) == 0) {
+            pid_t pid = (pid_t)existing.header->server_pid;
+            rcalc_shm_detach(&existing);
+            if (kill(pid, 0) == 0 || errno == EPERM) {
+                fprintf(stderr, "Error: A server is already using '%s'\n", name);
+                return -1;
+            }
         }
+        shm_unlink(name);
+        fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    }
+    if (fd < 0 || ftruncate(fd, (off_t)size) != 0) {
+        fprintf(stderr, "Error: Cannot create shared memory '%s': %s\n", name, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+            shm_unlink(name);
+        }
+        return -1;
+    }
+    return fd;
+}
+
+// Serve until SIGINT or SIGTERM. The library must already be shared.
+static int run_shm_server(const char *name, rcalc_context *library) {
+    // The directory lists every function in the library, oldest first
+    uint32_t function_count = 0;
+    for (UserFunction *func = library->user_functions; func; func = func->next) function_count++;
+    UserFunction **functions = malloc((function_count ? function_count : 1) * sizeof(UserFunction*));
+    if (!functions) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return 1;
+    }
+    uint32_t id = function_count;
+    for (UserFunction *func = library->user_functions; func; func = func->next) functions[--id] = func;
+    
+    size_t functions_offset = (sizeof(rcalc_shm_header) + 63) & ~(size_t)63;
+    size_t channels_offset = (functions_offset + function_count * sizeof(rcalc_shm_entry) + 63) & ~(size_t)63;
+    size_t size = channels_offset + RCALC_SHM_CHANNELS * sizeof(rcalc_shm_channel);
+    int fd = create_shm_region(name, size);
+    if (fd < 0) {
+        free(functions);
+        return 1;
+    }
+    rcalc_shm shm;
+    shm.header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    shm.size = size;
+    close(fd);
+    if (shm.header == MAP_FAILED) {
+        fprintf(stderr, "Error: Cannot map shared memory '%s': %s\n", name, strerror(errno));
+        shm_unlink(name);
+        free(functions);
+        return 1;
     }
     
-    filename[i] = '\0';
-    
-    if (filename[0] == '\0') {
-        fprintf(stderr, "Error: Empty filename\n");
-        return;
+    // The region starts zeroed, so only the layout and directory need writing
+    rcalc_shm_header *header = shm.header;
+    memcpy(header->magic, RCALC_SHM_MAGIC, 4);
+    header->version = RCALC_SHM_VERSION;
+    header->channel_count = RCALC_SHM_CHANNELS;
+    header->slot_count = RCALC_SHM_SLOTS;
+    header->function_count = function_count;
+    header->server_pid = (uint32_t)getpid();
+    header->functions_offset = functions_offset;
+    header->channels_offset = channels_offset;
+    header->size = size;
+    rcalc_shm_entry *directory = (rcalc_shm_entry *)((char *)header + functions_offset);
+    for (uint32_t i = 0; i < function_count; i++) {
+        strcpy(directory[i].name, functions[i]->name);
+        directory[i].param_count = functions[i]->param_count;
+    }
+    rcalc_shm_channel *channels = rcalc_shm_channels(&shm);
+    atomic_store_explicit(&header->ready, 1u, memory_order_release);
+    
+    install_stop_handlers();
+    fprintf(stderr, "Serving %u function%s on shared memory %s\n", function_count,
+            function_count == 1 ? "" : "s", name);
+    
+    ContextBinding binding;
+    bind_context_mode(library, &binding, 1);
+    int spins = 0;
+    while (!server_stopping) {
+        uint32_t answered = 0;
+        for (int c = 0; c < RCALC_SHM_CHANNELS; c++) {
+            answered += service_shm_channel(&channels[c], functions, function_count);
+        }
+        if (stats_interval > 0.0) maybe_dump_stats();
+        if (answered) {
+            spins = 0;
+        } else if (spins < RCALC_SHM_SPINS) {
+            spins++;
+        } else if (spins < 2 * RCALC_SHM_SPINS) {
+            spins++;
+            sched_yield();
+        } else {
+            // Announce the sleep, then look once more so no request is missed
+            unsigned bell = atomic_load(&header->doorbell);
+            atomic_store(&header->server_waiting, 1u);
+            int pending = 0;
+            for (int c = 0; c < RCALC_SHM_CHANNELS && !pending; c++) {
+                pending = atomic_load(&channels[c].submitted) != atomic_load(&channels[c].completed);
+            }
+            int timeout_ms = stats_dump_timeout_ms();
+            struct timespec timeout = { timeout_ms / 1000, (long)(timeout_ms % 1000) * 1000000 };
+            if (!pending) rcalc_shm_futex(&header->doorbell, FUTEX_WAIT, bell, timeout_ms < 0 ? NULL : &timeout);
+            atomic_store(&header->server_waiting, 0u);
+            spins = 0;
+        }
     }
+    unbind_context(&binding);
     
-    load_script_file(filename);
+    // Release clients waiting for answers that will not come
+    atomic_store(&header->ready, 0u);
+    for (int c = 0; c < RCALC_SHM_CHANNELS; c++) {
+        rcalc_shm_futex(&channels[c].completed, FUTEX_WAKE, INT32_MAX, NULL);
+    }
+    munmap(shm.header, size);
+    shm_unlink(name);
+    free(functions);
+    fprintf(stderr, "Server stopped\n");
+    return 0;
+}
+#else
+static int run_server(const char *path, rcalc_context *library) {
+    (void)path;
+    (void)library;
+    fprintf(stderr, "Error: --serve is not supported on this platform\n");
+    return 1;
+}
+
+static int run_shm_server(const char *name, rcalc_context *library) {
+    (void)name;
+    (void)library;
+    fprintf(stderr, "Error: --shm is not supported on this platform\n");
+    return 1;
+}
+#endif
+
+// Ctrl-C in the REPL stops the running evaluation rather than rcalc
+static rcalc_context *interrupted_context = NULL;
+
+static void cancel_on_interrupt(int signal_number) {
+    (void)signal_number;
+    rcalc_cancel(interrupted_context);
 }
 
 int main(int argc, char *argv[])
@@ -1797,26 +8192,294 @@ int main(int argc, char *argv[])
     size_t input_length = 0;
     size_t line_capacity = 0;
     double result;
-    int brace_count = 0;
-    int paren_count = 0;
-    int in_multiline = 0;
+    double startup = monotonic_seconds();
+    reset_stats();
+    StatementLexer lexer;
+    memset(&lexer, 0, sizeof(lexer));
+    
+    // The CLI runs one session, bound to the main thread, that prints as it goes
+    rcalc_context *session = rcalc_create();
+    if (!session) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return 1;
+    }
+    ContextBinding binding;
+    bind_context(session, &binding);
+    silent_mode = 0;
+    
+    // Parse options; the remaining arguments are script files, compacted
+    // in place to argv[1..script_count]
+    BatchOptions batch;
+    memset(&batch, 0, sizeof(batch));
+    char *one_shot[MAX_BATCH_OUTPUTS];
+    int one_shot_count = 0;
+    int stdin_batch = 0;
+    const char *image_path = NULL;
+    const char *serve_path = NULL;
+    const char *shm_name = NULL;
+    long max_calls = 0;
+    int max_depth = 0;
+    double timeout_ms = 0.0;
+    const char *stats_path = NULL;
+    int worker_mode = 0;
+    ShardOptions shard;
+    memset(&shard, 0, sizeof(shard));
+    shard.self = argv[0];
+    int script_count = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            if (batch.expression_count == MAX_BATCH_OUTPUTS) {
+                fprintf(stderr, "Error: Too many batch outputs (max %d)\n", MAX_BATCH_OUTPUTS);
+                return 1;
+            }
+            batch.expressions[batch.expression_count++] = argv[++i];
+        } else if (strcmp(argv[i], "-e") == 0 && i + 1 < argc) {
+            if (one_shot_count == MAX_BATCH_OUTPUTS) {
+                fprintf(stderr, "Error: Too many -e expressions (max %d)\n", MAX_BATCH_OUTPUTS);
+                return EXIT_SYNTAX_ERROR;
+            }
+            one_shot[one_shot_count++] = argv[++i];
+        } else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) {
+            argv[++script_count] = argv[++i];
+        } else if (strcmp(argv[i], "--stdin-batch") == 0) {
+            stdin_batch = 1;
+        } else if (strcmp(argv[i], "--input") == 0 && i + 1 < argc) {
+            batch.input_path = argv[++i];
+        } else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+            batch.output_path = argv[++i];
+        } else if (strcmp(argv[i], "--output-format=text") == 0) {
+            batch.binary_output = 0;
+        } else if (strcmp(argv[i], "--output-format=binary") == 0) {
+            batch.binary_output = 1;
+        } else if (strcmp(argv[i], "--stream") == 0) {
+            batch.stream = 1;
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            batch.thread_count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--eval-file") == 0 && i + 1 < argc) {
+            batch.eval_path = argv[++i];
+        } else if (strcmp(argv[i], "--timing") == 0) {
+            batch.timing = 1;
+        } else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+            serve_path = argv[++i];
+        } else if (strcmp(argv[i], "--shm") == 0 && i + 1 < argc) {
+            shm_name = argv[++i];
+        } else if (strcmp(argv[i], "--max-calls") == 0 && i + 1 < argc) {
+            forward_worker_option(&shard, argv + i, 2);
+            max_calls = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--max-depth") == 0 && i + 1 < argc) {
+            forward_worker_option(&shard, argv + i, 2);
+            max_depth = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--timeout") == 0 && i + 1 < argc) {
+            forward_worker_option(&shard, argv + i, 2);
+            timeout_ms = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--stats-interval") == 0 && i + 1 < argc) {
+            stats_interval = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--stats-file") == 0 && i + 1 < argc) {
+            stats_path = argv[++i];
+        } else if (strcmp(argv[i], "--max-memory") == 0 && i + 1 < argc) {
+            forward_worker_option(&shard, argv + i, 2);
+            if (parse_memory_size(argv[++i], &memory_limit) != 0) {
+                fprintf(stderr, "Error: --max-memory takes a size such as 65536, 512K, 64M or 2G\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--image") == 0 && i + 1 < argc) {
+            forward_worker_option(&shard, argv + i, 2);
+            image_path = argv[++i];
+        } else if (strcmp(argv[i], "--no-cache") == 0) {
+            forward_worker_option(&shard, argv + i, 1);
+            script_cache_enabled = 0;
+        } else if (strcmp(argv[i], "--lazy") == 0) {
+            forward_worker_option(&shard, argv + i, 1);
+            lazy_functions = 1;
+        } else if (strcmp(argv[i], "--on-error=nan") == 0) {
+            batch.on_error = ON_ERROR_NAN;
+        } else if (strcmp(argv[i], "--on-error=skip") == 0) {
+            batch.on_error = ON_ERROR_SKIP;
+        } else if (strcmp(argv[i], "--on-error=abort") == 0) {
+            batch.on_error = ON_ERROR_ABORT;
+        } else if (strcmp(argv[i], "--error-column") == 0) {
+            batch.error_column = 1;
+        } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+            long count;
+            if (parse_count_option(argv[++i], MAX_SHARD_WORKERS, &count) != 0) {
+                fprintf(stderr, "Error: --workers takes a number from 1 to %d\n", MAX_SHARD_WORKERS);
+                return 1;
+            }
+            shard.local_count = (int)count;
+        } else if (strcmp(argv[i], "--worker-command") == 0 && i + 1 < argc) {
+            if (shard.command_count == MAX_SHARD_WORKERS) {
+                fprintf(stderr, "Error: Too many worker commands (max %d)\n", MAX_SHARD_WORKERS);
+                return 1;
+            }
+            shard.commands[shard.command_count++] = argv[++i];
+        } else if (strcmp(argv[i], "--shard-rows") == 0 && i + 1 < argc) {
+            if (parse_count_option(argv[++i], SHARD_MAX_ROWS, &shard.shard_rows) != 0) {
+                fprintf(stderr, "Error: --shard-rows takes a number from 1 to %d\n", SHARD_MAX_ROWS);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--worker-timeout") == 0 && i + 1 < argc) {
+            char *end;
+            shard.timeout = strtod(argv[++i], &end);
+            if (end == argv[i] || *end != '\0' || !(shard.timeout > 0.0)) {
+                fprintf(stderr, "Error: --worker-timeout takes a positive number of seconds\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--worker") == 0) {
+            worker_mode = 1;
+        } else if (strncmp(argv[i], "--", 2) == 0) {
+            fprintf(stderr, "Error: Unknown or incomplete option '%s'\n", argv[i]);
+            return 1;
+        } else {
+            argv[++script_count] = argv[i];
+        }
+    }
+    
+    if (rcalc_set_limits(session, max_calls, max_depth, timeout_ms) != RCALC_OK) {
+        fprintf(stderr, "Error: --max-calls, --max-depth and --timeout cannot be negative\n");
+        return 1;
+    }
+    if (stats_interval < 0.0 || (stats_path && stats_interval == 0.0)) {
+        fprintf(stderr, "Error: --stats-file requires a positive --stats-interval\n");
+        return 1;
+    }
+    if (stats_path && !(stats_file = fopen(stats_path, "a"))) {
+        fprintf(stderr, "Error: Cannot open stats file '%s'\n", stats_path);
+        return 1;
+    }
+    if (stats_interval > 0.0) {
+        next_stats_dump = monotonic_seconds() + stats_interval;
+        atexit(finish_stats_dump);
+    }
+    
+    int mode_count = (one_shot_count > 0) + stdin_batch + (batch.expression_count > 0) + (batch.eval_path != NULL);
+    if ((one_shot_count || stdin_batch) && mode_count > 1) {
+        fprintf(stderr, "Error: -e, --stdin-batch, --batch and --eval-file cannot be combined\n");
+        return EXIT_SYNTAX_ERROR;
+    }
+    if (batch.expression_count && batch.eval_path) {
+        fprintf(stderr, "Error: --batch and --eval-file cannot be combined\n");
+        return 1;
+    }
+    if ((serve_path || shm_name) && mode_count + (serve_path && shm_name) > 0) {
+        fprintf(stderr, "Error: --serve and --shm cannot be combined with each other or with -e, "
+                        "--stdin-batch, --batch or --eval-file\n");
+        return 1;
+    }
+    if (!batch.expression_count && (batch.input_path || batch.binary_output || batch.stream ||
+                                    batch.on_error || batch.error_column)) {
+        fprintf(stderr, "Error: --input, --output-format, --stream, --on-error and --error-column require --batch\n");
+        return 1;
+    }
+    if (!batch.expression_count && !batch.eval_path && (batch.output_path || batch.thread_count)) {
+        fprintf(stderr, "Error: --output and --threads require --batch or --eval-file\n");
+        return 1;
+    }
+    int sharded = shard.local_count || shard.command_count;
+    if (shard.local_count + shard.command_count > MAX_SHARD_WORKERS) {
+        fprintf(stderr, "Error: Too many workers (max %d)\n", MAX_SHARD_WORKERS);
+        return 1;
+    }
+    if ((sharded || shard.shard_rows || shard.timeout > 0.0) &&
+        (!sharded || !batch.expression_count || batch.stream || batch.binary_output)) {
+        fprintf(stderr, "Error: --workers, --worker-command, --shard-rows and --worker-timeout require --batch "
+                        "with workers and text output, without --stream\n");
+        return 1;
+    }
+    if (worker_mode && (mode_count || serve_path || shm_name || sharded)) {
+        fprintf(stderr, "Error: --worker takes its batch from the coordinator and cannot be combined with "
+                        "other modes\n");
+        return 1;
+    }
+    
+    // Worker mode: load scripts silently and run batches a coordinator sends
+    if (worker_mode) {
+        silent_mode = 1;
+        int status = load_startup_image(image_path) == 0 &&
+                     load_script_files(argv + 1, script_count) == script_count ? 0 : -1;
+        if (status == 0) status = run_worker();
+        unbind_context(&binding);
+        rcalc_destroy(session);
+        return status == 0 ? 0 : 1;
+    }
+    
+    // One-shot mode: load scripts silently and print nothing but results
+    if (one_shot_count || stdin_batch) {
+        silent_mode = 1;
+        int status = load_startup_image(image_path) == 0 &&
+                     load_script_files(argv + 1, script_count) == script_count ? 0 : EXIT_LOAD_ERROR;
+        if (status == 0) {
+            status = stdin_batch ? run_stdin_batch() : run_one_shot_expressions(one_shot, one_shot_count);
+        }
+        if (batch.timing) {
+            fflush(stdout);
+            fprintf(stderr, "Completed in %.3f ms, %ld KB peak memory\n",
+                    (monotonic_seconds() - startup) * 1000.0, peak_memory_kb());
+        }
+        unbind_context(&binding);
+        rcalc_destroy(session);
+        return status;
+    }
+    
+    // Server modes: the loaded scripts become a shared library that every
+    // connection's session falls through to, or whose functions shared
+    // memory clients call
+    if (serve_path || shm_name) {
+        silent_mode = 1;
+        int status = load_startup_image(image_path) == 0 &&
+                     load_script_files(argv + 1, script_count) == script_count ? 0 : 1;
+        unbind_context(&binding);
+        if (status == 0) {
+            rcalc_share(session);
+            status = serve_path ? run_server(serve_path, session) : run_shm_server(shm_name, session);
+        }
+        rcalc_destroy(session);
+        return status;
+    }
+    
+    // Batch mode: load scripts silently, evaluate, and exit without the REPL
+    if (batch.expression_count || batch.eval_path) {
+        silent_mode = 1;
+        int status = load_startup_image(image_path) == 0 &&
+                     load_script_files(argv + 1, script_count) == script_count ? 0 : -1;
+        if (status == 0) {
+            if (batch.eval_path) {
+                status = run_expression_file(&batch);
+            } else if (sharded) {
+                shard.scripts = argv + 1;
+                shard.script_count = script_count;
+                status = run_sharded(&batch, &shard);
+            } else {
+                status = batch.stream ? run_stream(&batch) : run_batch(&batch);
+            }
+        }
+        unbind_context(&binding);
+        rcalc_destroy(session);
+        return status == 0 ? 0 : 1;
+    }
     
     // Enable colors
     enable_colors();
     
+    // Restore the startup image before scripts so scripts can build on it
+    if (image_path) {
+        if (load_startup_image(image_path) != 0) {
+            unbind_context(&binding);
+            rcalc_destroy(session);
+            return 1;
+        }
+        if (script_count == 0) printf("\n");
+    }
+    
     // Check for command-line script file
-    int loaded_scripts = 0;
-    if (argc > 1) {
+    if (script_count > 0) {
         // Load script file(s) from command line
-        for (int i = 1; i < argc; i++) {
-            if (load_script_file(argv[i]) == 0) {
-                loaded_scripts++;
-            } else {
-                fprintf(stderr, "Failed to load %s\n", argv[i]);
-            }
-        }
+        load_script_files(argv + 1, script_count);
         printf("\n");
     }
+    if (batch.timing) {
+        fprintf(stderr, "Startup: %.1f ms to first prompt, %ld KB peak memory\n",
+                (monotonic_seconds() - startup) * 1000.0, peak_memory_kb());
+    }
     
     print_normal("RCalc - Mathematical Expression Calculator with Variables and Functions\n");
     print_normal("Type 'help' for help\n");
@@ -1842,12 +8505,13 @@ int main(int argc, char *argv[])
     }
     
     while (1) {
-        if (in_multiline) {
+        if (statement_lexer_pending(&lexer)) {
             print_normal("... ");  // Continuation prompt
         } else {
             print_prompt();
         }
         fflush(stdout);
+        wait_for_input(statement_lexer_pending(&lexer));
         
         // Read input line with dynamic allocation
         ssize_t chars_read = getline(&line, &line_capacity, stdin);
@@ -1871,37 +8535,84 @@ int main(int argc, char *argv[])
         // Handle help command on any line
         if (strcmp(line, "help") == 0) {
             show_help();
-            // Clear any accumulated input and reset multiline state
-            input[0] = '\0';
+            // Discard any pending multiline input
             input_length = 0;
-            in_multiline = 0;
-            brace_count = 0;
-            paren_count = 0;
+            statement_lexer_reset(&lexer);
             continue;
         }
         
         // Handle load command
         if (strncmp(line, "load", 4) == 0 && (line[4] == '\0' || isspace(line[4]))) {
             parse_load_command(line);
-            // Clear any accumulated input and reset multiline state
-            input[0] = '\0';
+            // Discard any pending multiline input
+            input_length = 0;
+            statement_lexer_reset(&lexer);
+            continue;
+        }
+        
+        // Handle save and restore commands
+        if (is_repl_command(line, "save")) {
+            parse_save_command(line);
+            input_length = 0;
+            statement_lexer_reset(&lexer);
+            continue;
+        }
+        if (is_repl_command(line, "restore")) {
+            parse_restore_command(line);
+            input_length = 0;
+            statement_lexer_reset(&lexer);
+            continue;
+        }
+        
+        // Handle time and bench commands; "time = 1" still assigns a variable
+        if (is_repl_command(line, "time")) {
+            parse_time_command(line);
+            input_length = 0;
+            statement_lexer_reset(&lexer);
+            continue;
+        }
+        if (is_repl_command(line, "bench")) {
+            parse_bench_command(line);
+            input_length = 0;
+            statement_lexer_reset(&lexer);
+            continue;
+        }
+        
+        // Handle profile command
+        if (is_repl_command(line, "profile")) {
+            parse_profile_command(line);
+            input_length = 0;
+            statement_lexer_reset(&lexer);
+            continue;
+        }
+        
+        // Handle stats command
+        if (is_repl_command(line, "stats")) {
+            parse_stats_command(line);
             input_length = 0;
-            in_multiline = 0;
-            brace_count = 0;
-            paren_count = 0;
+            statement_lexer_reset(&lexer);
             continue;
         }
         
-        // If we're starting fresh and line is empty, skip
-        if (!in_multiline && chars_read == 0) {
+        // Handle memory command; "memory = 1" still assigns a variable
+        if (is_repl_command(line, "memory")) {
+            parse_memory_command(line);
+            input_length = 0;
+            statement_lexer_reset(&lexer);
             continue;
         }
         
-        // Calculate required space for appending this line
-        size_t line_len = strlen(line);
-        size_t space_needed = input_length + (input_length > 0 ? 1 : 0) + line_len + 1;
+        // Handle watch command
+        if (is_repl_command(line, "watch")) {
+            parse_watch_command(line);
+            // Discard any pending multiline input
+            input_length = 0;
+            statement_lexer_reset(&lexer);
+            continue;
+        }
         
-        // Grow input buffer if needed
+        // Append the line to the pending statement and scan only the new bytes
+        size_t space_needed = input_length + (size_t)chars_read + 2;
         if (space_needed > input_capacity) {
             size_t new_capacity = input_capacity;
             while (new_capacity < space_needed) {
@@ -1916,82 +8627,49 @@ int main(int argc, char *argv[])
             input = new_input;
             input_capacity = new_capacity;
         }
+        size_t scan_pos = input_length;
+        memcpy(input + input_length, line, (size_t)chars_read);
+        input_length += (size_t)chars_read;
+        input[input_length++] = '\n';
+        input[input_length] = '\0';
         
-        // Append current line to input buffer
-        if (input_length > 0) {
-            strcat(input, " ");  // Add space between lines
-            input_length++;
-        }
-        strcat(input, line);
-        input_length += line_len;
-        
-        // Count braces and parentheses to determine if we need more input
-        brace_count = 0;
-        paren_count = 0;
-        int in_string = 0;
+        int complete = statement_lexer_scan(&lexer, input, &scan_pos, input_length);
         
-        for (const char *p = input; *p; p++) {
-            if (*p == '"') {
-                in_string = !in_string;
-            } else if (!in_string) {
-                if (*p == '{') brace_count++;
-                else if (*p == '}') brace_count--;
-                else if (*p == '(') paren_count++;
-                else if (*p == ')') paren_count--;
-            }
-        }
-        
-        // Check if we need more input
-        int needs_more = 0;
-        
-        // If we have unmatched braces or parentheses
-        if (brace_count > 0 || paren_count > 0) {
-            needs_more = 1;
-        }
-        
-        // If line ends with certain tokens that suggest continuation
-        if (input_length > 0) {
-            char last_char = input[input_length - 1];
-            if (last_char == '{' || last_char == ',' || last_char == '(' || last_char == '+' || 
-                last_char == '-' || last_char == '*' || last_char == '/' || last_char == '^') {
-                needs_more = 1;
-            }
-        }
-        
-        // Check for incomplete function definition (has "double" and identifier but no complete body)
-        if (!needs_more && strstr(input, "double ") == input) {
-            // Simple heuristic: if it starts with "double" but doesn't have both { and }
-            int has_open_brace = strchr(input, '{') != NULL;
-            int has_close_brace = strchr(input, '}') != NULL;
-            if (has_open_brace && !has_close_brace) {
-                needs_more = 1;
-            }
+        // An empty line ends a statement left hanging on a trailing operator
+        if (!complete && chars_read == 0 && statement_lexer_pending(&lexer) &&
+            lexer.brace_depth <= 0 && lexer.paren_depth <= 0) {
+            complete = 1;
         }
-        
-        if (needs_more) {
-            in_multiline = 1;
+        if (!complete) {
+            // Nothing pending means the line was blank or a comment
+            if (!statement_lexer_pending(&lexer)) input_length = 0;
             continue;
         }
         
-        // We have a complete statement, evaluate it
-        in_multiline = 0;
-        
-        result = compute_expression(input);
+        // We have a complete statement, evaluate it; Ctrl-C cancels it
+        interrupted_context = session;
+        signal(SIGINT, cancel_on_interrupt);
+        result = compute_expression(input + lexer.start);
+        signal(SIGINT, SIG_DFL);
         if (!isnan(result)) {
             printf("= %.10g\n", result);
         }
         printf("\n");
+        maybe_dump_stats();
         
         // Clear input buffer for next statement
-        input[0] = '\0';
         input_length = 0;
+        statement_lexer_reset(&lexer);
     }
     
     // Cleanup
     free(input);
     free(line);
-    free_variables(variables);
-    free_user_functions();
+    free_watched_scripts();
+    free_profile();
+    unbind_context(&binding);
+    rcalc_destroy(session);
     
     return 0;
-}
\ No newline at end of file
+}
+#endif
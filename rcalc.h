@@ -0,0 +1,107 @@
+// RCalc embedding API
+//
+// Link against librcalc (rcalc.c built with -DRCALC_LIBRARY) to evaluate
+// expressions in-process. All definitions live in an rcalc_context; separate
+// contexts share nothing and may be used from different threads at the same
+// time. Within one context, calls that change definitions (define, load_file,
+// evaluate, set_variable, destroy) need exclusive use, while calls that only
+// evaluate (run, call, get_variable) may run on any number of threads at once
+// without locking.
+#ifndef RCALC_H
+#define RCALC_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct rcalc_context rcalc_context;
+typedef struct rcalc_expr rcalc_expr;
+
+// Result of an API call. The evaluation errors match the names printed by
+// the CLI's --on-error reporting.
+typedef enum {
+    RCALC_OK = 0,
+    RCALC_ERR_DIVISION_BY_ZERO,
+    RCALC_ERR_UNDEFINED_VARIABLE,
+    RCALC_ERR_UNKNOWN_FUNCTION,
+    RCALC_ERR_ARITY,
+    RCALC_ERR_CALL_LIMIT,
+    RCALC_ERR_RECURSION_LIMIT,
+    RCALC_ERR_TIMEOUT,
+    RCALC_ERR_CANCELLED,
+    RCALC_ERR_SYNTAX,
+    RCALC_ERR_IO,
+    RCALC_ERR_MEMORY,
+    RCALC_ERR_READ_ONLY
+} rcalc_status;
+
+// Create an empty context, or NULL if out of memory
+rcalc_context *rcalc_create(void);
+void rcalc_destroy(rcalc_context *ctx);
+
+// Shared libraries: load definitions into a context once, freeze it with
+// rcalc_share(), then create any number of sessions on top of it. A session
+// has its own variables and functions and looks up anything else in the
+// library, without copying it; defining a name the library already has
+// shadows it in that session only. Sessions of one library may be used from
+// different threads at the same time. The library cannot change once shared
+// (such calls fail with RCALC_ERR_READ_ONLY) and must be destroyed after all
+// of its sessions. Images saved from a session hold only its own definitions.
+rcalc_status rcalc_share(rcalc_context *library);
+rcalc_context *rcalc_create_session(const rcalc_context *library);
+
+// Syntax errors are printed to stderr as in the CLI unless quiet is set;
+// either way the call fails with RCALC_ERR_SYNTAX
+void rcalc_set_quiet(rcalc_context *ctx, int quiet);
+
+// Limits on each evaluation, checked as user functions are called: at most
+// max_calls calls, nested at most max_depth deep, finishing within
+// timeout_ms of the first call. An evaluation over a limit stops with
+// RCALC_ERR_CALL_LIMIT, RCALC_ERR_RECURSION_LIMIT or RCALC_ERR_TIMEOUT.
+// Zero means no limit, except that depth then keeps its default of 1000.
+// Sessions start with their library's limits.
+rcalc_status rcalc_set_limits(rcalc_context *ctx, long max_calls, int max_depth, double timeout_ms);
+
+// Stop every evaluation running in the context, from any thread or a signal
+// handler. They fail with RCALC_ERR_CANCELLED within about a thousand
+// function calls; evaluations started afterwards are unaffected.
+void rcalc_cancel(rcalc_context *ctx);
+
+// Run every statement in source text or a script file: function
+// definitions, assignments and expressions. Returns the first error.
+rcalc_status rcalc_define(rcalc_context *ctx, const char *source);
+rcalc_status rcalc_load_file(rcalc_context *ctx, const char *filename);
+
+// Parse and evaluate one statement, storing its value in *result
+rcalc_status rcalc_evaluate(rcalc_context *ctx, const char *expression, double *result);
+
+// Compile an expression once and evaluate it many times. Functions and
+// variables are looked up by name when it runs, so later definitions apply.
+rcalc_expr *rcalc_compile(rcalc_context *ctx, const char *expression, rcalc_status *status);
+rcalc_status rcalc_run(rcalc_context *ctx, const rcalc_expr *expr, double *result);
+void rcalc_expr_free(rcalc_expr *expr);
+
+// Call a user function directly, without parsing anything
+rcalc_status rcalc_call(rcalc_context *ctx, const char *name, const double *args, int arg_count,
+                        double *result);
+
+// Save every variable and function to a workspace image, or replace the
+// context's definitions with those from one. Images are mapped, not parsed,
+// and only load into a build with the same layout; others fail with
+// RCALC_ERR_IO.
+rcalc_status rcalc_save_image(rcalc_context *ctx, const char *path);
+rcalc_status rcalc_restore_image(rcalc_context *ctx, const char *path);
+
+rcalc_status rcalc_set_variable(rcalc_context *ctx, const char *name, double value);
+rcalc_status rcalc_get_variable(rcalc_context *ctx, const char *name, double *value);
+
+// Description of the calling thread's last failed call, e.g.
+// "Undefined variable 'x'"
+const char *rcalc_error_message(const rcalc_context *ctx);
+const char *rcalc_status_name(rcalc_status status);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
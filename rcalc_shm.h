@@ -0,0 +1,276 @@
+// RCalc shared-memory client
+//
+// rcalc --shm NAME creates the POSIX shared-memory object NAME and answers
+// calls to the functions of its loaded scripts through it, with no socket
+// or system call on the fast path. The region holds a directory of those
+// functions and a set of channels. A channel is a pair of single-producer,
+// single-consumer rings owned by one client thread: the client writes a
+// function ID and argument doubles into the next request slot, and the
+// server writes the result into the response slot of the same index. Both
+// sides spin briefly while waiting and then sleep on a futex, so an idle
+// server or client uses no CPU.
+//
+// Header-only, Linux only, C11 (the rings use <stdatomic.h>):
+//
+//   rcalc_shm shm;
+//   rcalc_shm_client client;
+//   rcalc_shm_attach("/rcalc", &shm);
+//   rcalc_shm_open_channel(&shm, &client);
+//   int area = rcalc_shm_function(&shm, "circle_area");
+//   double r = 2.0, result;
+//   rcalc_shm_call(&client, area, &r, 1, &result);
+//   rcalc_shm_close_channel(&client);
+//   rcalc_shm_detach(&shm);
+//
+// Link with -lrt on glibc older than 2.34.
+#ifndef RCALC_SHM_H
+#define RCALC_SHM_H
+
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "rcalc.h"
+
+#define RCALC_SHM_MAGIC "RSHM"
+#define RCALC_SHM_VERSION 1
+#define RCALC_SHM_CHANNELS 16
+#define RCALC_SHM_SLOTS 256        // Per channel; a power of two
+#define RCALC_SHM_MAX_ARGS 10
+#define RCALC_SHM_SPINS 256        // Polls before a waiting side yields, then sleeps
+
+typedef struct rcalc_shm_request {
+    uint32_t function;         // Index into the function directory
+    uint32_t arg_count;
+    double args[RCALC_SHM_MAX_ARGS];
+} rcalc_shm_request;
+
+typedef struct rcalc_shm_response {
+    double result;
+    int32_t status;            // rcalc_status
+    uint32_t reserved;
+} rcalc_shm_response;
+
+typedef struct rcalc_shm_entry {
+    char name[32];
+    int32_t param_count;
+    uint32_t reserved;
+} rcalc_shm_entry;
+
+// Counters only ever increase (modulo 2^32); slot i is i % RCALC_SHM_SLOTS.
+// Each counter sits on its own cache line, since the two sides write them.
+typedef struct rcalc_shm_channel {
+    _Alignas(64) atomic_uint owner;         // Process ID of the client holding it, or 0
+    _Alignas(64) atomic_uint submitted;     // Requests written; client only
+    _Alignas(64) atomic_uint completed;     // Responses written; server only, futex word
+    atomic_uint client_waiting;             // Client is asleep on completed
+    rcalc_shm_request requests[RCALC_SHM_SLOTS];
+    rcalc_shm_response responses[RCALC_SHM_SLOTS];
+} rcalc_shm_channel;
+
+typedef struct rcalc_shm_header {
+    char magic[4];
+    uint32_t version;
+    uint32_t channel_count;
+    uint32_t slot_count;
+    uint32_t function_count;
+    uint32_t server_pid;
+    uint64_t functions_offset; // From the start of the region
+    uint64_t channels_offset;
+    uint64_t size;
+    atomic_uint ready;                      // Set while the server is answering
+    _Alignas(64) atomic_uint server_waiting;  // Server is asleep on doorbell
+    atomic_uint doorbell;
+} rcalc_shm_header;
+
+typedef struct rcalc_shm {
+    rcalc_shm_header *header;
+    size_t size;
+} rcalc_shm;
+
+typedef struct rcalc_shm_client {
+    rcalc_shm_header *header;
+    rcalc_shm_channel *channel;
+    uint32_t submitted;        // Local copies of the channel's counters
+    uint32_t received;
+} rcalc_shm_client;
+
+static inline long rcalc_shm_futex(atomic_uint *word, int op, unsigned value, const struct timespec *timeout) {
+    return syscall(SYS_futex, (unsigned *)word, op, value, timeout, NULL, 0);
+}
+
+static inline const rcalc_shm_entry *rcalc_shm_directory(const rcalc_shm *shm) {
+    return (const rcalc_shm_entry *)((const char *)shm->header + shm->header->functions_offset);
+}
+
+static inline rcalc_shm_channel *rcalc_shm_channels(const rcalc_shm *shm) {
+    return (rcalc_shm_channel *)((char *)shm->header + shm->header->channels_offset);
+}
+
+// Map a server's region. Returns -1 if it does not exist, is not ready or
+// was made by an incompatible version.
+static inline int rcalc_shm_attach(const char *name, rcalc_shm *shm) {
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0) return -1;
+    struct stat st;
+    void *region = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(rcalc_shm_header)) {
+        region = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (region == MAP_FAILED) return -1;
+    rcalc_shm_header *header = region;
+    if (memcmp(header->magic, RCALC_SHM_MAGIC, 4) != 0 || header->version != RCALC_SHM_VERSION ||
+        header->slot_count != RCALC_SHM_SLOTS || header->size != (uint64_t)st.st_size ||
+        !atomic_load_explicit(&header->ready, memory_order_acquire)) {
+        munmap(region, (size_t)st.st_size);
+        return -1;
+    }
+    shm->header = header;
+    shm->size = (size_t)st.st_size;
+    return 0;
+}
+
+static inline void rcalc_shm_detach(rcalc_shm *shm) {
+    munmap(shm->header, shm->size);
+    shm->header = NULL;
+}
+
+// Function ID for a name, or -1 if the server has no such function
+static inline int rcalc_shm_function(const rcalc_shm *shm, const char *name) {
+    const rcalc_shm_entry *functions = rcalc_shm_directory(shm);
+    for (uint32_t i = 0; i < shm->header->function_count; i++) {
+        if (strncmp(functions[i].name, name, sizeof(functions[i].name)) == 0) return (int)i;
+    }
+    return -1;
+}
+
+static inline const rcalc_shm_response *rcalc_shm_wait(rcalc_shm_client *client);
+
+// Claim a free channel for the calling thread; -1 if all are taken. A
+// channel whose owner process has died is taken over once the server has
+// answered the requests it left behind.
+static inline int rcalc_shm_open_channel(rcalc_shm *shm, rcalc_shm_client *client) {
+    rcalc_shm_channel *channels = rcalc_shm_channels(shm);
+    unsigned self = (unsigned)getpid();
+    for (int pass = 0; pass < 2; pass++) {
+        for (uint32_t i = 0; i < shm->header->channel_count; i++) {
+            unsigned expected = atomic_load(&channels[i].owner);
+            if (pass == 0 && expected != 0) continue;
+            if (pass == 1 && (expected == 0 || kill((pid_t)expected, 0) == 0 || errno != ESRCH)) continue;
+            if (!atomic_compare_exchange_strong(&channels[i].owner, &expected, self)) continue;
+            client->header = shm->header;
+            client->channel = &channels[i];
+            client->submitted = atomic_load(&channels[i].submitted);
+            client->received = atomic_load(&channels[i].completed);
+            while (client->received != client->submitted) {
+                if (!rcalc_shm_wait(client)) {
+                    atomic_store(&channels[i].owner, 0u);
+                    client->channel = NULL;
+                    return -1;
+                }
+                client->received++;
+            }
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// The next request slot to fill in place, or NULL if every slot is in flight
+static inline rcalc_shm_request *rcalc_shm_next_request(rcalc_shm_client *client) {
+    if (client->submitted - client->received == RCALC_SHM_SLOTS) return NULL;
+    return &client->channel->requests[client->submitted % RCALC_SHM_SLOTS];
+}
+
+// Publish the slot from rcalc_shm_next_request(), waking the server if it sleeps
+static inline void rcalc_shm_submit(rcalc_shm_client *client) {
+    client->submitted++;
+    atomic_store(&client->channel->submitted, client->submitted);
+    if (atomic_load(&client->header->server_waiting)) {
+        atomic_fetch_add(&client->header->doorbell, 1u);
+        rcalc_shm_futex(&client->header->doorbell, FUTEX_WAKE, 1, NULL);
+    }
+}
+
+// The oldest unreceived response if it is ready, else NULL
+static inline const rcalc_shm_response *rcalc_shm_poll(rcalc_shm_client *client) {
+    if (client->received == client->submitted ||
+        atomic_load_explicit(&client->channel->completed, memory_order_acquire) == client->received) {
+        return NULL;
+    }
+    return &client->channel->responses[client->received % RCALC_SHM_SLOTS];
+}
+
+// Wait for the oldest unreceived response. Returns NULL if none is in
+// flight or the server stopped.
+static inline const rcalc_shm_response *rcalc_shm_wait(rcalc_shm_client *client) {
+    rcalc_shm_channel *channel = client->channel;
+    const struct timespec timeout = { 0, 100000000 };  // Recheck that the server is alive
+    int spins = 0;
+    const rcalc_shm_response *response = NULL;
+    while (client->received != client->submitted && !(response = rcalc_shm_poll(client))) {
+        if (!atomic_load_explicit(&client->header->ready, memory_order_acquire)) return NULL;
+        if (spins < RCALC_SHM_SPINS) {
+            spins++;
+        } else if (spins < 2 * RCALC_SHM_SPINS) {
+            spins++;
+            sched_yield();
+        } else {
+            atomic_store(&channel->client_waiting, 1u);
+            if (atomic_load(&channel->completed) == client->received) {
+                rcalc_shm_futex(&channel->completed, FUTEX_WAIT, client->received, &timeout);
+            }
+            atomic_store(&channel->client_waiting, 0u);
+        }
+    }
+    return client->received != client->submitted ? response : NULL;
+}
+
+// Done with the response from rcalc_shm_poll() or rcalc_shm_wait()
+static inline void rcalc_shm_release(rcalc_shm_client *client) {
+    client->received++;
+}
+
+// Call a function and wait for its result. Responses to requests submitted
+// earlier on the channel are waited for and dropped.
+static inline rcalc_status rcalc_shm_call(rcalc_shm_client *client, int function, const double *args,
+                                          int arg_count, double *result) {
+    if (arg_count < 0 || arg_count > RCALC_SHM_MAX_ARGS) return RCALC_ERR_ARITY;
+    while (client->received != client->submitted) {
+        if (!rcalc_shm_wait(client)) return RCALC_ERR_IO;
+        rcalc_shm_release(client);
+    }
+    rcalc_shm_request *request = rcalc_shm_next_request(client);
+    request->function = (uint32_t)function;
+    request->arg_count = (uint32_t)arg_count;
+    memcpy(request->args, args, (size_t)arg_count * sizeof(double));
+    rcalc_shm_submit(client);
+    const rcalc_shm_response *response = rcalc_shm_wait(client);
+    if (!response) return RCALC_ERR_IO;
+    *result = response->result;
+    rcalc_status status = (rcalc_status)response->status;
+    rcalc_shm_release(client);
+    return status;
+}
+
+// Wait for every request in flight, then give the channel back
+static inline void rcalc_shm_close_channel(rcalc_shm_client *client) {
+    while (client->received != client->submitted && rcalc_shm_wait(client)) {
+        rcalc_shm_release(client);
+    }
+    atomic_store(&client->channel->owner, 0u);
+    client->channel = NULL;
+}
+
+#endif